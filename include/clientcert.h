@@ -3,7 +3,9 @@
 #define ROOT_CERT_TAG 1
 #define CLIENT_CERT_TAG 2
 
+#ifdef CONFIG_SPAN_TLS_CREDENTIALS
 #define CLIENT_CERT 1
+#endif
 
 /**
  * The inc files are generated by Zephyr in .pio/<board
@@ -20,6 +22,7 @@
  * key size and strength (with RSA-2048 on one side and Ed25519 on the other
  * side)
  */
+#ifdef CLIENT_CERT
 static const unsigned char client_certificate[] = {
 #include "client.der.inc"
 };
@@ -32,3 +35,4 @@ static const unsigned char client_key[] = {
 static const unsigned char root_certificate[] = {
 #include "lab5e_ca.der.inc"
 };
+#endif
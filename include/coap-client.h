@@ -1,20 +1,225 @@
 #pragma once
 #include <zephyr.h>
 
+#include <net/coap.h>
 #include <sys/types.h>
 
+#include "transport.h"
+
+/**
+ * @brief Maximum number of Block2 requests kept in flight by
+ *        coap_blockwise_transfer_windowed(). Each one reserves
+ *        CONFIG_SPAN_COAP_MAX_BLOCK_SIZE bytes of RAM for replies that arrive
+ *        out of order.
+ */
+#define COAP_BLOCKWISE_MAX_WINDOW 4
+
 /**
  * @brief Start the CoAP client
+ * @param host IPv4 address of the server
+ * @param port server port
+ * @param transport TRANSPORT_UDP or TRANSPORT_DTLS
+ * @return 0 on success, -EPROTONOSUPPORT for TCP and TLS (CoAP over TCP
+ *         isn't implemented) or another negative error code
  */
-int coap_start_client(const char *host, uint16_t port);
+int coap_start_client(const char *host, uint16_t port,
+                      enum transport_type transport);
 
 /**
- * @brief Stop the CoAP client
+ * @brief Stop the CoAP client. Outstanding requests fail with -ECANCELED.
+ *        With CONFIG_SPAN_COAP_KEEP_SESSION the socket is left open, so the
+ *        next coap_start_client() to the same server goes on with the same
+ *        DTLS connection. This is keep-alive only, there is no session
+ *        resumption: if the server has dropped the connection, the next
+ *        request fails and the client reconnects with a full handshake.
  */
 int coap_stop_client(void);
 
 /**
- * @brief Send message via the CoAP client.
+ * @brief Close the socket (and DTLS session) kept by coap_stop_client().
+ * @return 0 on success, -EBUSY if the client is running
+ */
+int coap_close_session(void);
+
+/**
+ * @brief DTLS session statistics.
+ */
+struct coap_session_stats
+{
+  uint32_t handshakes;
+  uint32_t reused;
+  uint32_t last_handshake_ms;
+  uint32_t total_handshake_ms;
+  uint32_t last_handshake_cycles;
+};
+
+/**
+ * @brief Get the number of full handshakes (and the time spent on them) and
+ *        the number of times the kept socket was used again.
+ * @param stats statistics output
+ */
+void coap_get_session_stats(struct coap_session_stats *stats);
+
+#define COAP_RTT_HISTOGRAM_BUCKETS 10
+
+/**
+ * @brief Client counters. Bucket 0 of the RTT histogram counts round trips
+ *        below 16 ms, bucket n (n > 0) round trips from 2^(n+3) up to
+ *        2^(n+4) ms and the last bucket everything above that. The RTT is
+ *        measured from the first transmission of a request to its ACK.
+ *        first_request_ms is the uptime when the first request was sent.
+ *        requests counts confirmable requests only, NON messages are counted
+ *        in non_sent. rx_cycles is the time the receive thread spent on
+ *        rx_datagrams datagrams, from recv() until the callbacks returned.
+ */
+struct coap_client_metrics
+{
+  uint32_t requests;
+  uint32_t responses;
+  uint32_t notifications;
+  uint32_t retransmits;
+  uint32_t timeouts;
+  uint32_t resets;
+  uint32_t bytes_out;
+  uint32_t bytes_in;
+  uint32_t first_request_ms;
+  uint32_t rtt_histogram[COAP_RTT_HISTOGRAM_BUCKETS];
+  // Fast path (coap_send_fast()): NON messages, confirmable probes,
+  // messages held back by the congestion limits, switches to all-CON and
+  // the loss estimate from the probes in per mille
+  uint32_t non_sent;
+  uint32_t probes;
+  uint32_t throttled;
+  uint32_t fallbacks;
+  uint32_t loss_permille;
+  uint32_t rx_datagrams;
+  uint32_t rx_cycles;
+};
+
+/**
+ * @brief Get a copy of the client counters.
+ * @param metrics counters output
+ */
+void coap_get_metrics(struct coap_client_metrics *metrics);
+
+/**
+ * @brief Completion callback for asynchronous requests. The callback runs on
+ *        the client's receive thread and should return quickly. It may submit
+ *        or cancel requests.
+ * @param result 0 if a response was received, -ETIMEDOUT if the server didn't
+ *        respond, -ECONNRESET if the server rejected the request or
+ *        -ECANCELED if the client was stopped
+ * @param reply the response from the server or NULL if result is an error.
+ *        The packet is only valid until the callback returns.
+ * @param user_data the user_data passed to coap_submit_request()
+ */
+typedef void (*coap_response_callback_t)(int result,
+                                         const struct coap_packet *reply,
+                                         void *user_data);
+
+/**
+ * @brief Submit a request without waiting for the response. The request is
+ *        retransmitted until a response arrives or the retransmissions run
+ *        out and the callback is invoked exactly once either way.
+ * @param method CoAP method (COAP_METHOD_GET, COAP_METHOD_POST) to use
+ * @param path The path to use when sending the request
+ * @param buffer The buffer to send
+ * @param len The length of the buffer
+ * @param callback completion callback
+ * @param user_data passed on to the callback
+ * @return A handle for the request (>= 0), -EAGAIN if too many requests are
+ *         outstanding or the message pool is empty, or another negative
+ *         error code
+ */
+int coap_submit_request(const uint8_t method, const char *path,
+                        const uint8_t *buffer, size_t len,
+                        coap_response_callback_t callback, void *user_data);
+
+/**
+ * @brief Register a path that is used often. The URI-Path options are
+ *        encoded once and copied straight into every request sent with
+ *        coap_submit_request_to().
+ * @param path path to register
+ * @return A handle for the path (>= 0), -ENOMEM if the path cache is full or
+ *         the encoded path is longer than CONFIG_SPAN_COAP_PATH_MAX_LEN
+ */
+int coap_register_path(const char *path);
+
+/**
+ * @brief Submit a request to a registered path. Works like
+ *        coap_submit_request() but skips parsing the path.
+ * @param path handle returned by coap_register_path()
+ * @param method CoAP method (COAP_METHOD_GET, COAP_METHOD_POST) to use
+ * @param buffer The buffer to send
+ * @param len The length of the buffer
+ * @param callback completion callback
+ * @param user_data passed on to the callback
+ * @return A handle for the request (>= 0) or a negative error code
+ */
+int coap_submit_request_to(int path, const uint8_t method,
+                           const uint8_t *buffer, size_t len,
+                           coap_response_callback_t callback, void *user_data);
+
+/**
+ * @brief Send a message on the non-confirmable fast path. The message goes
+ *        out as NON (with No-Response for 2.xx) and nothing waits for a
+ *        response. Every CONFIG_SPAN_COAP_NON_PROBE_INTERVAL-th message is
+ *        sent as a confirmable probe instead, which feeds the RTT and loss
+ *        estimates. When the loss goes above
+ *        CONFIG_SPAN_COAP_NON_LOSS_THRESHOLD every message is a probe until
+ *        it has halved.
+ *
+ *        Congestion control follows RFC 7252 section 4.7: at most
+ *        CONFIG_SPAN_COAP_NSTART probes are outstanding and NON messages
+ *        are limited to CONFIG_SPAN_COAP_PROBING_RATE bytes/s. The function
+ *        never blocks; the caller decides whether to drop or retry a message
+ *        that is held back.
+ * @param path handle returned by coap_register_path()
+ * @param method CoAP method (COAP_METHOD_GET, COAP_METHOD_POST) to use
+ * @param buffer The buffer to send
+ * @param len The length of the buffer
+ * @return 0 if the message was sent, -EAGAIN if the congestion limits hold
+ *         it back or no buffer is free, or another negative error code
+ */
+int coap_send_fast(int path, const uint8_t method, const uint8_t *buffer,
+                   size_t len);
+
+/**
+ * @brief Cancel an outstanding request. The callback won't be invoked.
+ * @param handle handle returned by coap_submit_request()
+ * @return 0 if the request was cancelled, -ENOENT if it has already
+ *         completed
+ */
+int coap_cancel_request(int handle);
+
+/**
+ * @brief Observe a resource (RFC 7641). The callback is invoked with the
+ *        response to the registration and then with every notification.
+ *        Notifications that arrive out of order are dropped. The
+ *        registration is renewed every CONFIG_SPAN_COAP_OBSERVE_REREGISTER_S
+ *        seconds so NAT bindings don't expire, and after the client has been
+ *        restarted. The callback gets a negative result (and no reply) if a
+ *        registration fails; the registration is retried later.
+ * @param path path to resource
+ * @param callback notification callback, invoked on the receive thread
+ * @param user_data passed to the callback
+ * @return observation handle, -ENOMEM if too many resources are observed or
+ *         a negative error code if the registration can't be sent
+ */
+int coap_observe(const char *path, coap_response_callback_t callback,
+                 void *user_data);
+
+/**
+ * @brief Stop observing a resource. The server is told to remove the
+ *        observation and the callback won't be invoked again.
+ * @param handle handle returned by coap_observe()
+ * @return 0 on success, -ENOENT if the handle isn't known
+ */
+int coap_observe_cancel(int handle);
+
+/**
+ * @brief Send message via the CoAP client. The response must be picked up
+ *        with coap_read_message() before the next message is sent.
  * @param method CoAP method (COAP_METHOD_GET, COAP_METHOD_POST) to use
  * @param path The path to use when sending the request
  * @param buffer The buffer to send
@@ -23,13 +228,49 @@ int coap_stop_client(void);
 int coap_send_message(const uint8_t method, const char *path, const uint8_t *buffer, size_t len);
 
 /**
- * @brief Read message from CoAP client. The function will not block
+ * @brief A response to coap_send_message(). The payload points into the
+ *        client's receive buffer and is valid until the view is released
+ *        with coap_release_message().
+ */
+struct coap_message_view
+{
+  uint8_t code;
+  const uint8_t *payload;
+  size_t len;
+  uint8_t *buffer;
+};
+
+/**
+ * @brief Read the response to the message sent with coap_send_message()
+ *        without copying it. The function blocks until the response arrives
+ *        or the request times out. The view must be released with
+ *        coap_release_message() when the caller is done with it since it
+ *        holds a buffer from the client's message pool.
+ * @param view the response
+ * @return Number of payload bytes or a negative error code
+ */
+int coap_read_message_view(struct coap_message_view *view);
+
+/**
+ * @brief Release the receive buffer held by a view. Releasing a view that
+ *        doesn't hold a buffer is a no-op.
+ * @param view view returned by coap_read_message_view()
+ */
+void coap_release_message(struct coap_message_view *view);
+
+/**
+ * @brief Read the response to the message sent with coap_send_message() into
+ *        a buffer. The function blocks until the response arrives or the
+ *        request times out.
  * @param code response code from server
- * @param buffer buffer with data from server
- * @param len length of buffer
- * @return Number of bytes received
+ * @param buffer buffer for the payload
+ * @param size size of buffer
+ * @param len number of bytes copied into buffer
+ * @return Number of bytes received, -EMSGSIZE if the payload doesn't fit in
+ *         the buffer
  */
-int coap_read_message(uint8_t *code, uint8_t *buffer, size_t *len);
+int coap_read_message(uint8_t *code, uint8_t *buffer, size_t size,
+                      size_t *len);
 
 /**
  * @brief callback for blockwise transfers.
@@ -47,4 +288,54 @@ typedef int (*blockwise_callback_t)(bool last, uint32_t offset, uint8_t *buffer,
  * @param path path to resource
  * @param callback callback function for data blocks
  */
-int coap_blockwise_transfer(const char *path, blockwise_callback_t callback);
\ No newline at end of file
+int coap_blockwise_transfer(const char *path, blockwise_callback_t callback);
+
+/**
+ * @brief Pipelined blockwise transfer (with GET requests). Up to window Block2
+ *        requests are kept in flight, each with its own token and message ID.
+ *        Blocks that arrive out of order are buffered and handed to the
+ *        callback in offset order. This function returns when the download has
+ *        completed.
+ * @param path path to resource
+ * @param window number of outstanding requests (1 - COAP_BLOCKWISE_MAX_WINDOW)
+ * @param callback callback function for data blocks
+ */
+int coap_blockwise_transfer_windowed(const char *path, uint8_t window,
+                                     blockwise_callback_t callback);
+
+#define COAP_ETAG_MAX_LEN 8
+
+/**
+ * @brief Progress of a resumable blockwise transfer. A zeroed structure
+ *        starts the transfer from the beginning.
+ */
+struct coap_blockwise_state
+{
+  // Number of bytes handed to the callback
+  uint32_t offset;
+  // Size of the resource (from Size2) or 0 if it isn't known
+  uint32_t size;
+  // Block size (enum coap_block_size) of the last delivered block
+  uint8_t block_size;
+  uint8_t etag_len;
+  uint8_t etag[COAP_ETAG_MAX_LEN];
+};
+
+/**
+ * @brief Pipelined blockwise transfer that continues from state->offset.
+ *        The ETag, size and block size are updated before a block is
+ *        handed to the callback and the offset after the callback returns,
+ *        so the state can be saved and passed in again if the transfer is
+ *        interrupted. The ETag and size of every block are checked against
+ *        the ones the transfer started with.
+ * @param path path to resource
+ * @param window number of outstanding requests (1 - COAP_BLOCKWISE_MAX_WINDOW)
+ * @param state transfer state
+ * @param callback callback function for data blocks
+ * @return 0 when the transfer has completed, -ESTALE if the resource has
+ *         changed (the state is reset and the transfer must start over) or
+ *         a negative error code
+ */
+int coap_blockwise_transfer_resume(const char *path, uint8_t window,
+                                   struct coap_blockwise_state *state,
+                                   blockwise_callback_t callback);
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+#include <zephyr.h>
+
+/**
+ * @brief URI-Path options encoded the way they appear on the wire, ready to
+ *        be copied into a request.
+ */
+struct coap_encoded_path
+{
+  uint16_t len;
+  uint8_t data[CONFIG_SPAN_COAP_PATH_MAX_LEN];
+};
+
+/**
+ * @brief Split the path on '/' and encode each segment as a URI-Path option
+ *        (RFC 7252 section 3.1). A '/' at the end of the path is ignored.
+ * @param out encoded options
+ * @param path path of the resource
+ * @param prev_option the option that goes in front of the path in the
+ *        request (0 if none), the first delta is counted from it
+ * @return 0 on success, -ENOMEM if the encoded path is longer than
+ *         CONFIG_SPAN_COAP_PATH_MAX_LEN
+ */
+int coap_encode_path(struct coap_encoded_path *out, const char *path,
+                     uint16_t prev_option);
@@ -0,0 +1,41 @@
+#pragma once
+#include <zephyr.h>
+
+/**
+ * @brief Size of a buffer in the pool. Every buffer holds one complete CoAP
+ *        message (the largest block plus header and options).
+ */
+#define COAP_POOL_BUFFER_SIZE                                                  \
+  (CONFIG_SPAN_COAP_MAX_BLOCK_SIZE + CONFIG_SPAN_COAP_MSG_OVERHEAD)
+
+/**
+ * @brief Pool statistics.
+ */
+struct coap_pool_stats
+{
+  uint32_t buffers;
+  uint32_t used;
+  uint32_t high_water;
+  uint32_t failures;
+};
+
+/**
+ * @brief Get a message buffer from the pool. The function never blocks and is
+ *        safe to call from an ISR.
+ * @return A buffer of COAP_POOL_BUFFER_SIZE bytes or NULL if the pool is
+ *         exhausted
+ */
+uint8_t *coap_pool_alloc(void);
+
+/**
+ * @brief Return a buffer to the pool. Safe to call from an ISR.
+ * @param buffer buffer from coap_pool_alloc(). NULL is ignored.
+ */
+void coap_pool_free(uint8_t *buffer);
+
+/**
+ * @brief Read the pool statistics. The high-water mark is the largest number
+ *        of buffers that have been in use at the same time since boot.
+ * @param stats statistics output
+ */
+void coap_pool_get_stats(struct coap_pool_stats *stats);
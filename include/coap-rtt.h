@@ -0,0 +1,66 @@
+#pragma once
+#include <zephyr.h>
+
+#include <net/net_ip.h>
+
+/**
+ * @brief One RFC 6298 style estimator (smoothed RTT and variance), all values
+ *        in milliseconds.
+ */
+struct coap_rtt_estimator
+{
+  bool valid;
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
+};
+
+/**
+ * @brief Round trip time state for a single CoAP peer. This follows CoCoA
+ *        (draft-ietf-core-cocoa): a strong estimator is fed by exchanges that
+ *        completed without retransmissions, a weak estimator by exchanges that
+ *        needed one or two, and both are blended into the overall RTO.
+ */
+struct coap_rtt
+{
+  bool in_use;
+  struct in_addr addr;
+  uint16_t port;
+  struct coap_rtt_estimator strong;
+  struct coap_rtt_estimator weak;
+  uint32_t rto;
+  uint32_t last_update;
+};
+
+/**
+ * @brief Find the RTT state for a peer. The least recently updated entry is
+ *        recycled if the peer hasn't been seen before.
+ * @param addr peer address
+ * @return RTT state for the peer, never NULL
+ */
+struct coap_rtt *coap_rtt_lookup(const struct sockaddr_in *addr);
+
+/**
+ * @brief Get the timeout (in ms) for the first transmission of a confirmable
+ *        message. This is the current RTO with ACK_RANDOM_FACTOR dithering.
+ * @param rtt RTT state for the peer
+ */
+uint32_t coap_rtt_timeout(struct coap_rtt *rtt);
+
+/**
+ * @brief Get the timeout (in ms) for the next retransmission. CoCoA uses a
+ *        variable backoff factor so short RTOs back off faster than long ones.
+ * @param rtt RTT state for the peer
+ * @param timeout the timeout used for the previous transmission
+ */
+uint32_t coap_rtt_backoff(const struct coap_rtt *rtt, uint32_t timeout);
+
+/**
+ * @brief Add a round trip time measurement. The time is measured from the
+ *        first transmission of the request.
+ * @param rtt RTT state for the peer
+ * @param rtt_ms measured round trip time
+ * @param retransmissions number of retransmissions of the request
+ */
+void coap_rtt_sample(struct coap_rtt *rtt, uint32_t rtt_ms,
+                     uint8_t retransmissions);
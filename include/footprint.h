@@ -0,0 +1,51 @@
+#pragma once
+#include <zephyr.h>
+
+/**
+ * Memory footprint instrumentation, built with CONFIG_SPAN_FOOTPRINT. It
+ * records the peak stack use of every thread and the peak mbedTLS heap use,
+ * split between DTLS/TLS handshakes and the time outside them (steady
+ * state). The heap figures need CONFIG_MBEDTLS_MEMORY_DEBUG.
+ *
+ * footprint_report() logs the figures as "footprint <key>=<value>" lines,
+ * which scripts/footprint-report.sh collects next to the static RAM of every
+ * variable (the "footprint" build target) and compares against a baseline.
+ * Stack figures are only meaningful on targets that run the Zephyr threads
+ * on their own stacks (QEMU and hardware, not native_posix).
+ */
+
+/**
+ * @brief Peak mbedTLS heap use in bytes.
+ */
+struct footprint_heap_stats
+{
+  uint32_t size;
+  uint32_t handshake_peak;
+  uint32_t steady_peak;
+  uint32_t handshakes;
+};
+
+/**
+ * @brief Mark the start of a DTLS/TLS handshake. The heap peak up to now is
+ *        counted as steady state.
+ */
+void footprint_handshake_begin(void);
+
+/**
+ * @brief Mark the end of a handshake started with
+ *        footprint_handshake_begin(), whether it succeeded or not.
+ */
+void footprint_handshake_end(void);
+
+/**
+ * @brief Read the heap figures. The steady state peak includes the time
+ *        since the last handshake.
+ * @param stats statistics output
+ */
+void footprint_get_heap_stats(struct footprint_heap_stats *stats);
+
+/**
+ * @brief Log the stack high-water mark and size of every thread, the heap
+ *        peaks and the peak use of the CoAP buffer pool.
+ */
+void footprint_report(void);
@@ -0,0 +1,103 @@
+#pragma once
+#include <zephyr.h>
+
+#include <sys/types.h>
+
+#include "coap-client.h"
+
+/**
+ * Streaming decoder for packed firmware images. A packed image starts with
+ * a 16 byte header:
+ *
+ *   "SPFW" | version | flags | window | lookahead | image size | source size
+ *
+ * The sizes are 32-bit little endian values. Images that don't start with
+ * the header are passed through unchanged.
+ *
+ * If FOTA_IMAGE_COMPRESSED is set the rest of the image is a heatshrink
+ * stream with the given window and lookahead sizes (log2). If
+ * FOTA_IMAGE_DELTA is set the (decompressed) data is a delta against the
+ * image in the primary slot, as a series of records:
+ *
+ *   diff length | extra length | seek | diff[diff length] | extra[extra length]
+ *
+ * The lengths are unsigned LEB128 varints and seek is a zigzag encoded
+ * varint. Each diff byte is added to the next byte of the source image, the
+ * extra bytes are copied as is and the source position is moved by seek
+ * after the record, like the control triples in bsdiff.
+ *
+ * scripts/fota-pack.py creates packed images.
+ */
+
+#define FOTA_IMAGE_MAGIC "SPFW"
+#define FOTA_IMAGE_VERSION 1
+#define FOTA_IMAGE_HEADER_LEN 16
+
+#define FOTA_IMAGE_COMPRESSED 0x01
+#define FOTA_IMAGE_DELTA 0x02
+
+#define FOTA_DECODER_WINDOW_SIZE (1 << CONFIG_SPAN_FOTA_DECODER_WINDOW_SZ2)
+#define FOTA_DECODER_OUT_LEN 64
+#define FOTA_DECODER_CACHE_LEN 32
+
+/**
+ * @brief Decoder state. It doesn't contain any pointers so it can be saved
+ *        and restored as is.
+ */
+struct fota_decoder
+{
+  uint8_t stage;
+  uint8_t flags;
+  uint32_t image_size;
+  uint32_t source_size;
+  // Number of bytes handed to the output
+  uint32_t offset;
+
+  // heatshrink
+  uint8_t window_sz2;
+  uint8_t lookahead_sz2;
+  uint8_t hs_state;
+  uint8_t acc_bits;
+  uint16_t acc;
+  uint16_t hs_index;
+  uint16_t head;
+  uint8_t window[FOTA_DECODER_WINDOW_SIZE];
+
+  // delta
+  uint8_t delta_state;
+  uint8_t varint_shift;
+  uint32_t varint;
+  uint32_t diff_left;
+  uint32_t extra_left;
+  int32_t seek;
+  uint32_t source_pos;
+  uint32_t cache_offset;
+  uint8_t cache_len;
+  uint8_t cache[FOTA_DECODER_CACHE_LEN];
+
+  uint8_t out_len;
+  uint8_t out[FOTA_DECODER_OUT_LEN];
+};
+
+/**
+ * @brief Reset the decoder for a new image.
+ * @param dec decoder state
+ */
+void fota_decoder_init(struct fota_decoder *dec);
+
+/**
+ * @brief Decode the next part of an image. Decoded data is passed to the
+ *        output in order, with last set when the image is complete. All of
+ *        the data from the input is passed on before this returns.
+ * @param dec decoder state
+ * @param last set if this is the last part of the input
+ * @param buffer input data
+ * @param len length of input data
+ * @param output output for decoded data
+ * @return 0 on success, -EBADMSG if the image is malformed or truncated,
+ *         -ENOTSUP if the header is for a different version or window size
+ *         or the error returned by the output
+ */
+int fota_decoder_write(struct fota_decoder *dec, bool last,
+                       const uint8_t *buffer, size_t len,
+                       blockwise_callback_t output);
@@ -0,0 +1,65 @@
+#pragma once
+#include <zephyr.h>
+
+#include <sys/types.h>
+
+/**
+ * FOTA sink. Firmware blocks from a blockwise transfer are written to the
+ * MCUboot secondary slot as they arrive and hashed on the way, so the image
+ * is verified when the last block has been written, without reading it back
+ * from flash.
+ */
+
+#define FOTA_SINK_DIGEST_LEN 32
+
+/**
+ * @brief Prepare the secondary slot for a new image.
+ * @param expected_sha256 SHA-256 digest of the complete image or NULL if the
+ *        digest isn't known. The image is only marked for upgrade if the
+ *        digest matches.
+ * @return 0 on success, negative error code if the slot can't be opened
+ */
+int fota_sink_begin(const uint8_t *expected_sha256);
+
+/**
+ * @brief Write a block to the secondary slot. This has the same signature as
+ *        blockwise_callback_t and can be passed directly to
+ *        coap_blockwise_transfer(). Blocks must arrive in offset order. When
+ *        the last block is written the digest is checked and the image is
+ *        marked for a test upgrade on the next boot.
+ * @param last set to true when this is the last block
+ * @param offset byte offset of the block
+ * @param buffer block data
+ * @param len length of block
+ * @return 0 on success, -EINVAL if the block is out of order, -EBADMSG if the
+ *         digest doesn't match (or a resumed download doesn't match what it
+ *         finds in the slot) or a negative error code from the flash driver
+ */
+int fota_sink_write(bool last, uint32_t offset, uint8_t *buffer, size_t len);
+
+/**
+ * @brief Download an image with a blockwise transfer and write it to the
+ *        secondary slot. With CONFIG_SPAN_FOTA_CHECKPOINT the progress (the
+ *        transfer state and the partial hash) is saved to settings every
+ *        CONFIG_SPAN_FOTA_CHECKPOINT_BLOCKS blocks. An interrupted download
+ *        of the same path continues from the last checkpoint unless the
+ *        resource's ETag or size has changed.
+ * @param path path to the image resource
+ * @param window number of outstanding block requests
+ * @param expected_sha256 SHA-256 digest of the image or NULL
+ * @return 0 when the image is complete, negative error code otherwise
+ */
+int fota_sink_download(const char *path, uint8_t window,
+                       const uint8_t *expected_sha256);
+
+/**
+ * @brief Get the SHA-256 digest of the last complete image.
+ * @param digest output buffer, FOTA_SINK_DIGEST_LEN bytes
+ * @return 0 on success, -EAGAIN if no image has been completed
+ */
+int fota_sink_get_digest(uint8_t *digest);
+
+/**
+ * @brief Get the number of bytes written to the slot so far.
+ */
+size_t fota_sink_bytes_written(void);
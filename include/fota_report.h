@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -24,14 +25,19 @@ typedef struct
  * @brief encode report to Span into a byte buffer
  * @param report the report to encode
  * @param buffer buffer to encode to
- * @return length of encoded buffer
+ * @param size size of buffer
+ * @return length of encoded buffer or a negative error code if the report
+ *         doesn't fit
  */
-size_t encode_fota_report(fota_report_t *report, uint8_t *buffer);
+int encode_fota_report(const fota_report_t *report, uint8_t *buffer,
+                       size_t size);
 
 /**
  * @brief decode response from Span into response structure
  * @param resp response output
  * @param buffer buffer to decode
  * @param len length of buffer
+ * @return 0 on success, negative error code if the response is malformed or
+ *         a string is too long for the response structure
  */
 int decode_fota_response(fota_response_t *resp, const uint8_t *buffer, const size_t len);
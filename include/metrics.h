@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Snapshot of the networking counters. The snapshot is TLV encoded (see
+ * tlv.h) with the ids below. All values are 32-bit unsigned integers except
+ * METRICS_RTT_HISTOGRAM which holds one LEB128 varint per histogram bucket
+ * (see struct coap_client_metrics for the bucket limits).
+ */
+
+#define METRICS_UPTIME_S 1
+#define METRICS_COAP_REQUESTS 2
+#define METRICS_COAP_RESPONSES 3
+#define METRICS_COAP_NOTIFICATIONS 4
+#define METRICS_COAP_RETRANSMITS 5
+#define METRICS_COAP_TIMEOUTS 6
+#define METRICS_COAP_RESETS 7
+#define METRICS_COAP_BYTES_OUT 8
+#define METRICS_COAP_BYTES_IN 9
+#define METRICS_DTLS_HANDSHAKES 10
+#define METRICS_DTLS_HANDSHAKE_MS 11
+#define METRICS_UDP_DATAGRAMS 12
+#define METRICS_UDP_BYTES_OUT 13
+#define METRICS_UDP_ERRORS 14
+#define METRICS_RTT_HISTOGRAM 15
+#define METRICS_COAP_NON_SENT 16
+#define METRICS_COAP_PROBES 17
+#define METRICS_COAP_THROTTLED 18
+#define METRICS_COAP_FALLBACKS 19
+#define METRICS_COAP_LOSS_PERMILLE 20
+
+/**
+ * @brief Encode a snapshot of the counters.
+ * @param buffer output buffer
+ * @param size size of output buffer
+ * @return number of bytes written or -ENOMEM if the buffer is too small
+ */
+int metrics_encode(uint8_t *buffer, size_t size);
+
+/**
+ * @brief Post a snapshot of the counters to CONFIG_SPAN_METRICS_PATH. The
+ *        request is asynchronous and the result is only logged.
+ * @return 0 if the request was submitted, negative error code otherwise
+ */
+int metrics_send(void);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Network scheduler. Traffic that can wait is submitted as a job with a
+ * traffic class instead of being sent right away. A job runs at its deadline
+ * at the latest, which wakes the radio if it is asleep. Once the link is
+ * awake (because of a deadline or any other traffic) every job that is past
+ * its class' minimum delay runs in the same window, so the radio wakes up
+ * once for all of them. The link is considered awake for
+ * CONFIG_SPAN_NET_SCHED_WINDOW_MS after the last datagram in either
+ * direction.
+ *
+ * Jobs run on the system work queue and should return quickly.
+ */
+
+enum net_traffic_class
+{
+  // Reads the application is waiting for
+  NET_CLASS_READ,
+  // Uplink data
+  NET_CLASS_UPLINK,
+  // Firmware update checks and downloads
+  NET_CLASS_FOTA,
+  NET_CLASS_COUNT,
+};
+
+struct net_job;
+
+typedef void (*net_job_handler_t)(struct net_job *job);
+
+/**
+ * @brief A unit of deferred traffic. Initialize with net_job_init(); the
+ *        remaining fields are private to the scheduler.
+ */
+struct net_job
+{
+  net_job_handler_t handler;
+  uint8_t traffic_class;
+  uint8_t state;
+  uint32_t earliest;
+  uint32_t deadline;
+  struct net_job *next;
+};
+
+/**
+ * @brief Scheduler statistics.
+ */
+struct net_sched_stats
+{
+  // Jobs that ran
+  uint32_t jobs;
+  // Jobs that ran early in a window that was already open
+  uint32_t piggybacked;
+  // Times a deadline opened a window while the link was asleep
+  uint32_t deadline_wakeups;
+  // Times traffic started while the link was asleep
+  uint32_t link_wakeups;
+  // Estimated time the link has been awake
+  uint32_t link_awake_ms;
+};
+
+/**
+ * @brief Initialize the scheduler. Must be called before the CoAP client is
+ *        started.
+ */
+void net_sched_init(void);
+
+/**
+ * @brief Initialize a job.
+ * @param job job to initialize
+ * @param traffic_class one of enum net_traffic_class
+ * @param handler called when the job runs
+ */
+void net_job_init(struct net_job *job, uint8_t traffic_class,
+                  net_job_handler_t handler);
+
+/**
+ * @brief Schedule a job with the deadline of its traffic class. Submitting
+ *        a job that is already pending keeps the earlier deadline.
+ * @param job job to run
+ * @return 0 on success, -EINVAL if the job has an unknown class
+ */
+int net_sched_submit(struct net_job *job);
+
+/**
+ * @brief Schedule a job with an explicit deadline.
+ * @param job job to run
+ * @param deadline_ms longest time (in ms) the job may wait
+ * @return 0 on success, -EINVAL if the job has an unknown class
+ */
+int net_sched_submit_in(struct net_job *job, uint32_t deadline_ms);
+
+/**
+ * @brief Remove a job that hasn't run yet.
+ * @param job job to cancel
+ */
+void net_sched_cancel(struct net_job *job);
+
+/**
+ * @brief Tell the scheduler that the link is in use. Called by the clients
+ *        for every datagram sent or received.
+ */
+void net_sched_link_active(void);
+
+/**
+ * @brief Get a copy of the scheduler statistics.
+ * @param stats statistics output
+ */
+void net_sched_get_stats(struct net_sched_stats *stats);
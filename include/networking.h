@@ -1,6 +1,57 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr.h>
+
+/*
+ * Network bring-up. net_bringup_start() returns right away and the address
+ * is configured in the background, so the application can take (and queue)
+ * samples while the interface comes up. A static address is ready at once.
+ * With CONFIG_SPAN_DHCP_CACHE_LEASE the address from the last DHCP lease is
+ * configured straight away while the DHCP client confirms (or replaces) it.
+ */
+
+/**
+ * @brief How the interface got its address.
+ */
+enum net_address_source
+{
+  NET_ADDRESS_NONE,
+  NET_ADDRESS_STATIC,
+  NET_ADDRESS_CACHED,
+  NET_ADDRESS_DHCP,
+};
+
+/**
+ * @brief Bring-up statistics.
+ */
+struct net_bringup_stats
+{
+  // Where the first usable address came from
+  uint8_t source;
+  // Uptime when the first address was ready
+  uint32_t ready_ms;
+  // Uptime when the DHCP client was bound, 0 if it hasn't been
+  uint32_t dhcp_bound_ms;
+};
+
+/**
+ * @brief Start bringing the interface up without waiting for an address.
+ */
+void net_bringup_start(void);
+
+/**
+ * @brief Wait for the interface to get an address.
+ * @param timeout longest time to wait
+ * @return 0 if the interface has an address, -ETIMEDOUT if it didn't get
+ *         one in time
+ */
+int net_bringup_wait(k_timeout_t timeout);
+
 /**
- * @brief Initialize DHCP client and wait for IP address.
+ * @brief Get a copy of the bring-up statistics.
+ * @param stats statistics output
  */
-void dhcp_init(void);
+void net_bringup_get_stats(struct net_bringup_stats *stats);
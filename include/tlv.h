@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Table-driven TLV codec. Each field is a one byte id followed by the length
+ * and the value. Lengths up to 254 bytes are a single byte, longer values
+ * (up to 65535 bytes) are encoded as 0xFF followed by a 16-bit big endian
+ * length. The codec doesn't depend on the kernel and can be built on a host.
+ *
+ * The long form is an extension of the format the Span service used to
+ * exchange, where the length was always one byte. A decoder that doesn't
+ * know it reads 0xFF as 255 bytes, so the server side must handle it before
+ * any field can be 255 bytes or longer (none of the FOTA fields are today).
+ * scripts/coap-standin.py implements both forms.
+ */
+
+#define TLV_LONG_LENGTH 0xFF
+#define TLV_MAX_LENGTH 0xFFFF
+
+enum tlv_type {
+  // NUL-terminated string referenced by a char pointer. Encode only.
+  TLV_CSTR,
+  // NUL-terminated string stored in a char array. Decoding copies the value
+  // and fails if it doesn't fit.
+  TLV_CHARS,
+  // A struct tlv_span. Decoding points the span into the input buffer.
+  TLV_SPAN,
+  // 32-bit unsigned integer, big endian
+  TLV_UINT32,
+  // Boolean, a single byte that is 1 for true
+  TLV_BOOL,
+};
+
+/**
+ * @brief A view of a value in a TLV buffer. It is only valid as long as the
+ *        buffer is.
+ */
+struct tlv_span {
+  const uint8_t *data;
+  size_t len;
+};
+
+/**
+ * @brief Field description. Use TLV_FIELD to create entries.
+ */
+struct tlv_field {
+  uint8_t id;
+  uint8_t type;
+  uint16_t offset;
+  uint16_t size;
+};
+
+#define TLV_FIELD(_id, _type, _struct, _member)                               \
+  {                                                                           \
+    .id = (_id), .type = (_type), .offset = offsetof(_struct, _member),       \
+    .size = sizeof(((_struct *)0)->_member)                                   \
+  }
+
+/**
+ * @brief Encode the fields of a structure into a buffer.
+ * @param fields field table
+ * @param count number of fields in the table
+ * @param src structure to encode
+ * @param buf output buffer
+ * @param size size of output buffer
+ * @return number of bytes written, -ENOMEM if the buffer is too small,
+ *         -EMSGSIZE if a value is too long or -EINVAL if a field can't be
+ *         encoded
+ */
+int tlv_encode(const struct tlv_field *fields, size_t count, const void *src,
+               uint8_t *buf, size_t size);
+
+/**
+ * @brief Decode a buffer into a structure. Fields that aren't present in the
+ *        buffer are left untouched.
+ * @param fields field table
+ * @param count number of fields in the table
+ * @param dst structure to decode into
+ * @param buf buffer to decode
+ * @param len length of buffer
+ * @return 0 on success, -EBADMSG if the buffer is truncated, has an unknown
+ *         id or a value with the wrong length, -ENOSPC if a string doesn't fit
+ *         or -EINVAL if a field can't be decoded
+ */
+int tlv_decode(const struct tlv_field *fields, size_t count, void *dst,
+               const uint8_t *buf, size_t len);
@@ -0,0 +1,101 @@
+#pragma once
+#include <zephyr.h>
+
+#include <net/net_ip.h>
+#include <sys/types.h>
+
+/*
+ * Transports for the connections to the Span service. Every client opens its
+ * socket with transport_open() so the credentials, socket options and
+ * handshake timing are set up in one place. The transport is chosen per
+ * endpoint when the connection is opened, so the same image can use DTLS on
+ * an ethernet gateway and plain UDP on the CIoT endpoint of a cellular unit.
+ *
+ * The secure transports need the client certificate, which is built in with
+ * CONFIG_SPAN_TLS_CREDENTIALS.
+ */
+
+enum transport_type
+{
+  TRANSPORT_UDP,
+  TRANSPORT_DTLS,
+  TRANSPORT_TCP,
+  TRANSPORT_TLS,
+  TRANSPORT_COUNT,
+};
+
+/**
+ * @brief Handshake timing for a connection. Only set for DTLS and TLS.
+ */
+struct transport_handshake
+{
+  bool done;
+  uint32_t ms;
+  uint32_t cycles;
+};
+
+/**
+ * @brief Get the name of a transport ("udp", "dtls", "tcp" or "tls").
+ */
+const char *transport_name(enum transport_type type);
+
+/**
+ * @brief Look up a transport by name.
+ * @param name transport name
+ * @param type transport output
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int transport_parse(const char *name, enum transport_type *type);
+
+/**
+ * @brief Check if a transport is a byte stream (TCP or TLS). Messages on a
+ *        stream must be framed by the caller.
+ */
+bool transport_is_stream(enum transport_type type);
+
+/**
+ * @brief Check if a transport encrypts and authenticates the connection.
+ */
+bool transport_is_secure(enum transport_type type);
+
+/**
+ * @brief Bytes added to a message of len bytes on the wire: the IPv4 and
+ *        UDP/TCP headers and the DTLS/TLS record (header, explicit nonce and
+ *        an 8 byte CCM-8 tag). TCP acknowledgements and handshakes aren't
+ *        counted.
+ * @param type transport
+ * @param len message length
+ * @return total number of bytes on the wire
+ */
+size_t transport_wire_bytes(enum transport_type type, size_t len);
+
+/**
+ * @brief Create a socket for the transport and connect it. For DTLS and TLS
+ *        the handshake is done here.
+ * @param type transport to use
+ * @param addr server address
+ * @param handshake handshake timing output, may be NULL
+ * @return the socket (>= 0) or a negative error code. -EPROTONOSUPPORT if
+ *         the transport isn't built in.
+ */
+int transport_open(enum transport_type type, const struct sockaddr_in *addr,
+                   struct transport_handshake *handshake);
+
+/**
+ * @brief Get the transport configured for an endpoint. A transport saved
+ *        with transport_set_default() takes precedence over the Kconfig
+ *        default (CONFIG_SPAN_COAP_TRANSPORT for "coap",
+ *        CONFIG_SPAN_UPLINK_TRANSPORT for "uplink").
+ * @param endpoint "coap" or "uplink"
+ * @return the transport to use
+ */
+enum transport_type transport_get_default(const char *endpoint);
+
+/**
+ * @brief Set the transport for an endpoint. It is saved to settings (when
+ *        they are enabled) and used the next time the endpoint is opened.
+ * @param endpoint "coap" or "uplink"
+ * @param type transport to use
+ * @return 0 on success, -EINVAL for an unknown endpoint
+ */
+int transport_set_default(const char *endpoint, enum transport_type type);
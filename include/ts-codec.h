@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming compression for numeric time series, in the style of Gorilla
+ * (Pelkonen et al., VLDB 2015). Samples are (time, value) pairs of 32-bit
+ * integers packed into a bit stream, most significant bit first:
+ *
+ * - The first sample is stored as-is, 32 bits each.
+ * - Times are stored as the delta-of-delta from the previous sample, zig-zag
+ *   encoded: '0' for no change, '10' + 7 bits, '110' + 9 bits, '1110' +
+ *   12 bits or '1111' + 32 bits. A fixed sample rate costs one bit.
+ * - In TS_VALUE_DELTA mode values are stored as the zig-zag encoded
+ *   difference from the previous value with the same prefixes and 4, 8 or
+ *   16 bits (or 32). Meant for integer readings that change slowly.
+ * - In TS_VALUE_XOR mode values are XORed with the previous value: '0' for
+ *   the same value, '10' + the meaningful bits if they fit in the previous
+ *   window or '11' + 5 bits of leading zeros + 5 bits of length - 1 + the
+ *   meaningful bits. Meant for the bit patterns of floats.
+ *
+ * The stream doesn't record the number of samples, so the reader has to
+ * know it. The state is a fixed-size struct, nothing is allocated and there
+ * is no floating point. The codec doesn't depend on the kernel and can be
+ * built on a host.
+ */
+
+enum ts_value_mode {
+  TS_VALUE_DELTA,
+  TS_VALUE_XOR,
+};
+
+/**
+ * @brief Encoder state. The fields are private.
+ */
+struct ts_encoder {
+  uint8_t *buf;
+  size_t size;
+  size_t bits;
+  uint32_t count;
+  uint8_t mode;
+  uint8_t leading;
+  uint8_t trailing;
+  uint32_t time;
+  int32_t delta;
+  uint32_t value;
+};
+
+/**
+ * @brief Decoder state. The fields are private.
+ */
+struct ts_decoder {
+  const uint8_t *buf;
+  size_t len;
+  size_t bits;
+  uint32_t count;
+  uint8_t mode;
+  uint8_t leading;
+  uint8_t trailing;
+  uint32_t time;
+  int32_t delta;
+  uint32_t value;
+};
+
+/**
+ * @brief Start a stream.
+ * @param enc encoder state
+ * @param buf output buffer
+ * @param size size of output buffer
+ * @param mode how values are encoded
+ */
+void ts_encoder_init(struct ts_encoder *enc, uint8_t *buf, size_t size,
+                     enum ts_value_mode mode);
+
+/**
+ * @brief Append a sample. Nothing is written if the sample doesn't fit, so
+ *        the stream stays valid.
+ * @param enc encoder state
+ * @param time sample time, usually in ms
+ * @param value sample value (the bit pattern for floats)
+ * @return 0 on success, -ENOMEM if the buffer is full
+ */
+int ts_encode(struct ts_encoder *enc, uint32_t time, uint32_t value);
+
+/**
+ * @brief Number of samples in the stream.
+ */
+uint32_t ts_encoder_count(const struct ts_encoder *enc);
+
+/**
+ * @brief Length of the stream in bytes. The last byte is padded with zeros.
+ */
+size_t ts_encoder_len(const struct ts_encoder *enc);
+
+/**
+ * @brief Start reading a stream.
+ * @param dec decoder state
+ * @param buf stream
+ * @param len length of stream
+ * @param mode how values were encoded
+ */
+void ts_decoder_init(struct ts_decoder *dec, const uint8_t *buf, size_t len,
+                     enum ts_value_mode mode);
+
+/**
+ * @brief Read the next sample.
+ * @param dec decoder state
+ * @param time sample time output
+ * @param value sample value output
+ * @return 0 on success, -EBADMSG if the stream ends in the middle of a
+ *         sample
+ */
+int ts_decode(struct ts_decoder *dec, uint32_t *time, uint32_t *value);
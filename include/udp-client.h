@@ -1,7 +1,113 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr.h>
+
+#include "transport.h"
+
+/**
+ * @brief Counters for the plain UDP client. The handshake time is only set
+ *        when DTLS or TLS is used. send_cycles is the time spent in send() by
+ *        the sender thread, divide by datagrams to get the cost per packet.
+ *        latency_ms adds up the time from udp_uplink_commit() until each
+ *        datagram was sent and wire_bytes the estimated bytes on the wire
+ *        (see transport_wire_bytes()).
+ */
+struct udp_client_metrics
+{
+    uint32_t datagrams;
+    uint32_t bytes_out;
+    uint32_t errors;
+    uint32_t handshakes;
+    uint32_t last_handshake_ms;
+    uint32_t queue_full;
+    uint32_t send_cycles;
+    uint32_t latency_ms;
+    uint32_t wire_bytes;
+};
+
+/*
+ * UDP (or DTLS, TCP or TLS) uplink. Datagrams are formatted in place in a
+ * queue slot and sent by a separate thread, paced by a token bucket with
+ * CONFIG_SPAN_UDP_UPLINK_RATE datagrams per second and bursts of up to
+ * CONFIG_SPAN_UDP_UPLINK_BURST datagrams. The socket stays open until
+ * udp_uplink_close() is called. On TCP and TLS each datagram is sent with a
+ * 16-bit big endian length in front of it.
+ */
+
+/**
+ * @brief Open the uplink socket and start the sender thread. The DTLS or TLS
+ *        handshake (if any) is done here. Calling it while the socket is open
+ *        does nothing.
+ * @param host IPv4 address of the service
+ * @param port port of the service
+ * @param transport transport to use
+ * @return 0 on success, negative error code if the socket can't be opened
+ */
+int udp_uplink_open(const char *host, const int port,
+                    enum transport_type transport);
+
+/**
+ * @brief Get a queue slot to format a datagram in. Each successful call must
+ *        be followed by udp_uplink_commit() with the returned buffer. Other
+ *        producers can take slots in between; datagrams are sent in the
+ *        order the slots were handed out, so a slot that isn't committed
+ *        holds back the ones after it.
+ * @param timeout how long to wait for a free slot
+ * @return a buffer of CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD bytes or NULL if the
+ *         queue is full
+ */
+uint8_t *udp_uplink_alloc(k_timeout_t timeout);
+
+/**
+ * @brief Queue the datagram in a slot returned by udp_uplink_alloc().
+ * @param buffer the buffer udp_uplink_alloc() returned
+ * @param len length of the datagram
+ * @return 0 on success, -EMSGSIZE if len is larger than the slot (the
+ *         datagram is dropped)
+ */
+int udp_uplink_commit(uint8_t *buffer, size_t len);
+
+/**
+ * @brief Copy a datagram into the queue.
+ * @param buffer datagram to send
+ * @param len length of the datagram
+ * @param timeout how long to wait for a free slot
+ * @return 0 on success, -EAGAIN if the queue is full or -EMSGSIZE if the
+ *         datagram is too large
+ */
+int udp_uplink_send(const uint8_t *buffer, size_t len, k_timeout_t timeout);
+
+/**
+ * @brief Change the pacing of the sender thread.
+ * @param packets_per_second datagrams per second, 0 for no limit
+ * @param burst_size number of datagrams that can be sent back to back
+ */
+void udp_uplink_set_rate(uint32_t packets_per_second, uint32_t burst_size);
+
+/**
+ * @brief Wait for the queue to drain.
+ * @param timeout_ms how long to wait
+ * @return 0 when everything is sent or -ETIMEDOUT
+ */
+int udp_uplink_flush(int timeout_ms);
+
+/**
+ * @brief Close the socket. Datagrams that are still queued are dropped.
+ */
+void udp_uplink_close(void);
+
+/**
+ * @brief Send CONFIG_SPAN_UDP_SAMPLE_PACKETS datagrams through the uplink,
+ *        log the packet rate and close the socket. Each datagram holds a
+ *        sequence number and the uptime in ms (both 32-bit big endian).
+ */
+int send_udp(const char *host, const int port, enum transport_type transport);
+
 /**
- * @brief This is nothing exceptional, just the plain UDP bits. This will send 10 UDP or DTLS
- *         messages to the host and port specfied
+ * @brief Get a copy of the UDP client counters.
+ * @param metrics counters output
  */
-int send_udp(const char *host, const int port);
\ No newline at end of file
+void udp_get_metrics(struct udp_client_metrics *metrics);
@@ -0,0 +1,96 @@
+#pragma once
+#include <zephyr.h>
+
+#include <sys/types.h>
+
+/**
+ * Batched uplink. Samples are appended to a buffer and sent as a single CoAP
+ * POST when the buffer is full, when the oldest sample reaches
+ * CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS or when uplink_batch_flush() is called.
+ * The age limit is a deadline for the network scheduler (see net-sched.h), so
+ * a batch may also go out earlier in a window where the link is awake.
+ *
+ * The payload of the POST is a version byte followed by the age (in ms) of
+ * the first sample when the batch was sent and one record per sample:
+ *
+ *   0x01 | age | { dt | len | data[len] }*
+ *
+ * age, dt and len are unsigned LEB128 varints. dt is the time in ms since the
+ * first sample in the batch, so the server can recover the time of each
+ * sample as (time received - age + dt).
+ *
+ * Numeric samples added with uplink_batch_add_value() are compressed into a
+ * version 2 batch instead, with the number of samples (a varint) followed by
+ * a ts-codec.h stream in TS_VALUE_DELTA mode:
+ *
+ *   0x02 | age | count | series
+ *
+ * The times in the series are dt as above, so the first one is 0. A batch
+ * holds one format only; adding the other kind of sample flushes it first.
+ *
+ * With CONFIG_SPAN_UPLINK_STORE full batches are appended to the flash queue
+ * in uplink-store.h instead and sent from there, so they survive an outage or
+ * a reset. The age is then worked out when the batch leaves the queue.
+ */
+
+#define UPLINK_BATCH_VERSION 1
+#define UPLINK_BATCH_VERSION_SERIES 2
+
+/**
+ * @brief Statistics for the batched uplink.
+ */
+struct uplink_batch_stats
+{
+  uint32_t samples;
+  uint32_t sample_bytes;
+  uint32_t messages;
+  uint32_t payload_bytes;
+  uint32_t dropped;
+  // Batches appended to the store (CONFIG_SPAN_UPLINK_STORE)
+  uint32_t stored;
+};
+
+/**
+ * @brief Initialize the batched uplink. The CoAP client must be started
+ *        before anything is flushed.
+ * @param path resource the batches are posted to
+ * @return 0 on success, negative error code if the path can't be registered
+ */
+int uplink_batch_init(const char *path);
+
+/**
+ * @brief Append a sample to the batch. The batch is flushed first if the
+ *        sample doesn't fit.
+ * @param sample sample data
+ * @param len length of sample
+ * @return 0 if the sample was queued, -EMSGSIZE if it is larger than a
+ *         batch or the error from the flush if the batch couldn't be sent
+ */
+int uplink_batch_add(const uint8_t *sample, size_t len);
+
+/**
+ * @brief Append a numeric sample to the batch. Consecutive values are
+ *        compressed, so slowly changing readings take a few bits each.
+ * @param value sample value
+ * @return 0 if the sample was queued or the error from the flush if the
+ *         batch was full and couldn't be sent
+ */
+int uplink_batch_add_value(int32_t value);
+
+/**
+ * @brief Send the samples in the batch right away.
+ * @return 0 if the batch was sent or stored (or was empty), otherwise the
+ *         error from coap_submit_request(). The samples are kept on error.
+ */
+int uplink_batch_flush(void);
+
+/**
+ * @brief Number of batches waiting for a response from the server. This
+ *        includes the batches in the store that haven't been acknowledged.
+ */
+int uplink_batch_in_flight(void);
+
+/**
+ * @brief Read the statistics for the batched uplink.
+ */
+void uplink_batch_get_stats(struct uplink_batch_stats *stats);
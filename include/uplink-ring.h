@@ -0,0 +1,66 @@
+#pragma once
+#include <zephyr.h>
+
+#include <sys/types.h>
+
+/*
+ * Ring of datagram slots between the producers of the UDP uplink and its
+ * sender thread (udp-client.c). A producer takes a slot with
+ * uplink_ring_alloc(), formats the datagram in place and hands it over with
+ * uplink_ring_commit(). Producers may hold several slots and commit them in
+ * any order. The sender gets the slots in the order they were handed out
+ * from uplink_ring_next() and gives them back with uplink_ring_release(), so
+ * a slot that is still being filled holds back the ones after it.
+ */
+
+/**
+ * @brief A datagram slot. frame is right in front of data so a stream
+ *        transport can send a length prefix and the datagram in one go.
+ */
+struct uplink_slot
+{
+  uint16_t len;
+  uint32_t queued_at;
+  // Committed, but not passed on to the sender yet
+  bool ready;
+  // Too large, the sender hands it back without sending it
+  bool drop;
+  uint8_t frame[2];
+  uint8_t data[CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD];
+};
+
+/**
+ * @brief Get a slot to format a datagram in.
+ * @param timeout how long to wait for a free slot
+ * @return the data buffer of the slot (CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD
+ *         bytes) or NULL if no slot became free in time
+ */
+uint8_t *uplink_ring_alloc(k_timeout_t timeout);
+
+/**
+ * @brief Hand a slot returned by uplink_ring_alloc() to the sender.
+ * @param buffer the buffer uplink_ring_alloc() returned
+ * @param len length of the datagram
+ * @return 0 on success, -EMSGSIZE if len is larger than the slot (the
+ *         sender hands the slot back without sending it)
+ */
+int uplink_ring_commit(uint8_t *buffer, size_t len);
+
+/**
+ * @brief Get the oldest slot that has been passed on to the sender. Only
+ *        the sender thread calls this.
+ * @param timeout how long to wait for a slot
+ * @return the slot or NULL if none was passed on in time
+ */
+struct uplink_slot *uplink_ring_next(k_timeout_t timeout);
+
+/**
+ * @brief Give back the slot returned by uplink_ring_next().
+ */
+void uplink_ring_release(struct uplink_slot *slot);
+
+/**
+ * @brief Number of slots passed on to the sender that haven't been given
+ *        back yet.
+ */
+int uplink_ring_pending(void);
@@ -0,0 +1,108 @@
+#pragma once
+#include <zephyr.h>
+
+#include <sys/types.h>
+
+/**
+ * Store-and-forward queue for uplink batches. Batches are appended to a flash
+ * circular buffer (FCB) in the storage partition, after the sectors used by
+ * settings, and drained from there in bursts of up to
+ * CONFIG_SPAN_UPLINK_STORE_BURST requests in flight. A batch stays in flash
+ * until the server has acknowledged it, so nothing is lost while the link is
+ * down or when the device resets.
+ *
+ * Appending is a single FCB append (O(1), one flash write). Every entry
+ * carries a CRC, so an append that is interrupted by a reset is skipped when
+ * the queue is read back. Progress is committed by appending a small commit
+ * entry with the highest sequence number the server has acknowledged, and
+ * the oldest sector is erased once all of its batches are committed. Batches
+ * acknowledged after the last commit are sent again after a reset, so
+ * delivery is at least once.
+ *
+ * A batch that fails keeps its place in the burst and is sent again after
+ * CONFIG_SPAN_UPLINK_STORE_RETRY_MS, so the queue stops sending while the
+ * link is down. The FCB rotates through its sectors, which spreads the erases
+ * evenly. When the queue is full the oldest sector is dropped.
+ */
+
+/**
+ * @brief A stored batch handed to the send function.
+ */
+struct uplink_store_entry
+{
+  uint32_t seq;
+  // Format byte given to uplink_store_append()
+  uint8_t format;
+  // Age of the first sample. Batches stored before a reset only count the
+  // time since boot on top of the age they had when they were stored.
+  uint32_t age;
+  const uint8_t *data;
+  size_t len;
+};
+
+/**
+ * @brief Send a stored batch. The function must call uplink_store_done()
+ *        with the sequence number when the request completes.
+ * @return 0 if the request was submitted, negative error code otherwise
+ */
+typedef int (*uplink_store_send_t)(const struct uplink_store_entry *entry);
+
+/**
+ * @brief Store statistics. flash_bytes counts everything programmed (entries,
+ *        their FCB headers and commit entries), so flash_bytes /
+ *        payload_bytes is the write amplification.
+ */
+struct uplink_store_stats
+{
+  uint32_t appended;
+  uint32_t sent;
+  uint32_t acked;
+  uint32_t failed;
+  uint32_t dropped;
+  uint32_t pending;
+  uint32_t commits;
+  uint32_t erases;
+  uint32_t payload_bytes;
+  uint32_t flash_bytes;
+};
+
+/**
+ * @brief Open the queue and find the batches left from before a reset.
+ * @param send function used to send stored batches
+ * @return 0 on success, negative error code if the flash area can't be used
+ */
+int uplink_store_init(uplink_store_send_t send);
+
+/**
+ * @brief Append a batch to the queue.
+ * @param format format of the batch, handed back to the send function
+ * @param data batch records
+ * @param len length of the batch, at most CONFIG_SPAN_UPLINK_BATCH_SIZE
+ * @param age age (in ms) of the first sample in the batch
+ * @return 0 on success, -EMSGSIZE if the batch is too large or another
+ *         negative error code if the flash couldn't be written
+ */
+int uplink_store_append(uint8_t format, const uint8_t *data, size_t len,
+                        uint32_t age);
+
+/**
+ * @brief Start sending the stored batches. Returns right away; the batches
+ *        are sent from the system work queue.
+ */
+void uplink_store_drain(void);
+
+/**
+ * @brief Report the outcome of a request submitted by the send function.
+ *        This doesn't wait for flash: the result is applied, committed and
+ *        the next batch sent from the system work queue.
+ * @param seq sequence number of the batch
+ * @param result 0 if the server has the batch, negative if it must be sent
+ *        again
+ */
+void uplink_store_done(uint32_t seq, int result);
+
+/**
+ * @brief Get a copy of the store statistics.
+ * @param stats statistics output
+ */
+void uplink_store_get_stats(struct uplink_store_stats *stats);
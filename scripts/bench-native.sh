@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Build the sample for native_posix, run it against the local stand-in
+# server and print a short performance report: messages/s and blockwise
+# throughput (from the stand-in), handshake time and peak buffer use (from
+# the sample's log). The stand-in has no DTLS, so the handshake lines only
+# show figures when the sample is pointed at the Span service.
+#
+# The zeth interface must be up first (as root):
+#   $ZEPHYR_BASE/../tools/net-tools/net-setup.sh
+#
+# Network impairments are passed on to the stand-in, for instance:
+#   scripts/bench-native.sh --latency 100 --jitter 50 --loss 0.05
+#
+# The UDP uplink runs unpaced by default to find the sustainable packet
+# rate. Set UDP_RATE (datagrams/s) and UDP_PACKETS to change that.
+# FAST_MESSAGES messages go out on the CoAP fast path (coap_send_fast()),
+# limited to COAP_RATE bytes/s. FW_WINDOW is the number of firmware blocks
+# requested at a time.
+# UPLINK_TRANSPORT picks the uplink transport (udp or tcp; tls needs the
+# client certificate built in and --tls-cert/--tls-key for the stand-in).
+#
+# The sample logs the time from boot to its first CoAP request. With DHCP=1
+# the address comes from a DHCP server on zeth (dnsmasq, for instance)
+# instead of the static address. The sample is then built with
+# overlay-store.conf and the lease is cached in the flash simulator, so the
+# second run boots with the cached lease. CACHE_LEASE=n measures the full
+# DHCP exchange every time.
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD=$ROOT/build-native
+RUN_TIMEOUT=${RUN_TIMEOUT:-60}
+UDP_RATE=${UDP_RATE:-0}
+UDP_PACKETS=${UDP_PACKETS:-1000}
+DHCP=${DHCP:-0}
+CACHE_LEASE=${CACHE_LEASE:-y}
+UPLINK_TRANSPORT=${UPLINK_TRANSPORT:-udp}
+FAST_MESSAGES=${FAST_MESSAGES:-100}
+COAP_RATE=${COAP_RATE:-1000}
+FW_WINDOW=${FW_WINDOW:-4}
+
+cat > "$BUILD.conf" <<EOF
+CONFIG_SPAN_UDP_UPLINK_RATE=$UDP_RATE
+CONFIG_SPAN_UDP_SAMPLE_PACKETS=$UDP_PACKETS
+CONFIG_SPAN_UPLINK_TRANSPORT="$UPLINK_TRANSPORT"
+CONFIG_SPAN_COAP_FAST_SAMPLE_MESSAGES=$FAST_MESSAGES
+CONFIG_SPAN_COAP_PROBING_RATE=$COAP_RATE
+CONFIG_SPAN_FOTA_DOWNLOAD_WINDOW=$FW_WINDOW
+EOF
+OVERLAYS=$BUILD.conf
+if [ "$DHCP" = 1 ]; then
+  cat >> "$BUILD.conf" <<EOF
+CONFIG_NET_CONFIG_MY_IPV4_ADDR=""
+CONFIG_SPAN_DHCP_CACHE_LEASE=$CACHE_LEASE
+EOF
+  OVERLAYS="$ROOT/zephyr/overlay-store.conf $BUILD.conf"
+fi
+
+west build -b native_posix -d "$BUILD" "$ROOT/zephyr" -- \
+  -DOVERLAY_CONFIG="$OVERLAYS" > "$BUILD.log" 2>&1 || {
+  echo "build failed, see $BUILD.log" >&2
+  exit 1
+}
+
+python3 "$ROOT/scripts/coap-standin.py" --bind 192.0.2.2 --update "$@" \
+  > "$BUILD.server" 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null || true' EXIT
+sleep 1
+
+timeout "$RUN_TIMEOUT" "$BUILD/zephyr/zephyr.exe" > "$BUILD.run" 2>&1 || true
+kill $SERVER
+wait $SERVER || true
+trap - EXIT
+
+echo "== native_posix $*"
+cat "$BUILD.server"
+echo "== sample"
+grep -E "Boot:|DTLS|CoAP buffers|CoAP receive|Sent [0-9]+ samples|Received last block|UDP uplink|CoAP fast path" \
+  "$BUILD.run" || echo "nothing logged, see $BUILD.run"
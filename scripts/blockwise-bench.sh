@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+# Run bench-native.sh once per firmware download window and compare the
+# blockwise throughput the stand-in measures. Window 1 is stop-and-wait.
+# Arguments are passed on to bench-native.sh and the stand-in; the window
+# only pays off when there is latency to hide, for instance:
+#   scripts/blockwise-bench.sh --latency 500 --jitter 100 --loss 0.02
+#
+# WINDOWS defaults to every window the client supports
+# (COAP_BLOCKWISE_MAX_WINDOW).
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WINDOWS=${WINDOWS:-"1 2 3 4"}
+
+for w in $WINDOWS; do
+  echo "== window $w"
+  FW_WINDOW=$w "$ROOT/scripts/bench-native.sh" "$@" |
+    grep -E "blockwise:|Received last block"
+done
@@ -0,0 +1,483 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the Span CoAP service, for running the sample on
+native_posix (or qemu_x86) without the real backend. Plain CoAP over UDP
+only; build the sample with CONFIG_SPAN_TLS_CREDENTIALS=n. There is no DTLS
+listener since Python's ssl module has no DTLS.
+
+Resources:
+  POST u            firmware report, answered with a FOTA response (TLV)
+  GET  u            the same FOTA response, observable (RFC 7641)
+  GET  fw           firmware image, blockwise (Block2, Size2, ETag)
+  POST data/...     uplink data, counted
+  POST metrics      device counters (see include/metrics.h), the last
+                    snapshot is printed in the summary
+
+TLV payloads (include/tlv.h) are a one byte id, a one byte length and the
+value. Values of 255 bytes or more have 0xFF in the length byte, followed
+by the real length as a 16-bit big endian number. A server that reads the
+length byte on its own gets such values wrong.
+
+UDP datagrams to --udp-port are counted as well. The uplink can also connect
+over TCP to the same port (or TLS with --tls-cert and --tls-key), where every
+message has a 16-bit big endian length in front of it.
+
+Impairments (applied to both directions):
+  --latency MS      one-way delay
+  --jitter MS       random extra delay (0 - MS), which also reorders
+  --loss P          drop probability
+  --reorder P       probability that a datagram is held back by --latency ms
+                    extra so it arrives after the ones sent after it
+
+A summary (messages/s, blockwise KB/s and so on) is printed on exit.
+"""
+import argparse
+import heapq
+import os
+import random
+import select
+import signal
+import socket
+import struct
+import sys
+import time
+
+CON, NON, ACK, RST = 0, 1, 2, 3
+GET, POST = 1, 2
+CONTENT = (2 << 5) | 5
+CHANGED = (2 << 5) | 4
+NOT_FOUND = (4 << 5) | 4
+BAD_OPTION = (4 << 5) | 2
+
+OPT_ETAG = 4
+OPT_OBSERVE = 6
+OPT_URI_PATH = 11
+OPT_BLOCK2 = 23
+OPT_SIZE2 = 28
+OPT_NO_RESPONSE = 258
+
+
+def parse(data):
+    if len(data) < 4 or data[0] >> 6 != 1:
+        return None
+    tkl = data[0] & 0x0F
+    msg = {
+        "type": (data[0] >> 4) & 3,
+        "code": data[1],
+        "id": struct.unpack(">H", data[2:4])[0],
+        "token": data[4:4 + tkl],
+        "options": [],
+        "payload": b"",
+    }
+    i = 4 + tkl
+    number = 0
+    while i < len(data):
+        if data[i] == 0xFF:
+            msg["payload"] = data[i + 1:]
+            break
+        fields = [data[i] >> 4, data[i] & 0x0F]
+        i += 1
+        for n in range(2):
+            if fields[n] == 13:
+                fields[n] = data[i] + 13
+                i += 1
+            elif fields[n] == 14:
+                fields[n] = struct.unpack(">H", data[i:i + 2])[0] + 269
+                i += 2
+        number += fields[0]
+        msg["options"].append((number, data[i:i + fields[1]]))
+        i += fields[1]
+    return msg
+
+
+def option(msg, number):
+    for n, v in msg["options"]:
+        if n == number:
+            return v
+    return None
+
+
+def uint(value):
+    return int.from_bytes(value, "big") if value else 0
+
+
+def encode_uint(val):
+    return val.to_bytes((val.bit_length() + 7) // 8, "big") if val else b""
+
+
+def build(mtype, code, mid, token, options=(), payload=b""):
+    out = bytearray([0x40 | (mtype << 4) | len(token), code])
+    out += struct.pack(">H", mid) + token
+    last = 0
+    for number, value in sorted(options, key=lambda o: o[0]):
+        fields = []
+        for val in (number - last, len(value)):
+            if val < 13:
+                fields.append((val, b""))
+            elif val < 269:
+                fields.append((13, bytes([val - 13])))
+            else:
+                fields.append((14, struct.pack(">H", val - 269)))
+        out.append((fields[0][0] << 4) | fields[1][0])
+        out += fields[0][1] + fields[1][1] + value
+        last = number
+    if payload:
+        out += b"\xff" + payload
+    return bytes(out)
+
+
+def tlv(fields):
+    out = bytearray()
+    for fid, value in fields:
+        if len(value) < 0xFF:
+            out += bytes([fid, len(value)])
+        else:
+            out += bytes([fid, 0xFF]) + struct.pack(">H", len(value))
+        out += value
+    return bytes(out)
+
+
+def decode_tlv(payload):
+    """Yields (id, value) for every field."""
+    pos = 0
+    while pos + 2 <= len(payload):
+        fid, length = payload[pos], payload[pos + 1]
+        pos += 2
+        if length == 0xFF:
+            length = int.from_bytes(payload[pos:pos + 2], "big")
+            pos += 2
+        yield fid, payload[pos:pos + length]
+        pos += length
+
+
+METRIC_NAMES = {
+    1: "uptime_s", 2: "requests", 3: "responses", 4: "notifications",
+    5: "retransmits", 6: "timeouts", 7: "resets", 8: "bytes_out",
+    9: "bytes_in", 10: "handshakes", 11: "handshake_ms", 12: "udp_datagrams",
+    13: "udp_bytes_out", 14: "udp_errors", 16: "non_sent", 17: "probes",
+    18: "throttled", 19: "fallbacks", 20: "loss_permille",
+}
+METRIC_RTT_HISTOGRAM = 15
+
+
+def decode_metrics(payload):
+    metrics = {}
+    for fid, value in decode_tlv(payload):
+        if fid == METRIC_RTT_HISTOGRAM:
+            buckets, val, shift = [], 0, 0
+            for b in value:
+                val |= (b & 0x7F) << shift
+                shift += 7
+                if not b & 0x80:
+                    buckets.append(val)
+                    val, shift = 0, 0
+            metrics["rtt_histogram"] = buckets
+        elif fid in METRIC_NAMES:
+            metrics[METRIC_NAMES[fid]] = int.from_bytes(value, "big")
+    return metrics
+
+
+class StandIn:
+    def __init__(self, args):
+        self.args = args
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind((args.bind, args.port))
+        self.udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.udp.bind((args.bind, args.udp_port))
+        self.tcp = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.tcp.bind((args.bind, args.udp_port))
+        self.tcp.listen(4)
+        self.tls = None
+        if args.tls_cert:
+            import ssl
+            self.tls = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            self.tls.load_cert_chain(args.tls_cert, args.tls_key)
+        # Connected uplink streams and the bytes not yet framed
+        self.streams = {}
+        if args.firmware:
+            self.firmware = open(args.firmware, "rb").read()
+        else:
+            self.firmware = os.urandom(args.firmware_size)
+        self.etag = struct.pack(">I", random.getrandbits(32))
+        self.update = args.update
+        self.observers = {}
+        self.metrics = {}
+        self.observe_seq = random.randrange(1 << 24)
+        self.next_id = random.randrange(1 << 16)
+        self.queue = []
+        self.seq = 0
+        self.start = time.monotonic()
+        self.stats = {
+            "rx": 0, "tx": 0, "dropped": 0, "requests": {}, "fw_bytes": 0,
+            "fw_first": None, "fw_last": None, "data_bytes": 0, "udp": 0,
+            "udp_bytes": 0, "udp_first": None, "udp_last": None,
+            "duplicates": 0, "suppressed": 0,
+        }
+        self.seen = {}
+
+    def count_uplink(self, length):
+        self.stats["udp"] += 1
+        self.stats["udp_bytes"] += length
+        now = time.monotonic()
+        if self.stats["udp_first"] is None:
+            self.stats["udp_first"] = now
+        self.stats["udp_last"] = now
+
+    def accept(self):
+        conn, _ = self.tcp.accept()
+        if self.tls:
+            try:
+                conn = self.tls.wrap_socket(conn, server_side=True)
+            except OSError as e:
+                print("TLS handshake failed: %s" % e)
+                conn.close()
+                return
+        self.streams[conn] = bytearray()
+
+    def read_stream(self, conn):
+        buf = self.streams[conn]
+        closed = False
+        while True:
+            try:
+                data = conn.recv(4096)
+            except OSError:
+                data = b""
+            if not data:
+                closed = True
+                break
+            buf += data
+            # TLS may have decrypted more than select() can see
+            if not getattr(conn, "pending", lambda: 0)():
+                break
+        while len(buf) >= 2:
+            length = struct.unpack(">H", buf[:2])[0]
+            if len(buf) < 2 + length:
+                break
+            self.count_uplink(length)
+            del buf[:2 + length]
+        if closed:
+            del self.streams[conn]
+            conn.close()
+
+    def delay(self):
+        a = self.args
+        d = a.latency + random.uniform(0, a.jitter)
+        if random.random() < a.reorder:
+            d += max(a.latency, 20)
+        return d / 1000.0
+
+    def schedule(self, when, action, *params):
+        self.seq += 1
+        heapq.heappush(self.queue, (when, self.seq, action, params))
+
+    def send(self, data, addr):
+        if random.random() < self.args.loss:
+            self.stats["dropped"] += 1
+            return
+        self.schedule(time.monotonic() + self.delay(), self._send, data, addr)
+
+    def _send(self, data, addr):
+        self.stats["tx"] += 1
+        self.sock.sendto(data, addr)
+
+    def fota_response(self):
+        return tlv([
+            (1, self.args.fw_host.encode()),
+            (2, struct.pack(">I", self.args.fw_port)),
+            (3, b"fw"),
+            (4, bytes([1 if self.update else 0])),
+        ])
+
+    def reply(self, req, addr, code, options=(), payload=b""):
+        if req["type"] == CON:
+            data = build(ACK, code, req["id"], req["token"], options, payload)
+        else:
+            # No-Response (RFC 7967) has one bit per response class
+            suppress = option(req, OPT_NO_RESPONSE)
+            if suppress is not None and uint(suppress) & (1 << (
+                    (code >> 5) - 1)):
+                self.stats["suppressed"] += 1
+                return
+            self.next_id = (self.next_id + 1) & 0xFFFF
+            data = build(NON, code, self.next_id, req["token"], options,
+                         payload)
+        # Retransmitted requests get the same response
+        self.seen[(addr, req["id"])] = data
+        if len(self.seen) > 256:
+            del self.seen[next(iter(self.seen))]
+        self.send(data, addr)
+
+    def handle(self, data, addr):
+        if random.random() < self.args.loss:
+            self.stats["dropped"] += 1
+            return
+        self.stats["rx"] += 1
+        req = parse(data)
+        if not req or req["type"] in (ACK, RST):
+            if req and req["type"] == RST:
+                self.observers = {k: v for k, v in self.observers.items()
+                                  if v[1] != req["id"]}
+            return
+        cached = self.seen.get((addr, req["id"]))
+        if cached:
+            self.stats["duplicates"] += 1
+            self.send(cached, addr)
+            return
+        path = "/".join(v.decode() for n, v in req["options"]
+                        if n == OPT_URI_PATH)
+        key = ("%s %s" % ({GET: "GET", POST: "POST"}.get(req["code"], "?"),
+                          path.split("/")[0]))
+        self.stats["requests"][key] = self.stats["requests"].get(key, 0) + 1
+
+        if path == "u":
+            observe = option(req, OPT_OBSERVE)
+            options = []
+            if req["code"] == GET and observe is not None:
+                if uint(observe) == 0:
+                    self.observers[(addr, req["token"])] = (addr, None)
+                    options.append((OPT_OBSERVE,
+                                    encode_uint(self.observe_seq)))
+                else:
+                    self.observers.pop((addr, req["token"]), None)
+            code = CONTENT if req["code"] == GET else CHANGED
+            self.reply(req, addr, code, options, self.fota_response())
+        elif path == "fw" and req["code"] == GET:
+            self.serve_block(req, addr)
+        elif path.startswith("data") and req["code"] == POST:
+            self.stats["data_bytes"] += len(req["payload"])
+            self.reply(req, addr, CHANGED)
+        elif path == "metrics" and req["code"] == POST:
+            self.metrics = decode_metrics(req["payload"])
+            self.reply(req, addr, CHANGED)
+        else:
+            self.reply(req, addr, NOT_FOUND)
+
+    def serve_block(self, req, addr):
+        block2 = option(req, OPT_BLOCK2)
+        value = uint(block2) if block2 is not None else 6
+        szx = min(value & 7, self.args.max_szx)
+        size = 16 << szx
+        # A smaller size than asked for refers to the start of the block
+        num = (value >> 4) * ((16 << (value & 7)) // size)
+        data = self.firmware[num * size:(num + 1) * size]
+        more = (num + 1) * size < len(self.firmware)
+        options = [(OPT_ETAG, self.etag),
+                   (OPT_BLOCK2, encode_uint((num << 4) | (more << 3) | szx))]
+        if option(req, OPT_SIZE2) is not None:
+            options.append((OPT_SIZE2, encode_uint(len(self.firmware))))
+        now = time.monotonic()
+        if self.stats["fw_first"] is None or num == 0:
+            self.stats["fw_first"] = now
+            self.stats["fw_bytes"] = 0
+        self.stats["fw_last"] = now
+        self.stats["fw_bytes"] += len(data)
+        self.reply(req, addr, CONTENT, options, data)
+
+    def notify(self):
+        self.update = True
+        self.observe_seq = (self.observe_seq + 1) & 0xFFFFFF
+        print("Publishing firmware update to %d observer(s)" %
+              len(self.observers), file=sys.stderr)
+        for key, (addr, _) in list(self.observers.items()):
+            self.next_id = (self.next_id + 1) & 0xFFFF
+            self.observers[key] = (addr, self.next_id)
+            self.send(build(CON, CONTENT, self.next_id, key[1],
+                            [(OPT_OBSERVE, encode_uint(self.observe_seq))],
+                            self.fota_response()), addr)
+
+    def run(self):
+        if self.args.publish_after:
+            self.schedule(self.start + self.args.publish_after, self.notify)
+        deadline = (self.start + self.args.duration
+                    if self.args.duration else None)
+        while deadline is None or time.monotonic() < deadline:
+            timeout = 0.25
+            if self.queue:
+                timeout = max(0, min(timeout,
+                                     self.queue[0][0] - time.monotonic()))
+            readable, _, _ = select.select(
+                [self.sock, self.udp, self.tcp] + list(self.streams), [], [],
+                timeout)
+            for s in readable:
+                if s is self.tcp:
+                    self.accept()
+                    continue
+                if s in self.streams:
+                    self.read_stream(s)
+                    continue
+                data, addr = s.recvfrom(2048)
+                if s is self.udp:
+                    self.count_uplink(len(data))
+                else:
+                    self.handle(data, addr)
+            while self.queue and self.queue[0][0] <= time.monotonic():
+                _, _, action, params = heapq.heappop(self.queue)
+                action(*params)
+
+    def summary(self):
+        s = self.stats
+        elapsed = time.monotonic() - self.start
+        print("== stand-in summary (%.1f s)" % elapsed)
+        print("datagrams: %d received, %d sent, %d dropped, %d duplicates, "
+              "%d responses suppressed" %
+              (s["rx"], s["tx"], s["dropped"], s["duplicates"],
+               s["suppressed"]))
+        for key in sorted(s["requests"]):
+            print("  %-10s %d" % (key, s["requests"][key]))
+        total = sum(s["requests"].values())
+        print("messages/s: %.1f" % (total / elapsed if elapsed else 0))
+        if s["fw_first"] is not None and s["fw_last"] > s["fw_first"]:
+            print("blockwise: %d bytes in %.2f s, %.1f KB/s" % (
+                s["fw_bytes"], s["fw_last"] - s["fw_first"],
+                s["fw_bytes"] / 1024.0 / (s["fw_last"] - s["fw_first"])))
+        print("uplink: %d bytes of CoAP data, %d uplink messages (%d bytes)" %
+              (s["data_bytes"], s["udp"], s["udp_bytes"]))
+        if s["udp"] > 1 and s["udp_last"] > s["udp_first"]:
+            print("udp: %.1f datagrams/s" %
+                  ((s["udp"] - 1) / (s["udp_last"] - s["udp_first"])))
+        if self.metrics:
+            print("device metrics:")
+            for key, value in self.metrics.items():
+                print("  %-14s %s" % (key, value))
+        sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5684)
+    parser.add_argument("--udp-port", type=int, default=1234)
+    parser.add_argument("--tls-cert", help="certificate for TLS uplinks")
+    parser.add_argument("--tls-key", help="key for --tls-cert")
+    parser.add_argument("--firmware", help="image served on fw")
+    parser.add_argument("--firmware-size", type=int, default=64 * 1024,
+                        help="size of random image if --firmware isn't set")
+    parser.add_argument("--max-szx", type=int, default=6,
+                        help="largest block size the server uses (0-6)")
+    parser.add_argument("--update", action="store_true",
+                        help="report an available update from the start")
+    parser.add_argument("--publish-after", type=float, default=0,
+                        help="notify observers of an update after N seconds")
+    parser.add_argument("--fw-host", default="192.0.2.2")
+    parser.add_argument("--fw-port", type=int, default=5684)
+    parser.add_argument("--latency", type=float, default=0)
+    parser.add_argument("--jitter", type=float, default=0)
+    parser.add_argument("--loss", type=float, default=0)
+    parser.add_argument("--reorder", type=float, default=0)
+    parser.add_argument("--duration", type=float, default=0,
+                        help="exit after N seconds (0 runs until killed)")
+    args = parser.parse_args()
+
+    server = StandIn(args)
+    signal.signal(signal.SIGTERM, lambda *_: sys.exit(0))
+    try:
+        server.run()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    server.summary()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Build the sample with the trimmed mbedTLS profile
+# (overlay-mbedtls-minimal.conf) and with the full profile (prj.conf) and
+# print a footprint report for both as key=value lines, prefixed with the
+# profile name:
+#
+#   minimal.flash, minimal.ram           image totals
+#   minimal.ram.<file>.<symbol>          every static variable in the app
+#
+# With RUN=1 the images are also run (QEMU or native targets) with
+# CONFIG_SPAN_FOOTPRINT and the figures the sample logs are added:
+#
+#   minimal.stack.<thread>.used/.size    stack high-water mark and size
+#   minimal.heap.mbedtls.handshake       peak mbedTLS heap during handshakes
+#   minimal.heap.mbedtls.steady          peak mbedTLS heap otherwise
+#   minimal.pool.coap.used/.size         CoAP buffer pool peak and size
+#   minimal.time.handshake_ms/_cycles    time of the last DTLS handshake
+#
+# Then, for every figure in both reports, what the trimmed profile saves
+# over the full one, and a heap size with a quarter of headroom over the
+# peak during the handshake, to set CONFIG_MBEDTLS_HEAP_SIZE from:
+#
+#   saved.flash, saved.heap.mbedtls.handshake, ...
+#   minimal.heap.mbedtls.suggested
+#
+# The DTLS handshake needs a reachable server, see LAB5E_HOST in src/main.c.
+# The build logs (memory regions) are in build-footprint-*.
+#
+# With BASELINE set to an earlier report the script exits with status 1 if
+# any figure has grown by more than TOLERANCE percent (default 5), so CI can
+# keep a baseline in the tree and fail on regressions. The handshake times
+# and the savings are left out of that.
+#
+#   scripts/footprint-report.sh qemu_x86 > footprint-baseline.txt
+#   RUN=1 BASELINE=footprint-baseline.txt scripts/footprint-report.sh
+#
+# Usage: scripts/footprint-report.sh [board] > footprint-report.txt
+#
+set -e
+
+BOARD=${1:-qemu_x86}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+RUN_TIMEOUT=${RUN_TIMEOUT:-60}
+TOLERANCE=${TOLERANCE:-5}
+REPORT=$ROOT/build-footprint.txt
+
+report() {
+  name=$1
+  build=$ROOT/build-footprint-$name
+  shift
+
+  west build -p always -b "$BOARD" -d "$build" "$ROOT/zephyr" -- \
+    -DCONFIG_MBEDTLS_MEMORY_DEBUG=y -DCONFIG_SPAN_FOOTPRINT=y "$@" \
+    > "$build.log" 2>&1 &&
+    west build -d "$build" -t footprint >> "$build.log" 2>&1 || {
+    echo "$name: build failed, see $build.log" >&2
+    exit 1
+  }
+  sed "s/^/$name./" "$build/footprint.txt"
+
+  if [ "$RUN" = "1" ]; then
+    timeout "$RUN_TIMEOUT" west build -d "$build" -t run > "$build.run" 2>&1 || true
+    grep -o "footprint [^ ]*=[0-9]*" "$build.run" | sed "s/^footprint /$name./" ||
+      echo "$name: no footprint logged, see $build.run" >&2
+    sed -n "s/.*DTLS: last handshake took \([0-9]*\) ms (\([0-9]*\) cycles).*/\1 \2/p" \
+      "$build.run" | tail -n 1 | while read -r ms cycles; do
+      echo "$name.time.handshake_ms=$ms"
+      echo "$name.time.handshake_cycles=$cycles"
+    done
+  fi
+}
+
+{
+  report minimal -DOVERLAY_CONFIG=overlay-mbedtls-minimal.conf
+  report full
+} > "$REPORT"
+awk -F= '
+  { value[$1] = $2; keys[NR] = $1 }
+  END {
+    for (i = 1; i <= NR; i++) {
+      figure = substr(keys[i], length("minimal.") + 1)
+      if (keys[i] ~ /^minimal\./ && ("full." figure) in value)
+        printf "saved.%s=%d\n", figure, value["full." figure] - value[keys[i]]
+    }
+    peak = value["minimal.heap.mbedtls.handshake"]
+    if (peak > 0)
+      printf "minimal.heap.mbedtls.suggested=%d\n", int((peak * 5 / 4 + 1023) / 1024) * 1024
+  }' "$REPORT" > "$REPORT.derived"
+cat "$REPORT.derived" >> "$REPORT"
+rm "$REPORT.derived"
+cat "$REPORT"
+
+if [ -n "$BASELINE" ]; then
+  # Figures missing from either report are not compared
+  awk -F= -v tolerance="$TOLERANCE" '
+    NR == FNR { base[$1] = $2; next }
+    /^saved\./ || /\.time\./ { next }
+    ($1 in base) && $2 * 100 > base[$1] * (100 + tolerance) {
+      printf "%s: %d -> %d\n", $1, base[$1], $2 > "/dev/stderr"
+      failed = 1
+    }
+    END { exit failed }' "$BASELINE" "$REPORT" || {
+    echo "footprint has grown by more than $TOLERANCE% over $BASELINE" >&2
+    exit 1
+  }
+fi
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Print the static memory use of a build as key=value lines:
+#   flash, ram              totals for the image (text + data, data + bss)
+#   ram.<file>.<symbol>     every variable in the application with its size
+#
+# The application's buffers, thread stacks and memory slabs show up as
+# variables, for instance ram.main.buffer or
+# ram.coap-pool._k_mem_slab_buf_coap_slab.
+# Run by the "footprint" build target (west build -t footprint), which
+# writes the output to footprint.txt in the build directory.
+#
+# Usage: scripts/footprint-syms.sh nm libapp.a zephyr.elf
+#
+set -e
+
+NM=$1
+LIB=$2
+ELF=$3
+# size from the same toolchain as nm
+SIZE=${NM%nm}size
+
+"$SIZE" "$ELF" | awk 'NR == 2 { print "flash=" $1 + $2; print "ram=" $2 + $3 }'
+
+"$NM" -S -t d "$LIB" | awk '
+  /:$/ { file = $1; sub(/:$/, "", file); sub(/\.c(\.obj|\.o)$/, "", file) }
+  NF == 4 && $3 ~ /^[bBdD]$/ && $2 + 0 > 0 {
+    print "ram." file "." $4 "=" $2 + 0
+  }' | sort
@@ -0,0 +1,256 @@
+#!/usr/bin/env python3
+"""
+Pack a firmware image for the FOTA decoder (see include/fota-decoder.h).
+
+The image can be compressed with heatshrink and/or encoded as a delta
+against the image that is running on the device:
+
+    scripts/fota-pack.py --compress new.bin new.spfw
+    scripts/fota-pack.py --compress --old running.bin new.bin new.spfw
+
+The delta records are the bsdiff control triples, and the delta is found
+the way bsdiff finds it, with a hash index over the old image instead of a
+suffix array. Code that has moved or only had addresses changed diffs to
+runs of zeroes, which is what the compressor is there for.
+"""
+import argparse
+import struct
+import sys
+
+MAGIC = b"SPFW"
+VERSION = 1
+COMPRESSED = 0x01
+DELTA = 0x02
+
+
+def varint(val):
+    out = bytearray()
+    while val >= 0x80:
+        out.append((val & 0x7F) | 0x80)
+        val >>= 7
+    out.append(val)
+    return out
+
+
+def zigzag(val):
+    return (val << 1) ^ (val >> 31)
+
+
+# Length of the strings the old image is indexed by, and how many places
+# are kept for each string
+INDEX_LEN = 8
+INDEX_PLACES = 32
+
+
+def index(old):
+    """Where each INDEX_LEN byte string starts in the old image."""
+    places = {}
+    for i in range(len(old) - INDEX_LEN + 1):
+        found = places.setdefault(old[i:i + INDEX_LEN], [])
+        if len(found) < INDEX_PLACES:
+            found.append(i)
+    return places
+
+
+def match_len(old, pos, new, scan):
+    """Number of bytes that match at old[pos:] and new[scan:]."""
+    n = 0
+    limit = min(len(old) - pos, len(new) - scan)
+    # Whole chunks first, then byte by byte
+    while n + 64 <= limit and old[pos + n:pos + n + 64] == new[scan + n:scan + n + 64]:
+        n += 64
+    while n < limit and old[pos + n] == new[scan + n]:
+        n += 1
+    return n
+
+
+def search(places, old, new, scan):
+    """Longest match of new[scan:] in the old image as (length, position)."""
+    best_len, best_pos = 0, 0
+    for pos in places.get(new[scan:scan + INDEX_LEN], ()):
+        n = match_len(old, pos, new, scan)
+        if n > best_len:
+            best_len, best_pos = n, pos
+    return best_len, best_pos
+
+
+def delta(old, new):
+    """
+    Diff the new image against the old one like bsdiff does: find long
+    matches anywhere in the old image, extend them both ways as long as at
+    least half the bytes still match and emit the bytes in between as
+    extra data. Moved code then diffs to runs of zeroes.
+    """
+    places = index(old)
+    out = bytearray()
+    scan = length = 0
+    last_scan = last_pos = last_offset = 0
+    pos = 0
+    while scan < len(new):
+        old_score = 0
+        scan += length
+        scsc = scan
+        while scan < len(new):
+            length, pos = search(places, old, new, scan)
+            while scsc < scan + length:
+                if (scsc + last_offset < len(old)
+                        and old[scsc + last_offset] == new[scsc]):
+                    old_score += 1
+                scsc += 1
+            # Stop at a match that is the current alignment or much better
+            # than it
+            if (length == old_score and length) or length > old_score + 8:
+                break
+            if (scan + last_offset < len(old)
+                    and old[scan + last_offset] == new[scan]):
+                old_score -= 1
+            scan += 1
+
+        if length == old_score and scan < len(new):
+            continue
+
+        # Extend the last match forwards and this one backwards
+        s = best = len_f = 0
+        i = 0
+        while last_scan + i < scan and last_pos + i < len(old):
+            if old[last_pos + i] == new[last_scan + i]:
+                s += 1
+            i += 1
+            if s * 2 - i > best * 2 - len_f:
+                best, len_f = s, i
+        len_b = 0
+        if scan < len(new):
+            s = best = 0
+            i = 1
+            while scan >= last_scan + i and pos >= i:
+                if old[pos - i] == new[scan - i]:
+                    s += 1
+                if s * 2 - i > best * 2 - len_b:
+                    best, len_b = s, i
+                i += 1
+        # Split an overlap where it costs the fewest mismatches
+        if last_scan + len_f > scan - len_b:
+            overlap = last_scan + len_f - (scan - len_b)
+            s = best = len_s = 0
+            for i in range(overlap):
+                if (new[last_scan + len_f - overlap + i]
+                        == old[last_pos + len_f - overlap + i]):
+                    s += 1
+                if new[scan - len_b + i] == old[pos - len_b + i]:
+                    s -= 1
+                if s > best:
+                    best, len_s = s, i + 1
+            len_f += len_s - overlap
+            len_b -= len_s
+
+        extra_len = scan - len_b - (last_scan + len_f)
+        seek = (pos - len_b) - (last_pos + len_f) if scan < len(new) else 0
+        out += varint(len_f) + varint(extra_len) + varint(zigzag(seek))
+        out += bytes((new[last_scan + i] - old[last_pos + i]) & 0xFF
+                     for i in range(len_f))
+        out += new[last_scan + len_f:scan - len_b]
+        last_scan = scan - len_b
+        last_pos = pos - len_b
+        last_offset = pos - scan
+    return bytes(out)
+
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.byte = 0
+        self.bits = 0
+
+    def put(self, val, count):
+        for bit in range(count - 1, -1, -1):
+            self.byte = (self.byte << 1) | ((val >> bit) & 1)
+            self.bits += 1
+            if self.bits == 8:
+                self.out.append(self.byte)
+                self.byte = 0
+                self.bits = 0
+
+    def finish(self):
+        if self.bits:
+            self.out.append(self.byte << (8 - self.bits))
+        return bytes(self.out)
+
+
+def heatshrink(data, window_sz2, lookahead_sz2):
+    """heatshrink (LZSS) encoder. Matches never reach before the start."""
+    window = 1 << window_sz2
+    lookahead = 1 << lookahead_sz2
+    # A back reference must be shorter than the literals it replaces
+    min_len = (1 + window_sz2 + lookahead_sz2) // 9 + 1
+    chains = {}
+    w = BitWriter()
+    i = 0
+    while i < len(data):
+        best_len = 0
+        best_dist = 0
+        key = data[i:i + 2]
+        for pos in reversed(chains.get(key, [])):
+            dist = i - pos
+            if dist > window:
+                break
+            n = 0
+            while (n < lookahead and i + n < len(data)
+                   and data[pos + n] == data[i + n]):
+                n += 1
+            if n > best_len:
+                best_len, best_dist = n, dist
+                if n == lookahead:
+                    break
+        step = 1
+        if best_len >= min_len:
+            w.put(0, 1)
+            w.put(best_dist - 1, window_sz2)
+            w.put(best_len - 1, lookahead_sz2)
+            step = best_len
+        else:
+            w.put(1, 1)
+            w.put(data[i], 8)
+        for j in range(i, i + step):
+            chain = chains.setdefault(data[j:j + 2], [])
+            chain.append(j)
+            if len(chain) > 64:
+                del chain[:32]
+        i += step
+    return w.finish()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    parser.add_argument("--old", help="image running on the device")
+    parser.add_argument("--compress", action="store_true")
+    parser.add_argument("--window", type=int, default=8)
+    parser.add_argument("--lookahead", type=int, default=4)
+    parser.add_argument("image")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    new = open(args.image, "rb").read()
+    flags = 0
+    source_size = 0
+    payload = new
+    if args.old:
+        old = open(args.old, "rb").read()
+        payload = delta(old, new)
+        source_size = len(old)
+        flags |= DELTA
+    if args.compress:
+        payload = heatshrink(payload, args.window, args.lookahead)
+        flags |= COMPRESSED
+
+    header = MAGIC + struct.pack("<BBBBII", VERSION, flags, args.window,
+                                 args.lookahead, len(new), source_size)
+    with open(args.output, "wb") as f:
+        f.write(header + payload)
+    print("%s: %d -> %d bytes (%.1f%%)" % (args.output, len(new),
+                                           len(header) + len(payload),
+                                           100.0 * (len(header) + len(payload))
+                                           / len(new)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
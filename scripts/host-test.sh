@@ -0,0 +1,124 @@
+#!/bin/sh
+#
+# Build the host tests in scripts/host and run them. Each test links
+# modules from src/ unchanged against the simulated kernel in scripts/host
+# (see scripts/host/include/host.h). Name the tests to run, or run them all:
+#   scripts/host-test.sh rtt decoder sink sched sched-merge
+#
+# CC and CFLAGS can be overridden, for instance
+#   CFLAGS="-g -fsanitize=address,undefined" scripts/host-test.sh
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+# The log formats in src/ are written for 32-bit targets, where size_t and
+# int are the same size
+CFLAGS=${CFLAGS:-"-O2 -Wall -Wno-format"}
+OUT=$ROOT/build-host
+HOST="$ROOT/scripts/host/host.c $ROOT/scripts/host/flash.c
+  $ROOT/scripts/host/settings.c $ROOT/scripts/host/fcb.c"
+# SHA-256 for mbedtls/sha256.h
+LIBS="-lcrypto -lm"
+
+# Modules from src/ that each test links
+sources() {
+  case $1 in
+    rtt) echo "src/coap-rtt.c" ;;
+    decoder) echo "src/fota-decoder.c" ;;
+    sink) echo "src/fota-sink.c src/fota-decoder.c" ;;
+    sched | sched-merge) echo "src/net-sched.c" ;;
+    store | store-burst1) echo "src/uplink-store.c src/net-sched.c" ;;
+    path) echo "src/coap-path.c" ;;
+    ring) echo "src/uplink-ring.c" ;;
+    transport) echo "src/transport.c" ;;
+    blockwise) echo "src/coap-rtt.c" ;;
+    batch | batch-single | batch-series)
+      echo "src/uplink-batch.c src/ts-codec.c src/net-sched.c src/coap-path.c" ;;
+    *) echo "unknown test $1" >&2; exit 1 ;;
+  esac
+}
+
+# Tests that build another test's program with other options
+program() {
+  case $1 in
+    sched-merge) echo sched ;;
+    store-burst1) echo store ;;
+    batch-single | batch-series) echo batch ;;
+    *) echo "$1" ;;
+  esac
+}
+
+defines() {
+  case $1 in
+    # Reads and firmware updates wait for a window opened by other traffic,
+    # batches go out early in one after half their age
+    sched-merge)
+      echo "-DCONFIG_SPAN_NET_SCHED_READ_DEADLINE_MS=1000" \
+        "-DCONFIG_SPAN_NET_SCHED_UPLINK_MIN_DELAY_MS=2500" \
+        "-DCONFIG_SPAN_NET_SCHED_FOTA_DEADLINE_MS=30000" ;;
+    store-burst1) echo "-DCONFIG_SPAN_UPLINK_STORE_BURST=1" ;;
+    # Room for segments with a two byte extended length
+    path) echo "-DCONFIG_SPAN_COAP_PATH_MAX_LEN=512" ;;
+    batch | batch-single | batch-series) echo "-DHOST_NO_UPLINK_STORE" ;;
+  esac
+}
+
+# Two firmware images that look a little like code, the second a new version
+# of the first with changed words, an insertion and a longer end. The new
+# one is packed by fota-pack.py in every way the decoder takes. Prints the
+# arguments for the decoder test.
+pack_images() {
+  dir=$OUT/decoder
+  mkdir -p "$dir"
+  python3 -c '
+import random
+import sys
+
+rng = random.Random(1)
+words = [bytes(rng.getrandbits(8) for _ in range(4)) for _ in range(256)]
+old = bytearray(b"".join(rng.choice(words) for _ in range(12000)))
+new = bytearray(old)
+for _ in range(200):
+    pos = rng.randrange(len(new) // 4) * 4
+    new[pos:pos + 4] = rng.choice(words)
+new[20000:20000] = b"".join(rng.choice(words) for _ in range(250))
+new += b"".join(rng.choice(words) for _ in range(750))
+open(sys.argv[1] + "/old.bin", "wb").write(old)
+open(sys.argv[1] + "/new.bin", "wb").write(new)
+' "$dir"
+  pack="python3 $ROOT/scripts/fota-pack.py"
+  $pack "$dir/new.bin" "$dir/new.spfw" 2>/dev/null
+  $pack --compress "$dir/new.bin" "$dir/new-compressed.spfw" 2>/dev/null
+  $pack --old "$dir/old.bin" "$dir/new.bin" "$dir/new-delta.spfw" 2>/dev/null
+  $pack --compress --old "$dir/old.bin" "$dir/new.bin" \
+    "$dir/new-compressed-delta.spfw" 2>/dev/null
+  echo "$dir/old.bin $dir/new.bin $dir/new.bin $dir/new.spfw"
+  echo "$dir/new-compressed.spfw $dir/new-delta.spfw"
+  echo "$dir/new-compressed-delta.spfw"
+}
+
+# Arguments for each test
+args() {
+  case $1 in
+    decoder) pack_images ;;
+    sched | sched-merge | store | store-burst1) echo "$1" ;;
+    batch | batch-single | batch-series) echo "${1#batch-}" ;;
+  esac
+}
+
+TESTS=${*:-rtt decoder sink sched sched-merge store-burst1 store path
+  batch-single batch batch-series ring transport blockwise}
+mkdir -p "$OUT"
+for test in $TESTS; do
+  SRCS=
+  for src in $(sources "$test"); do
+    SRCS="$SRCS $ROOT/$src"
+  done
+  $CC $CFLAGS $(defines "$test") -include "$ROOT/scripts/host/autoconf.h" \
+    -I"$ROOT/scripts/host/include" -I"$ROOT/scripts/host" -I"$ROOT/include" \
+    -o "$OUT/$test-test" "$ROOT/scripts/host/$(program "$test")-test.c" \
+    $SRCS $HOST $LIBS
+  echo "== $test"
+  "$OUT/$test-test" $(args "$test")
+done
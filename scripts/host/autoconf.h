@@ -0,0 +1,104 @@
+#pragma once
+/*
+ * Configuration for the host tests: the defaults from zephyr/Kconfig and
+ * zephyr/prj.conf for the modules they build. A value can be changed with
+ * -D on the command line.
+ */
+
+#define CONFIG_SPAN_FOTA_SINK 1
+#define CONFIG_SPAN_FOTA_CHECKPOINT 1
+// From overlay-store.conf. With -DHOST_NO_UPLINK_STORE the modules are
+// built like with prj.conf alone.
+#ifndef HOST_NO_UPLINK_STORE
+#define CONFIG_SPAN_UPLINK_STORE 1
+#endif
+
+#ifndef CONFIG_SPAN_COAP_TRANSPORT
+#define CONFIG_SPAN_COAP_TRANSPORT "udp"
+#endif
+#ifndef CONFIG_SPAN_UPLINK_TRANSPORT
+#define CONFIG_SPAN_UPLINK_TRANSPORT "udp"
+#endif
+
+#ifndef CONFIG_SPAN_COAP_ACK_TIMEOUT_MS
+#define CONFIG_SPAN_COAP_ACK_TIMEOUT_MS 2000
+#endif
+#ifndef CONFIG_SPAN_COAP_MAX_RETRANSMIT
+#define CONFIG_SPAN_COAP_MAX_RETRANSMIT 4
+#endif
+#ifndef CONFIG_SPAN_COAP_RTT_PEERS
+#define CONFIG_SPAN_COAP_RTT_PEERS 4
+#endif
+#ifndef CONFIG_SPAN_COAP_MAX_REQUESTS
+#define CONFIG_SPAN_COAP_MAX_REQUESTS 4
+#endif
+#ifndef CONFIG_SPAN_COAP_MAX_BLOCK_SIZE
+#define CONFIG_SPAN_COAP_MAX_BLOCK_SIZE 1024
+#endif
+#ifndef CONFIG_SPAN_COAP_PATH_MAX_LEN
+#define CONFIG_SPAN_COAP_PATH_MAX_LEN 64
+#endif
+
+#ifndef CONFIG_SPAN_NET_SCHED_WINDOW_MS
+#define CONFIG_SPAN_NET_SCHED_WINDOW_MS 2000
+#endif
+#ifndef CONFIG_SPAN_NET_SCHED_READ_MIN_DELAY_MS
+#define CONFIG_SPAN_NET_SCHED_READ_MIN_DELAY_MS 0
+#endif
+#ifndef CONFIG_SPAN_NET_SCHED_READ_DEADLINE_MS
+#define CONFIG_SPAN_NET_SCHED_READ_DEADLINE_MS 0
+#endif
+#ifndef CONFIG_SPAN_NET_SCHED_UPLINK_MIN_DELAY_MS
+#define CONFIG_SPAN_NET_SCHED_UPLINK_MIN_DELAY_MS \
+  CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS
+#endif
+#ifndef CONFIG_SPAN_NET_SCHED_UPLINK_DEADLINE_MS
+#define CONFIG_SPAN_NET_SCHED_UPLINK_DEADLINE_MS 5000
+#endif
+#ifndef CONFIG_SPAN_NET_SCHED_FOTA_MIN_DELAY_MS
+#define CONFIG_SPAN_NET_SCHED_FOTA_MIN_DELAY_MS 0
+#endif
+#ifndef CONFIG_SPAN_NET_SCHED_FOTA_DEADLINE_MS
+#define CONFIG_SPAN_NET_SCHED_FOTA_DEADLINE_MS 0
+#endif
+
+#ifndef CONFIG_SPAN_UPLINK_BATCH_SIZE
+#define CONFIG_SPAN_UPLINK_BATCH_SIZE 256
+#endif
+#ifndef CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS
+#define CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS 5000
+#endif
+#ifndef CONFIG_SPAN_UPLINK_STORE_SECTORS
+#define CONFIG_SPAN_UPLINK_STORE_SECTORS 4
+#endif
+#ifndef CONFIG_SPAN_UPLINK_STORE_BURST
+#define CONFIG_SPAN_UPLINK_STORE_BURST 4
+#endif
+#ifndef CONFIG_SPAN_UPLINK_STORE_COMMIT_INTERVAL
+#define CONFIG_SPAN_UPLINK_STORE_COMMIT_INTERVAL 8
+#endif
+#ifndef CONFIG_SPAN_UPLINK_STORE_RETRY_MS
+#define CONFIG_SPAN_UPLINK_STORE_RETRY_MS 30000
+#endif
+#ifndef CONFIG_SPAN_UDP_UPLINK_QUEUE_LEN
+#define CONFIG_SPAN_UDP_UPLINK_QUEUE_LEN 8
+#endif
+#ifndef CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD
+#define CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD 64
+#endif
+#ifndef CONFIG_SETTINGS_NVS_SECTOR_COUNT
+#define CONFIG_SETTINGS_NVS_SECTOR_COUNT 2
+#endif
+#ifndef CONFIG_SETTINGS_NVS_SECTOR_SIZE_MULT
+#define CONFIG_SETTINGS_NVS_SECTOR_SIZE_MULT 1
+#endif
+
+#ifndef CONFIG_SPAN_FOTA_WRITE_BUF_SIZE
+#define CONFIG_SPAN_FOTA_WRITE_BUF_SIZE 512
+#endif
+#ifndef CONFIG_SPAN_FOTA_DECODER_WINDOW_SZ2
+#define CONFIG_SPAN_FOTA_DECODER_WINDOW_SZ2 8
+#endif
+#ifndef CONFIG_SPAN_FOTA_CHECKPOINT_BLOCKS
+#define CONFIG_SPAN_FOTA_CHECKPOINT_BLOCKS 16
+#endif
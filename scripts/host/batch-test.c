@@ -0,0 +1,298 @@
+/*
+ * The batched uplink (src/uplink-batch.c) against one POST per sample, over
+ * an hour of simulated time. A sample is taken every SAMPLE_MS, like the
+ * loop in main.c, and either posted on its own as one byte ("single", how
+ * the sample sent its data before there was a batch), added to a batch as
+ * one byte ("batch") or added as a numeric value ("series"). The CoAP client
+ * is replaced by a server in this file, which splits every batch back into
+ * samples and checks their values and times.
+ *
+ * Every request is confirmable and answered by a piggybacked 2.04 with no
+ * payload. The bytes on the wire are counted for both directions with the
+ * header sizes from transport_wire_bytes(), for UDP and for DTLS. Wake-ups
+ * and the radio-on time come from net_sched_get_stats().
+ *
+ * host-test.sh builds this without the flash queue, like prj.conf alone.
+ *
+ *   batch-test single|batch|series
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <net/coap.h>
+#include <zephyr.h>
+
+#include "coap-client.h"
+#include "coap-path.h"
+#include "host.h"
+#include "net-sched.h"
+#include "ts-codec.h"
+#include "uplink-batch.h"
+
+#define DURATION_MS (3600 * 1000)
+// Time after the last sample for the last batch to go out
+#define TAIL_MS (60 * 1000)
+#define SAMPLE_MS 250
+#define RTT_MS 200
+#define MAX_SAMPLES (DURATION_MS / SAMPLE_MS)
+#define PATH "data/on/server"
+
+// CoAP header and the token coap-client.c puts in every message
+#define COAP_HEADER 4
+#define TOKEN_LEN 8
+#define CODE_CHANGED 0x44
+// As in transport.c
+#define UDP_OVERHEAD (20 + 8)
+#define DTLS_OVERHEAD (UDP_OVERHEAD + 13 + 8 + 8)
+
+enum mode
+{
+  MODE_SINGLE,
+  MODE_BATCH,
+  MODE_SERIES,
+};
+
+struct request
+{
+  bool used;
+  coap_response_callback_t callback;
+  void *user_data;
+  struct k_delayed_work work;
+};
+
+static enum mode mode;
+static struct coap_encoded_path path;
+static struct request requests[CONFIG_SPAN_COAP_MAX_REQUESTS];
+
+// Samples as they were taken and as the server got them
+static uint32_t sample_time[MAX_SAMPLES];
+static uint32_t sample_value[MAX_SAMPLES];
+static uint32_t taken;
+static uint32_t received;
+
+static uint32_t messages;
+static uint32_t payload_bytes;
+static uint32_t datagrams;
+static uint32_t coap_bytes;
+
+int coap_register_path(const char *name)
+{
+  return coap_encode_path(&path, name, 0) < 0 ? -ENOMEM : 0;
+}
+
+uint8_t coap_header_get_code(const struct coap_packet *cpkt)
+{
+  return CODE_CHANGED;
+}
+
+static void check_sample(uint32_t time, uint32_t value)
+{
+  if (!HOST_CHECK(received < taken) ||
+      !HOST_CHECK(time == sample_time[received]) ||
+      !HOST_CHECK(value == sample_value[received]))
+  {
+    printf("  sample %d: %d at %d ms\n", received, value, time);
+  }
+  received++;
+}
+
+static bool get_varint(const uint8_t *buf, size_t len, size_t *pos,
+                       uint32_t *val)
+{
+  *val = 0;
+  for (int shift = 0; *pos < len && shift < 35; shift += 7)
+  {
+    uint8_t b = buf[(*pos)++];
+    *val |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Split a batch into samples the way the server does, see
+ * include/uplink-batch.h. The time of a sample is the time the batch was
+ * received less the age plus dt.
+ */
+static void receive_batch(const uint8_t *buf, size_t len)
+{
+  uint32_t now = k_uptime_get_32();
+  size_t pos = 1;
+  uint32_t age;
+  if (!HOST_CHECK(len > 1) || !HOST_CHECK(get_varint(buf, len, &pos, &age)))
+  {
+    return;
+  }
+  if (buf[0] == UPLINK_BATCH_VERSION)
+  {
+    while (pos < len)
+    {
+      uint32_t dt;
+      uint32_t sample_len;
+      if (!HOST_CHECK(get_varint(buf, len, &pos, &dt)) ||
+          !HOST_CHECK(get_varint(buf, len, &pos, &sample_len)) ||
+          !HOST_CHECK(sample_len == 1 && pos + sample_len <= len))
+      {
+        return;
+      }
+      check_sample(now - age + dt, buf[pos]);
+      pos += sample_len;
+    }
+  }
+  else if (HOST_CHECK(buf[0] == UPLINK_BATCH_VERSION_SERIES))
+  {
+    uint32_t count;
+    if (!HOST_CHECK(get_varint(buf, len, &pos, &count)))
+    {
+      return;
+    }
+    struct ts_decoder dec;
+    ts_decoder_init(&dec, &buf[pos], len - pos, TS_VALUE_DELTA);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint32_t dt;
+      uint32_t value;
+      if (!HOST_CHECK(ts_decode(&dec, &dt, &value) == 0))
+      {
+        return;
+      }
+      check_sample(now - age + dt, value);
+    }
+  }
+}
+
+static void response_handler(struct k_work *work)
+{
+  struct request *req = CONTAINER_OF(work, struct request, work.work);
+  req->used = false;
+  net_sched_link_active();
+  datagrams++;
+  coap_bytes += COAP_HEADER + TOKEN_LEN;
+  if (req->callback)
+  {
+    req->callback(0, NULL, req->user_data);
+  }
+}
+
+int coap_submit_request_to(int handle, const uint8_t method,
+                           const uint8_t *buffer, size_t len,
+                           coap_response_callback_t callback, void *user_data)
+{
+  struct request *req = NULL;
+  for (int i = 0; i < ARRAY_SIZE(requests) && !req; i++)
+  {
+    if (!requests[i].used)
+    {
+      req = &requests[i];
+    }
+  }
+  if (!HOST_CHECK(handle == 0 && method == COAP_METHOD_POST) || !req)
+  {
+    return -EAGAIN;
+  }
+  net_sched_link_active();
+  messages++;
+  payload_bytes += len;
+  datagrams++;
+  // Header, token, path options, payload marker and payload
+  coap_bytes += COAP_HEADER + TOKEN_LEN + path.len + 1 + len;
+
+  if (mode == MODE_SINGLE)
+  {
+    if (HOST_CHECK(len == 1))
+    {
+      check_sample(k_uptime_get_32(), buffer[0]);
+    }
+  }
+  else
+  {
+    receive_batch(buffer, len);
+  }
+
+  req->used = true;
+  req->callback = callback;
+  req->user_data = user_data;
+  k_delayed_work_submit(&req->work, K_MSEC(RTT_MS));
+  return 0;
+}
+
+static void take_sample(uint32_t i)
+{
+  uint8_t byte = (uint8_t)i;
+  sample_time[taken] = k_uptime_get_32();
+  sample_value[taken] = mode == MODE_SERIES ? i : byte;
+  taken++;
+
+  int r = 0;
+  switch (mode)
+  {
+  case MODE_SINGLE:
+    r = coap_submit_request_to(0, COAP_METHOD_POST, &byte, 1, NULL, NULL);
+    break;
+  case MODE_BATCH:
+    r = uplink_batch_add(&byte, 1);
+    break;
+  case MODE_SERIES:
+    r = uplink_batch_add_value(i);
+    break;
+  }
+  HOST_CHECK(r == 0);
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = argc > 1 ? argv[1] : "batch";
+  mode = strcmp(name, "single") == 0   ? MODE_SINGLE
+         : strcmp(name, "series") == 0 ? MODE_SERIES
+                                       : MODE_BATCH;
+  host_seed(1);
+  net_sched_init();
+  for (int i = 0; i < ARRAY_SIZE(requests); i++)
+  {
+    k_delayed_work_init(&requests[i].work, response_handler);
+  }
+  if (mode == MODE_SINGLE)
+  {
+    HOST_CHECK(coap_register_path(PATH) == 0);
+  }
+  else
+  {
+    HOST_CHECK(uplink_batch_init(PATH) == 0);
+  }
+
+  for (uint32_t i = 0; i < MAX_SAMPLES; i++)
+  {
+    take_sample(i);
+    host_run(SAMPLE_MS);
+  }
+  if (mode != MODE_SINGLE)
+  {
+    HOST_CHECK(uplink_batch_flush() == 0);
+  }
+  host_run(TAIL_MS);
+
+  struct net_sched_stats stats;
+  net_sched_get_stats(&stats);
+  uint32_t udp_bytes = coap_bytes + datagrams * UDP_OVERHEAD;
+  uint32_t dtls_bytes = coap_bytes + datagrams * DTLS_OVERHEAD;
+  printf("%-10s %8s %9s %9s %9s %9s %8s %6s\n", "", "samples", "messages",
+         "payload", "udp B", "dtls B", "B/sample", "on %");
+  printf("%-10s %8d %9d %9d %9d %9d %8.1f %6.1f\n", name, taken, messages,
+         payload_bytes, udp_bytes, dtls_bytes, (double)dtls_bytes / taken,
+         100.0 * stats.link_awake_ms / (DURATION_MS + TAIL_MS));
+
+  // Every sample arrived once, in order, with its value and time
+  HOST_CHECK(received == taken);
+  if (mode != MODE_SINGLE)
+  {
+    struct uplink_batch_stats batch;
+    uplink_batch_get_stats(&batch);
+    HOST_CHECK(batch.samples == taken && batch.dropped == 0);
+    HOST_CHECK(batch.messages == messages);
+    HOST_CHECK(uplink_batch_in_flight() == 0);
+  }
+  return host_test_result();
+}
@@ -0,0 +1,308 @@
+/*
+ * Firmware download windows (CONFIG_SPAN_FOTA_DOWNLOAD_WINDOW) over links
+ * with latency, jitter and loss. The download is simulated the way
+ * coap_blockwise_transfer_resume() runs it: only the first block is
+ * requested until its reply has told the size, then up to window Block2
+ * requests are in flight, and a slot stays taken until its block has been
+ * handed over in order. Every request is confirmable, with the timeouts,
+ * backoff and RTT samples of src/coap-rtt.c. A request that gets no reply
+ * after MAX_RETRANSMIT retransmissions halves the block size and requests
+ * everything that hasn't been handed over again.
+ *
+ * The links follow coap-standin.py: a one-way delay plus a random extra
+ * delay up to the jitter, and the same loss in both directions. The narrow
+ * links also send the replies no faster than their rate. The table is the
+ * mean throughput of several downloads of the image for every window.
+ *
+ *   blockwise-test
+ */
+#include <stdio.h>
+
+#include <zephyr.h>
+
+#include "coap-rtt.h"
+#include "host.h"
+
+#define IMAGE_BYTES (128 * 1024)
+// The largest block that fits a DTLS datagram on ethernet, as
+// initial_block_size() picks it
+#define BLOCK_BYTES 1024
+#define MIN_BLOCK_BYTES 16
+// IPv4, UDP, CoAP header, token and options
+#define REQUEST_BYTES (28 + 24)
+#define REPLY_HEADER_BYTES (28 + 16)
+#define MAX_WINDOW 4
+#define RUNS 20
+#define MAX_PACKETS 256
+// Give up on a download after this long
+#define LIMIT_MS (3600 * 1000)
+
+struct link
+{
+  const char *name;
+  uint32_t latency_ms;
+  uint32_t jitter_ms;
+  double loss;
+  // Bytes/s for the replies, 0 for no limit
+  uint32_t rate;
+};
+
+static const struct link links[] = {
+    {"standin", 100, 50, 0, 0},      {"standin", 100, 50, 0.02, 0},
+    {"standin", 100, 50, 0.05, 0},   {"standin", 100, 50, 0.15, 0},
+    {"narrow", 300, 100, 0, 8000},   {"narrow", 300, 100, 0.02, 8000},
+    {"narrow", 300, 100, 0.05, 8000}, {"narrow", 300, 100, 0.15, 8000},
+};
+
+enum
+{
+  SLOT_FREE,
+  SLOT_WAITING,
+  SLOT_DONE,
+};
+
+struct slot
+{
+  uint8_t state;
+  uint32_t offset;
+  uint32_t size;
+  // Replies to earlier exchanges of the slot are dropped
+  uint32_t token;
+  uint32_t first_sent;
+  uint8_t retries;
+  uint32_t timeout;
+  struct k_delayed_work timer;
+};
+
+struct packet
+{
+  bool used;
+  bool reply;
+  uint32_t token;
+  struct slot *slot;
+  struct k_delayed_work work;
+};
+
+static const struct link *link;
+static uint8_t window;
+static struct coap_rtt *rtt;
+static struct slot slots[MAX_WINDOW];
+static struct packet packets[MAX_PACKETS];
+static uint32_t next_token;
+static uint32_t block_bytes;
+static uint32_t next_offset;
+static uint32_t deliver_offset;
+// Time the link has finished sending the replies queued so far
+static uint32_t reply_link_free;
+static uint32_t retransmits;
+static uint32_t timeouts;
+
+static bool lost(void)
+{
+  return host_rand_unit() < link->loss;
+}
+
+static uint32_t delay(void)
+{
+  return link->latency_ms + host_rand() % (link->jitter_ms + 1);
+}
+
+static void send_packet(struct slot *slot, bool reply, uint32_t bytes)
+{
+  if (lost())
+  {
+    return;
+  }
+  uint32_t now = k_uptime_get_32();
+  uint32_t at = now;
+  if (reply && link->rate > 0)
+  {
+    reply_link_free = MAX(reply_link_free, now) + bytes * 1000 / link->rate;
+    at = reply_link_free;
+  }
+  for (int i = 0; i < MAX_PACKETS; i++)
+  {
+    struct packet *p = &packets[i];
+    if (!p->used)
+    {
+      p->used = true;
+      p->reply = reply;
+      p->token = slot->token;
+      p->slot = slot;
+      k_delayed_work_submit(&p->work, K_MSEC(at - now + delay()));
+      return;
+    }
+  }
+  HOST_CHECK(!"out of packets");
+}
+
+static void send_request(struct slot *slot)
+{
+  send_packet(slot, false, REQUEST_BYTES);
+  k_delayed_work_submit(&slot->timer, K_MSEC(slot->timeout));
+}
+
+static void fill_window(void)
+{
+  uint8_t limit = deliver_offset == 0 ? 1 : window;
+  uint8_t outstanding = 0;
+  for (int i = 0; i < window; i++)
+  {
+    outstanding += slots[i].state != SLOT_FREE;
+  }
+  for (int i = 0; i < window && outstanding < limit; i++)
+  {
+    struct slot *slot = &slots[i];
+    if (slot->state != SLOT_FREE || next_offset >= IMAGE_BYTES)
+    {
+      continue;
+    }
+    slot->state = SLOT_WAITING;
+    slot->offset = next_offset;
+    slot->size = MIN(block_bytes, IMAGE_BYTES - next_offset);
+    slot->token = next_token++;
+    slot->first_sent = k_uptime_get_32();
+    slot->retries = 0;
+    slot->timeout = coap_rtt_timeout(rtt);
+    next_offset += slot->size;
+    outstanding++;
+    send_request(slot);
+  }
+}
+
+static void packet_handler(struct k_work *work)
+{
+  struct packet *p = CONTAINER_OF(work, struct packet, work.work);
+  struct slot *slot = p->slot;
+  p->used = false;
+  if (!p->reply)
+  {
+    // The server answers every copy of a request
+    send_packet(slot, true, REPLY_HEADER_BYTES + slot->size);
+    return;
+  }
+  if (slot->state != SLOT_WAITING || slot->token != p->token)
+  {
+    return;
+  }
+  k_delayed_work_cancel(&slot->timer);
+  coap_rtt_sample(rtt, k_uptime_get_32() - slot->first_sent, slot->retries);
+  slot->state = SLOT_DONE;
+
+  // Hand over the blocks that are next in line
+  for (bool found = true; found;)
+  {
+    found = false;
+    for (int i = 0; i < window; i++)
+    {
+      if (slots[i].state == SLOT_DONE && slots[i].offset == deliver_offset)
+      {
+        slots[i].state = SLOT_FREE;
+        deliver_offset += slots[i].size;
+        found = true;
+      }
+    }
+  }
+  fill_window();
+}
+
+static void timer_handler(struct k_work *work)
+{
+  struct slot *slot = CONTAINER_OF(work, struct slot, timer.work);
+  if (slot->retries < CONFIG_SPAN_COAP_MAX_RETRANSMIT)
+  {
+    slot->retries++;
+    slot->timeout = coap_rtt_backoff(rtt, slot->timeout);
+    retransmits++;
+    send_request(slot);
+    return;
+  }
+  // Smaller blocks for everything that hasn't been handed over
+  timeouts++;
+  block_bytes = MAX(block_bytes / 2, MIN_BLOCK_BYTES);
+  for (int i = 0; i < window; i++)
+  {
+    k_delayed_work_cancel(&slots[i].timer);
+    slots[i].state = SLOT_FREE;
+  }
+  next_offset = deliver_offset;
+  fill_window();
+}
+
+// Returns the download time in ms
+static uint32_t download(uint32_t run)
+{
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(5683),
+      .sin_addr.s_addr = htonl(0x0a000001 + run),
+  };
+  // A fresh peer, so every download starts from the default RTO
+  rtt = coap_rtt_lookup(&addr);
+  block_bytes = BLOCK_BYTES;
+  next_offset = 0;
+  deliver_offset = 0;
+
+  uint32_t start = k_uptime_get_32();
+  fill_window();
+  while (deliver_offset < IMAGE_BYTES &&
+         k_uptime_get_32() - start < LIMIT_MS)
+  {
+    host_run(10);
+  }
+  uint32_t elapsed = k_uptime_get_32() - start;
+  HOST_CHECK(deliver_offset == IMAGE_BYTES);
+
+  // Let the replies still on their way arrive, they are dropped
+  host_run(10 * 1000);
+  for (int i = 0; i < MAX_PACKETS; i++)
+  {
+    HOST_CHECK(!packets[i].used);
+  }
+  return elapsed;
+}
+
+int main(void)
+{
+  host_seed(1);
+  for (int i = 0; i < MAX_WINDOW; i++)
+  {
+    k_delayed_work_init(&slots[i].timer, timer_handler);
+  }
+  for (int i = 0; i < MAX_PACKETS; i++)
+  {
+    k_delayed_work_init(&packets[i].work, packet_handler);
+  }
+
+  printf("%-8s %5s %6s %5s", "", "delay", "jitter", "loss");
+  for (int w = 1; w <= MAX_WINDOW; w++)
+  {
+    printf("  w=%d KB/s", w);
+  }
+  printf(" %6s %6s\n", "retx", "smalls");
+
+  uint32_t run = 0;
+  for (int i = 0; i < ARRAY_SIZE(links); i++)
+  {
+    link = &links[i];
+    printf("%-8s %5d %6d %4.0f%%", link->name, link->latency_ms,
+           link->jitter_ms, 100 * link->loss);
+    retransmits = 0;
+    timeouts = 0;
+    for (window = 1; window <= MAX_WINDOW; window++)
+    {
+      uint64_t total_ms = 0;
+      for (int r = 0; r < RUNS; r++)
+      {
+        total_ms += download(run++);
+      }
+      printf(" %9.1f", (double)IMAGE_BYTES * RUNS / total_ms * 1000 / 1024);
+    }
+    // Retransmissions per block and block size reductions over all windows
+    printf(" %6.2f %6d\n",
+           (double)retransmits / (MAX_WINDOW * RUNS * IMAGE_BYTES /
+                                  BLOCK_BYTES),
+           timeouts);
+  }
+  return host_test_result();
+}
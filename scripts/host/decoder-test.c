@@ -0,0 +1,313 @@
+/*
+ * Firmware decoder (src/fota-decoder.c) against images packed by
+ * scripts/fota-pack.py. Every image is fed in blocks of several sizes and
+ * in random splits, with the decoder state saved and restored in the
+ * middle like a resumed download does, and the output has to be the new
+ * image, in order and with last set once at the end.
+ *
+ *   decoder-test old.bin new.bin packed...
+ *
+ * old.bin is put in the primary slot as the source of the deltas. new.bin
+ * can be given as one of the packed images to test the pass-through.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <storage/flash_map.h>
+#include <zephyr.h>
+
+#include "fota-decoder.h"
+#include "host.h"
+
+#define SLOT_SIZE (256 * 1024)
+#define SLOT_SECTOR_SIZE 4096
+// Random splits after the first block, which has the header
+#define RANDOM_SPLIT_MAX 300
+
+struct image
+{
+  const char *name;
+  uint8_t *data;
+  size_t len;
+};
+
+// The decoded image
+static uint8_t *out;
+static size_t out_size;
+static size_t out_len;
+static int last_count;
+
+static struct image load(const char *name)
+{
+  struct image img = {.name = name};
+  FILE *f = fopen(name, "rb");
+  if (!f)
+  {
+    perror(name);
+    exit(2);
+  }
+  fseek(f, 0, SEEK_END);
+  img.len = ftell(f);
+  rewind(f);
+  img.data = malloc(img.len);
+  if (fread(img.data, 1, img.len, f) != img.len)
+  {
+    perror(name);
+    exit(2);
+  }
+  fclose(f);
+  return img;
+}
+
+static int output(bool last, uint32_t offset, uint8_t *buffer, size_t len)
+{
+  // Contiguous and never after the last part
+  if (!HOST_CHECK(offset == out_len && last_count == 0) ||
+      !HOST_CHECK(out_len + len <= out_size))
+  {
+    return -EIO;
+  }
+  memcpy(out + out_len, buffer, len);
+  out_len += len;
+  if (last)
+  {
+    last_count++;
+  }
+  return 0;
+}
+
+static size_t next_block(size_t offset, size_t block)
+{
+  if (block)
+  {
+    return block;
+  }
+  if (offset == 0)
+  {
+    return FOTA_IMAGE_HEADER_LEN + host_rand() % RANDOM_SPLIT_MAX;
+  }
+  return 1 + host_rand() % RANDOM_SPLIT_MAX;
+}
+
+/*
+ * Decode a packed image in blocks of the given size, or random sizes if
+ * block is 0. Once on the way the state is saved, a few more blocks are
+ * decoded and then the state is restored and decoding goes on from the
+ * saved block again.
+ */
+static int decode(const struct image *packed, size_t block, size_t resume_at)
+{
+  enum
+  {
+    BEFORE_SAVE,
+    SAVED,
+    RESTORED,
+  } phase = BEFORE_SAVE;
+  struct fota_decoder dec;
+  struct fota_decoder saved;
+  size_t saved_offset = 0;
+  size_t saved_out_len = 0;
+  size_t restore_at = 0;
+
+  fota_decoder_init(&dec);
+  out_len = 0;
+  last_count = 0;
+  for (size_t offset = 0; offset < packed->len;)
+  {
+    if (phase == BEFORE_SAVE && offset >= resume_at)
+    {
+      saved = dec;
+      saved_offset = offset;
+      saved_out_len = out_len;
+      restore_at = offset + 3 * next_block(offset, block);
+      phase = SAVED;
+    }
+    else if (phase == SAVED && offset >= restore_at)
+    {
+      // Clobber the state to catch anything that isn't saved
+      memset(&dec, 0xAA, sizeof(dec));
+      dec = saved;
+      offset = saved_offset;
+      out_len = saved_out_len;
+      phase = RESTORED;
+    }
+    size_t len = next_block(offset, block);
+    len = MIN(len, packed->len - offset);
+    bool last = (offset + len == packed->len);
+    int ret = fota_decoder_write(&dec, last, packed->data + offset, len,
+                                 output);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    offset += len;
+  }
+  return 0;
+}
+
+static void test_image(const struct image *packed, const struct image *new)
+{
+  const size_t blocks[] = {16, 64, 256, 1024, 0, 0, 0};
+  for (size_t i = 0; i < ARRAY_SIZE(blocks); i++)
+  {
+    size_t resume_at = host_rand() % packed->len;
+    int ret = decode(packed, blocks[i], resume_at);
+    if (!HOST_CHECK(ret == 0) || !HOST_CHECK(out_len == new->len) ||
+        !HOST_CHECK(memcmp(out, new->data, new->len) == 0) ||
+        !HOST_CHECK(last_count == 1))
+    {
+      printf("  %s: block %zu, resumed at %zu\n", packed->name, blocks[i],
+             resume_at);
+    }
+  }
+  const char *name = strrchr(packed->name, '/');
+  printf("%-24s %8zu %8zu %6.1f%%\n", name ? name + 1 : packed->name,
+         packed->len, new->len, 100.0 * packed->len / new->len);
+}
+
+static size_t put_varint(uint8_t *buf, uint32_t val)
+{
+  size_t len = 0;
+  for (; val >= 0x80; val >>= 7)
+  {
+    buf[len++] = (val & 0x7F) | 0x80;
+  }
+  buf[len++] = val;
+  return len;
+}
+
+/*
+ * A delta with many records that seek back and forth anywhere in the
+ * source, longer and more often than fota-pack.py writes them for the test
+ * images.
+ */
+static void test_records(const struct image *old)
+{
+  const uint32_t image_size = 32 * 1024;
+  struct image packed = {.name = "records"};
+  struct image new = {.name = "records"};
+  // Records add at most 3 varints to the data
+  packed.data = malloc(FOTA_IMAGE_HEADER_LEN + 2 * image_size);
+  new.data = malloc(image_size);
+
+  uint8_t *p = packed.data + FOTA_IMAGE_HEADER_LEN;
+  uint32_t pos = 0;
+  while (new.len < image_size)
+  {
+    uint32_t left = image_size - new.len;
+    // MIN() evaluates its arguments twice
+    uint32_t diff_len = host_rand() % 3000;
+    uint32_t extra_len = host_rand() % 200;
+    diff_len = MIN(diff_len, MIN(left, old->len - pos));
+    extra_len = MIN(extra_len, left - diff_len);
+    p += put_varint(p, diff_len);
+    p += put_varint(p, extra_len);
+    // Anywhere in the source for the next record
+    int32_t seek = (int32_t)(host_rand() % (old->len + 1)) - (pos + diff_len);
+    p += put_varint(p, ((uint32_t)seek << 1) ^ (uint32_t)(seek >> 31));
+    for (uint32_t i = 0; i < diff_len; i++)
+    {
+      // Mostly unchanged, like code that has moved
+      *p = (host_rand() % 16) ? 0 : host_rand();
+      new.data[new.len++] = old->data[pos++] + *p++;
+    }
+    for (uint32_t i = 0; i < extra_len; i++)
+    {
+      *p = host_rand();
+      new.data[new.len++] = *p++;
+    }
+    pos += seek;
+  }
+  packed.len = p - packed.data;
+
+  uint8_t header[FOTA_IMAGE_HEADER_LEN] = FOTA_IMAGE_MAGIC;
+  header[4] = FOTA_IMAGE_VERSION;
+  header[5] = FOTA_IMAGE_DELTA;
+  memcpy(header + 8, &image_size, 4);
+  memcpy(header + 12, &(uint32_t){old->len}, 4);
+  memcpy(packed.data, header, sizeof(header));
+
+  uint8_t *prev_out = out;
+  size_t prev_out_size = out_size;
+  out = malloc(image_size);
+  out_size = image_size;
+  test_image(&packed, &new);
+  free(out);
+  out = prev_out;
+  out_size = prev_out_size;
+  free(new.data);
+  free(packed.data);
+}
+
+// Malformed images are refused, also when they are cut short
+static void test_malformed(const struct image *packed)
+{
+  struct image bad = *packed;
+  bad.data = malloc(packed->len);
+
+  // Truncated
+  memcpy(bad.data, packed->data, packed->len);
+  bad.len = packed->len / 2;
+  HOST_CHECK(decode(&bad, 64, SIZE_MAX) == -EBADMSG);
+  HOST_CHECK(last_count == 0);
+  bad.len = packed->len;
+
+  // Another version
+  bad.data[4] = FOTA_IMAGE_VERSION + 1;
+  HOST_CHECK(decode(&bad, 64, SIZE_MAX) == -ENOTSUP);
+  bad.data[4] = packed->data[4];
+
+  // A larger window than the decoder has
+  if (packed->data[5] & FOTA_IMAGE_COMPRESSED)
+  {
+    bad.data[6] = CONFIG_SPAN_FOTA_DECODER_WINDOW_SZ2 + 1;
+    HOST_CHECK(decode(&bad, 64, SIZE_MAX) == -ENOTSUP);
+    bad.data[6] = packed->data[6];
+  }
+
+  // A delta against more than the primary slot has
+  if (packed->data[5] & FOTA_IMAGE_DELTA)
+  {
+    memcpy(bad.data + 12, &(uint32_t){SLOT_SIZE + 1}, 4);
+    HOST_CHECK(decode(&bad, 64, SIZE_MAX) == -EBADMSG);
+  }
+  free(bad.data);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 4)
+  {
+    fprintf(stderr, "usage: %s old.bin new.bin packed...\n", argv[0]);
+    return 2;
+  }
+  host_seed(1);
+  struct image old = load(argv[1]);
+  struct image new = load(argv[2]);
+  if (old.len > SLOT_SIZE)
+  {
+    fprintf(stderr, "%s doesn't fit in the slot\n", old.name);
+    return 2;
+  }
+  host_flash_init(FLASH_AREA_ID(image_0), SLOT_SIZE, SLOT_SECTOR_SIZE, 4);
+  memcpy(host_flash_data(FLASH_AREA_ID(image_0)), old.data, old.len);
+  out_size = new.len;
+  out = malloc(out_size);
+
+  printf("%-24s %8s %8s %7s\n", "image", "packed", "image", "ratio");
+  for (int i = 3; i < argc; i++)
+  {
+    struct image packed = load(argv[i]);
+    test_image(&packed, &new);
+    if (memcmp(packed.data, FOTA_IMAGE_MAGIC, 4) == 0)
+    {
+      test_malformed(&packed);
+    }
+    free(packed.data);
+  }
+  test_records(&old);
+  free(out);
+  free(new.data);
+  free(old.data);
+  return host_test_result();
+}
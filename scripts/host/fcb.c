@@ -0,0 +1,373 @@
+/*
+ * Flash circular buffer for the host tests, see include/fs/fcb.h. The
+ * on-flash layout follows Zephyr's FCB: a sector header, then entries made
+ * of a one or two byte length, the data and a CRC-8, each padded to the
+ * write alignment.
+ */
+#include <fs/fcb.h>
+#include <storage/flash_map.h>
+#include <zephyr.h>
+
+struct fcb_disk_area
+{
+  uint32_t fd_magic;
+  uint8_t fd_ver;
+  uint8_t _pad;
+  uint16_t fd_id;
+};
+
+#define ERASED_VAL 0xFF
+
+static uint32_t len_in_flash(const struct fcb *fcb, uint32_t len)
+{
+  return ROUND_UP(len, fcb->f_align);
+}
+
+static uint32_t header_len(const struct fcb *fcb)
+{
+  return len_in_flash(fcb, sizeof(struct fcb_disk_area));
+}
+
+static uint8_t crc8(const uint8_t *data, size_t len, uint8_t crc)
+{
+  for (size_t i = 0; i < len; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+static struct flash_sector *next_sector(const struct fcb *fcb,
+                                        struct flash_sector *sector)
+{
+  sector++;
+  if (sector >= &fcb->f_sectors[fcb->f_sector_cnt])
+  {
+    sector = fcb->f_sectors;
+  }
+  return sector;
+}
+
+// 1 if the header is valid, 0 if the sector is erased, -ENOMSG otherwise
+static int read_header(const struct fcb *fcb, const struct flash_sector *sector,
+                       struct fcb_disk_area *hdr)
+{
+  int ret = flash_area_read(fcb->fap, sector->fs_off, hdr, sizeof(*hdr));
+  if (ret < 0)
+  {
+    return -EIO;
+  }
+  if (hdr->fd_magic == 0xFFFFFFFF)
+  {
+    return 0;
+  }
+  if (hdr->fd_magic != fcb->f_magic || hdr->fd_ver != fcb->f_version)
+  {
+    return -ENOMSG;
+  }
+  return 1;
+}
+
+static int write_header(struct fcb *fcb, struct flash_sector *sector,
+                        uint16_t id)
+{
+  uint8_t buf[ROUND_UP(sizeof(struct fcb_disk_area), 32)];
+  struct fcb_disk_area hdr = {
+      .fd_magic = fcb->f_magic,
+      .fd_ver = fcb->f_version,
+      ._pad = ERASED_VAL,
+      .fd_id = id,
+  };
+  memset(buf, ERASED_VAL, sizeof(buf));
+  memcpy(buf, &hdr, sizeof(hdr));
+  return flash_area_write(fcb->fap, sector->fs_off, buf, header_len(fcb));
+}
+
+/*
+ * Read the length of the entry at loc->fe_elem_off. Returns 0 and fills in
+ * the data offset and length, or -ENOENT if the length is erased.
+ */
+static int read_entry(const struct fcb *fcb, struct fcb_entry *loc)
+{
+  if (loc->fe_elem_off + 2 > loc->fe_sector->fs_size)
+  {
+    return -ENOENT;
+  }
+  uint8_t len[2];
+  int ret = flash_area_read(fcb->fap, loc->fe_sector->fs_off + loc->fe_elem_off,
+                            len, sizeof(len));
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (len[0] == ERASED_VAL)
+  {
+    return -ENOENT;
+  }
+  uint32_t len_bytes = 1;
+  loc->fe_data_len = len[0];
+  if (len[0] & 0x80)
+  {
+    if (len[1] == ERASED_VAL)
+    {
+      return -ENOENT;
+    }
+    loc->fe_data_len = (len[0] & 0x7F) | (len[1] << 7);
+    len_bytes = 2;
+  }
+  loc->fe_data_off = loc->fe_elem_off + len_in_flash(fcb, len_bytes);
+  return 0;
+}
+
+static uint32_t entry_end(const struct fcb *fcb, const struct fcb_entry *loc)
+{
+  return loc->fe_data_off + len_in_flash(fcb, loc->fe_data_len) +
+         len_in_flash(fcb, 1);
+}
+
+// CRC-8 of the length and the data of an entry
+static int entry_crc(const struct fcb *fcb, const struct fcb_entry *loc,
+                     uint8_t *crc)
+{
+  uint8_t buf[256];
+  uint8_t len[2] = {loc->fe_data_len & 0x7F, loc->fe_data_len >> 7};
+  size_t len_bytes = 1;
+  if (loc->fe_data_len >= 0x80)
+  {
+    len[0] |= 0x80;
+    len_bytes = 2;
+  }
+  *crc = crc8(len, len_bytes, 0xFF);
+  off_t off = FCB_ENTRY_FA_DATA_OFF(*loc);
+  for (size_t done = 0; done < loc->fe_data_len;)
+  {
+    size_t n = MIN(sizeof(buf), loc->fe_data_len - done);
+    int ret = flash_area_read(fcb->fap, off + done, buf, n);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    *crc = crc8(buf, n, *crc);
+    done += n;
+  }
+  return 0;
+}
+
+static bool entry_valid(const struct fcb *fcb, const struct fcb_entry *loc)
+{
+  uint8_t crc;
+  uint8_t stored;
+  return entry_end(fcb, loc) <= loc->fe_sector->fs_size &&
+         entry_crc(fcb, loc, &crc) == 0 &&
+         flash_area_read(fcb->fap,
+                         FCB_ENTRY_FA_DATA_OFF(*loc) +
+                             len_in_flash(fcb, loc->fe_data_len),
+                         &stored, 1) == 0 &&
+         stored == crc;
+}
+
+int fcb_init(int f_area_id, struct fcb *fcb)
+{
+  int ret = flash_area_open(f_area_id, &fcb->fap);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  fcb->f_align = flash_area_align(fcb->fap);
+
+  struct flash_sector *oldest = NULL;
+  struct flash_sector *newest = NULL;
+  uint16_t oldest_id = 0;
+  uint16_t newest_id = 0;
+  for (int i = 0; i < fcb->f_sector_cnt; i++)
+  {
+    struct fcb_disk_area hdr;
+    ret = read_header(fcb, &fcb->f_sectors[i], &hdr);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ret == 0)
+    {
+      continue;
+    }
+    if (!oldest || (int16_t)(hdr.fd_id - oldest_id) < 0)
+    {
+      oldest = &fcb->f_sectors[i];
+      oldest_id = hdr.fd_id;
+    }
+    if (!newest || (int16_t)(hdr.fd_id - newest_id) > 0)
+    {
+      newest = &fcb->f_sectors[i];
+      newest_id = hdr.fd_id;
+    }
+  }
+  if (!newest)
+  {
+    oldest = newest = fcb->f_sectors;
+    newest_id = 0;
+    ret = write_header(fcb, newest, newest_id);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  fcb->f_oldest = oldest;
+  fcb->f_active_id = newest_id;
+
+  // Appends continue after the last entry with a length, valid or not
+  struct fcb_entry loc = {.fe_sector = newest,
+                          .fe_elem_off = header_len(fcb)};
+  while (read_entry(fcb, &loc) == 0 &&
+         entry_end(fcb, &loc) <= newest->fs_size)
+  {
+    loc.fe_elem_off = entry_end(fcb, &loc);
+  }
+  fcb->f_active.fe_sector = newest;
+  fcb->f_active.fe_elem_off = loc.fe_elem_off;
+  return 0;
+}
+
+int fcb_append(struct fcb *fcb, uint16_t len, struct fcb_entry *loc)
+{
+  uint8_t buf[32];
+  size_t len_bytes = (len < 0x80) ? 1 : 2;
+  uint32_t total = len_in_flash(fcb, len_bytes) + len_in_flash(fcb, len) +
+                   len_in_flash(fcb, 1);
+  struct fcb_entry *active = &fcb->f_active;
+  if (active->fe_elem_off + total > active->fe_sector->fs_size)
+  {
+    struct flash_sector *sector = next_sector(fcb, active->fe_sector);
+    if (sector == fcb->f_oldest ||
+        header_len(fcb) + total > sector->fs_size)
+    {
+      return -ENOSPC;
+    }
+    int ret = write_header(fcb, sector, fcb->f_active_id + 1);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    fcb->f_active_id++;
+    active->fe_sector = sector;
+    active->fe_elem_off = header_len(fcb);
+  }
+
+  memset(buf, ERASED_VAL, sizeof(buf));
+  buf[0] = len & 0x7F;
+  if (len_bytes == 2)
+  {
+    buf[0] |= 0x80;
+    buf[1] = len >> 7;
+  }
+  int ret = flash_area_write(fcb->fap,
+                             active->fe_sector->fs_off + active->fe_elem_off,
+                             buf, len_in_flash(fcb, len_bytes));
+  if (ret < 0)
+  {
+    return ret;
+  }
+  loc->fe_sector = active->fe_sector;
+  loc->fe_elem_off = active->fe_elem_off;
+  loc->fe_data_off = active->fe_elem_off + len_in_flash(fcb, len_bytes);
+  loc->fe_data_len = len;
+  active->fe_elem_off += total;
+  return 0;
+}
+
+int fcb_append_finish(struct fcb *fcb, struct fcb_entry *loc)
+{
+  uint8_t buf[32];
+  int ret = entry_crc(fcb, loc, &buf[0]);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  memset(&buf[1], ERASED_VAL, sizeof(buf) - 1);
+  return flash_area_write(fcb->fap,
+                          FCB_ENTRY_FA_DATA_OFF(*loc) +
+                              len_in_flash(fcb, loc->fe_data_len),
+                          buf, len_in_flash(fcb, 1));
+}
+
+int fcb_getnext(struct fcb *fcb, struct fcb_entry *loc)
+{
+  if (!loc->fe_sector)
+  {
+    loc->fe_sector = fcb->f_oldest;
+    loc->fe_elem_off = 0;
+  }
+  for (;;)
+  {
+    if (loc->fe_elem_off == 0)
+    {
+      loc->fe_elem_off = header_len(fcb);
+    }
+    else
+    {
+      loc->fe_elem_off = entry_end(fcb, loc);
+    }
+    bool end_of_sector =
+        (loc->fe_sector == fcb->f_active.fe_sector)
+            ? loc->fe_elem_off >= fcb->f_active.fe_elem_off
+            : read_entry(fcb, loc) < 0;
+    if (end_of_sector)
+    {
+      if (loc->fe_sector == fcb->f_active.fe_sector)
+      {
+        return -ENOTSUP;
+      }
+      loc->fe_sector = next_sector(fcb, loc->fe_sector);
+      loc->fe_elem_off = 0;
+      continue;
+    }
+    if (read_entry(fcb, loc) < 0)
+    {
+      return -ENOTSUP;
+    }
+    if (entry_valid(fcb, loc))
+    {
+      return 0;
+    }
+    // Interrupted append, skip it
+  }
+}
+
+int fcb_rotate(struct fcb *fcb)
+{
+  int ret = flash_area_erase(fcb->fap, fcb->f_oldest->fs_off,
+                             fcb->f_oldest->fs_size);
+  if (ret < 0)
+  {
+    return -EIO;
+  }
+  if (fcb->f_oldest == fcb->f_active.fe_sector)
+  {
+    struct flash_sector *sector = next_sector(fcb, fcb->f_oldest);
+    ret = write_header(fcb, sector, fcb->f_active_id + 1);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    fcb->f_active.fe_sector = sector;
+    fcb->f_active.fe_elem_off = header_len(fcb);
+    fcb->f_active_id++;
+  }
+  fcb->f_oldest = next_sector(fcb, fcb->f_oldest);
+  return 0;
+}
+
+int fcb_free_sector_cnt(struct fcb *fcb)
+{
+  int count = 0;
+  for (struct flash_sector *sector = next_sector(fcb, fcb->f_active.fe_sector);
+       sector != fcb->f_oldest; sector = next_sector(fcb, sector))
+  {
+    count++;
+  }
+  return count;
+}
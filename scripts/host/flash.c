@@ -0,0 +1,241 @@
+/*
+ * Flash areas and the MCUboot upgrade request for the host tests. The
+ * contents live in shared memory so they survive host_boot().
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <dfu/mcuboot.h>
+#include <drivers/flash.h>
+#include <storage/flash_map.h>
+#include <zephyr.h>
+
+#include "host.h"
+
+#define ERASED_VAL 0xFF
+
+struct host_flash
+{
+  struct flash_area area;
+  size_t sector_size;
+  uint8_t align;
+  uint8_t *data;
+  struct host_flash_stats stats;
+};
+
+struct host_shared
+{
+  struct host_flash flash[HOST_FLASH_AREA_COUNT];
+  uint32_t cut_after;
+  int boot_requests;
+};
+
+static struct host_shared *shared;
+
+// The areas are laid out one after the other on a single device
+static off_t next_device_off;
+
+// Before main() so every boot sees the same memory
+__attribute__((constructor)) static void flash_init(void)
+{
+  shared = host_shared_alloc(sizeof(*shared));
+}
+
+static struct host_flash *get_flash(int id)
+{
+  if (id < 0 || id >= HOST_FLASH_AREA_COUNT || !shared->flash[id].data)
+  {
+    return NULL;
+  }
+  return &shared->flash[id];
+}
+
+static struct host_flash *area_flash(const struct flash_area *fa)
+{
+  return get_flash(fa->fa_id);
+}
+
+void host_flash_init(int id, size_t size, size_t sector_size, uint8_t align)
+{
+  struct host_flash *flash = &shared->flash[id];
+  flash->area.fa_id = id;
+  flash->area.fa_off = next_device_off;
+  flash->area.fa_size = size;
+  flash->area.fa_dev_name = "host-flash";
+  flash->sector_size = sector_size;
+  flash->align = align;
+  flash->data = host_shared_alloc(size);
+  memset(flash->data, ERASED_VAL, size);
+  memset(&flash->stats, 0, sizeof(flash->stats));
+  next_device_off += size;
+}
+
+uint8_t *host_flash_data(int id)
+{
+  return get_flash(id)->data;
+}
+
+void host_flash_get_stats(int id, struct host_flash_stats *stats)
+{
+  *stats = get_flash(id)->stats;
+}
+
+void host_flash_cut_after(uint32_t n)
+{
+  shared->cut_after = n;
+}
+
+// True if the power goes out during this operation
+static bool power_cut(void)
+{
+  if (shared->cut_after == 0)
+  {
+    return false;
+  }
+  return --shared->cut_after == 0;
+}
+
+int flash_area_open(uint8_t id, const struct flash_area **fa)
+{
+  struct host_flash *flash = get_flash(id);
+  if (!flash)
+  {
+    return -ENOENT;
+  }
+  *fa = &flash->area;
+  return 0;
+}
+
+void flash_area_close(const struct flash_area *fa)
+{
+}
+
+static bool in_area(const struct flash_area *fa, off_t off, size_t len)
+{
+  return off >= 0 && (size_t)off <= fa->fa_size && len <= fa->fa_size - off;
+}
+
+int flash_area_read(const struct flash_area *fa, off_t off, void *dst,
+                    size_t len)
+{
+  if (!in_area(fa, off, len))
+  {
+    return -EINVAL;
+  }
+  memcpy(dst, area_flash(fa)->data + off, len);
+  return 0;
+}
+
+int flash_area_write(const struct flash_area *fa, off_t off, const void *src,
+                     size_t len)
+{
+  struct host_flash *flash = area_flash(fa);
+  if (!in_area(fa, off, len) || off % flash->align || len % flash->align)
+  {
+    return -EINVAL;
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    if (flash->data[off + i] != ERASED_VAL)
+    {
+      flash->stats.overwrites++;
+      return -EIO;
+    }
+  }
+  if (power_cut())
+  {
+    memcpy(flash->data + off, src, ROUND_DOWN(len / 2, flash->align));
+    _exit(HOST_POWER_CUT);
+  }
+  memcpy(flash->data + off, src, len);
+  flash->stats.writes++;
+  flash->stats.bytes_written += len;
+  return 0;
+}
+
+int flash_area_erase(const struct flash_area *fa, off_t off, size_t len)
+{
+  struct host_flash *flash = area_flash(fa);
+  if (!in_area(fa, off, len) || off % flash->sector_size ||
+      len % flash->sector_size)
+  {
+    return -EINVAL;
+  }
+  if (power_cut())
+  {
+    _exit(HOST_POWER_CUT);
+  }
+  memset(flash->data + off, ERASED_VAL, len);
+  flash->stats.erases += len / flash->sector_size;
+  flash->stats.bytes_erased += len;
+  return 0;
+}
+
+uint8_t flash_area_align(const struct flash_area *fa)
+{
+  return area_flash(fa)->align;
+}
+
+uint8_t flash_area_erased_val(const struct flash_area *fa)
+{
+  return ERASED_VAL;
+}
+
+int flash_area_get_sectors(int fa_id, uint32_t *count,
+                           struct flash_sector *sectors)
+{
+  struct host_flash *flash = get_flash(fa_id);
+  if (!flash)
+  {
+    return -ENOENT;
+  }
+  uint32_t total = flash->area.fa_size / flash->sector_size;
+  for (uint32_t i = 0; i < total; i++)
+  {
+    if (i >= *count)
+    {
+      return -ENOMEM;
+    }
+    sectors[i].fs_off = i * flash->sector_size;
+    sectors[i].fs_size = flash->sector_size;
+  }
+  *count = total;
+  return 0;
+}
+
+const struct device *flash_area_get_device(const struct flash_area *fa)
+{
+  // Any non-NULL pointer, there is only one device
+  return (const struct device *)shared;
+}
+
+int flash_get_page_info_by_offs(const struct device *dev, off_t offset,
+                                struct flash_pages_info *info)
+{
+  for (int id = 0; id < HOST_FLASH_AREA_COUNT; id++)
+  {
+    struct host_flash *flash = get_flash(id);
+    if (flash && offset >= flash->area.fa_off &&
+        offset < flash->area.fa_off + (off_t)flash->area.fa_size)
+    {
+      off_t rel = offset - flash->area.fa_off;
+      info->index = rel / flash->sector_size;
+      info->start_offset =
+          flash->area.fa_off + info->index * flash->sector_size;
+      info->size = flash->sector_size;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+int boot_request_upgrade(int permanent)
+{
+  shared->boot_requests++;
+  return 0;
+}
+
+int host_boot_requests(void)
+{
+  return shared->boot_requests;
+}
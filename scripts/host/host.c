@@ -0,0 +1,330 @@
+/*
+ * Simulated kernel for the host tests: clock, work queue, random numbers,
+ * logging and resets. See include/host.h.
+ */
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <logging/log.h>
+#include <random/rand32.h>
+#include <zephyr.h>
+
+#include "host.h"
+
+int host_log_level;
+
+static int64_t now_ms;
+static uint64_t rand_state = 0x853c49e6748fea9bULL;
+
+// Work items that are due, in submission order
+static struct k_work *queue_head;
+static struct k_work *queue_tail;
+// Delayed work items that haven't come due
+static struct k_delayed_work *timers;
+
+// Kept in shared memory so checks that fail in a boot are counted
+static int *failures;
+
+__attribute__((constructor)) static void host_init(void)
+{
+  const char *level = getenv("HOST_LOG");
+  host_log_level = level ? atoi(level) : LOG_LEVEL_NONE;
+  failures = host_shared_alloc(sizeof(*failures));
+}
+
+void *host_shared_alloc(size_t size)
+{
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    perror("mmap");
+    exit(2);
+  }
+  return mem;
+}
+
+int k_mutex_init(struct k_mutex *mutex)
+{
+  mutex->lock_count = 0;
+  return 0;
+}
+
+int k_mutex_lock(struct k_mutex *mutex, k_timeout_t timeout)
+{
+  mutex->lock_count++;
+  return 0;
+}
+
+int k_mutex_unlock(struct k_mutex *mutex)
+{
+  if (mutex->lock_count <= 0)
+  {
+    fprintf(stderr, "mutex %p unlocked while not locked\n", (void *)mutex);
+    abort();
+  }
+  mutex->lock_count--;
+  return 0;
+}
+
+int k_sem_init(struct k_sem *sem, unsigned int initial, unsigned int limit)
+{
+  sem->count = initial;
+  sem->limit = limit;
+  return 0;
+}
+
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout)
+{
+  if (sem->count == 0 && timeout.ms < 0)
+  {
+    fprintf(stderr, "semaphore %p taken forever at 0\n", (void *)sem);
+    abort();
+  }
+  if (sem->count == 0 && timeout.ms > 0)
+  {
+    host_run(timeout.ms);
+  }
+  if (sem->count == 0)
+  {
+    return timeout.ms == 0 ? -EBUSY : -EAGAIN;
+  }
+  sem->count--;
+  return 0;
+}
+
+void k_sem_give(struct k_sem *sem)
+{
+  if (sem->count < sem->limit)
+  {
+    sem->count++;
+  }
+}
+
+unsigned int k_sem_count_get(struct k_sem *sem)
+{
+  return sem->count;
+}
+
+uint32_t k_uptime_get_32(void)
+{
+  return (uint32_t)now_ms;
+}
+
+int64_t k_uptime_get(void)
+{
+  return now_ms;
+}
+
+uint32_t k_cycle_get_32(void)
+{
+  return (uint32_t)(now_ms * 1000);
+}
+
+void k_work_init(struct k_work *work, k_work_handler_t handler)
+{
+  work->handler = handler;
+  work->queued = false;
+  work->next = NULL;
+}
+
+int k_work_submit(struct k_work *work)
+{
+  if (work->queued)
+  {
+    return 0;
+  }
+  work->queued = true;
+  work->next = NULL;
+  if (queue_tail)
+  {
+    queue_tail->next = work;
+  }
+  else
+  {
+    queue_head = work;
+  }
+  queue_tail = work;
+  return 1;
+}
+
+bool k_work_pending(const struct k_work *work)
+{
+  return work->queued;
+}
+
+void k_delayed_work_init(struct k_delayed_work *work,
+                         k_work_handler_t handler)
+{
+  k_work_init(&work->work, handler);
+  work->pending = false;
+  work->next = NULL;
+}
+
+int k_delayed_work_cancel(struct k_delayed_work *work)
+{
+  if (!work->pending)
+  {
+    return -EINVAL;
+  }
+  for (struct k_delayed_work **p = &timers; *p; p = &(*p)->next)
+  {
+    if (*p == work)
+    {
+      *p = work->next;
+      break;
+    }
+  }
+  work->pending = false;
+  return 0;
+}
+
+int k_delayed_work_submit(struct k_delayed_work *work, k_timeout_t delay)
+{
+  k_delayed_work_cancel(work);
+  if (delay.ms <= 0)
+  {
+    return k_work_submit(&work->work);
+  }
+  work->due = now_ms + delay.ms;
+  work->pending = true;
+  work->next = timers;
+  timers = work;
+  return 0;
+}
+
+int32_t k_delayed_work_remaining_get(struct k_delayed_work *work)
+{
+  return work->pending ? (int32_t)(work->due - now_ms) : 0;
+}
+
+void host_run_pending(void)
+{
+  while (queue_head)
+  {
+    struct k_work *work = queue_head;
+    queue_head = work->next;
+    if (!queue_head)
+    {
+      queue_tail = NULL;
+    }
+    work->next = NULL;
+    work->queued = false;
+    work->handler(work);
+  }
+}
+
+static struct k_delayed_work *next_timer(void)
+{
+  struct k_delayed_work *next = NULL;
+  for (struct k_delayed_work *t = timers; t; t = t->next)
+  {
+    if (!next || t->due < next->due)
+    {
+      next = t;
+    }
+  }
+  return next;
+}
+
+void host_run(uint32_t ms)
+{
+  int64_t end = now_ms + ms;
+  for (;;)
+  {
+    host_run_pending();
+    struct k_delayed_work *timer = next_timer();
+    if (!timer || timer->due > end)
+    {
+      break;
+    }
+    now_ms = MAX(now_ms, timer->due);
+    k_delayed_work_cancel(timer);
+    k_work_submit(&timer->work);
+  }
+  now_ms = end;
+}
+
+void host_set_time(int64_t ms)
+{
+  now_ms = ms;
+}
+
+void host_seed(uint32_t seed)
+{
+  rand_state = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+}
+
+uint32_t host_rand(void)
+{
+  // PCG32
+  uint64_t old = rand_state;
+  rand_state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+  uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+  uint32_t rot = (uint32_t)(old >> 59u);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+double host_rand_unit(void)
+{
+  return host_rand() / 4294967296.0;
+}
+
+uint32_t sys_rand32_get(void)
+{
+  return host_rand();
+}
+
+int host_boot(int (*boot)(void *arg), void *arg)
+{
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork");
+    exit(2);
+  }
+  if (pid == 0)
+  {
+    int ret = boot(arg);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(ret);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+  {
+    perror("waitpid");
+    exit(2);
+  }
+  if (WIFSIGNALED(status))
+  {
+    fprintf(stderr, "boot terminated by signal %d\n", WTERMSIG(status));
+    (*failures)++;
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+bool host_check(bool ok, const char *expr, const char *file, int line)
+{
+  if (!ok)
+  {
+    printf("FAIL %s:%d: %s\n", file, line, expr);
+    (*failures)++;
+  }
+  return ok;
+}
+
+int host_test_result(void)
+{
+  if (*failures)
+  {
+    printf("%d check(s) failed\n", *failures);
+    return 1;
+  }
+  return 0;
+}
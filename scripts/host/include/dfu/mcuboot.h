@@ -0,0 +1,7 @@
+#pragma once
+
+#define BOOT_UPGRADE_TEST 0
+#define BOOT_UPGRADE_PERMANENT 1
+
+/* Counted in host_boot_requests */
+int boot_request_upgrade(int permanent);
@@ -0,0 +1,44 @@
+#pragma once
+/*
+ * Flash circular buffer for the host build. It follows the layout and the
+ * rules of Zephyr's FCB on top of the host flash: a header at the start of
+ * every sector, entries with a length in front and a CRC behind, appends
+ * that fail with -ENOSPC when the next sector is the oldest one and
+ * rotation by erasing the oldest sector.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <storage/flash_map.h>
+
+struct fcb_entry
+{
+  struct flash_sector *fe_sector;
+  uint32_t fe_elem_off;
+  uint32_t fe_data_off;
+  uint16_t fe_data_len;
+};
+
+#define FCB_ENTRY_FA_DATA_OFF(entry)                                           \
+  ((entry).fe_sector->fs_off + (entry).fe_data_off)
+
+struct fcb
+{
+  uint32_t f_magic;
+  uint8_t f_version;
+  uint8_t f_sector_cnt;
+  uint8_t f_scratch_cnt;
+  struct flash_sector *f_sectors;
+  struct flash_sector *f_oldest;
+  struct fcb_entry f_active;
+  uint16_t f_active_id;
+  uint8_t f_align;
+  const struct flash_area *fap;
+};
+
+int fcb_init(int f_area_id, struct fcb *fcb);
+int fcb_append(struct fcb *fcb, uint16_t len, struct fcb_entry *loc);
+int fcb_append_finish(struct fcb *fcb, struct fcb_entry *loc);
+int fcb_getnext(struct fcb *fcb, struct fcb_entry *loc);
+int fcb_rotate(struct fcb *fcb);
+int fcb_free_sector_cnt(struct fcb *fcb);
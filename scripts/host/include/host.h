@@ -0,0 +1,118 @@
+#pragma once
+/*
+ * Control of the simulated device for the host tests in scripts/host. The
+ * tests build modules from src/ unchanged against the headers in this
+ * directory and drive time, flash contents, settings and resets from here.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Move the clock forward, running every work item that becomes due
+ *        on the way at its due time.
+ * @param ms time to advance
+ */
+void host_run(uint32_t ms);
+
+/**
+ * @brief Run the work items that are due without moving the clock.
+ */
+void host_run_pending(void);
+
+/**
+ * @brief Set the clock. Only used before anything is scheduled, to start
+ *        close to a wraparound of k_uptime_get_32().
+ */
+void host_set_time(int64_t ms);
+
+/**
+ * @brief Seed sys_rand32_get() and host_rand().
+ */
+void host_seed(uint32_t seed);
+
+/**
+ * @brief Random number for the test itself, from the same generator.
+ */
+uint32_t host_rand(void);
+
+/**
+ * @brief Random number in [0, 1).
+ */
+double host_rand_unit(void);
+
+/**
+ * @brief Set up a flash area. The area starts out erased.
+ * @param id FLASH_AREA_ID() of the area
+ * @param size size in bytes
+ * @param sector_size erase unit
+ * @param align write unit
+ */
+void host_flash_init(int id, size_t size, size_t sector_size, uint8_t align);
+
+/**
+ * @brief Direct access to the contents of a flash area.
+ */
+uint8_t *host_flash_data(int id);
+
+struct host_flash_stats
+{
+  uint32_t writes;
+  uint32_t erases;
+  uint32_t bytes_written;
+  uint32_t bytes_erased;
+  // Writes to locations that weren't erased (refused)
+  uint32_t overwrites;
+};
+
+/**
+ * @brief Get the counters of a flash area. They are kept across host_boot().
+ */
+void host_flash_get_stats(int id, struct host_flash_stats *stats);
+
+/**
+ * @brief Cut the power during a flash operation. The process started by
+ *        host_boot() exits in the middle of the n-th write or erase from
+ *        now on (a write programs its first half, an erase leaves the
+ *        sector as it was), or never if n is 0.
+ */
+void host_flash_cut_after(uint32_t n);
+
+#define HOST_POWER_CUT 99
+
+/**
+ * @brief Run one boot of the device: the function runs in a child process
+ *        with fresh static state in every module, while flash, settings and
+ *        the boot requests are shared with the test.
+ * @param boot function to run
+ * @param arg passed to the function
+ * @return the exit status of the boot, HOST_POWER_CUT if the power was cut
+ *         or the value returned by the function
+ */
+int host_boot(int (*boot)(void *arg), void *arg);
+
+/**
+ * @brief Allocate memory that is shared with the processes started by
+ *        host_boot(), for state that survives a reset. It is never freed.
+ */
+void *host_shared_alloc(size_t size);
+
+/**
+ * @brief Number of calls to boot_request_upgrade() so far.
+ */
+int host_boot_requests(void);
+
+/**
+ * @brief Remove every value from the settings.
+ */
+void host_settings_clear(void);
+
+/**
+ * @brief Report a failed check and count it. host_test_result() returns the
+ *        exit status for main().
+ */
+#define HOST_CHECK(cond)                                                       \
+  host_check((cond), #cond, __FILE__, __LINE__)
+
+bool host_check(bool ok, const char *expr, const char *file, int line);
+int host_test_result(void);
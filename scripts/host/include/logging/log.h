@@ -0,0 +1,37 @@
+#pragma once
+/*
+ * Log macros for the host build. Messages go to stderr when their level is
+ * at or below host_log_level (HOST_LOG in the environment, 0 by default so
+ * only the test output is shown).
+ */
+#include <stdio.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERR 1
+#define LOG_LEVEL_WRN 2
+#define LOG_LEVEL_INF 3
+#define LOG_LEVEL_DBG 4
+
+extern int host_log_level;
+
+#define LOG_MODULE_REGISTER(name, ...)                                         \
+  static const char *const host_log_module __attribute__((unused)) = #name
+#define LOG_MODULE_DECLARE(name, ...) LOG_MODULE_REGISTER(name)
+
+#define HOST_LOG(level, tag, fmt, ...)                                         \
+  do                                                                           \
+  {                                                                            \
+    if (host_log_level >= (level))                                             \
+    {                                                                          \
+      fprintf(stderr, "<%s> %s: " fmt "\n", tag, host_log_module,            \
+              ##__VA_ARGS__);                                                  \
+    }                                                                          \
+  } while (0)
+
+#define LOG_ERR(...) HOST_LOG(LOG_LEVEL_ERR, "err", __VA_ARGS__)
+#define LOG_WRN(...) HOST_LOG(LOG_LEVEL_WRN, "wrn", __VA_ARGS__)
+#define LOG_INF(...) HOST_LOG(LOG_LEVEL_INF, "inf", __VA_ARGS__)
+#define LOG_DBG(...) HOST_LOG(LOG_LEVEL_DBG, "dbg", __VA_ARGS__)
+#define LOG_HEXDUMP_DBG(data, len, str) LOG_DBG("%s (%d bytes)", str, (int)(len))
+
+#define log_strdup(str) (str)
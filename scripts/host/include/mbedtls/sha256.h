@@ -0,0 +1,42 @@
+#pragma once
+/* The mbedTLS 2.x SHA-256 API on top of OpenSSL's libcrypto */
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+#include <string.h>
+
+typedef SHA256_CTX mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+static inline void mbedtls_sha256_clone(mbedtls_sha256_context *dst,
+                                        const mbedtls_sha256_context *src)
+{
+  *dst = *src;
+}
+
+static inline int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx,
+                                            int is224)
+{
+  return is224 ? -1 : (SHA256_Init(ctx) == 1 ? 0 : -1);
+}
+
+static inline int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx,
+                                            const unsigned char *input,
+                                            size_t ilen)
+{
+  return SHA256_Update(ctx, input, ilen) == 1 ? 0 : -1;
+}
+
+static inline int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx,
+                                            unsigned char output[32])
+{
+  return SHA256_Final(output, ctx) == 1 ? 0 : -1;
+}
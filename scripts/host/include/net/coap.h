@@ -0,0 +1,35 @@
+#pragma once
+/*
+ * Only the declarations include/coap-client.h, src/coap-path.c and
+ * src/uplink-batch.c need
+ */
+#include <stdint.h>
+
+struct coap_packet;
+
+enum coap_option_num
+{
+  COAP_OPTION_OBSERVE = 6,
+  COAP_OPTION_URI_PATH = 11,
+};
+
+enum coap_method
+{
+  COAP_METHOD_GET = 1,
+  COAP_METHOD_POST = 2,
+  COAP_METHOD_PUT = 3,
+  COAP_METHOD_DELETE = 4,
+};
+
+enum coap_block_size
+{
+  COAP_BLOCK_16,
+  COAP_BLOCK_32,
+  COAP_BLOCK_64,
+  COAP_BLOCK_128,
+  COAP_BLOCK_256,
+  COAP_BLOCK_512,
+  COAP_BLOCK_1024,
+};
+
+uint8_t coap_header_get_code(const struct coap_packet *cpkt);
@@ -0,0 +1,9 @@
+#pragma once
+/*
+ * The BSD socket calls src/transport.c makes without TLS credentials, from
+ * the host's own socket API
+ */
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <net/net_ip.h>
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+/* Seeded with host_seed() so a run can be repeated */
+uint32_t sys_rand32_get(void);
@@ -0,0 +1,52 @@
+#pragma once
+/*
+ * Flash map for the host build. The areas are RAM buffers set up with
+ * host_flash_init() and, like settings, survive host_boot(). Like NOR flash with ECC (and the flash of most
+ * MCUs), a location can only be programmed once between erases: writing to
+ * a location that isn't erased fails with -EIO and is counted in
+ * host_flash_stats.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FLASH_AREA_ID(label) HOST_FLASH_AREA_##label
+
+enum
+{
+  HOST_FLASH_AREA_image_0,
+  HOST_FLASH_AREA_image_1,
+  HOST_FLASH_AREA_storage,
+  HOST_FLASH_AREA_COUNT,
+};
+
+struct device;
+
+struct flash_area
+{
+  uint8_t fa_id;
+  uint8_t fa_device_id;
+  uint16_t pad16;
+  off_t fa_off;
+  size_t fa_size;
+  const char *fa_dev_name;
+};
+
+struct flash_sector
+{
+  off_t fs_off;
+  size_t fs_size;
+};
+
+int flash_area_open(uint8_t id, const struct flash_area **fa);
+void flash_area_close(const struct flash_area *fa);
+int flash_area_read(const struct flash_area *fa, off_t off, void *dst,
+                    size_t len);
+int flash_area_write(const struct flash_area *fa, off_t off, const void *src,
+                     size_t len);
+int flash_area_erase(const struct flash_area *fa, off_t off, size_t len);
+uint8_t flash_area_align(const struct flash_area *fa);
+uint8_t flash_area_erased_val(const struct flash_area *fa);
+int flash_area_get_sectors(int fa_id, uint32_t *count,
+                           struct flash_sector *sectors);
+const struct device *flash_area_get_device(const struct flash_area *fa);
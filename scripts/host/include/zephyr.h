@@ -0,0 +1,134 @@
+#pragma once
+/*
+ * Host stand-in for the parts of the Zephyr kernel API the portable modules
+ * use. Everything runs on one thread in simulated time: the clock only moves
+ * when host_run() is called, and work items run from there. See host.h.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define ROUND_UP(x, align) ((((x) + (align)-1) / (align)) * (align))
+#define ROUND_DOWN(x, align) (((x) / (align)) * (align))
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+#define BUILD_ASSERT(cond, msg) _Static_assert(cond, msg)
+#define CONTAINER_OF(ptr, type, field)                                         \
+  ((type *)(((char *)(ptr)) - offsetof(type, field)))
+#define __aligned(x) __attribute__((aligned(x)))
+#define __packed __attribute__((packed))
+#define ARG_UNUSED(x) (void)(x)
+#define MSEC_PER_SEC 1000
+
+#define snprintk snprintf
+#define printk printf
+
+typedef struct
+{
+  int64_t ms;
+} k_timeout_t;
+
+#define K_MSEC(ms) ((k_timeout_t){(ms)})
+#define K_SECONDS(s) K_MSEC((int64_t)(s)*MSEC_PER_SEC)
+#define K_NO_WAIT K_MSEC(0)
+#define K_FOREVER K_MSEC(-1)
+
+/* There is only one thread, so a mutex just checks that it is balanced */
+struct k_mutex
+{
+  int lock_count;
+};
+
+#define K_MUTEX_DEFINE(name) struct k_mutex name
+
+int k_mutex_init(struct k_mutex *mutex);
+int k_mutex_lock(struct k_mutex *mutex, k_timeout_t timeout);
+int k_mutex_unlock(struct k_mutex *mutex);
+
+/*
+ * Taking a semaphore that is at zero moves the clock forward by the timeout
+ * instead of blocking. With K_FOREVER nothing could ever give it, so the
+ * test is stopped.
+ */
+struct k_sem
+{
+  unsigned int count;
+  unsigned int limit;
+};
+
+#define K_SEM_DEFINE(name, initial, max)                                       \
+  struct k_sem name = {(initial), (max)}
+
+int k_sem_init(struct k_sem *sem, unsigned int initial, unsigned int limit);
+int k_sem_take(struct k_sem *sem, k_timeout_t timeout);
+void k_sem_give(struct k_sem *sem);
+unsigned int k_sem_count_get(struct k_sem *sem);
+
+uint32_t k_uptime_get_32(void);
+int64_t k_uptime_get(void);
+// Counts microseconds of simulated time
+uint32_t k_cycle_get_32(void);
+
+struct k_work;
+typedef void (*k_work_handler_t)(struct k_work *work);
+
+struct k_work
+{
+  k_work_handler_t handler;
+  bool queued;
+  struct k_work *next;
+};
+
+struct k_delayed_work
+{
+  struct k_work work;
+  bool pending;
+  int64_t due;
+  struct k_delayed_work *next;
+};
+
+void k_work_init(struct k_work *work, k_work_handler_t handler);
+int k_work_submit(struct k_work *work);
+bool k_work_pending(const struct k_work *work);
+void k_delayed_work_init(struct k_delayed_work *work,
+                         k_work_handler_t handler);
+int k_delayed_work_submit(struct k_delayed_work *work, k_timeout_t delay);
+int k_delayed_work_cancel(struct k_delayed_work *work);
+int32_t k_delayed_work_remaining_get(struct k_delayed_work *work);
+
+typedef long atomic_t;
+typedef long atomic_val_t;
+
+static inline atomic_val_t atomic_get(const atomic_t *target)
+{
+  return *target;
+}
+
+static inline atomic_val_t atomic_set(atomic_t *target, atomic_val_t value)
+{
+  atomic_val_t old = *target;
+  *target = value;
+  return old;
+}
+
+static inline atomic_val_t atomic_add(atomic_t *target, atomic_val_t value)
+{
+  atomic_val_t old = *target;
+  *target += value;
+  return old;
+}
+
+static inline atomic_val_t atomic_inc(atomic_t *target)
+{
+  return atomic_add(target, 1);
+}
+
+static inline atomic_val_t atomic_dec(atomic_t *target)
+{
+  return atomic_add(target, -1);
+}
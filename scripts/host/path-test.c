@@ -0,0 +1,231 @@
+/*
+ * URI-Path encoding (src/coap-path.c). Random paths are encoded and parsed
+ * back with a separate option parser, segments of every length class of
+ * RFC 7252 section 3.1 included, and paths that don't fit are refused.
+ * host-test.sh builds this with room for 512 bytes of options so segments
+ * of 269 bytes and more fit.
+ *
+ * Then the time to put the sample's paths into a request is measured both
+ * ways: encoding the path for every request, like coap_submit_request()
+ * does, and copying the options coap_register_path() encoded once, like
+ * coap_submit_request_to() does.
+ *
+ *   path-test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <net/coap.h>
+#include <zephyr.h>
+
+#include "coap-path.h"
+#include "host.h"
+
+#define ROUNDS 1000000
+#define RANDOM_PATHS 10000
+
+// Read by the benchmark so the compiler can't drop the work
+static volatile uint32_t sink;
+
+/*
+ * Parse URI-Path options back into a path. Returns the number of bytes
+ * parsed or -1 if the options are malformed or aren't URI-Path.
+ */
+static int parse_path(const uint8_t *buf, size_t len, uint16_t prev_option,
+                      char *path, size_t size)
+{
+  size_t pos = 0;
+  size_t out = 0;
+  bool first = true;
+  uint16_t option = prev_option;
+  while (pos < len)
+  {
+    uint32_t fields[2] = {buf[pos] >> 4, buf[pos] & 0x0F};
+    pos++;
+    for (int i = 0; i < 2; i++)
+    {
+      if (fields[i] == 13 && pos < len)
+      {
+        fields[i] = 13 + buf[pos++];
+      }
+      else if (fields[i] == 14 && pos + 1 < len)
+      {
+        fields[i] = 269 + (buf[pos] << 8) + buf[pos + 1];
+        pos += 2;
+      }
+      else if (fields[i] >= 13)
+      {
+        return -1;
+      }
+    }
+    option += fields[0];
+    if (option != COAP_OPTION_URI_PATH || pos + fields[1] > len ||
+        out + fields[1] + 2 > size)
+    {
+      return -1;
+    }
+    // Segments after the first are separated by '/'
+    if (!first)
+    {
+      path[out++] = '/';
+    }
+    first = false;
+    memcpy(&path[out], &buf[pos], fields[1]);
+    out += fields[1];
+    pos += fields[1];
+  }
+  path[out] = 0;
+  return pos;
+}
+
+static void check_path(const char *path, uint16_t prev_option)
+{
+  struct coap_encoded_path encoded;
+  char parsed[2 * CONFIG_SPAN_COAP_PATH_MAX_LEN + 1];
+  int ret = coap_encode_path(&encoded, path, prev_option);
+  if (!HOST_CHECK(ret == 0))
+  {
+    printf("  %s\n", path);
+    return;
+  }
+  int len = parse_path(encoded.data, encoded.len, prev_option, parsed,
+                       sizeof(parsed));
+  if (!HOST_CHECK(len == encoded.len) ||
+      !HOST_CHECK(strcmp(parsed, path) == 0))
+  {
+    printf("  %s -> %s\n", path, parsed);
+  }
+}
+
+/*
+ * A random path with segments of 0 to 12 bytes (the length fits in the
+ * first byte) and now and then one of 13 to 268 (one extended byte) or 269
+ * and more (two extended bytes).
+ */
+static size_t random_path(char *path, size_t max_len)
+{
+  size_t len = 0;
+  int segments = 1 + host_rand() % 4;
+  for (int i = 0; i < segments; i++)
+  {
+    size_t seg = host_rand() % 13;
+    if (host_rand() % 4 == 0)
+    {
+      seg = 13 + host_rand() % 40;
+    }
+    else if (host_rand() % 16 == 0)
+    {
+      seg = 269 + host_rand() % 40;
+    }
+    if (len + seg + 1 >= max_len)
+    {
+      break;
+    }
+    if (i > 0)
+    {
+      path[len++] = '/';
+    }
+    for (size_t j = 0; j < seg; j++)
+    {
+      path[len++] = 'a' + host_rand() % 26;
+    }
+  }
+  path[len] = 0;
+  return len;
+}
+
+static void test_encoding(void)
+{
+  char path[CONFIG_SPAN_COAP_PATH_MAX_LEN];
+  for (int i = 0; i < RANDOM_PATHS; i++)
+  {
+    // A trailing '/' is dropped, so the path wouldn't come back the same
+    size_t len = random_path(path, sizeof(path) - 8);
+    if (len > 0 && path[len - 1] == '/')
+    {
+      continue;
+    }
+    check_path(path, 0);
+    check_path(path, COAP_OPTION_OBSERVE);
+  }
+
+  // Examples from the sample, and a segment longer than the 31 bytes the
+  // old per-request encoder could take
+  check_path("u", 0);
+  check_path("data/on/server", 0);
+  check_path("fw", COAP_OPTION_OBSERVE);
+  check_path("a-segment-that-is-longer-than-thirty-one-bytes", 0);
+
+  // A trailing '/' is ignored, an empty segment in the middle is kept
+  struct coap_encoded_path a;
+  struct coap_encoded_path b;
+  HOST_CHECK(coap_encode_path(&a, "data/on/", 0) == 0);
+  HOST_CHECK(coap_encode_path(&b, "data/on", 0) == 0);
+  HOST_CHECK(a.len == b.len && memcmp(a.data, b.data, a.len) == 0);
+  check_path("data//on", 0);
+
+  // The first option byte and an extended length
+  HOST_CHECK(coap_encode_path(&a, "u", 0) == 0);
+  HOST_CHECK(a.len == 2 && a.data[0] == 0xB1 && a.data[1] == 'u');
+  HOST_CHECK(coap_encode_path(&a, "u", COAP_OPTION_OBSERVE) == 0);
+  HOST_CHECK(a.data[0] == 0x51);
+  memset(path, 'x', 20);
+  path[20] = 0;
+  HOST_CHECK(coap_encode_path(&a, path, 0) == 0);
+  HOST_CHECK(a.len == 22 && a.data[0] == 0xBD && a.data[1] == 20 - 13);
+
+  // Too long for the buffer
+  char *long_path = malloc(CONFIG_SPAN_COAP_PATH_MAX_LEN + 1);
+  memset(long_path, 'x', CONFIG_SPAN_COAP_PATH_MAX_LEN);
+  long_path[CONFIG_SPAN_COAP_PATH_MAX_LEN] = 0;
+  HOST_CHECK(coap_encode_path(&a, long_path, 0) == -ENOMEM);
+  free(long_path);
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Put the path into a request buffer ROUNDS times
+static void bench_path(const char *path)
+{
+  static uint8_t request[CONFIG_SPAN_COAP_PATH_MAX_LEN];
+  struct coap_encoded_path encoded;
+  struct coap_encoded_path registered;
+  coap_encode_path(&registered, path, 0);
+
+  double start = now_ns();
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    coap_encode_path(&encoded, path, 0);
+    memcpy(request, encoded.data, encoded.len);
+    sink += request[i % encoded.len];
+  }
+  double encode_ns = (now_ns() - start) / ROUNDS;
+
+  start = now_ns();
+  for (int i = 0; i < ROUNDS; i++)
+  {
+    memcpy(request, registered.data, registered.len);
+    sink += request[i % registered.len];
+  }
+  double copy_ns = (now_ns() - start) / ROUNDS;
+
+  printf("%-16s %6d %10.1f %10.1f\n", path, registered.len, encode_ns,
+         copy_ns);
+}
+
+int main(void)
+{
+  host_seed(1);
+  test_encoding();
+
+  printf("%-16s %6s %10s %10s\n", "path", "bytes", "encode ns", "copy ns");
+  bench_path("u");
+  bench_path("data/on/server");
+  return host_test_result();
+}
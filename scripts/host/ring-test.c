@@ -0,0 +1,158 @@
+/*
+ * The slot ring of the UDP uplink (src/uplink-ring.c). Producers hold
+ * several slots at once and commit them in any order, and the sender has to
+ * get every slot in the order it was handed out, as soon as the slots before
+ * it have been committed. First the whole ring is handed out and committed
+ * backwards, then producers and the sender take random steps.
+ *
+ *   ring-test
+ */
+#include <stdio.h>
+
+#include <zephyr.h>
+
+#include "host.h"
+#include "uplink-ring.h"
+
+#define RING_LEN CONFIG_SPAN_UDP_UPLINK_QUEUE_LEN
+#define STEPS 200000
+
+// Slots handed out and not committed, in the order they were handed out
+static uint8_t *held[RING_LEN];
+static int held_count;
+// Numbers written into the slots as they are handed out
+static uint32_t handed_out;
+static uint32_t committed;
+static uint32_t received;
+static uint32_t dropped;
+
+static uint8_t *alloc(void)
+{
+  uint8_t *buf = uplink_ring_alloc(K_NO_WAIT);
+  if (buf)
+  {
+    memcpy(buf, &handed_out, sizeof(handed_out));
+    handed_out++;
+    held[held_count++] = buf;
+  }
+  return buf;
+}
+
+// Commit the held slot at index i, oversized now and then
+static void commit(int i)
+{
+  uint8_t *buf = held[i];
+  memmove(&held[i], &held[i + 1], (held_count - i - 1) * sizeof(held[0]));
+  held_count--;
+
+  bool drop = host_rand() % 16 == 0;
+  size_t len = drop ? CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD + 1 : sizeof(uint32_t);
+  int r = uplink_ring_commit(buf, len);
+  HOST_CHECK(r == (drop ? -EMSGSIZE : 0));
+  committed++;
+}
+
+// Take the next slot as the sender, if there is one
+static bool receive(void)
+{
+  struct uplink_slot *slot = uplink_ring_next(K_NO_WAIT);
+  if (!slot)
+  {
+    return false;
+  }
+  uint32_t seq;
+  memcpy(&seq, slot->data, sizeof(seq));
+  if (!HOST_CHECK(seq == received))
+  {
+    printf("  got slot %d, expected %d\n", seq, received);
+  }
+  HOST_CHECK(slot->drop ? slot->len == 0 : slot->len == sizeof(seq));
+  dropped += slot->drop;
+  received++;
+  uplink_ring_release(slot);
+  return true;
+}
+
+static void test_full_ring_backwards(void)
+{
+  for (int i = 0; i < RING_LEN; i++)
+  {
+    HOST_CHECK(alloc() != NULL);
+  }
+  HOST_CHECK(uplink_ring_alloc(K_NO_WAIT) == NULL);
+
+  // Nothing goes to the sender while the first slot is being filled
+  while (held_count > 1)
+  {
+    commit(held_count - 1);
+    HOST_CHECK(uplink_ring_pending() == 0);
+    HOST_CHECK(uplink_ring_next(K_NO_WAIT) == NULL);
+  }
+  commit(0);
+  HOST_CHECK(uplink_ring_pending() == RING_LEN);
+  while (receive())
+  {
+  }
+  HOST_CHECK(received == RING_LEN);
+  HOST_CHECK(uplink_ring_pending() == 0);
+}
+
+static void test_random_steps(void)
+{
+  for (int step = 0; step < STEPS; step++)
+  {
+    switch (host_rand() % 3)
+    {
+    case 0:
+      if (!alloc())
+      {
+        // Only a full ring turns a producer away
+        HOST_CHECK(handed_out - received == RING_LEN);
+      }
+      break;
+    case 1:
+      if (held_count > 0)
+      {
+        commit(host_rand() % held_count);
+      }
+      break;
+    case 2:
+      receive();
+      break;
+    }
+    // Slots before the first one still held have all been passed on
+    uint32_t first_held = handed_out - held_count;
+    if (held_count > 0)
+    {
+      uint8_t *first = held[0];
+      memcpy(&first_held, first, sizeof(first_held));
+    }
+    if (!HOST_CHECK(received + uplink_ring_pending() >= first_held))
+    {
+      printf("  step %d: %d received, %d pending, slot %d held\n", step,
+             received, uplink_ring_pending(), first_held);
+      return;
+    }
+  }
+
+  // Commit what is left in random order and empty the ring
+  while (held_count > 0)
+  {
+    commit(host_rand() % held_count);
+  }
+  while (receive())
+  {
+  }
+  HOST_CHECK(received == handed_out && committed == handed_out);
+  HOST_CHECK(uplink_ring_pending() == 0);
+}
+
+int main(void)
+{
+  host_seed(1);
+  test_full_ring_backwards();
+  test_random_steps();
+  printf("%d slots handed out, %d received in order, %d dropped\n",
+         handed_out, received, dropped);
+  return host_test_result();
+}
@@ -0,0 +1,190 @@
+/*
+ * Loss injection for the RTT estimator (src/coap-rtt.c). Confirmable
+ * exchanges run over a simulated link with the timeouts, backoff and
+ * sampling the CoAP client uses, and the retransmission counts and the RTO
+ * are checked against what the link should give. A retransmission is
+ * spurious if an earlier transmission was answered and the reply was still
+ * on its way.
+ */
+#include <stdlib.h>
+
+#include <zephyr.h>
+
+#include "coap-rtt.h"
+#include "host.h"
+
+struct link
+{
+  const char *name;
+  uint32_t rtt_ms;
+  uint32_t jitter_ms;
+  // Loss in each direction
+  double loss;
+};
+
+struct result
+{
+  uint32_t exchanges;
+  uint32_t retransmits;
+  uint32_t spurious;
+  uint32_t failed;
+  uint64_t rto_sum;
+};
+
+static bool lost(const struct link *link)
+{
+  return host_rand_unit() < link->loss;
+}
+
+static uint32_t delay(const struct link *link)
+{
+  return link->rtt_ms - link->jitter_ms +
+         host_rand() % (2 * link->jitter_ms + 1);
+}
+
+/*
+ * One exchange, like the client does it: the first transmission with
+ * coap_rtt_timeout(), retransmissions with coap_rtt_backoff() and a sample
+ * measured from the first transmission when the reply arrives.
+ */
+static void exchange(struct coap_rtt *rtt, const struct link *link,
+                     struct result *res)
+{
+  uint32_t start = k_uptime_get_32();
+  uint32_t sent = 0;
+  uint32_t timeout = coap_rtt_timeout(rtt);
+  uint32_t reply = UINT32_MAX;
+  res->exchanges++;
+  for (uint8_t retries = 0;; retries++)
+  {
+    if (!lost(link) && !lost(link))
+    {
+      reply = MIN(reply, sent + delay(link));
+    }
+    if (reply <= sent + timeout)
+    {
+      host_run(reply - (k_uptime_get_32() - start));
+      coap_rtt_sample(rtt, reply, retries);
+      return;
+    }
+    if (retries == CONFIG_SPAN_COAP_MAX_RETRANSMIT)
+    {
+      host_run(sent + timeout - (k_uptime_get_32() - start));
+      res->failed++;
+      return;
+    }
+    sent += timeout;
+    timeout = coap_rtt_backoff(rtt, timeout);
+    res->retransmits++;
+    if (reply != UINT32_MAX)
+    {
+      res->spurious++;
+    }
+  }
+}
+
+/*
+ * Run exchanges a second apart and report the second half, after the
+ * estimator has settled. rto is the mean RTO over that half.
+ */
+static struct result run_link(const struct link *link, uint32_t exchanges,
+                              uint32_t *rto)
+{
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(5683),
+      .sin_addr.s_addr = htonl(0x0a000001),
+  };
+  // A peer per link, so every link starts from the default RTO
+  static uint32_t peer;
+  addr.sin_addr.s_addr = htonl(0x0a000001 + peer++);
+  struct coap_rtt *rtt = coap_rtt_lookup(&addr);
+
+  struct result res = {0};
+  for (uint32_t i = 0; i < exchanges; i++)
+  {
+    if (i == exchanges / 2)
+    {
+      memset(&res, 0, sizeof(res));
+    }
+    exchange(rtt, link, &res);
+    res.rto_sum += rtt->rto;
+    host_run(1000);
+  }
+  *rto = res.rto_sum / res.exchanges;
+  printf("%-8s %6d %4.0f%% %9d %11.3f %9d %7d %8d\n", link->name,
+         link->rtt_ms, 100 * link->loss, res.exchanges,
+         (double)res.retransmits / res.exchanges, res.spurious, res.failed,
+         *rto);
+  return res;
+}
+
+/*
+ * The least recently updated peer is recycled, also when the uptime counter
+ * has wrapped since some of the peers were updated.
+ */
+static void test_recycle_after_wrap(void)
+{
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(5683)};
+  struct coap_rtt *first = NULL;
+
+  host_set_time(0xFFFFFFFFLL - 10000);
+  for (int i = 0; i < CONFIG_SPAN_COAP_RTT_PEERS; i++)
+  {
+    addr.sin_addr.s_addr = htonl(0xc0a80001 + i);
+    struct coap_rtt *rtt = coap_rtt_lookup(&addr);
+    if (i == 0)
+    {
+      first = rtt;
+    }
+    // The last peer is seen after the wrap
+    host_run(10000 / (CONFIG_SPAN_COAP_RTT_PEERS - 1) + 1);
+  }
+  HOST_CHECK(k_uptime_get_32() < 10000);
+
+  addr.sin_addr.s_addr = htonl(0xc0a800ff);
+  HOST_CHECK(coap_rtt_lookup(&addr) == first);
+  // The peer that was updated last is still there
+  addr.sin_addr.s_addr = htonl(0xc0a80001 + CONFIG_SPAN_COAP_RTT_PEERS - 1);
+  HOST_CHECK(coap_rtt_lookup(&addr) != first);
+}
+
+int main(int argc, char **argv)
+{
+  host_seed(argc > 1 ? atoi(argv[1]) : 1);
+  test_recycle_after_wrap();
+
+  const struct link clean = {"clean", 200, 20, 0.0};
+  const struct link lossy = {"lossy", 200, 20, 0.1};
+  const struct link slow = {"slow", 3000, 500, 0.05};
+  const uint32_t exchanges = 2000;
+  uint32_t rto;
+
+  printf("%-8s %6s %5s %9s %11s %9s %7s %8s\n", "link", "rtt", "loss",
+         "exchanges", "retx/exch", "spurious", "failed", "rto");
+
+  // No loss: the RTO comes down from ACK_TIMEOUT and hardly anything is
+  // sent twice (the estimate can dip under the slowest replies)
+  struct result res = run_link(&clean, exchanges, &rto);
+  HOST_CHECK(res.retransmits * 100 < res.exchanges);
+  HOST_CHECK(rto > clean.rtt_ms && rto < CONFIG_SPAN_COAP_ACK_TIMEOUT_MS / 2);
+
+  // 10% each way loses 19% of the transmissions, so about 0.23
+  // retransmissions per exchange. Samples from retransmitted exchanges
+  // raise the RTO a little, but it stays well under ACK_TIMEOUT.
+  res = run_link(&lossy, exchanges, &rto);
+  double retx = (double)res.retransmits / res.exchanges;
+  HOST_CHECK(retx > 0.15 && retx < 0.35);
+  HOST_CHECK(res.spurious * 20 < res.retransmits);
+  HOST_CHECK(res.failed * 200 < res.exchanges);
+  HOST_CHECK(rto < CONFIG_SPAN_COAP_ACK_TIMEOUT_MS / 2);
+
+  // A link slower than ACK_TIMEOUT: the RTO goes up and the spurious
+  // retransmissions stop
+  res = run_link(&slow, exchanges, &rto);
+  HOST_CHECK(rto > slow.rtt_ms);
+  HOST_CHECK(res.spurious * 20 < res.exchanges);
+  HOST_CHECK(res.failed * 200 < res.exchanges);
+
+  return host_test_result();
+}
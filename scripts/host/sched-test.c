@@ -0,0 +1,177 @@
+/*
+ * The network scheduler (src/net-sched.c) with the sample's traffic over
+ * an hour of simulated time. Samples go into the batched uplink, a read
+ * runs every minute and a firmware notification, followed by a download,
+ * arrives about every 15 minutes. Every job is a request and a response
+ * an RTT later, which both tell the scheduler that the link is in use.
+ *
+ * host-test.sh builds this twice: "sched" with the default timing, which
+ * sends everything when it is due like the sample did before there was a
+ * scheduler, and "sched-merge" with reads and firmware updates waiting for
+ * a window and batches going out early in one. The wake-ups and the
+ * radio-on time come from net_sched_get_stats().
+ *
+ *   sched-test name [seed]
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <zephyr.h>
+
+#include "host.h"
+#include "net-sched.h"
+
+#define DURATION_MS (3600 * 1000)
+#define RTT_MS 200
+#define SAMPLE_MS 250
+#define READ_EVERY_MS (60 * 1000)
+#define NOTIFY_EVERY_MS (900 * 1000)
+// Firmware download: blocks and blocks per request window
+#define FW_BLOCKS 256
+#define FW_WINDOW 4
+
+struct traffic
+{
+  struct net_job job;
+  uint32_t min_delay_ms;
+  uint32_t deadline_ms;
+  // When the pending job was first submitted
+  uint32_t submitted;
+  bool pending;
+  // Responses still to come, an RTT apart
+  uint32_t replies;
+  struct k_delayed_work reply_work;
+};
+
+static struct traffic traffic[NET_CLASS_COUNT];
+static bool batch_open;
+static uint32_t late;
+static uint32_t early;
+
+static struct traffic *job_traffic(struct net_job *job)
+{
+  return CONTAINER_OF(job, struct traffic, job);
+}
+
+static void reply_handler(struct k_work *work)
+{
+  struct traffic *t = CONTAINER_OF(work, struct traffic, reply_work.work);
+  net_sched_link_active();
+  if (--t->replies > 0)
+  {
+    k_delayed_work_submit(&t->reply_work, K_MSEC(RTT_MS));
+  }
+}
+
+static void job_handler(struct net_job *job)
+{
+  struct traffic *t = job_traffic(job);
+  uint32_t waited = k_uptime_get_32() - t->submitted;
+  late += waited > t->deadline_ms;
+  early += waited < MIN(t->min_delay_ms, t->deadline_ms);
+  t->pending = false;
+
+  // A request now and the responses later. A download sends a request
+  // for every window of blocks when the previous one has been answered.
+  net_sched_link_active();
+  t->replies = 1;
+  if (job->traffic_class == NET_CLASS_FOTA)
+  {
+    t->replies = (FW_BLOCKS + FW_WINDOW - 1) / FW_WINDOW;
+  }
+  else if (job->traffic_class == NET_CLASS_UPLINK)
+  {
+    batch_open = false;
+  }
+  k_delayed_work_submit(&t->reply_work, K_MSEC(RTT_MS));
+}
+
+static void submit(uint8_t traffic_class, uint32_t deadline_ms)
+{
+  struct traffic *t = &traffic[traffic_class];
+  if (!t->pending)
+  {
+    t->submitted = k_uptime_get_32();
+    t->deadline_ms = deadline_ms;
+    t->pending = true;
+  }
+  net_sched_submit_in(&t->job, deadline_ms);
+}
+
+static uint32_t exp_interval(uint32_t mean_ms)
+{
+  return -log(1.0 - host_rand_unit()) * mean_ms;
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = argc > 1 ? argv[1] : "sched";
+  host_seed(argc > 2 ? atoi(argv[2]) : 1);
+
+  const uint32_t min_delay[NET_CLASS_COUNT] = {
+      [NET_CLASS_READ] = CONFIG_SPAN_NET_SCHED_READ_MIN_DELAY_MS,
+      [NET_CLASS_UPLINK] = CONFIG_SPAN_NET_SCHED_UPLINK_MIN_DELAY_MS,
+      [NET_CLASS_FOTA] = CONFIG_SPAN_NET_SCHED_FOTA_MIN_DELAY_MS,
+  };
+  net_sched_init();
+  for (int i = 0; i < NET_CLASS_COUNT; i++)
+  {
+    net_job_init(&traffic[i].job, i, job_handler);
+    k_delayed_work_init(&traffic[i].reply_work, reply_handler);
+    traffic[i].min_delay_ms = min_delay[i];
+  }
+
+  uint32_t next_sample = 0;
+  uint32_t next_read = READ_EVERY_MS;
+  uint32_t next_notify = exp_interval(NOTIFY_EVERY_MS);
+  uint32_t submitted = 0;
+  while (k_uptime_get_32() < DURATION_MS)
+  {
+    uint32_t now = k_uptime_get_32();
+    if (now >= next_sample)
+    {
+      next_sample += SAMPLE_MS;
+      if (!batch_open)
+      {
+        batch_open = true;
+        submit(NET_CLASS_UPLINK, CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS);
+        submitted++;
+      }
+    }
+    if (now >= next_read)
+    {
+      next_read += READ_EVERY_MS;
+      submitted += !traffic[NET_CLASS_READ].pending;
+      submit(NET_CLASS_READ, CONFIG_SPAN_NET_SCHED_READ_DEADLINE_MS);
+    }
+    if (now >= next_notify)
+    {
+      next_notify += exp_interval(NOTIFY_EVERY_MS);
+      submitted += !traffic[NET_CLASS_FOTA].pending;
+      submit(NET_CLASS_FOTA, CONFIG_SPAN_NET_SCHED_FOTA_DEADLINE_MS);
+    }
+    uint32_t next = MIN(next_sample, MIN(next_read, next_notify));
+    host_run(MIN(next, DURATION_MS) - now);
+  }
+
+  struct net_sched_stats stats;
+  net_sched_get_stats(&stats);
+  printf("%-16s %6s %12s %8s %12s %6s\n", "", "jobs", "piggybacked",
+         "wakeups", "radio on s", "on %");
+  printf("%-16s %6d %12d %8d %12.1f %6.1f\n", name, stats.jobs,
+         stats.piggybacked, stats.link_wakeups, stats.link_awake_ms / 1000.0,
+         100.0 * stats.link_awake_ms / DURATION_MS);
+
+  // Every job runs once, within its deadline and not before its minimum
+  // delay
+  uint32_t still_pending = 0;
+  for (int i = 0; i < NET_CLASS_COUNT; i++)
+  {
+    still_pending += traffic[i].pending;
+  }
+  HOST_CHECK(stats.jobs + still_pending == submitted);
+  HOST_CHECK(late == 0);
+  HOST_CHECK(early == 0);
+  return host_test_result();
+}
@@ -0,0 +1,147 @@
+/*
+ * Settings for the host tests, kept in shared memory so they survive
+ * host_boot(). A value is saved or deleted in one step, like the NVS
+ * backend does it.
+ */
+#include <errno.h>
+#include <string.h>
+
+#include <settings/settings.h>
+#include <zephyr.h>
+
+#include "host.h"
+
+#define SETTINGS_MAX 8
+#define SETTINGS_NAME_LEN 32
+#define SETTINGS_VALUE_LEN 4096
+#define HANDLERS_MAX 4
+
+struct setting
+{
+  char name[SETTINGS_NAME_LEN];
+  size_t len;
+  uint8_t value[SETTINGS_VALUE_LEN];
+};
+
+static struct setting *settings;
+// Handlers are registered by every boot again, so they aren't shared
+static struct settings_handler *handlers[HANDLERS_MAX];
+static int handler_count;
+
+// Before main() so every boot sees the same memory
+__attribute__((constructor)) static void settings_init(void)
+{
+  settings = host_shared_alloc(SETTINGS_MAX * sizeof(*settings));
+}
+
+void host_settings_clear(void)
+{
+  memset(settings, 0, SETTINGS_MAX * sizeof(*settings));
+}
+
+int settings_subsys_init(void)
+{
+  return 0;
+}
+
+int settings_register(struct settings_handler *handler)
+{
+  if (handler_count == HANDLERS_MAX)
+  {
+    return -ENOMEM;
+  }
+  handlers[handler_count++] = handler;
+  return 0;
+}
+
+struct read_arg
+{
+  const struct setting *setting;
+};
+
+static ssize_t read_value(void *cb_arg, void *data, size_t len)
+{
+  const struct setting *setting = ((struct read_arg *)cb_arg)->setting;
+  len = MIN(len, setting->len);
+  memcpy(data, setting->value, len);
+  return len;
+}
+
+int settings_load_subtree(const char *subtree)
+{
+  size_t prefix = subtree ? strlen(subtree) : 0;
+  for (int i = 0; i < SETTINGS_MAX; i++)
+  {
+    struct setting *setting = &settings[i];
+    if (!setting->name[0] ||
+        (subtree && (strncmp(setting->name, subtree, prefix) != 0 ||
+                     setting->name[prefix] != '/')))
+    {
+      continue;
+    }
+    const char *slash = strchr(setting->name, '/');
+    if (!slash)
+    {
+      continue;
+    }
+    for (int h = 0; h < handler_count; h++)
+    {
+      if (strlen(handlers[h]->name) == (size_t)(slash - setting->name) &&
+          strncmp(handlers[h]->name, setting->name, slash - setting->name) ==
+              0)
+      {
+        struct read_arg arg = {setting};
+        handlers[h]->h_set(slash + 1, setting->len, read_value, &arg);
+      }
+    }
+  }
+  return 0;
+}
+
+int settings_load(void)
+{
+  return settings_load_subtree(NULL);
+}
+
+int settings_save_one(const char *name, const void *value, size_t val_len)
+{
+  if (strlen(name) >= SETTINGS_NAME_LEN || val_len > SETTINGS_VALUE_LEN)
+  {
+    return -EINVAL;
+  }
+  struct setting *free_slot = NULL;
+  for (int i = 0; i < SETTINGS_MAX; i++)
+  {
+    struct setting *setting = &settings[i];
+    if (strcmp(setting->name, name) == 0)
+    {
+      free_slot = setting;
+      break;
+    }
+    if (!free_slot && !setting->name[0])
+    {
+      free_slot = setting;
+    }
+  }
+  if (!free_slot)
+  {
+    return -ENOMEM;
+  }
+  strcpy(free_slot->name, name);
+  memcpy(free_slot->value, value, val_len);
+  free_slot->len = val_len;
+  return 0;
+}
+
+int settings_delete(const char *name)
+{
+  for (int i = 0; i < SETTINGS_MAX; i++)
+  {
+    struct setting *setting = &settings[i];
+    if (strcmp(setting->name, name) == 0)
+    {
+      memset(setting, 0, sizeof(*setting));
+    }
+  }
+  return 0;
+}
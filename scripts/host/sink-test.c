@@ -0,0 +1,378 @@
+/*
+ * FOTA sink (src/fota-sink.c) writing to a RAM backed secondary slot. The
+ * blocks are written directly for the error cases and through
+ * fota_sink_download() with a simulated blockwise transfer for the
+ * interrupted downloads, the power cuts and the changed images. The flash
+ * refuses to program a location twice, so a resumed download that writes
+ * over what is already in the slot fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mbedtls/sha256.h>
+#include <storage/flash_map.h>
+#include <zephyr.h>
+
+#include "coap-client.h"
+#include "fota-decoder.h"
+#include "fota-sink.h"
+#include "host.h"
+
+#define SLOT_ID FLASH_AREA_ID(image_1)
+#define SLOT_SIZE (64 * 1024)
+#define SLOT_SECTOR_SIZE 4096
+#define SLOT_ALIGN 8
+#define BLOCK_LEN 512
+#define PATH "fw/image"
+
+/*
+ * The image on the server. blocks counts the blocks sent over all boots and
+ * fail_after makes the transfer time out after that many blocks of a boot.
+ */
+struct server
+{
+  uint8_t data[SLOT_SIZE + BLOCK_LEN];
+  size_t len;
+  uint8_t etag;
+  uint32_t fail_after;
+  uint32_t blocks;
+};
+
+static struct server *server;
+
+int coap_blockwise_transfer_resume(const char *path, uint8_t window,
+                                   struct coap_blockwise_state *state,
+                                   blockwise_callback_t callback)
+{
+  if (state->offset > 0 &&
+      (state->etag_len != 1 || state->etag[0] != server->etag ||
+       state->size != server->len))
+  {
+    memset(state, 0, sizeof(*state));
+    return -ESTALE;
+  }
+  for (uint32_t sent = 0; state->offset < server->len; sent++)
+  {
+    if (server->fail_after && sent == server->fail_after)
+    {
+      return -ETIMEDOUT;
+    }
+    state->size = server->len;
+    state->block_size = COAP_BLOCK_512;
+    state->etag_len = 1;
+    state->etag[0] = server->etag;
+    size_t len = MIN(BLOCK_LEN, server->len - state->offset);
+    bool last = (state->offset + len == server->len);
+    server->blocks++;
+    int ret = callback(last, state->offset, server->data + state->offset, len);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    state->offset += len;
+  }
+  return 0;
+}
+
+static void sha256(const uint8_t *data, size_t len, uint8_t *digest)
+{
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts_ret(&ctx, 0);
+  mbedtls_sha256_update_ret(&ctx, data, len);
+  mbedtls_sha256_finish_ret(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+}
+
+// An image of len bytes, also packed with a header if packed is set
+static void make_image(size_t len, bool packed)
+{
+  uint8_t *image = server->data;
+  if (packed)
+  {
+    uint32_t image_size = len;
+    memcpy(image, FOTA_IMAGE_MAGIC, 4);
+    image[4] = FOTA_IMAGE_VERSION;
+    memset(image + 5, 0, 3);
+    memcpy(image + 8, &image_size, 4);
+    memset(image + 12, 0, 4);
+    image += FOTA_IMAGE_HEADER_LEN;
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    image[i] = host_rand();
+  }
+  server->len = len + (packed ? FOTA_IMAGE_HEADER_LEN : 0);
+  server->etag++;
+}
+
+static const uint8_t *image_data(void)
+{
+  bool packed = memcmp(server->data, FOTA_IMAGE_MAGIC, 4) == 0;
+  return server->data + (packed ? FOTA_IMAGE_HEADER_LEN : 0);
+}
+
+static size_t image_len(void)
+{
+  bool packed = memcmp(server->data, FOTA_IMAGE_MAGIC, 4) == 0;
+  return server->len - (packed ? FOTA_IMAGE_HEADER_LEN : 0);
+}
+
+// The slot has the image, padded with erased bytes
+static bool slot_has_image(void)
+{
+  const uint8_t *slot = host_flash_data(SLOT_ID);
+  size_t len = image_len();
+  if (memcmp(slot, image_data(), len) != 0)
+  {
+    return false;
+  }
+  for (size_t i = len; i < SLOT_SIZE; i++)
+  {
+    if (slot[i] != 0xFF)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void reset_slot(void)
+{
+  host_flash_init(SLOT_ID, SLOT_SIZE, SLOT_SECTOR_SIZE, SLOT_ALIGN);
+  host_settings_clear();
+  server->blocks = 0;
+  server->fail_after = 0;
+}
+
+static int write_blocks(size_t len)
+{
+  for (size_t off = 0; off < len; off += BLOCK_LEN)
+  {
+    size_t n = MIN(BLOCK_LEN, len - off);
+    int ret = fota_sink_write(off + n == len, off, server->data + off, n);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Blocks in order. The image doesn't end on a block, write buffer or write
+ * alignment boundary, so the last partial buffer is padded and flushed.
+ */
+static void test_in_order(void)
+{
+  uint8_t digest[FOTA_SINK_DIGEST_LEN];
+  uint8_t got[FOTA_SINK_DIGEST_LEN];
+  int requests = host_boot_requests();
+
+  reset_slot();
+  make_image(20 * BLOCK_LEN + 13, false);
+  sha256(server->data, server->len, digest);
+  HOST_CHECK(fota_sink_begin(digest) == 0);
+  HOST_CHECK(write_blocks(server->len) == 0);
+  HOST_CHECK(fota_sink_bytes_written() == server->len);
+  HOST_CHECK(slot_has_image());
+  HOST_CHECK(fota_sink_get_digest(got) == 0 &&
+             memcmp(got, digest, sizeof(got)) == 0);
+  HOST_CHECK(host_boot_requests() == requests + 1);
+
+  // Without a digest the image is taken as it is
+  reset_slot();
+  make_image(3 * BLOCK_LEN + 1, false);
+  HOST_CHECK(fota_sink_begin(NULL) == 0);
+  HOST_CHECK(write_blocks(server->len) == 0);
+  HOST_CHECK(slot_has_image());
+  HOST_CHECK(host_boot_requests() == requests + 2);
+}
+
+// Missing and repeated blocks stop the image
+static void test_out_of_order(void)
+{
+  int requests = host_boot_requests();
+  uint8_t *data = server->data;
+
+  reset_slot();
+  make_image(8 * BLOCK_LEN, false);
+  HOST_CHECK(fota_sink_begin(NULL) == 0);
+  HOST_CHECK(fota_sink_write(false, 0, data, BLOCK_LEN) == 0);
+  HOST_CHECK(fota_sink_write(false, 2 * BLOCK_LEN, data + 2 * BLOCK_LEN,
+                             BLOCK_LEN) == -EINVAL);
+  // Nothing is taken once the order is lost
+  HOST_CHECK(fota_sink_write(false, BLOCK_LEN, data + BLOCK_LEN,
+                             BLOCK_LEN) == -EINVAL);
+
+  HOST_CHECK(fota_sink_begin(NULL) == 0);
+  HOST_CHECK(fota_sink_write(false, 0, data, BLOCK_LEN) == 0);
+  HOST_CHECK(fota_sink_write(false, BLOCK_LEN, data + BLOCK_LEN,
+                             BLOCK_LEN) == 0);
+  HOST_CHECK(fota_sink_write(false, BLOCK_LEN, data + BLOCK_LEN,
+                             BLOCK_LEN) == -EINVAL);
+  HOST_CHECK(host_boot_requests() == requests);
+}
+
+// An image larger than the slot is refused before anything past it
+static void test_overflow(void)
+{
+  int requests = host_boot_requests();
+
+  reset_slot();
+  make_image(SLOT_SIZE + 100, false);
+  HOST_CHECK(fota_sink_begin(NULL) == 0);
+  HOST_CHECK(write_blocks(server->len) == -EFBIG);
+  HOST_CHECK(fota_sink_bytes_written() <= SLOT_SIZE);
+  HOST_CHECK(host_boot_requests() == requests);
+}
+
+// A complete image with the wrong digest isn't marked for upgrade
+static void test_digest_mismatch(void)
+{
+  uint8_t digest[FOTA_SINK_DIGEST_LEN];
+  int requests = host_boot_requests();
+
+  reset_slot();
+  make_image(10 * BLOCK_LEN, false);
+  sha256(server->data, server->len, digest);
+  digest[0] ^= 1;
+  HOST_CHECK(fota_sink_begin(digest) == 0);
+  HOST_CHECK(write_blocks(server->len) == -EBADMSG);
+  HOST_CHECK(fota_sink_get_digest(digest) == -EAGAIN);
+  HOST_CHECK(host_boot_requests() == requests);
+}
+
+static uint8_t expected_digest[FOTA_SINK_DIGEST_LEN];
+
+// A boot that downloads the image, with the expected digest in arg or NULL
+static int download(void *arg)
+{
+  int ret = fota_sink_download(PATH, 1, arg);
+  return ret == 0 ? 0 : 1;
+}
+
+/*
+ * Download in boots until one completes. Returns the number of boots, or 0
+ * if it took too many.
+ */
+static int download_boots(uint32_t cut_after)
+{
+  host_flash_cut_after(cut_after);
+  for (int boots = 1; boots <= 3; boots++)
+  {
+    int ret = host_boot(download, expected_digest);
+    host_flash_cut_after(0);
+    if (ret == 0)
+    {
+      return boots;
+    }
+  }
+  return 0;
+}
+
+// A download that times out continues from the last checkpoint
+static void test_resume(bool packed)
+{
+  int requests = host_boot_requests();
+  const uint32_t blocks = 40;
+
+  reset_slot();
+  make_image(blocks * BLOCK_LEN - 300, packed);
+  sha256(image_data(), image_len(), expected_digest);
+  server->fail_after = blocks / 2 + 3;
+  HOST_CHECK(host_boot(download, expected_digest) == 1);
+  server->fail_after = 0;
+  HOST_CHECK(host_boot(download, expected_digest) == 0);
+  HOST_CHECK(slot_has_image());
+  HOST_CHECK(host_boot_requests() == requests + 1);
+
+  struct host_flash_stats stats;
+  host_flash_get_stats(SLOT_ID, &stats);
+  HOST_CHECK(stats.overwrites == 0);
+  // Only the blocks after the checkpoint are fetched again
+  HOST_CHECK(server->blocks <= blocks + CONFIG_SPAN_FOTA_CHECKPOINT_BLOCKS);
+  printf("resume%s: %d blocks for a %d block image, %d bytes programmed\n",
+         packed ? " (packed)" : "", server->blocks, blocks,
+         stats.bytes_written);
+}
+
+/*
+ * An image that changes on the server while a download is interrupted is
+ * downloaded again from the start. Without a digest only the ETag and the
+ * size tell.
+ */
+static void test_changed_image(void)
+{
+  reset_slot();
+  make_image(30 * BLOCK_LEN, false);
+  server->fail_after = 25;
+  HOST_CHECK(host_boot(download, NULL) == 1);
+  make_image(30 * BLOCK_LEN - 100, false);
+  server->fail_after = 0;
+  HOST_CHECK(host_boot(download, NULL) == 0);
+  HOST_CHECK(server->blocks == 25 + 30);
+  HOST_CHECK(slot_has_image());
+
+  struct host_flash_stats stats;
+  host_flash_get_stats(SLOT_ID, &stats);
+  HOST_CHECK(stats.overwrites == 0);
+}
+
+/*
+ * The power is cut during every flash operation of a download in turn. The
+ * next boot continues and completes the image, without programming a
+ * location twice and with a single upgrade request.
+ */
+static void test_power_cut(bool packed)
+{
+  const uint32_t blocks = 40;
+  int cuts = 0;
+  int extra_blocks = 0;
+
+  for (uint32_t cut = 1;; cut++)
+  {
+    int requests = host_boot_requests();
+    reset_slot();
+    host_seed(cut);
+    make_image(blocks * BLOCK_LEN - 300, packed);
+    sha256(image_data(), image_len(), expected_digest);
+
+    int boots = download_boots(cut);
+    struct host_flash_stats stats;
+    host_flash_get_stats(SLOT_ID, &stats);
+    if (!HOST_CHECK(boots > 0) || !HOST_CHECK(slot_has_image()) ||
+        !HOST_CHECK(stats.overwrites == 0) ||
+        !HOST_CHECK(host_boot_requests() == requests + 1))
+    {
+      printf("  cut during flash operation %d\n", cut);
+    }
+    if (boots == 1)
+    {
+      // Past the last operation
+      break;
+    }
+    cuts++;
+    extra_blocks += server->blocks - blocks;
+  }
+  printf("power cut%s: %d cuts, %.1f blocks fetched again per cut\n",
+         packed ? " (packed)" : "", cuts, (double)extra_blocks / cuts);
+}
+
+int main(int argc, char **argv)
+{
+  host_seed(1);
+  server = host_shared_alloc(sizeof(*server));
+
+  test_in_order();
+  test_out_of_order();
+  test_overflow();
+  test_digest_mismatch();
+  test_resume(false);
+  test_resume(true);
+  test_changed_image();
+  test_power_cut(false);
+  test_power_cut(true);
+
+  return host_test_result();
+}
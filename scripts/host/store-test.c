@@ -0,0 +1,308 @@
+/*
+ * The uplink queue (src/uplink-store.c) on a RAM backed storage partition
+ * with the FCB from fcb.c, over an hour of simulated time. A batch of
+ * BATCH_LEN bytes is stored every BATCH_MS and the link goes down for
+ * OUTAGE_MS at OUTAGE_START_MS. Requests sent while the link is down time
+ * out after TIMEOUT_MS. The drain rate is the backlog at the first
+ * acknowledgement after the outage divided by the time until all of it has
+ * been delivered. Write amplification is what the flash has programmed per
+ * payload byte.
+ *
+ * With resets the device is reset at random times and the power is cut
+ * during random flash operations. The queue is read back from flash on
+ * every boot, so batches acknowledged after the last commit are sent again
+ * (duplicates), but every batch that was stored is delivered.
+ *
+ * host-test.sh builds this as "store" and as "store-burst1" with
+ * CONFIG_SPAN_UPLINK_STORE_BURST set to 1.
+ *
+ *   store-test name [seed]
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <storage/flash_map.h>
+#include <zephyr.h>
+
+#include "host.h"
+#include "net-sched.h"
+#include "uplink-store.h"
+
+#define AREA_ID FLASH_AREA_ID(storage)
+#define SECTOR_SIZE 4096
+#define SECTORS                                                                \
+  (CONFIG_SETTINGS_NVS_SECTOR_COUNT + CONFIG_SPAN_UPLINK_STORE_SECTORS)
+#define ALIGN 8
+
+#define DURATION_MS (3600 * 1000)
+// Time after the last batch to send what is left
+#define TAIL_MS (300 * 1000)
+#define BATCH_MS 5000
+#define BATCH_LEN 200
+#define OUTAGE_START_MS (600 * 1000)
+#define OUTAGE_MS (240 * 1000)
+#define RTT_MS 200
+#define TIMEOUT_MS 45000
+#define MEAN_RESET_MS (600 * 1000)
+#define MAX_BATCHES (DURATION_MS / BATCH_MS)
+
+/*
+ * The server and the clock outside the device, kept across boots. Batches
+ * are numbered by the test, in the first bytes of their data.
+ */
+struct world
+{
+  // Time when the current boot started
+  int64_t boot_at;
+  int64_t now;
+  // End of the current boot
+  int64_t reset_at;
+  uint32_t next_batch;
+  uint32_t received[MAX_BATCHES];
+  uint32_t corrupt;
+  uint32_t boots;
+  uint32_t power_cuts;
+  // Drain after the outage
+  int64_t drain_start;
+  int64_t drained_at;
+  uint32_t backlog_upto;
+  uint32_t backlog_left;
+  uint32_t backlog;
+};
+
+static struct world *world;
+
+// A request that is waiting for its response
+struct request
+{
+  bool used;
+  uint32_t seq;
+  int result;
+  struct k_delayed_work work;
+};
+
+static struct request requests[CONFIG_SPAN_UPLINK_STORE_BURST];
+
+static int64_t world_time(void)
+{
+  return world->boot_at + k_uptime_get_32();
+}
+
+static bool link_up(int64_t t)
+{
+  return t < OUTAGE_START_MS || t >= OUTAGE_START_MS + OUTAGE_MS;
+}
+
+static void fill_batch(uint8_t *data, uint32_t batch)
+{
+  memcpy(data, &batch, sizeof(batch));
+  for (size_t i = sizeof(batch); i < BATCH_LEN; i++)
+  {
+    data[i] = batch + i;
+  }
+}
+
+static void received(uint32_t batch, int64_t t)
+{
+  if (t >= OUTAGE_START_MS + OUTAGE_MS && world->drain_start == 0)
+  {
+    // Everything stored so far that hasn't arrived is the backlog
+    world->drain_start = t;
+    world->backlog_upto = world->next_batch;
+    for (uint32_t i = 0; i < world->backlog_upto; i++)
+    {
+      world->backlog_left += (world->received[i] == 0);
+    }
+    world->backlog = world->backlog_left;
+  }
+  if (world->received[batch]++ == 0 && world->drain_start &&
+      batch < world->backlog_upto && --world->backlog_left == 0)
+  {
+    world->drained_at = t;
+  }
+}
+
+static void response_handler(struct k_work *work)
+{
+  struct request *req = CONTAINER_OF(work, struct request, work.work);
+  req->used = false;
+  net_sched_link_active();
+  uplink_store_done(req->seq, req->result);
+}
+
+static int send(const struct uplink_store_entry *entry)
+{
+  struct request *req = NULL;
+  for (int i = 0; i < ARRAY_SIZE(requests) && !req; i++)
+  {
+    if (!requests[i].used)
+    {
+      req = &requests[i];
+    }
+  }
+  if (!req)
+  {
+    return -EAGAIN;
+  }
+  net_sched_link_active();
+
+  uint32_t batch;
+  uint8_t expected[BATCH_LEN];
+  memcpy(&batch, entry->data, sizeof(batch));
+  if (entry->len != BATCH_LEN || batch >= MAX_BATCHES)
+  {
+    world->corrupt++;
+    return -EINVAL;
+  }
+  fill_batch(expected, batch);
+  if (memcmp(entry->data, expected, BATCH_LEN) != 0)
+  {
+    world->corrupt++;
+  }
+
+  int64_t t = world_time();
+  req->used = true;
+  req->seq = entry->seq;
+  if (link_up(t))
+  {
+    received(batch, t);
+    req->result = 0;
+    k_delayed_work_submit(&req->work, K_MSEC(RTT_MS));
+  }
+  else
+  {
+    req->result = -ETIMEDOUT;
+    k_delayed_work_submit(&req->work, K_MSEC(TIMEOUT_MS));
+  }
+  return 0;
+}
+
+/*
+ * One boot: open the queue and store a batch every BATCH_MS until the
+ * reset. world->now follows the clock so a power cut knows where it was.
+ */
+static int boot(void *arg)
+{
+  world->boots++;
+  net_sched_init();
+  for (int i = 0; i < ARRAY_SIZE(requests); i++)
+  {
+    k_delayed_work_init(&requests[i].work, response_handler);
+  }
+  if (uplink_store_init(send) < 0)
+  {
+    return 1;
+  }
+  uplink_store_drain();
+
+  for (;;)
+  {
+    int64_t now = world_time();
+    world->now = now;
+    if (now >= world->reset_at)
+    {
+      return 0;
+    }
+    int64_t next_at = (int64_t)world->next_batch * BATCH_MS;
+    if (world->next_batch < MAX_BATCHES && now >= next_at)
+    {
+      uint8_t data[BATCH_LEN];
+      fill_batch(data, world->next_batch);
+      if (uplink_store_append(0, data, sizeof(data), 0) == 0)
+      {
+        world->next_batch++;
+      }
+      uplink_store_drain();
+      continue;
+    }
+    int64_t until = world->reset_at;
+    if (world->next_batch < MAX_BATCHES)
+    {
+      until = MIN(until, next_at);
+    }
+    // Steps of at most a second for world->now
+    host_run(MIN(until - now, 1000));
+  }
+}
+
+static uint32_t exp_interval(uint32_t mean_ms)
+{
+  return -log(1.0 - host_rand_unit()) * mean_ms;
+}
+
+static void run(const char *name, bool resets)
+{
+  memset(world, 0, sizeof(*world));
+  host_flash_init(AREA_ID, SECTORS * SECTOR_SIZE, SECTOR_SIZE, ALIGN);
+
+  const int64_t end = DURATION_MS + TAIL_MS;
+  while (world->now < end)
+  {
+    world->boot_at = world->now;
+    world->reset_at = end;
+    if (resets && world->now < DURATION_MS)
+    {
+      world->reset_at = MIN(end, world->now + exp_interval(MEAN_RESET_MS));
+      // Half of the resets are power cuts during a flash operation
+      if (host_rand() % 2)
+      {
+        host_flash_cut_after(1 + host_rand() % 100);
+      }
+    }
+    int ret = host_boot(boot, NULL);
+    host_flash_cut_after(0);
+    if (ret == HOST_POWER_CUT)
+    {
+      world->power_cuts++;
+    }
+    else if (!HOST_CHECK(ret == 0))
+    {
+      return;
+    }
+  }
+
+  uint32_t delivered = 0;
+  uint32_t duplicates = 0;
+  for (uint32_t i = 0; i < world->next_batch; i++)
+  {
+    delivered += (world->received[i] > 0);
+    duplicates += world->received[i] - (world->received[i] > 0);
+  }
+  struct host_flash_stats flash;
+  host_flash_get_stats(AREA_ID, &flash);
+  double drain_s = (world->drained_at - world->drain_start) / 1000.0;
+  printf("%-20s %5d %5d %8d %8d %5d %6d %6d %9.2f %7.1f %7.1f\n", name,
+         world->boots, world->power_cuts, world->next_batch, delivered,
+         duplicates, world->next_batch - delivered, flash.erases,
+         (double)flash.bytes_written / (world->next_batch * BATCH_LEN),
+         drain_s, world->backlog / drain_s);
+
+  // Every stored batch arrives, unchanged, and the flash is never
+  // programmed twice
+  HOST_CHECK(world->next_batch == MAX_BATCHES);
+  HOST_CHECK(delivered == world->next_batch);
+  HOST_CHECK(world->corrupt == 0);
+  HOST_CHECK(flash.overwrites == 0);
+  HOST_CHECK(world->drained_at > world->drain_start);
+  if (!resets)
+  {
+    HOST_CHECK(duplicates == 0);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *name = argc > 1 ? argv[1] : "store";
+  char label[32];
+  host_seed(argc > 2 ? atoi(argv[2]) : 1);
+  world = host_shared_alloc(sizeof(*world));
+
+  printf("%-20s %5s %5s %8s %8s %5s %6s %6s %9s %7s %7s\n", "", "boots",
+         "cuts", "stored", "received", "dups", "lost", "erases", "write amp",
+         "drain s", "batch/s");
+  run(name, false);
+  snprintf(label, sizeof(label), "%s+resets", name);
+  run(label, true);
+  return host_test_result();
+}
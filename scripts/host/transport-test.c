@@ -0,0 +1,77 @@
+/*
+ * Bytes on the wire per uplink message for every transport
+ * (transport_wire_bytes() in src/transport.c), which transport-bench.sh
+ * can't measure without the network. On TCP and TLS the uplink puts a
+ * 16-bit length in front of every message, like udp-client.c does. The
+ * first size is the message send_udp() sends, the last a full batch
+ * (CONFIG_SPAN_UPLINK_BATCH_SIZE).
+ *
+ *   transport-test
+ */
+#include <errno.h>
+#include <stdio.h>
+
+#include <zephyr.h>
+
+#include "host.h"
+#include "transport.h"
+
+// As in transport.c
+#define IPV4_HEADER 20
+#define UDP_HEADER 8
+#define TCP_HEADER 20
+#define DTLS_RECORD_OVERHEAD (13 + 8 + 8)
+#define TLS_RECORD_OVERHEAD (5 + 8 + 8)
+// As in udp-client.c
+#define STREAM_FRAME 2
+
+static const size_t sizes[] = {8, 64, CONFIG_SPAN_UPLINK_BATCH_SIZE};
+
+static size_t expected(enum transport_type type, size_t len)
+{
+  switch (type)
+  {
+  case TRANSPORT_UDP:
+    return IPV4_HEADER + UDP_HEADER + len;
+  case TRANSPORT_DTLS:
+    return IPV4_HEADER + UDP_HEADER + DTLS_RECORD_OVERHEAD + len;
+  case TRANSPORT_TCP:
+    return IPV4_HEADER + TCP_HEADER + STREAM_FRAME + len;
+  case TRANSPORT_TLS:
+    return IPV4_HEADER + TCP_HEADER + TLS_RECORD_OVERHEAD + STREAM_FRAME + len;
+  default:
+    return 0;
+  }
+}
+
+int main(void)
+{
+  enum transport_type parsed;
+  printf("%-10s", "");
+  for (int i = 0; i < ARRAY_SIZE(sizes); i++)
+  {
+    printf(" %5d B msg %6s", sizes[i], "over");
+  }
+  printf("\n");
+
+  for (int t = 0; t < TRANSPORT_COUNT; t++)
+  {
+    HOST_CHECK(transport_parse(transport_name(t), &parsed) == 0 && parsed == t);
+
+    printf("%-10s", transport_name(t));
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++)
+    {
+      size_t len = sizes[i] + (transport_is_stream(t) ? STREAM_FRAME : 0);
+      size_t wire = transport_wire_bytes(t, len);
+      if (!HOST_CHECK(wire == expected(t, sizes[i])))
+      {
+        printf("\n  %s: %d bytes, expected %d\n", transport_name(t), wire,
+               expected(t, sizes[i]));
+      }
+      printf(" %11d %5.0f%%", wire, 100.0 * (wire - sizes[i]) / sizes[i]);
+    }
+    printf("\n");
+  }
+  HOST_CHECK(transport_parse("quic", &parsed) == -EINVAL);
+  return host_test_result();
+}
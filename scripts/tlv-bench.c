@@ -0,0 +1,330 @@
+/*
+ * Host fuzz test and benchmark for the TLV codec (src/tlv.c).
+ *
+ * The fuzz part encodes random structures with every field type, in random
+ * field order and with values on both sides of the long length form, and
+ * checks that they decode to the same values. Encoding into every shorter
+ * buffer must fail without writing past the end. Random buffers, mutated
+ * encodings and every prefix of an encoding must decode or fail cleanly;
+ * the inputs are copied to exactly sized heap buffers so an address
+ * sanitizer build catches any read past the end.
+ *
+ * The benchmark reports the time to encode the firmware report and decode
+ * the FOTA response with the same field tables as src/fota_report.c.
+ *
+ * Built and run by scripts/tlv-bench.sh.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fota_report.h"
+#include "tlv.h"
+
+#define ROUNDS 1000000
+#define MAX_ENCODED 2048
+#define GUARD 16
+
+struct fuzz_msg {
+  const char *cstr;
+  char chars[32];
+  struct tlv_span span;
+  uint32_t u32;
+  bool flag;
+  char long_chars[600];
+};
+
+// The same message with the encode-only string decoded into an array
+struct fuzz_decoded {
+  char cstr[700];
+  char chars[32];
+  struct tlv_span span;
+  uint32_t u32;
+  bool flag;
+  char long_chars[600];
+};
+
+enum { ID_CSTR = 1, ID_CHARS, ID_SPAN, ID_U32, ID_FLAG, ID_LONG, FIELDS = 6 };
+
+static const struct tlv_field encode_fields[FIELDS] = {
+    TLV_FIELD(ID_CSTR, TLV_CSTR, struct fuzz_msg, cstr),
+    TLV_FIELD(ID_CHARS, TLV_CHARS, struct fuzz_msg, chars),
+    TLV_FIELD(ID_SPAN, TLV_SPAN, struct fuzz_msg, span),
+    TLV_FIELD(ID_U32, TLV_UINT32, struct fuzz_msg, u32),
+    TLV_FIELD(ID_FLAG, TLV_BOOL, struct fuzz_msg, flag),
+    TLV_FIELD(ID_LONG, TLV_CHARS, struct fuzz_msg, long_chars),
+};
+
+static const struct tlv_field decode_fields[FIELDS] = {
+    TLV_FIELD(ID_CSTR, TLV_CHARS, struct fuzz_decoded, cstr),
+    TLV_FIELD(ID_CHARS, TLV_CHARS, struct fuzz_decoded, chars),
+    TLV_FIELD(ID_SPAN, TLV_SPAN, struct fuzz_decoded, span),
+    TLV_FIELD(ID_U32, TLV_UINT32, struct fuzz_decoded, u32),
+    TLV_FIELD(ID_FLAG, TLV_BOOL, struct fuzz_decoded, flag),
+    TLV_FIELD(ID_LONG, TLV_CHARS, struct fuzz_decoded, long_chars),
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void) {
+  rng_state = rng_state * 1103515245u + 12345u;
+  return rng_state >> 8;
+}
+
+static int failures;
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "round %d: %s:%d: %s\n", round, __FILE__, __LINE__,    \
+              #cond);                                                         \
+      failures++;                                                             \
+      return;                                                                 \
+    }                                                                         \
+  } while (0)
+
+// Lengths close to the one byte limit are picked more often
+static size_t random_len(size_t max) {
+  size_t len;
+  switch (rng() % 4) {
+  case 0:
+    len = 253 + rng() % 5;
+    break;
+  case 1:
+    len = rng() % 8;
+    break;
+  default:
+    len = rng() % (max + 1);
+    break;
+  }
+  return len <= max ? len : max;
+}
+
+static void random_string(char *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (char)(1 + rng() % 255);
+  }
+  buf[len] = 0;
+}
+
+static void fuzz_round_trip(int round) {
+  static char cstr[700];
+  static uint8_t span[700];
+  static uint8_t buf[MAX_ENCODED + GUARD];
+  struct fuzz_msg msg;
+  struct tlv_field fields[FIELDS];
+
+  memset(&msg, 0, sizeof(msg));
+  if (rng() % 4) {
+    random_string(cstr, random_len(sizeof(cstr) - 1));
+    msg.cstr = cstr;
+  }
+  random_string(msg.chars, rng() % sizeof(msg.chars));
+  if (rng() % 4) {
+    size_t len = random_len(sizeof(span));
+    for (size_t i = 0; i < len; i++) {
+      span[i] = (uint8_t)rng();
+    }
+    msg.span.data = span;
+    msg.span.len = len;
+  }
+  msg.u32 = rng() ^ (rng() << 24);
+  msg.flag = rng() & 1;
+  random_string(msg.long_chars, random_len(sizeof(msg.long_chars) - 1));
+
+  // Random field order
+  memcpy(fields, encode_fields, sizeof(fields));
+  for (int i = FIELDS - 1; i > 0; i--) {
+    int j = rng() % (i + 1);
+    struct tlv_field f = fields[i];
+    fields[i] = fields[j];
+    fields[j] = f;
+  }
+
+  memset(buf, 0xA5, sizeof(buf));
+  int len = tlv_encode(fields, FIELDS, &msg, buf, MAX_ENCODED);
+  CHECK(len > 0);
+  for (int i = MAX_ENCODED; i < MAX_ENCODED + GUARD; i++) {
+    CHECK(buf[i] == 0xA5);
+  }
+
+  uint8_t *exact = malloc(len);
+  memcpy(exact, buf, len);
+  struct fuzz_decoded dec;
+  memset(&dec, 0x5A, sizeof(dec));
+  int ret = tlv_decode(decode_fields, FIELDS, &dec, exact, len);
+  CHECK(ret == 0);
+  if (msg.cstr) {
+    CHECK(strcmp(dec.cstr, msg.cstr) == 0);
+  } else {
+    // Missing fields are left alone
+    CHECK((uint8_t)dec.cstr[0] == 0x5A);
+  }
+  CHECK(strcmp(dec.chars, msg.chars) == 0);
+  if (msg.span.data) {
+    CHECK(dec.span.len == msg.span.len);
+    CHECK(dec.span.data >= exact && dec.span.data + dec.span.len <= exact + len);
+    CHECK(memcmp(dec.span.data, msg.span.data, msg.span.len) == 0);
+  }
+  CHECK(dec.u32 == msg.u32);
+  CHECK(dec.flag == msg.flag);
+  CHECK(strcmp(dec.long_chars, msg.long_chars) == 0);
+
+  // Every prefix either ends on a field boundary or is rejected
+  for (int n = 0; n < len; n++) {
+    uint8_t *prefix = malloc(n ? n : 1);
+    memcpy(prefix, exact, n);
+    ret = tlv_decode(decode_fields, FIELDS, &dec, prefix, n);
+    free(prefix);
+    CHECK(ret == 0 || ret == -EBADMSG);
+  }
+  free(exact);
+
+  // A shorter buffer is rejected and nothing is written past it
+  size_t size = rng() % len;
+  memset(buf, 0xA5, sizeof(buf));
+  ret = tlv_encode(fields, FIELDS, &msg, buf, size);
+  CHECK(ret == -ENOMEM);
+  for (size_t i = size; i < size + GUARD; i++) {
+    CHECK(buf[i] == 0xA5);
+  }
+}
+
+/*
+ * Random bytes, or a valid encoding with a few bytes changed. Decoding
+ * must not read out of bounds and must only return the documented errors.
+ */
+static void fuzz_decode(int round) {
+  static uint8_t buf[MAX_ENCODED];
+  size_t len;
+
+  if (rng() % 2) {
+    len = rng() % 64;
+    for (size_t i = 0; i < len; i++) {
+      buf[i] = (uint8_t)rng();
+    }
+    // Mostly known ids, so the value checks are reached
+    for (size_t i = 0; i < len; i += 2 + rng() % 8) {
+      buf[i] = 1 + rng() % (FIELDS + 1);
+    }
+  } else {
+    struct fuzz_msg msg = {.u32 = rng(), .flag = true};
+    random_string(msg.chars, rng() % sizeof(msg.chars));
+    random_string(msg.long_chars, random_len(sizeof(msg.long_chars) - 1));
+    int ret = tlv_encode(encode_fields, FIELDS, &msg, buf, sizeof(buf));
+    CHECK(ret > 0);
+    len = ret;
+    for (int i = rng() % 4; i >= 0; i--) {
+      buf[rng() % len] = (uint8_t)rng();
+    }
+  }
+
+  uint8_t *exact = malloc(len ? len : 1);
+  memcpy(exact, buf, len);
+  struct fuzz_decoded dec;
+  memset(&dec, 0, sizeof(dec));
+  int ret = tlv_decode(decode_fields, FIELDS, &dec, exact, len);
+  CHECK(ret == 0 || ret == -EBADMSG || ret == -ENOSPC);
+  if (ret == 0) {
+    CHECK(strlen(dec.chars) < sizeof(dec.chars));
+    CHECK(!dec.span.data ||
+          (dec.span.data >= exact && dec.span.data + dec.span.len <= exact + len));
+  }
+  free(exact);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Same ids and types as src/fota_report.c
+static const struct tlv_field report_fields[] = {
+    TLV_FIELD(1, TLV_CSTR, fota_report_t, version),
+    TLV_FIELD(2, TLV_CSTR, fota_report_t, model),
+    TLV_FIELD(3, TLV_CSTR, fota_report_t, serial),
+    TLV_FIELD(4, TLV_CSTR, fota_report_t, manufacturer),
+};
+
+static const struct tlv_field response_fields[] = {
+    TLV_FIELD(1, TLV_CHARS, fota_response_t, host),
+    TLV_FIELD(2, TLV_UINT32, fota_response_t, port),
+    TLV_FIELD(3, TLV_CHARS, fota_response_t, path),
+    TLV_FIELD(4, TLV_BOOL, fota_response_t, update),
+};
+
+static void bench(void) {
+  fota_report_t report = {
+      .version = "1.2.3",
+      .model = "STM32 F429zi",
+      .serial = "0123456789abcdef",
+      .manufacturer = "Exploratory Engineering",
+  };
+  const fota_response_t expected = {
+      .host = "172.16.15.14", .port = 5683, .path = "fw", .update = true};
+  uint8_t report_buf[128];
+  uint8_t response_buf[128];
+  volatile int sink = 0;
+
+  int report_len = tlv_encode(report_fields, 4, &report, report_buf,
+                              sizeof(report_buf));
+  // The decode table encodes too, the server's side of the exchange
+  int response_len = tlv_encode(response_fields, 4, &expected, response_buf,
+                                sizeof(response_buf));
+
+  double start = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    sink += tlv_encode(report_fields, 4, &report, report_buf,
+                       sizeof(report_buf));
+  }
+  double encode_ns = (now_ns() - start) / ROUNDS;
+
+  fota_response_t resp;
+  start = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    sink += tlv_decode(response_fields, 4, &resp, response_buf, response_len);
+  }
+  double decode_ns = (now_ns() - start) / ROUNDS;
+  if (memcmp(&resp, &expected, sizeof(resp)) != 0) {
+    fprintf(stderr, "FOTA response doesn't decode\n");
+    failures++;
+  }
+
+  printf("%-22s %6s %8s\n", "", "bytes", "ns/op");
+  printf("%-22s %6d %8.1f\n", "encode FOTA report", report_len, encode_ns);
+  printf("%-22s %6d %8.1f\n", "decode FOTA response", response_len,
+         decode_ns);
+}
+
+int main(int argc, char **argv) {
+  int rounds = 20000;
+  bool run_bench = true;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      rng_state = strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--no-bench") == 0) {
+      run_bench = false;
+    } else {
+      fprintf(stderr, "usage: %s [--rounds n] [--seed n] [--no-bench]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  for (int round = 0; round < rounds; round++) {
+    fuzz_round_trip(round);
+    fuzz_decode(round);
+  }
+  if (rounds > 0) {
+    printf("fuzz: %d rounds, %d failures\n", rounds, failures);
+  }
+  if (run_bench) {
+    bench();
+  }
+  return failures ? 1 : 0;
+}
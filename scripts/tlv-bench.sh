@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Build the TLV codec (src/tlv.c) with its fuzz test and benchmark for the
+# host and run them. The fuzz test runs in a build with the address and
+# undefined behaviour sanitizers (SANITIZE, empty to leave them out), the
+# benchmark in an optimized build. Arguments are passed on to the fuzz
+# test, for instance:
+#   scripts/tlv-bench.sh --rounds 200000 --seed 7
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-O2 -Wall -Wextra"}
+SANITIZE=${SANITIZE-"-fsanitize=address,undefined -fno-sanitize-recover=all"}
+BIN=$ROOT/build-tlv-bench
+
+$CC -g -O1 -Wall -Wextra $SANITIZE -I"$ROOT/include" -o "$BIN-fuzz" \
+  "$ROOT/scripts/tlv-bench.c" "$ROOT/src/tlv.c"
+"$BIN-fuzz" --no-bench "$@"
+
+$CC $CFLAGS -I"$ROOT/include" -o "$BIN" "$ROOT/scripts/tlv-bench.c" \
+  "$ROOT/src/tlv.c"
+"$BIN" --rounds 0
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Run bench-native.sh once per uplink transport and compare the packet rate,
+# per-message latency (time from queueing to send() on the device) and bytes
+# on the wire per message. Arguments are passed on to bench-native.sh and
+# the stand-in, for instance:
+#   scripts/transport-bench.sh --latency 50
+#
+# TRANSPORTS defaults to the transports the stand-in can terminate without
+# the client certificate. "tls" works when the sample is built with
+# CONFIG_SPAN_TLS_CREDENTIALS=y and the stand-in gets --tls-cert/--tls-key.
+# There is no DTLS peer on the host, so DTLS is measured against the Span
+# service.
+#
+# The bytes on the wire per message for every transport need no network and
+# are printed first, from the transport host test.
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TRANSPORTS=${TRANSPORTS:-"udp tcp"}
+
+"$ROOT/scripts/host-test.sh" transport
+
+for t in $TRANSPORTS; do
+  echo "== $t"
+  UPLINK_TRANSPORT=$t "$ROOT/scripts/bench-native.sh" "$@" |
+    grep -E "UDP uplink|uplink messages|datagrams/s"
+done
@@ -0,0 +1,234 @@
+/*
+ * Host benchmark for the time-series codec (src/ts-codec.c). Encodes a few
+ * synthetic sensor series, checks that they decode to the same samples and
+ * reports the compression ratio and the encode time per sample.
+ *
+ * Ratios are given against 8 bytes per sample (32-bit time and value) and
+ * against the v1 batch records (dt | len | 4 byte value) the uplink used
+ * before, both for one long stream and for streams cut into batches of
+ * --batch bytes, where every batch starts over with a full first sample.
+ *
+ * Built and run by scripts/ts-bench.sh.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ts-codec.h"
+
+#define SAMPLES 4096
+#define ROUNDS 200
+
+struct series {
+  const char *name;
+  enum ts_value_mode mode;
+  uint32_t time[SAMPLES];
+  uint32_t value[SAMPLES];
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void) {
+  rng_state = rng_state * 1103515245u + 12345u;
+  return rng_state >> 8;
+}
+
+static int jitter(int range) {
+  return (int)(rng() % (2 * range + 1)) - range;
+}
+
+static uint32_t float_bits(float f) {
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+/*
+ * The sample's own loop: a counter every 250 ms.
+ */
+static void make_counter(struct series *s) {
+  s->name = "counter";
+  s->mode = TS_VALUE_DELTA;
+  for (int i = 0; i < SAMPLES; i++) {
+    s->time[i] = i * 250;
+    s->value[i] = i;
+  }
+}
+
+/*
+ * Temperature in 1/100 degrees every 10 s with a few ms of timer jitter.
+ */
+static void make_temperature(struct series *s) {
+  s->name = "temperature";
+  s->mode = TS_VALUE_DELTA;
+  int32_t t = 2150;
+  for (int i = 0; i < SAMPLES; i++) {
+    s->time[i] = i * 10000 + jitter(20);
+    if (rng() % 4 == 0) {
+      t += jitter(3);
+    }
+    s->value[i] = (uint32_t)t;
+  }
+}
+
+/*
+ * Battery voltage in mV every minute, dropping a step now and then.
+ */
+static void make_battery(struct series *s) {
+  s->name = "battery";
+  s->mode = TS_VALUE_DELTA;
+  int32_t mv = 3700;
+  for (int i = 0; i < SAMPLES; i++) {
+    s->time[i] = i * 60000;
+    if (rng() % 50 == 0) {
+      mv -= 1 + rng() % 3;
+    }
+    s->value[i] = (uint32_t)mv;
+  }
+}
+
+/*
+ * Relative humidity as a float every 30 s, a slow daily curve rounded to
+ * 0.1 like most sensors report it.
+ */
+static void make_humidity(struct series *s) {
+  s->name = "humidity (float)";
+  s->mode = TS_VALUE_XOR;
+  for (int i = 0; i < SAMPLES; i++) {
+    s->time[i] = i * 30000;
+    float rh = 55.0f + 15.0f * sinf(i * 30.0f / 86400.0f * 6.2831853f);
+    rh = roundf(rh * 10.0f) / 10.0f;
+    s->value[i] = float_bits(rh);
+  }
+}
+
+/*
+ * 12-bit ADC noise every 100 ms, close to the worst case.
+ */
+static void make_noise(struct series *s) {
+  s->name = "adc noise";
+  s->mode = TS_VALUE_DELTA;
+  for (int i = 0; i < SAMPLES; i++) {
+    s->time[i] = i * 100;
+    s->value[i] = rng() & 0xFFF;
+  }
+}
+
+static size_t varint_len(uint32_t val) {
+  size_t n = 1;
+  while (val >= 0x80) {
+    val >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Encode the series in batches of batch_size bytes (or one stream if 0) and
+ * check every batch. Returns the total encoded size.
+ */
+static size_t encode_all(const struct series *s, uint8_t *buf,
+                         size_t batch_size, size_t *batches) {
+  size_t total = 0;
+  int i = 0;
+  *batches = 0;
+  while (i < SAMPLES) {
+    size_t size = batch_size ? batch_size : (size_t)SAMPLES * 9;
+    struct ts_encoder enc;
+    ts_encoder_init(&enc, buf, size, s->mode);
+    int first = i;
+    while (i < SAMPLES && ts_encode(&enc, s->time[i], s->value[i]) == 0) {
+      i++;
+    }
+    if (i == first) {
+      fprintf(stderr, "%s: sample doesn't fit in a batch\n", s->name);
+      exit(1);
+    }
+
+    struct ts_decoder dec;
+    ts_decoder_init(&dec, buf, ts_encoder_len(&enc), s->mode);
+    for (int j = first; j < i; j++) {
+      uint32_t t, v;
+      if (ts_decode(&dec, &t, &v) < 0 || t != s->time[j] ||
+          v != s->value[j]) {
+        fprintf(stderr, "%s: sample %d doesn't decode\n", s->name, j);
+        exit(1);
+      }
+    }
+    total += ts_encoder_len(&enc);
+    (*batches)++;
+  }
+  return total;
+}
+
+static void run(struct series *s, size_t batch_size) {
+  static uint8_t buf[SAMPLES * 9];
+  size_t batches;
+  size_t stream = encode_all(s, buf, 0, &batches);
+  size_t batched = encode_all(s, buf, batch_size, &batches);
+
+  // v1 records with a 4 byte value, dt relative to the first sample of the
+  // batch. Assumes the same number of batches as the compressed stream,
+  // which favours v1.
+  size_t raw = (size_t)SAMPLES * 8;
+  size_t v1 = 0;
+  int per_batch = (SAMPLES + batches - 1) / batches;
+  for (int i = 0; i < SAMPLES; i++) {
+    uint32_t dt = s->time[i] - s->time[i - i % per_batch];
+    v1 += varint_len(dt) + 1 + 4;
+  }
+
+  volatile uint32_t sink = 0;
+  double start = now_ns();
+  for (int r = 0; r < ROUNDS; r++) {
+    struct ts_encoder enc;
+    ts_encoder_init(&enc, buf, sizeof(buf), s->mode);
+    for (int i = 0; i < SAMPLES; i++) {
+      ts_encode(&enc, s->time[i], s->value[i]);
+    }
+    sink += ts_encoder_len(&enc);
+  }
+  double ns = (now_ns() - start) / ((double)ROUNDS * SAMPLES);
+
+  printf("%-18s %8.2f %8.2f %8.2f %8.2f %9.1f %8.1f\n", s->name,
+         (double)stream * 8 / SAMPLES, (double)raw / stream,
+         (double)raw / batched, (double)v1 / batched,
+         (double)SAMPLES / batches, ns);
+}
+
+int main(int argc, char **argv) {
+  size_t batch_size = 251;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_size = strtoul(argv[++i], NULL, 0);
+    } else {
+      fprintf(stderr, "usage: %s [--batch bytes]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  static struct series s;
+  void (*makers[])(struct series *) = {make_counter, make_temperature,
+                                       make_battery, make_humidity,
+                                       make_noise};
+
+  printf("%-18s %8s %8s %8s %8s %9s %8s\n", "", "bits/smp", "x raw",
+         "x batch", "x v1", "smp/batch", "ns/smp");
+  for (size_t i = 0; i < sizeof(makers) / sizeof(makers[0]); i++) {
+    makers[i](&s);
+    run(&s, batch_size);
+  }
+  printf("x raw: vs 8 bytes per sample as one stream, x batch: the same in "
+         "%zu byte batches,\nx v1: vs v1 batch records in the same batches\n",
+         batch_size);
+  return 0;
+}
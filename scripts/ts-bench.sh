@@ -0,0 +1,20 @@
+#!/bin/sh
+#
+# Build the time-series codec (src/ts-codec.c) and its benchmark for the
+# host and run it. Arguments are passed on to the benchmark, for instance:
+#   scripts/ts-bench.sh --batch 251
+#
+# The default batch is CONFIG_SPAN_UPLINK_BATCH_SIZE (256) less the room
+# the sample count takes in a v2 batch. CC and CFLAGS can be overridden to
+# compare compilers or to build for an M4 with qemu-arm, for instance.
+#
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-O2 -Wall -Wextra"}
+BIN=$ROOT/build-ts-bench
+
+$CC $CFLAGS -I"$ROOT/include" -o "$BIN" "$ROOT/scripts/ts-bench.c" \
+  "$ROOT/src/ts-codec.c" -lm
+"$BIN" "$@"
@@ -4,6 +4,7 @@
 #include <zephyr.h>
 
 #include <net/coap.h>
+#include <net/net_if.h>
 #include <net/net_ip.h>
 #include <net/socket.h>
 #include <net/udp.h>
@@ -11,180 +12,485 @@
 LOG_MODULE_REGISTER(coap_client, LOG_LEVEL_DBG);
 
 #include "coap-client.h"
+#include "coap-path.h"
+#include "coap-pool.h"
+#include "coap-rtt.h"
+#include "net-sched.h"
+#include "transport.h"
 
-#include "clientcert.h"
+#define MAX_COAP_MSG_LEN COAP_POOL_BUFFER_SIZE
 
-#ifdef CLIENT_CERT
-#include <net/tls_credentials.h>
-#endif
+// Worst case: every request holds a buffer, a full blockwise window waits
+// for delivery and one more buffer is needed to receive the next reply.
+BUILD_ASSERT(CONFIG_SPAN_COAP_POOL_BUFFERS >=
+                 CONFIG_SPAN_COAP_MAX_REQUESTS + COAP_BLOCKWISE_MAX_WINDOW + 1,
+             "CoAP buffer pool is too small");
 
-#define BLOCK_WISE_TRANSFER_SIZE_GET 256
-#define MAX_COAP_MSG_LEN (BLOCK_WISE_TRANSFER_SIZE_GET + 64)
-static uint8_t coap_data_buffer[MAX_COAP_MSG_LEN];
+BUILD_ASSERT((CONFIG_SPAN_COAP_MAX_BLOCK_SIZE &
+              (CONFIG_SPAN_COAP_MAX_BLOCK_SIZE - 1)) == 0,
+             "CoAP block size must be a power of two");
 
-/* CoAP socket fd */
-static int sock;
+/*
+ * How long to wait for a separate response after the request has been acked.
+ * This is MAX_TRANSMIT_WAIT from RFC 7252 section 4.8.2.
+ */
+#define EXCHANGE_TIMEOUT_MS                                                    \
+  (CONFIG_SPAN_COAP_ACK_TIMEOUT_MS *                                           \
+   ((1 << (CONFIG_SPAN_COAP_MAX_RETRANSMIT + 1)) - 1) * 3 / 2)
+
+/*
+ * Longest time the receive thread sleeps in poll(). New requests don't wake
+ * the thread so this bounds how late their first retransmission can be.
+ */
+#define MAX_POLL_INTERVAL_MS 250
+
+#define OBSERVE_REREGISTER_MS (CONFIG_SPAN_COAP_OBSERVE_REREGISTER_S * 1000)
+
+// A notification that arrives this long after the previous one is always
+// considered newer, whatever its sequence number
+#define OBSERVE_FRESHNESS_MS 128000
+
+// No-Response option (RFC 7967). Set to 2 on the fast path: the client isn't
+// interested in 2.xx responses to NON messages.
+#define OPTION_NO_RESPONSE 258
+#define NO_RESPONSE_SUCCESS 2
+
+// Weight of a new transmission in the loss estimate (1/8, like SRTT)
+#define LOSS_GAIN_SHIFT 3
+
+/* Block size used for the next Block2 request. Adjusted during transfers. */
+static enum coap_block_size block_size = COAP_BLOCK_256;
+
+/* CoAP socket fd. Kept open across stop/start to keep the DTLS connection. */
+static int sock = -1;
+static enum transport_type transport;
 
 struct pollfd fds[1];
 static int nfds;
 
 static void prepare_fds(void)
 {
+  nfds = 0;
   fds[nfds].fd = sock;
   fds[nfds].events = POLLIN;
   nfds++;
 }
 
-int coap_start_client(const char *host, uint16_t port)
+/* Round trip time estimate for the server */
+static struct coap_rtt *peer_rtt;
+
+/*
+ * Outstanding confirmable requests. The request owns a pool buffer with the
+ * encoded message until the response arrives so it can be retransmitted.
+ */
+struct coap_request
 {
-  int ret = 0;
-  struct sockaddr_in addr;
+  bool in_use;
+  bool acked;
+  int handle;
+  // COAP_TYPE_CON, or COAP_TYPE_NON for messages built on the fast path
+  uint8_t type;
+  uint16_t id;
+  uint8_t token[COAP_TOKEN_MAX_LEN];
+  uint8_t retries;
+  uint32_t sent_at;
+  uint32_t timeout;
+  uint32_t deadline;
+  coap_response_callback_t callback;
+  void *user_data;
+  size_t len;
+  uint8_t *data;
+};
+static struct coap_request requests[CONFIG_SPAN_COAP_MAX_REQUESTS];
+static int next_handle;
 
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
+/*
+ * The request table and the socket are shared between the application and
+ * the receive thread. Callbacks are invoked with the lock held; k_mutex is
+ * recursive so they may submit or cancel requests.
+ */
+static K_MUTEX_DEFINE(client_lock);
 
-  inet_pton(AF_INET, host, &addr.sin_addr);
+/*
+ * Datagrams are received straight into a pool buffer. A callback can keep the
+ * buffer (with retain_reply()) instead of copying the payload; otherwise it
+ * goes back to the pool once the reply has been dispatched.
+ */
+static uint8_t *rx_buffer;
+static bool rx_retained;
+
+static K_THREAD_STACK_DEFINE(rx_stack, CONFIG_SPAN_COAP_RX_STACK_SIZE);
+static struct k_thread rx_thread;
+static bool rx_thread_created;
+static volatile bool client_running;
+static K_SEM_DEFINE(client_started, 0, 1);
+static K_SEM_DEFINE(client_stopped, 0, 1);
+
+static void receive_thread(void *p1, void *p2, void *p3);
+static void complete_all_requests(int result);
+
+/*
+ * Pick the largest block size that fits in a single datagram on the default
+ * interface once the IP, UDP, DTLS and CoAP headers are accounted for.
+ */
+static enum coap_block_size initial_block_size(void)
+{
+  struct net_if *iface = net_if_get_default();
+  int room = (iface ? net_if_get_mtu(iface) : NET_IPV4_MTU) -
+             transport_wire_bytes(transport, 0) - CONFIG_SPAN_COAP_MSG_OVERHEAD;
+
+  enum coap_block_size szx = COAP_BLOCK_1024;
+  while (szx > COAP_BLOCK_16 &&
+         (coap_block_size_to_bytes(szx) > CONFIG_SPAN_COAP_MAX_BLOCK_SIZE ||
+          coap_block_size_to_bytes(szx) > room))
+  {
+    szx--;
+  }
+  return szx;
+}
+
+/* The server the socket is connected to */
+static struct sockaddr_in server_addr;
+
+/*
+ * Non-confirmable fast path. Every CONFIG_SPAN_COAP_NON_PROBE_INTERVAL-th
+ * message is a confirmable probe, which keeps the RTT and loss estimates up
+ * to date. The loss estimate is per mille of probe transmissions. Above
+ * CONFIG_SPAN_COAP_NON_LOSS_THRESHOLD every message is a probe until the
+ * loss has halved. Probes are limited to CONFIG_SPAN_COAP_NSTART outstanding
+ * and NON messages to CONFIG_SPAN_COAP_PROBING_RATE bytes/s (RFC 7252
+ * section 4.7). Only touched with the lock held.
+ */
+static struct
+{
+  uint32_t since_probe;
+  uint32_t loss;
+  bool all_con;
+  // Token bucket for NON messages in bytes * 1000
+  uint32_t credit;
+  uint32_t refilled_at;
+} fast;
 
-#ifdef CLIENT_CERT
-  ret = tls_credential_add(ROOT_CERT_TAG, TLS_CREDENTIAL_CA_CERTIFICATE,
-                           root_certificate, sizeof(root_certificate));
-  if (ret != 0)
+static struct coap_session_stats session_stats;
+
+/*
+ * Counters for the metrics. They are only updated with the client lock held
+ * so plain increments will do.
+ */
+static struct coap_client_metrics metrics;
+
+static void count_rtt(uint32_t rtt_ms)
+{
+  // Bucket 0 is everything below 16 ms, then one bucket per power of two
+  int bucket = 0;
+  if (rtt_ms >= 16)
   {
-    LOG_ERR("Unable to add root certificate to TLS credentials: %d", ret);
+    bucket = MIN(31 - __builtin_clz(rtt_ms) - 3,
+                 COAP_RTT_HISTOGRAM_BUCKETS - 1);
   }
+  metrics.rtt_histogram[bucket]++;
+}
 
-  // There's no constant for a client certificate but the rest of the code
-  // refers to the server certificate as "own" so this looks a bit weird.
-  ret = tls_credential_add(CLIENT_CERT_TAG, TLS_CREDENTIAL_SERVER_CERTIFICATE,
-                           client_certificate, sizeof(client_certificate));
-  if (ret != 0)
+/*
+ * Create the socket and connect to the server. For DTLS sockets this is
+ * where the handshake happens so the time spent is recorded.
+ */
+static int open_socket(const struct sockaddr_in *addr)
+{
+  struct transport_handshake handshake;
+  sock = transport_open(transport, addr, &handshake);
+  if (sock < 0)
   {
-    LOG_ERR("Unable to add client certificate to TLS credentials: %d", ret);
+    int ret = sock;
+    sock = -1;
+    return ret;
   }
-  ret = tls_credential_add(CLIENT_CERT_TAG, TLS_CREDENTIAL_PRIVATE_KEY,
-                           client_key, sizeof(client_key));
-  if (ret != 0)
+  if (handshake.done)
   {
-    LOG_ERR("Unable to add client key to TLS credentials: %d", ret);
+    session_stats.handshakes++;
+    session_stats.last_handshake_ms = handshake.ms;
+    session_stats.last_handshake_cycles = handshake.cycles;
+    session_stats.total_handshake_ms += handshake.ms;
   }
-  LOG_DBG("TLS credentials added for socket");
 
-  sock = socket(addr.sin_family, SOCK_DGRAM, IPPROTO_DTLS_1_2);
-#else
+  server_addr = *addr;
+  prepare_fds();
+  return 0;
+}
 
-  sock = socket(addr.sin_family, SOCK_DGRAM, IPPROTO_UDP);
+int coap_start_client(const char *host, uint16_t port,
+                      enum transport_type type)
+{
+  struct sockaddr_in addr;
 
-#endif
-  if (sock < 0)
+  // CoAP over TCP and TLS (RFC 8323) uses a different message format
+  if (transport_is_stream(type))
   {
-    LOG_ERR("Failed to create UDP socket %d", errno);
-    return -errno;
+    return -EPROTONOSUPPORT;
   }
 
-#ifdef CLIENT_CERT
-  sec_tag_t sec_tag_list[] = {
-      ROOT_CERT_TAG,
-      CLIENT_CERT_TAG,
-  };
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
 
-  ret = setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list,
-                   sizeof(sec_tag_list));
-  if (ret < 0)
-  {
-    LOG_ERR("Error setting TLS tag socket option: %d", errno);
-  }
+  inet_pton(AF_INET, host, &addr.sin_addr);
 
-  // Certificate verification doesn't work - it might be a memory issue or it
-  // might be the missing intermediate(s). The verification works for the
-  // *server* so the client is behaving as expected and it works for mbedtls on
-  // ESP-IDF so I'm inclined to point a finger on impedance mismatch somewhere
-  // in Zephyr
-  int verify = TLS_PEER_VERIFY_OPTIONAL;
-  ret = setsockopt(sock, SOL_TLS, TLS_PEER_VERIFY, &verify, sizeof(verify));
-  if (ret < 0)
+  if (sock >= 0 && transport == type &&
+      server_addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+      server_addr.sin_port == addr.sin_port)
   {
-    LOG_ERR("Failed to set TLS_PEER_VERIFY option: %d", errno);
-    ret = -errno;
+    // The socket (and the DTLS connection) survived the last stop
+    session_stats.reused++;
+    LOG_DBG("Reusing session");
   }
-#endif
-  ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-  if (ret < 0)
+  else
   {
-    LOG_ERR("Cannot connect to UDP remote : %d", errno);
-    return -errno;
+    if (sock >= 0)
+    {
+      close(sock);
+      sock = -1;
+    }
+    transport = type;
+    int ret = open_socket(&addr);
+    if (ret < 0)
+    {
+      return ret;
+    }
   }
 
-  prepare_fds();
+  peer_rtt = coap_rtt_lookup(&addr);
+
+  block_size = initial_block_size();
+  LOG_DBG("Using %d byte blocks over %s",
+          coap_block_size_to_bytes(block_size), transport_name(transport));
+
+  if (!rx_thread_created)
+  {
+    k_thread_create(&rx_thread, rx_stack, K_THREAD_STACK_SIZEOF(rx_stack),
+                    receive_thread, NULL, NULL, NULL,
+                    CONFIG_SPAN_COAP_RX_THREAD_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&rx_thread, "coap_rx");
+    rx_thread_created = true;
+  }
+  client_running = true;
+  k_sem_give(&client_started);
 
   return 0;
 }
 
 int coap_stop_client(void)
 {
+  if (client_running)
+  {
+    // The receive thread notices within one poll interval
+    client_running = false;
+    k_sem_take(&client_stopped, K_FOREVER);
+  }
+  complete_all_requests(-ECANCELED);
+  if (!IS_ENABLED(CONFIG_SPAN_COAP_KEEP_SESSION))
+  {
+    coap_close_session();
+  }
+  return 0;
+}
+
+int coap_close_session(void)
+{
+  if (client_running)
+  {
+    return -EBUSY;
+  }
+  if (sock >= 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+  return 0;
+}
+
+/*
+ * Errors from send() and recv() that mean the session is gone
+ */
+static bool session_lost(int err)
+{
+  return err == ENOTCONN || err == ECONNRESET || err == ECONNABORTED ||
+         err == EPIPE;
+}
+
+/*
+ * The session is gone (the server has forgotten it or the address changed
+ * without a connection ID). Open a new socket to the same server. Must be
+ * called with the lock held.
+ */
+static int reconnect(void)
+{
+  LOG_WRN("Lost session with server, reconnecting");
   close(sock);
+  return open_socket(&server_addr);
+}
+
+void coap_get_session_stats(struct coap_session_stats *stats)
+{
+  *stats = session_stats;
+}
+
+void coap_get_metrics(struct coap_client_metrics *out)
+{
+  k_mutex_lock(&client_lock, K_FOREVER);
+  *out = metrics;
+  k_mutex_unlock(&client_lock);
+}
+
+/* Paths registered with coap_register_path() */
+static struct coap_encoded_path paths[CONFIG_SPAN_COAP_PATH_CACHE_SIZE];
+static int num_paths;
+
+/*
+ * Observed resources (RFC 7641). The registration is an ordinary request
+ * with the observation's token; notifications that arrive after it has
+ * completed are matched on the token here. The path is encoded to follow the
+ * Observe option.
+ */
+struct coap_observation
+{
+  bool in_use;
+  bool have_seq;
+  int handle;
+  // Handle of the outstanding registration or -1
+  int request;
+  uint8_t token[COAP_TOKEN_MAX_LEN];
+  uint32_t seq;
+  uint32_t seq_time;
+  uint32_t reregister_at;
+  coap_response_callback_t callback;
+  void *user_data;
+  struct coap_encoded_path path;
+};
+static struct coap_observation observations[CONFIG_SPAN_COAP_MAX_OBSERVATIONS];
+static int next_observation_handle;
+
+/*
+ * Copy pre-encoded URI-Path options into the request. The path must have
+ * been encoded for the option in front of it (none, or Observe); the
+ * packet's option bookkeeping is updated so later options get the right
+ * delta.
+ */
+static int append_paths(struct coap_packet *request,
+                        const struct coap_encoded_path *path)
+{
+  if (path->len == 0)
+  {
+    return 0;
+  }
+  if (request->offset + path->len > request->max_len)
+  {
+    LOG_ERR("Unable add path to request");
+    return -ENOMEM;
+  }
+  memcpy(&request->data[request->offset], path->data, path->len);
+  request->offset += path->len;
+  request->opt_len += path->len;
+  request->delta = COAP_OPTION_URI_PATH;
   return 0;
 }
 
-static int append_paths(struct coap_packet *request, const char *path)
+int coap_register_path(const char *path)
 {
-  char tmp[32];
-  char *p = (char *)path;
-  char *start = p;
-  int r;
-  size_t len;
-  while (*p)
+  int ret;
+  k_mutex_lock(&client_lock, K_FOREVER);
+  if (num_paths >= CONFIG_SPAN_COAP_PATH_CACHE_SIZE)
   {
-    if (*p == '/')
-    {
-      len = (p - start);
-      memset(tmp, 0, 32);
-      strncpy(tmp, start, len);
-      r = coap_packet_append_option(request, COAP_OPTION_URI_PATH, tmp, len);
-      if (r < 0)
-      {
-        LOG_ERR("Unable add option to request: %d", r);
-        return -ENOMEM;
-      }
-      start = p + 1;
-    }
-    p++;
+    LOG_ERR("Can't register %s, path cache is full", log_strdup(path));
+    ret = -ENOMEM;
   }
-  if (start < p)
+  else
   {
-    r = coap_packet_append_option(request, COAP_OPTION_URI_PATH, start,
-                                  strlen(start));
-    if (r < 0)
+    ret = coap_encode_path(&paths[num_paths], path, 0);
+    if (ret == 0)
     {
-      LOG_ERR("Unable add option to request: %d", r);
-      return -ENOMEM;
+      ret = num_paths++;
     }
   }
-  return 0;
+  k_mutex_unlock(&client_lock);
+  return ret;
 }
 
-int coap_send_message(const uint8_t method, const char *path,
-                      const uint8_t *buffer, size_t len)
+/*
+ * Milliseconds until the deadline, 0 if it has passed.
+ */
+static int time_left(uint32_t deadline)
+{
+  int32_t left = (int32_t)(deadline - k_uptime_get_32());
+  return (left > 0) ? left : 0;
+}
+
+/*
+ * Build a request into the request's own buffer. If block2 is set the Block2
+ * and Size2 options are added. If observe isn't negative the Observe option
+ * is added; the path must then be encoded to follow it.
+ */
+static int build_request(struct coap_request *req, uint8_t method,
+                         const struct coap_encoded_path *path,
+                         const uint8_t *buffer, size_t len,
+                         struct coap_block_context *block2, int observe)
 {
   struct coap_packet request;
   int r;
 
-  memset(coap_data_buffer, 0, MAX_COAP_MSG_LEN);
-
-  r = coap_packet_init(&request, coap_data_buffer, MAX_COAP_MSG_LEN,
-                       COAP_VERSION_1, COAP_TYPE_CON, COAP_TOKEN_MAX_LEN,
-                       coap_next_token(), method, coap_next_id());
+  r = coap_packet_init(&request, req->data, MAX_COAP_MSG_LEN, COAP_VERSION_1,
+                       req->type, COAP_TOKEN_MAX_LEN, req->token, method,
+                       req->id);
   if (r < 0)
   {
     LOG_ERR("Failed to init CoAP message: %d", r);
     return -ENOMEM;
   }
 
+  if (observe >= 0)
+  {
+    r = coap_append_option_int(&request, COAP_OPTION_OBSERVE, observe);
+    if (r < 0)
+    {
+      LOG_ERR("Unable to add observe option: %d", r);
+      return r;
+    }
+  }
+
   r = append_paths(&request, path);
   if (r < 0)
   {
     return -ENOMEM;
   }
 
+  if (block2)
+  {
+    r = coap_append_block2_option(&request, block2);
+    if (r < 0)
+    {
+      LOG_ERR("Unable to add block2 option: %d", r);
+      return r;
+    }
+    // Ask for the total size so a window doesn't run past the last block,
+    // also when a transfer is resumed part way
+    r = coap_append_option_int(&request, COAP_OPTION_SIZE2, 0);
+    if (r < 0)
+    {
+      LOG_ERR("Unable to add size2 option: %d", r);
+      return r;
+    }
+  }
+
+  if (req->type == COAP_TYPE_NON)
+  {
+    r = coap_append_option_int(&request, OPTION_NO_RESPONSE,
+                               NO_RESPONSE_SUCCESS);
+    if (r < 0)
+    {
+      LOG_ERR("Unable to add no-response option: %d", r);
+      return r;
+    }
+  }
+
   switch (method)
   {
   case COAP_METHOD_POST:
@@ -210,146 +516,1413 @@ int coap_send_message(const uint8_t method, const char *path,
     // Can't handle other methods
     return -EINVAL;
   }
+  req->len = request.offset;
+  return 0;
+}
+
+/*
+ * Send a request and add it to the request table. A new token is used unless
+ * one is given.
+ */
+static int submit_request(uint8_t method, const struct coap_encoded_path *path,
+                          const uint8_t *buffer, size_t len,
+                          struct coap_block_context *block2,
+                          const uint8_t *token, int observe,
+                          coap_response_callback_t callback, void *user_data)
+{
+  if (!callback)
+  {
+    return -EINVAL;
+  }
+  if (!client_running)
+  {
+    return -ENOTCONN;
+  }
+
+  k_mutex_lock(&client_lock, K_FOREVER);
+  struct coap_request *req = NULL;
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    if (!requests[i].in_use)
+    {
+      req = &requests[i];
+      break;
+    }
+  }
+  if (!req)
+  {
+    k_mutex_unlock(&client_lock);
+    return -EAGAIN;
+  }
+
+  req->data = coap_pool_alloc();
+  if (!req->data)
+  {
+    k_mutex_unlock(&client_lock);
+    return -EAGAIN;
+  }
 
-  r = send(sock, request.data, request.offset, 0);
+  req->type = COAP_TYPE_CON;
+  req->id = coap_next_id();
+  memcpy(req->token, token ? token : coap_next_token(), COAP_TOKEN_MAX_LEN);
+  int r = build_request(req, method, path, buffer, len, block2, observe);
   if (r < 0)
   {
-    LOG_ERR("Error calling send(): %d", errno);
-    return -errno;
+    coap_pool_free(req->data);
+    k_mutex_unlock(&client_lock);
+    return r;
   }
-  return 0;
+
+  r = send(sock, req->data, req->len, 0);
+  if (r < 0 && session_lost(errno) && reconnect() == 0)
+  {
+    r = send(sock, req->data, req->len, 0);
+  }
+  if (r < 0)
+  {
+    int err = errno;
+    LOG_ERR("Error calling send(): %d", err);
+    coap_pool_free(req->data);
+    k_mutex_unlock(&client_lock);
+    return -err;
+  }
+  if (metrics.requests == 0)
+  {
+    metrics.first_request_ms = k_uptime_get_32();
+  }
+  metrics.requests++;
+  metrics.bytes_out += req->len;
+  net_sched_link_active();
+
+  next_handle = (next_handle + 1) & 0x7FFFFFFF;
+  req->handle = next_handle;
+  req->in_use = true;
+  req->acked = false;
+  req->retries = 0;
+  req->callback = callback;
+  req->user_data = user_data;
+  req->sent_at = k_uptime_get_32();
+  req->timeout = coap_rtt_timeout(peer_rtt);
+  req->deadline = req->sent_at + req->timeout;
+  // The receive thread may complete the request and reuse the slot as soon
+  // as the lock is released
+  int handle = req->handle;
+  k_mutex_unlock(&client_lock);
+  return handle;
 }
 
-static void wait_for_data(void)
+int coap_submit_request(const uint8_t method, const char *path,
+                        const uint8_t *buffer, size_t len,
+                        coap_response_callback_t callback, void *user_data)
 {
-  if (poll(fds, nfds, -1) < 0)
+  struct coap_encoded_path encoded;
+  int r = coap_encode_path(&encoded, path, 0);
+  if (r < 0)
   {
-    LOG_ERR("Error in poll:%d", errno);
+    return r;
   }
+  return submit_request(method, &encoded, buffer, len, NULL, NULL, -1,
+                        callback, user_data);
 }
 
-int coap_read_message(uint8_t *code, uint8_t *buffer, size_t *len)
+int coap_submit_request_to(int path, const uint8_t method,
+                           const uint8_t *buffer, size_t len,
+                           coap_response_callback_t callback, void *user_data)
 {
-  memset(coap_data_buffer, 0, MAX_COAP_MSG_LEN);
-  wait_for_data();
-
-  int rcvd = recv(sock, coap_data_buffer, MAX_COAP_MSG_LEN, MSG_DONTWAIT);
-  if (rcvd == 0)
+  if (path < 0 || path >= num_paths)
   {
-    *len = 0;
-    LOG_DBG("No data in recv=%d", rcvd);
-    return -EIO;
+    return -EINVAL;
   }
+  return submit_request(method, &paths[path], buffer, len, NULL, NULL, -1,
+                        callback, user_data);
+}
 
-  if (rcvd < 0)
+int coap_cancel_request(int handle)
+{
+  int ret = -ENOENT;
+  k_mutex_lock(&client_lock, K_FOREVER);
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
   {
-    LOG_ERR("Error reading data: %d", errno);
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    if (requests[i].in_use && requests[i].handle == handle)
     {
-      *len = 0;
-      return 0;
+      requests[i].in_use = false;
+      coap_pool_free(requests[i].data);
+      ret = 0;
+      break;
     }
-    return -errno;
   }
-  struct coap_packet reply;
-  int ret = coap_packet_parse(&reply, coap_data_buffer, rcvd, NULL, 0);
-  if (ret < 0)
+  k_mutex_unlock(&client_lock);
+  return ret;
+}
+
+static void probe_callback(int result, const struct coap_packet *reply,
+                           void *user_data)
+{
+  if (result < 0)
   {
-    LOG_ERR("Invalid CoAP packet returned: %d", ret);
-    *len = 0;
-    return 0;
+    LOG_DBG("Probe failed: %d", result);
   }
-  *len = rcvd - reply.offset;
-  *code = coap_header_get_code(&reply);
-  memcpy(buffer, reply.data + reply.offset, *len);
-  return *len;
 }
 
-int coap_blockwise_transfer(const char *path, blockwise_callback_t callback)
+/*
+ * Feed the outcome of a probe into the loss estimate: every retransmission
+ * means a lost request (or ACK) and so does the last transmission if it
+ * timed out. Must be called with the lock held.
+ */
+static void probe_done(const struct coap_request *req, int result)
 {
-  if (!callback)
+  if (result != 0 && result != -ETIMEDOUT && result != -ECONNRESET)
   {
-    LOG_ERR("Can't do request to %s. Callback function is null",
-            log_strdup(path));
-    return -ENODATA;
+    // Cancelled, says nothing about the network
+    return;
   }
-  struct coap_packet request;
-  struct coap_packet reply;
-  int r;
-  struct coap_block_context blk_ctx;
+  int sent = req->retries + 1;
+  int lost = req->retries + (result == -ETIMEDOUT ? 1 : 0);
+  for (int i = 0; i < sent; i++)
+  {
+    fast.loss -= fast.loss >> LOSS_GAIN_SHIFT;
+    if (i < lost)
+    {
+      fast.loss += 1000 >> LOSS_GAIN_SHIFT;
+    }
+  }
+  metrics.loss_permille = fast.loss;
 
-  coap_block_transfer_init(&blk_ctx, COAP_BLOCK_256,
-                           BLOCK_WISE_TRANSFER_SIZE_GET);
+  uint32_t threshold = CONFIG_SPAN_COAP_NON_LOSS_THRESHOLD * 10;
+  if (!fast.all_con && fast.loss > threshold)
+  {
+    LOG_WRN("Loss is %d.%d%%, sending every message confirmable",
+            fast.loss / 10, fast.loss % 10);
+    fast.all_con = true;
+    metrics.fallbacks++;
+  }
+  else if (fast.all_con && fast.loss < threshold / 2)
+  {
+    LOG_INF("Loss is %d.%d%%, back to the non-confirmable fast path",
+            fast.loss / 10, fast.loss % 10);
+    fast.all_con = false;
+  }
+}
 
-  bool last_block = false;
-  size_t total_size = 0;
-  while (!last_block)
+/*
+ * Remove the request from the table and invoke its callback. Must be called
+ * with the lock held.
+ */
+static void complete_request(struct coap_request *req, int result,
+                             const struct coap_packet *reply)
+{
+  if (req->callback == probe_callback)
   {
-    memset(coap_data_buffer, 0, MAX_COAP_MSG_LEN);
+    probe_done(req, result);
+  }
+  req->in_use = false;
+  coap_pool_free(req->data);
+  req->callback(result, reply, req->user_data);
+}
 
-    r = coap_packet_init(&request, coap_data_buffer, MAX_COAP_MSG_LEN,
-                         COAP_VERSION_1, COAP_TYPE_CON, COAP_TOKEN_MAX_LEN,
-                         coap_next_token(), COAP_METHOD_GET, coap_next_id());
-    if (r < 0)
+static int outstanding_probes(void)
+{
+  int n = 0;
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    if (requests[i].in_use && requests[i].callback == probe_callback)
     {
-      LOG_ERR("Failed to init CoAP message: %d", r);
-      return -ENOMEM;
+      n++;
     }
+  }
+  return n;
+}
 
-    r = append_paths(&request, path);
-    if (r < 0)
-    {
-      return -ENOMEM;
-    }
+/*
+ * Build a NON message and send it if the PROBING_RATE bucket has room for
+ * it. Must be called with the lock held.
+ */
+static int send_non(uint8_t method, const struct coap_encoded_path *path,
+                    const uint8_t *buffer, size_t len)
+{
+  struct coap_request msg = {.type = COAP_TYPE_NON};
+  msg.data = coap_pool_alloc();
+  if (!msg.data)
+  {
+    return -EAGAIN;
+  }
+  msg.id = coap_next_id();
+  memcpy(msg.token, coap_next_token(), COAP_TOKEN_MAX_LEN);
+  int r = build_request(&msg, method, path, buffer, len, NULL, -1);
+  if (r < 0)
+  {
+    coap_pool_free(msg.data);
+    return r;
+  }
 
-    r = coap_append_block2_option(&request, &blk_ctx);
-    if (r < 0)
-    {
-      LOG_ERR("Unable to add block2 option: %d", r);
-      return r;
-    }
-    r = send(sock, request.data, request.offset, 0);
-    if (r < 0)
+  // The bucket holds at most one full message
+  uint32_t now = k_uptime_get_32();
+  uint32_t capacity = MAX_COAP_MSG_LEN * 1000;
+  uint32_t elapsed = now - fast.refilled_at;
+  if (fast.refilled_at == 0 ||
+      elapsed >= capacity / CONFIG_SPAN_COAP_PROBING_RATE)
+  {
+    fast.credit = capacity;
+  }
+  else
+  {
+    fast.credit =
+        MIN(capacity, fast.credit + elapsed * CONFIG_SPAN_COAP_PROBING_RATE);
+  }
+  fast.refilled_at = now;
+  if (fast.credit < msg.len * 1000)
+  {
+    coap_pool_free(msg.data);
+    metrics.throttled++;
+    return -EAGAIN;
+  }
+
+  r = send(sock, msg.data, msg.len, 0);
+  if (r < 0 && session_lost(errno) && reconnect() == 0)
+  {
+    r = send(sock, msg.data, msg.len, 0);
+  }
+  int err = errno;
+  coap_pool_free(msg.data);
+  if (r < 0)
+  {
+    LOG_ERR("Error calling send(): %d", err);
+    return -err;
+  }
+  fast.credit -= msg.len * 1000;
+  metrics.non_sent++;
+  metrics.bytes_out += msg.len;
+  net_sched_link_active();
+  return 0;
+}
+
+int coap_send_fast(int path, const uint8_t method, const uint8_t *buffer,
+                   size_t len)
+{
+  if (path < 0 || path >= num_paths)
+  {
+    return -EINVAL;
+  }
+  if (!client_running)
+  {
+    return -ENOTCONN;
+  }
+
+  k_mutex_lock(&client_lock, K_FOREVER);
+  int r;
+  bool probe = fast.all_con ||
+               fast.since_probe + 1 >= CONFIG_SPAN_COAP_NON_PROBE_INTERVAL;
+  if (probe && outstanding_probes() < CONFIG_SPAN_COAP_NSTART)
+  {
+    r = submit_request(method, &paths[path], buffer, len, NULL, NULL, -1,
+                       probe_callback, NULL);
+    if (r >= 0)
     {
-      LOG_ERR("Error sending request: %d", r);
-      return r;
+      fast.since_probe = 0;
+      metrics.probes++;
+      r = 0;
     }
-    // Wait for response
-    wait_for_data();
-    int rcvd = recv(sock, coap_data_buffer, MAX_COAP_MSG_LEN, MSG_DONTWAIT);
-    if (rcvd == 0)
+  }
+  else if (fast.all_con)
+  {
+    // Every message must be confirmable and NSTART is used up
+    metrics.throttled++;
+    r = -EAGAIN;
+  }
+  else
+  {
+    // A probe that has to wait for NSTART goes with the next message
+    r = send_non(method, &paths[path], buffer, len);
+    if (r == 0)
     {
-      // End of file
-      LOG_ERR("No data received from server: %d", rcvd);
-      return -EIO;
+      fast.since_probe++;
     }
-    if (rcvd < 0)
+  }
+  k_mutex_unlock(&client_lock);
+  return r;
+}
+
+/*
+ * Keep the receive buffer of the reply being dispatched. Called from a
+ * completion callback; the buffer must be returned with coap_pool_free().
+ */
+static uint8_t *retain_reply(const struct coap_packet *reply)
+{
+  rx_retained = true;
+  return reply->data;
+}
+
+static void complete_all_requests(int result)
+{
+  k_mutex_lock(&client_lock, K_FOREVER);
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    if (requests[i].in_use)
     {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
-      {
-        return 0;
-      }
-      return -errno;
+      complete_request(&requests[i], result, NULL);
     }
+  }
+  k_mutex_unlock(&client_lock);
+}
 
-    r = coap_packet_parse(&reply, coap_data_buffer, rcvd, NULL, 0);
-    if (r < 0)
+/*
+ * Acknowledge (COAP_TYPE_ACK) or reject (COAP_TYPE_RESET) a confirmable
+ * message from the server.
+ */
+static void send_empty(uint8_t type, uint16_t id)
+{
+  struct coap_packet ack;
+  uint8_t ack_buffer[4];
+
+  if (coap_packet_init(&ack, ack_buffer, sizeof(ack_buffer), COAP_VERSION_1,
+                       type, 0, NULL, COAP_CODE_EMPTY, id) < 0)
+  {
+    return;
+  }
+  if (send(sock, ack.data, ack.offset, 0) < 0)
+  {
+    LOG_ERR("Error sending empty message: %d", errno);
+    return;
+  }
+  metrics.bytes_out += ack.offset;
+  net_sched_link_active();
+}
+
+/*
+ * Time until the first retransmission timer expires. Must be called with the
+ * lock held.
+ */
+static int next_timeout(void)
+{
+  int timeout = MAX_POLL_INTERVAL_MS;
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    if (requests[i].in_use)
     {
-      LOG_ERR("Invalid CoAP packet received: %d", r);
-      return r;
+      timeout = MIN(timeout, time_left(requests[i].deadline));
     }
-    r = coap_update_from_block(&reply, &blk_ctx);
+  }
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_OBSERVATIONS; i++)
+  {
+    if (observations[i].in_use && observations[i].request < 0)
+    {
+      timeout = MIN(timeout, time_left(observations[i].reregister_at));
+    }
+  }
+  return timeout;
+}
 
-    size_t len = rcvd - reply.hdr_len - reply.opt_len;
-    total_size += len;
-    last_block = (coap_next_block(&reply, &blk_ctx) == 0);
-    r = callback(last_block, total_size - len, coap_data_buffer + reply.offset,
-                 len);
-    if (r != 0)
+/*
+ * Retransmit the requests whose timers have expired with a backed off
+ * timeout. Requests that have reached MAX_RETRANSMIT (or were acked but
+ * never answered) fail with -ETIMEDOUT. Must be called with the lock held.
+ */
+static void retransmit_requests(void)
+{
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    struct coap_request *req = &requests[i];
+    if (!req->in_use || time_left(req->deadline) > 0)
     {
-      LOG_INF("Aborting blockwise transfer. Return value = %d", r);
-      return r;
+      continue;
+    }
+    if (req->acked || req->retries >= CONFIG_SPAN_COAP_MAX_RETRANSMIT)
+    {
+      LOG_ERR("No response to request %d after %d retransmissions", req->id,
+              req->retries);
+      metrics.timeouts++;
+      complete_request(req, -ETIMEDOUT, NULL);
+      continue;
+    }
+    req->retries++;
+    req->timeout = coap_rtt_backoff(peer_rtt, req->timeout);
+    req->deadline = k_uptime_get_32() + req->timeout;
+    LOG_DBG("Retransmitting request %d (%d), next timeout in %d ms", req->id,
+            req->retries, req->timeout);
+    if (send(sock, req->data, req->len, 0) < 0)
+    {
+      LOG_ERR("Error calling send(): %d", errno);
+      continue;
+    }
+    metrics.retransmits++;
+    metrics.bytes_out += req->len;
+    net_sched_link_active();
+  }
+}
+
+static struct coap_request *find_request_by_id(uint16_t id)
+{
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    if (requests[i].in_use && requests[i].id == id)
+    {
+      return &requests[i];
+    }
+  }
+  return NULL;
+}
+
+static struct coap_request *find_request_by_token(const uint8_t *token,
+                                                  uint8_t tkl)
+{
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_REQUESTS; i++)
+  {
+    if (requests[i].in_use && tkl == COAP_TOKEN_MAX_LEN &&
+        memcmp(requests[i].token, token, tkl) == 0)
+    {
+      return &requests[i];
+    }
+  }
+  return NULL;
+}
+
+static struct coap_observation *find_observation_by_token(
+    const uint8_t *token, uint8_t tkl)
+{
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_OBSERVATIONS; i++)
+  {
+    if (observations[i].in_use && tkl == COAP_TOKEN_MAX_LEN &&
+        memcmp(observations[i].token, token, tkl) == 0)
+    {
+      return &observations[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Check if a notification is newer than the last one (RFC 7641 section 3.4).
+ * Sequence numbers are 24 bits and wrap.
+ */
+static bool notification_is_fresh(const struct coap_observation *obs,
+                                  uint32_t seq)
+{
+  if (!obs->have_seq)
+  {
+    return true;
+  }
+  uint32_t v1 = obs->seq;
+  uint32_t v2 = seq;
+  return (v1 < v2 && v2 - v1 < (1 << 23)) ||
+         (v1 > v2 && v1 - v2 > (1 << 23)) ||
+         (k_uptime_get_32() - obs->seq_time > OBSERVE_FRESHNESS_MS);
+}
+
+/*
+ * Hand a notification (or the response to a registration) to the
+ * observer. Stale and reordered notifications are dropped. Must be called
+ * with the lock held.
+ */
+static void process_notification(struct coap_observation *obs,
+                                 const struct coap_packet *reply)
+{
+  int seq = coap_get_option_int(reply, COAP_OPTION_OBSERVE);
+  if (seq < 0)
+  {
+    // The server didn't register us (or has removed the observation).
+    // Try again later.
+    LOG_WRN("Observation %d was not accepted: code %d", obs->handle,
+            coap_header_get_code(reply));
+    obs->have_seq = false;
+    obs->reregister_at = k_uptime_get_32() + OBSERVE_REREGISTER_MS;
+    obs->callback(0, reply, obs->user_data);
+    return;
+  }
+  if (!notification_is_fresh(obs, seq))
+  {
+    LOG_DBG("Dropping stale notification %d for observation %d", seq,
+            obs->handle);
+    return;
+  }
+  obs->have_seq = true;
+  obs->seq = seq;
+  obs->seq_time = k_uptime_get_32();
+  obs->callback(0, reply, obs->user_data);
+}
+
+/*
+ * Completion of a registration request. A failed registration is retried
+ * after the re-registration interval; a cancelled one (the client was
+ * stopped) as soon as the client is running again.
+ */
+static void observe_callback(int result, const struct coap_packet *reply,
+                             void *user_data)
+{
+  struct coap_observation *obs = (struct coap_observation *)user_data;
+
+  obs->request = -1;
+  obs->reregister_at = k_uptime_get_32() + OBSERVE_REREGISTER_MS;
+  if (result < 0)
+  {
+    if (result == -ECANCELED)
+    {
+      obs->reregister_at = k_uptime_get_32();
+    }
+    obs->callback(result, NULL, obs->user_data);
+    return;
+  }
+  process_notification(obs, reply);
+}
+
+/*
+ * Send (or resend) the registration. Must be called with the lock held.
+ */
+static int register_observation(struct coap_observation *obs)
+{
+  int r = submit_request(COAP_METHOD_GET, &obs->path, NULL, 0, NULL,
+                         obs->token, 0, observe_callback, obs);
+  if (r < 0)
+  {
+    return r;
+  }
+  obs->request = r;
+  return 0;
+}
+
+/*
+ * Re-register observations whose interval has passed. NAT bindings time
+ * out if nothing goes from the device to the server, and notifications
+ * stop arriving. Must be called with the lock held.
+ */
+static void refresh_observations(void)
+{
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_OBSERVATIONS; i++)
+  {
+    struct coap_observation *obs = &observations[i];
+    if (obs->in_use && obs->request < 0 && time_left(obs->reregister_at) == 0)
+    {
+      LOG_DBG("Re-registering observation %d", obs->handle);
+      if (register_observation(obs) < 0)
+      {
+        // No free request. Try again on the next poll.
+        obs->reregister_at = k_uptime_get_32() + MAX_POLL_INTERVAL_MS;
+      }
+    }
+  }
+}
+
+int coap_observe(const char *path, coap_response_callback_t callback,
+                 void *user_data)
+{
+  if (!callback)
+  {
+    return -EINVAL;
+  }
+  k_mutex_lock(&client_lock, K_FOREVER);
+  struct coap_observation *obs = NULL;
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_OBSERVATIONS; i++)
+  {
+    if (!observations[i].in_use)
+    {
+      obs = &observations[i];
+      break;
     }
   }
+  if (!obs)
+  {
+    k_mutex_unlock(&client_lock);
+    return -ENOMEM;
+  }
+  int r = coap_encode_path(&obs->path, path, COAP_OPTION_OBSERVE);
+  if (r < 0)
+  {
+    k_mutex_unlock(&client_lock);
+    return r;
+  }
+  memcpy(obs->token, coap_next_token(), COAP_TOKEN_MAX_LEN);
+  obs->have_seq = false;
+  obs->callback = callback;
+  obs->user_data = user_data;
+  r = register_observation(obs);
+  if (r < 0)
+  {
+    k_mutex_unlock(&client_lock);
+    return r;
+  }
+  next_observation_handle = (next_observation_handle + 1) & 0x7FFFFFFF;
+  obs->handle = next_observation_handle;
+  obs->in_use = true;
+  k_mutex_unlock(&client_lock);
+  return obs->handle;
+}
+
+static void deregister_callback(int result, const struct coap_packet *reply,
+                                void *user_data)
+{
+}
+
+int coap_observe_cancel(int handle)
+{
+  int ret = -ENOENT;
+  k_mutex_lock(&client_lock, K_FOREVER);
+  for (int i = 0; i < CONFIG_SPAN_COAP_MAX_OBSERVATIONS; i++)
+  {
+    struct coap_observation *obs = &observations[i];
+    if (obs->in_use && obs->handle == handle)
+    {
+      if (obs->request >= 0)
+      {
+        coap_cancel_request(obs->request);
+      }
+      obs->in_use = false;
+      // Tell the server to stop sending notifications. If this doesn't get
+      // through the next notification is rejected instead.
+      submit_request(COAP_METHOD_GET, &obs->path, NULL, 0, NULL, obs->token,
+                     1, deregister_callback, NULL);
+      ret = 0;
+      break;
+    }
+  }
+  k_mutex_unlock(&client_lock);
+  return ret;
+}
+
+/*
+ * Match a reply with the outstanding requests. ACK and RST messages are
+ * matched on message ID, responses on token. Notifications are matched on
+ * the token of an observation. Must be called with the lock held.
+ */
+static void dispatch_reply(const struct coap_packet *reply)
+{
+  uint8_t token[COAP_TOKEN_MAX_LEN];
+  uint8_t type = coap_header_get_type(reply);
+  uint16_t id = coap_header_get_id(reply);
+
+  if (type == COAP_TYPE_ACK || type == COAP_TYPE_RESET)
+  {
+    struct coap_request *req = find_request_by_id(id);
+    if (!req)
+    {
+      LOG_DBG("Dropping reply %d that doesn't match any request", id);
+      return;
+    }
+    if (type == COAP_TYPE_RESET)
+    {
+      LOG_ERR("Request %d was rejected by the server", id);
+      metrics.resets++;
+      complete_request(req, -ECONNRESET, NULL);
+      return;
+    }
+    if (!req->acked)
+    {
+      uint32_t rtt = k_uptime_get_32() - req->sent_at;
+      coap_rtt_sample(peer_rtt, rtt, req->retries);
+      count_rtt(rtt);
+    }
+    if (coap_header_get_code(reply) == COAP_CODE_EMPTY)
+    {
+      // The response will follow separately. Stop retransmitting but
+      // don't wait longer than the exchange lifetime.
+      req->acked = true;
+      req->deadline = req->sent_at + EXCHANGE_TIMEOUT_MS;
+      return;
+    }
+  }
+
+  uint8_t tkl = coap_header_get_token(reply, token);
+  struct coap_request *req = find_request_by_token(token, tkl);
+  if (req && (type != COAP_TYPE_ACK || req->id == id))
+  {
+    if (type == COAP_TYPE_CON)
+    {
+      send_empty(COAP_TYPE_ACK, id);
+    }
+    metrics.responses++;
+    complete_request(req, 0, reply);
+    return;
+  }
+  struct coap_observation *obs = find_observation_by_token(token, tkl);
+  if (obs && type != COAP_TYPE_ACK)
+  {
+    if (type == COAP_TYPE_CON)
+    {
+      send_empty(COAP_TYPE_ACK, id);
+    }
+    metrics.notifications++;
+    process_notification(obs, reply);
+    return;
+  }
+  LOG_DBG("Dropping reply %d with unknown token", id);
+  if (type == COAP_TYPE_CON)
+  {
+    // Rejecting a notification for an observation we have forgotten about
+    // makes the server remove it (RFC 7641 section 3.6)
+    send_empty(COAP_TYPE_RESET, id);
+  }
+}
+
+/*
+ * The receive thread owns the socket while the client is running. It
+ * dispatches replies to the outstanding requests and drives the
+ * retransmission timers.
+ */
+static void receive_thread(void *p1, void *p2, void *p3)
+{
+  struct coap_packet reply;
+
+  while (true)
+  {
+    k_sem_take(&client_started, K_FOREVER);
+    while (client_running)
+    {
+      k_mutex_lock(&client_lock, K_FOREVER);
+      int timeout = next_timeout();
+      k_mutex_unlock(&client_lock);
+
+      int ret = poll(fds, nfds, timeout);
+      if (ret < 0)
+      {
+        LOG_ERR("Error in poll:%d", errno);
+        k_sleep(K_MSEC(MAX_POLL_INTERVAL_MS));
+        continue;
+      }
+
+      k_mutex_lock(&client_lock, K_FOREVER);
+      if (ret > 0 && !rx_buffer)
+      {
+        rx_buffer = coap_pool_alloc();
+      }
+      if (ret > 0 && !rx_buffer)
+      {
+        // Every buffer is in use. Leave the datagram in the socket until
+        // one is released.
+        LOG_DBG("No free receive buffer");
+        k_mutex_unlock(&client_lock);
+        k_sleep(K_MSEC(MAX_POLL_INTERVAL_MS));
+        k_mutex_lock(&client_lock, K_FOREVER);
+      }
+      else if (ret > 0)
+      {
+        uint32_t start = k_cycle_get_32();
+        int rcvd = recv(sock, rx_buffer, MAX_COAP_MSG_LEN, MSG_DONTWAIT);
+        if (rcvd < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          LOG_ERR("Error reading data: %d", errno);
+        }
+        if ((rcvd == 0 && transport_is_secure(transport)) ||
+            (rcvd < 0 && session_lost(errno)))
+        {
+          // The server closed the session. Outstanding requests are
+          // retransmitted on the new one.
+          reconnect();
+        }
+        if (rcvd > 0)
+        {
+          metrics.bytes_in += rcvd;
+          net_sched_link_active();
+          ret = coap_packet_parse(&reply, rx_buffer, rcvd, NULL, 0);
+          if (ret < 0)
+          {
+            LOG_ERR("Invalid CoAP packet returned: %d", ret);
+          }
+          else
+          {
+            rx_retained = false;
+            dispatch_reply(&reply);
+            if (rx_retained)
+            {
+              // A callback kept the buffer. Get a new one next time.
+              rx_buffer = NULL;
+            }
+          }
+          metrics.rx_datagrams++;
+          metrics.rx_cycles += k_cycle_get_32() - start;
+        }
+      }
+      retransmit_requests();
+      refresh_observations();
+      k_mutex_unlock(&client_lock);
+    }
+    coap_pool_free(rx_buffer);
+    rx_buffer = NULL;
+    k_sem_give(&client_stopped);
+  }
+}
+
+/*
+ * The synchronous API is a single request on top of the asynchronous one.
+ * The receive buffer with the response is kept until the caller releases it.
+ */
+static K_SEM_DEFINE(sync_sem, 0, 1);
+static bool sync_pending;
+static struct
+{
+  int result;
+  struct coap_message_view view;
+} sync_reply;
+
+static void sync_callback(int result, const struct coap_packet *reply,
+                          void *user_data)
+{
+  struct coap_message_view *view = &sync_reply.view;
+  sync_reply.result = result;
+  view->payload = NULL;
+  view->len = 0;
+  view->buffer = NULL;
+  if (reply)
+  {
+    uint16_t len = 0;
+    view->payload = coap_packet_get_payload(reply, &len);
+    view->len = view->payload ? len : 0;
+    view->code = coap_header_get_code(reply);
+    // Hold on to the receive buffer the reply lives in
+    view->buffer = retain_reply(reply);
+  }
+  k_sem_give(&sync_sem);
+}
+
+int coap_send_message(const uint8_t method, const char *path,
+                      const uint8_t *buffer, size_t len)
+{
+  if (sync_pending)
+  {
+    LOG_ERR("Previous response hasn't been read yet");
+    return -EBUSY;
+  }
+  k_sem_reset(&sync_sem);
+  int r = coap_submit_request(method, path, buffer, len, sync_callback, NULL);
+  if (r < 0)
+  {
+    return r;
+  }
+  sync_pending = true;
   return 0;
-}
\ No newline at end of file
+}
+
+int coap_read_message_view(struct coap_message_view *view)
+{
+  if (!sync_pending)
+  {
+    LOG_ERR("No request has been sent");
+    return -EINVAL;
+  }
+  // The request always completes, either with a response, an error or when
+  // the retransmissions run out.
+  k_sem_take(&sync_sem, K_FOREVER);
+  sync_pending = false;
+  *view = sync_reply.view;
+  if (sync_reply.result < 0)
+  {
+    return sync_reply.result;
+  }
+  return view->len;
+}
+
+void coap_release_message(struct coap_message_view *view)
+{
+  coap_pool_free(view->buffer);
+  view->buffer = NULL;
+  view->payload = NULL;
+  view->len = 0;
+}
+
+int coap_read_message(uint8_t *code, uint8_t *buffer, size_t size,
+                      size_t *len)
+{
+  struct coap_message_view view;
+
+  *len = 0;
+  int r = coap_read_message_view(&view);
+  if (r < 0)
+  {
+    return r;
+  }
+  if (view.len > size)
+  {
+    LOG_ERR("Response is %d bytes, buffer is %d bytes", view.len, size);
+    coap_release_message(&view);
+    return -EMSGSIZE;
+  }
+  *code = view.code;
+  *len = view.len;
+  memcpy(buffer, view.payload, view.len);
+  coap_release_message(&view);
+  return *len;
+}
+
+/*
+ * Block2 requests in flight. Each slot tracks one asynchronous request and
+ * keeps the receive buffer of a block that arrives ahead of the one the
+ * callback is waiting for. Offsets are kept in bytes since the block size may change
+ * during the transfer.
+ */
+enum block_state
+{
+  BLOCK_FREE,
+  BLOCK_WAITING,   // request submitted
+  BLOCK_DONE,      // reply (or error) from the receive thread
+  BLOCK_RECEIVED,  // validated and waiting to be delivered in order
+  BLOCK_REJECTED,  // error reply ahead of the delivered blocks
+};
+
+struct block_slot
+{
+  enum block_state state;
+  int handle;
+  int result;
+  uint8_t code;
+  int block2;
+  int size2;
+  bool truncated;
+  bool last;
+  uint8_t etag_len;
+  uint8_t etag[COAP_ETAG_MAX_LEN];
+  enum coap_block_size block_size;
+  uint32_t offset;
+  size_t len;
+  const uint8_t *payload;
+  uint8_t *buffer;
+};
+static struct block_slot block_slots[COAP_BLOCKWISE_MAX_WINDOW];
+static K_SEM_DEFINE(block_sem, 0, COAP_BLOCKWISE_MAX_WINDOW);
+
+/*
+ * Runs on the receive thread. Stash the reply in the slot and let the
+ * transfer loop deal with it.
+ */
+static void block_callback(int result, const struct coap_packet *reply,
+                           void *user_data)
+{
+  struct block_slot *slot = (struct block_slot *)user_data;
+  slot->result = result;
+  slot->len = 0;
+  if (reply)
+  {
+    uint16_t len = 0;
+    const uint8_t *payload = coap_packet_get_payload(reply, &len);
+    slot->code = coap_header_get_code(reply);
+    slot->block2 = coap_get_option_int(reply, COAP_OPTION_BLOCK2);
+    slot->size2 = coap_get_option_int(reply, COAP_OPTION_SIZE2);
+    // A datagram that filled the buffer might have been cut short
+    slot->truncated = (reply->max_len >= MAX_COAP_MSG_LEN);
+    struct coap_option etag;
+    slot->etag_len = 0;
+    if (coap_find_options(reply, COAP_OPTION_ETAG, &etag, 1) == 1 &&
+        etag.len <= COAP_ETAG_MAX_LEN)
+    {
+      slot->etag_len = etag.len;
+      memcpy(slot->etag, etag.value, etag.len);
+    }
+    if (payload)
+    {
+      slot->buffer = retain_reply(reply);
+      slot->payload = payload;
+      slot->len = len;
+    }
+  }
+  slot->state = BLOCK_DONE;
+  k_sem_give(&block_sem);
+}
+
+static void free_slot_buffer(struct block_slot *slot)
+{
+  coap_pool_free(slot->buffer);
+  slot->buffer = NULL;
+  slot->payload = NULL;
+}
+
+static struct block_slot *find_slot_by_offset(uint32_t offset)
+{
+  for (int i = 0; i < COAP_BLOCKWISE_MAX_WINDOW; i++)
+  {
+    if (block_slots[i].state != BLOCK_FREE && block_slots[i].offset == offset)
+    {
+      return &block_slots[i];
+    }
+  }
+  return NULL;
+}
+
+static struct block_slot *free_slot(void)
+{
+  for (int i = 0; i < COAP_BLOCKWISE_MAX_WINDOW; i++)
+  {
+    if (block_slots[i].state == BLOCK_FREE)
+    {
+      return &block_slots[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Cancel every outstanding block request and drop buffered blocks, except
+ * for the slot in keep (which may be NULL). Must be called with the lock held.
+ */
+static void release_slots(struct block_slot *keep)
+{
+  for (int i = 0; i < COAP_BLOCKWISE_MAX_WINDOW; i++)
+  {
+    if (&block_slots[i] == keep)
+    {
+      continue;
+    }
+    if (block_slots[i].state == BLOCK_WAITING)
+    {
+      coap_cancel_request(block_slots[i].handle);
+    }
+    free_slot_buffer(&block_slots[i]);
+    block_slots[i].state = BLOCK_FREE;
+  }
+}
+
+static int send_block_request(const struct coap_encoded_path *path,
+                              struct block_slot *slot)
+{
+  struct coap_block_context blk_ctx;
+
+  coap_block_transfer_init(&blk_ctx, slot->block_size, 0);
+  blk_ctx.current = slot->offset;
+
+  slot->state = BLOCK_WAITING;
+  int r = submit_request(COAP_METHOD_GET, path, NULL, 0, &blk_ctx, NULL, -1,
+                         block_callback, slot);
+  if (r < 0)
+  {
+    slot->state = BLOCK_FREE;
+    return r;
+  }
+  slot->handle = r;
+  return 0;
+}
+
+/*
+ * Use a smaller block size for the rest of the session. Returns false if
+ * we're already at the smallest size.
+ */
+static bool step_down_block_size(void)
+{
+  if (block_size <= COAP_BLOCK_16)
+  {
+    return false;
+  }
+  block_size--;
+  LOG_INF("Block size reduced to %d bytes", coap_block_size_to_bytes(block_size));
+  return true;
+}
+
+/*
+ * Check a reply stashed by block_callback(). Returns 1 if the slot is ready
+ * for delivery, 0 if it isn't (or the outstanding requests were reset) and a
+ * negative value if the transfer should stop. Must be called with the lock
+ * held.
+ */
+static int process_block(const char *path, struct block_slot *slot,
+                         uint32_t deliver_offset, uint32_t *next_offset,
+                         uint32_t *total_size, int *timeouts)
+{
+  if (slot->result == -ETIMEDOUT)
+  {
+    // Retransmissions didn't help. Assume the link drops large datagrams
+    // and request everything that hasn't been delivered again with smaller
+    // blocks.
+    if (++(*timeouts) > CONFIG_SPAN_COAP_BLOCK_MAX_TIMEOUTS)
+    {
+      LOG_ERR("Timed out waiting for %s at offset %d", log_strdup(path),
+              deliver_offset);
+      return -ETIMEDOUT;
+    }
+    step_down_block_size();
+    release_slots(NULL);
+    *next_offset = deliver_offset;
+    return 0;
+  }
+  if (slot->result < 0)
+  {
+    LOG_ERR("Block request at offset %d failed: %d", slot->offset,
+            slot->result);
+    return slot->result;
+  }
+  *timeouts = 0;
+
+  if (slot->code == COAP_RESPONSE_CODE_REQUEST_TOO_LARGE || slot->truncated)
+  {
+    // The reply didn't fit (or might have been truncated)
+    if (!step_down_block_size())
+    {
+      return -EMSGSIZE;
+    }
+    release_slots(NULL);
+    *next_offset = deliver_offset;
+    return 0;
+  }
+  if (slot->code != COAP_RESPONSE_CODE_CONTENT)
+  {
+    if (slot->offset > deliver_offset && *total_size == UINT32_MAX)
+    {
+      // Without Size2 the window can run past the end of the resource and
+      // the server rejects those blocks. It is only an error if the blocks
+      // before this one don't end the resource.
+      slot->state = BLOCK_REJECTED;
+      return 0;
+    }
+    LOG_ERR("Block at offset %d of %s returned code %d", slot->offset,
+            log_strdup(path), slot->code);
+    return -EIO;
+  }
+
+  if (slot->size2 > 0)
+  {
+    *total_size = slot->size2;
+  }
+
+  // A reply without a block2 option is the entire resource
+  enum coap_block_size szx = slot->block_size;
+  if (slot->block2 >= 0)
+  {
+    szx = (enum coap_block_size)(slot->block2 & 0x07);
+  }
+  if (szx < slot->block_size)
+  {
+    // The server picked a smaller block size. The reply only covers the
+    // start of what we asked for so every other outstanding request is
+    // stale. Keep this block if it is next in line.
+    LOG_INF("Server chose %d byte blocks", coap_block_size_to_bytes(szx));
+    block_size = MIN(block_size, szx);
+    bool keep = (slot->offset == deliver_offset);
+    release_slots(keep ? slot : NULL);
+    *next_offset = deliver_offset;
+    if (!keep)
+    {
+      return 0;
+    }
+    slot->block_size = szx;
+    *next_offset += coap_block_size_to_bytes(szx);
+  }
+
+  if (slot->len > coap_block_size_to_bytes(slot->block_size))
+  {
+    LOG_ERR("Block at offset %d is %d bytes, expected at most %d",
+            slot->offset, slot->len,
+            coap_block_size_to_bytes(slot->block_size));
+    return -EMSGSIZE;
+  }
+  slot->last = (slot->block2 < 0) || !(slot->block2 & 0x08);
+  if (slot->last)
+  {
+    *total_size = slot->offset + slot->len;
+  }
+  else if (slot->len != coap_block_size_to_bytes(slot->block_size))
+  {
+    LOG_ERR("Short block (%d bytes) at offset %d", slot->len, slot->offset);
+    return -EIO;
+  }
+  slot->state = BLOCK_RECEIVED;
+  return 1;
+}
+
+/*
+ * Check that a block belongs to the same version of the resource as the
+ * blocks that were delivered before it. The first block of a transfer that
+ * starts from the beginning sets the ETag and size.
+ */
+static bool same_resource(struct coap_blockwise_state *state,
+                          const struct block_slot *slot, uint32_t total_size)
+{
+  uint32_t size = (total_size == UINT32_MAX) ? 0 : total_size;
+  if (slot->offset == 0)
+  {
+    state->etag_len = slot->etag_len;
+    memcpy(state->etag, slot->etag, slot->etag_len);
+    state->size = size;
+    return true;
+  }
+  if (slot->etag_len != state->etag_len ||
+      memcmp(slot->etag, state->etag, slot->etag_len) != 0)
+  {
+    return false;
+  }
+  if (size != 0 && state->size != 0 && size != state->size)
+  {
+    return false;
+  }
+  state->size = size;
+  return true;
+}
+
+int coap_blockwise_transfer(const char *path, blockwise_callback_t callback)
+{
+  return coap_blockwise_transfer_windowed(path, 1, callback);
+}
+
+int coap_blockwise_transfer_windowed(const char *path, uint8_t window,
+                                     blockwise_callback_t callback)
+{
+  struct coap_blockwise_state state = {0};
+  return coap_blockwise_transfer_resume(path, window, &state, callback);
+}
+
+int coap_blockwise_transfer_resume(const char *path, uint8_t window,
+                                   struct coap_blockwise_state *state,
+                                   blockwise_callback_t callback)
+{
+  if (!callback)
+  {
+    LOG_ERR("Can't do request to %s. Callback function is null",
+            log_strdup(path));
+    return -ENODATA;
+  }
+  if (window < 1 || window > COAP_BLOCKWISE_MAX_WINDOW)
+  {
+    LOG_ERR("Window size %d is out of range (1-%d)", window,
+            COAP_BLOCKWISE_MAX_WINDOW);
+    return -EINVAL;
+  }
+  // Every block goes to the same path so it is only parsed once
+  struct coap_encoded_path encoded;
+  int r = coap_encode_path(&encoded, path, 0);
+  if (r < 0)
+  {
+    return r;
+  }
+
+  memset(block_slots, 0, sizeof(block_slots));
+  k_sem_reset(&block_sem);
+
+  if (state->offset > 0)
+  {
+    // Continue with the block size that was used when the transfer stopped
+    // so the offset is on a block boundary.
+    if (state->block_size < block_size)
+    {
+      block_size = state->block_size;
+    }
+    if (state->offset % coap_block_size_to_bytes(block_size) != 0)
+    {
+      LOG_ERR("Can't resume %s at offset %d", log_strdup(path),
+              state->offset);
+      return -EINVAL;
+    }
+    LOG_INF("Resuming %s at offset %d", log_strdup(path), state->offset);
+  }
+
+  // Byte offsets: the next one to request, the next one to hand to the
+  // callback and the total size of the resource (when it is known).
+  uint32_t start_offset = state->offset;
+  uint32_t next_offset = start_offset;
+  uint32_t deliver_offset = start_offset;
+  // A resumed transfer knows the size from before, if the server sent it
+  uint32_t total_size = (state->size > 0) ? state->size : UINT32_MAX;
+  int timeouts = 0;
+
+  while (true)
+  {
+    k_mutex_lock(&client_lock, K_FOREVER);
+
+    // Only the first block is requested until its reply has told us the size
+    uint8_t limit = (deliver_offset == start_offset) ? 1 : window;
+    int outstanding = 0;
+    for (int i = 0; i < COAP_BLOCKWISE_MAX_WINDOW; i++)
+    {
+      outstanding += (block_slots[i].state != BLOCK_FREE) ? 1 : 0;
+    }
+    while (outstanding < limit && next_offset < total_size)
+    {
+      struct block_slot *slot = free_slot();
+      if (!slot)
+      {
+        break;
+      }
+      slot->offset = next_offset;
+      slot->block_size = block_size;
+      r = send_block_request(&encoded, slot);
+      if (r == -EAGAIN && outstanding > 0)
+      {
+        // All requests are in use. Try again when one of ours completes.
+        break;
+      }
+      if (r < 0)
+      {
+        goto done;
+      }
+      next_offset += coap_block_size_to_bytes(block_size);
+      outstanding++;
+    }
+    k_mutex_unlock(&client_lock);
+
+    // Wait for a reply
+    k_sem_take(&block_sem, K_FOREVER);
+
+    k_mutex_lock(&client_lock, K_FOREVER);
+    for (int i = 0; i < COAP_BLOCKWISE_MAX_WINDOW; i++)
+    {
+      if (block_slots[i].state == BLOCK_DONE &&
+          block_slots[i].offset < total_size)
+      {
+        r = process_block(path, &block_slots[i], deliver_offset, &next_offset,
+                          &total_size, &timeouts);
+        if (r < 0)
+        {
+          goto done;
+        }
+      }
+    }
+
+    // Forget about blocks past the end of the resource, whether they have
+    // been answered or not
+    for (int i = 0; i < COAP_BLOCKWISE_MAX_WINDOW; i++)
+    {
+      if (block_slots[i].state != BLOCK_FREE &&
+          block_slots[i].offset >= total_size)
+      {
+        if (block_slots[i].state == BLOCK_WAITING)
+        {
+          coap_cancel_request(block_slots[i].handle);
+        }
+        free_slot_buffer(&block_slots[i]);
+        block_slots[i].state = BLOCK_FREE;
+      }
+    }
+    k_mutex_unlock(&client_lock);
+
+    // Hand over the blocks that are next in line. Buffered slots are only
+    // touched by this thread so the lock isn't needed.
+    struct block_slot *slot;
+    while ((slot = find_slot_by_offset(deliver_offset)) &&
+           slot->state != BLOCK_WAITING && slot->state != BLOCK_DONE)
+    {
+      if (slot->state == BLOCK_REJECTED)
+      {
+        LOG_ERR("Block at offset %d of %s returned code %d", slot->offset,
+                log_strdup(path), slot->code);
+        k_mutex_lock(&client_lock, K_FOREVER);
+        r = -EIO;
+        goto done;
+      }
+      if (!same_resource(state, slot, total_size))
+      {
+        // The resource has changed since the transfer was started. The
+        // caller has to start over.
+        LOG_WRN("%s has changed, restarting transfer", log_strdup(path));
+        memset(state, 0, sizeof(*state));
+        k_mutex_lock(&client_lock, K_FOREVER);
+        r = -ESTALE;
+        goto done;
+      }
+      state->block_size = slot->block_size;
+      r = callback(slot->last, deliver_offset, (uint8_t *)slot->payload,
+                   slot->len);
+      if (r != 0)
+      {
+        LOG_INF("Aborting blockwise transfer. Return value = %d", r);
+        k_mutex_lock(&client_lock, K_FOREVER);
+        goto done;
+      }
+      free_slot_buffer(slot);
+      slot->state = BLOCK_FREE;
+      state->offset = deliver_offset + slot->len;
+      if (slot->last)
+      {
+        k_mutex_lock(&client_lock, K_FOREVER);
+        r = 0;
+        goto done;
+      }
+      deliver_offset += slot->len;
+    }
+  }
+
+done:
+  release_slots(NULL);
+  k_mutex_unlock(&client_lock);
+  return r;
+}
@@ -0,0 +1,82 @@
+#include <errno.h>
+#include <string.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#include <net/coap.h>
+
+#include "coap-path.h"
+
+LOG_MODULE_REGISTER(coap_path, LOG_LEVEL_DBG);
+
+/*
+ * Encode a single option (RFC 7252 section 3.1). Returns the number of bytes
+ * written or -ENOMEM if it doesn't fit.
+ */
+static int encode_option(uint8_t *buf, size_t size, uint16_t delta,
+                         const uint8_t *value, uint16_t len)
+{
+  uint8_t ext[4];
+  size_t ext_len = 0;
+  uint8_t nibbles[2];
+  uint16_t fields[2] = {delta, len};
+
+  for (int i = 0; i < 2; i++)
+  {
+    if (fields[i] < 13)
+    {
+      nibbles[i] = fields[i];
+    }
+    else if (fields[i] < 269)
+    {
+      nibbles[i] = 13;
+      ext[ext_len++] = fields[i] - 13;
+    }
+    else
+    {
+      nibbles[i] = 14;
+      ext[ext_len++] = (fields[i] - 269) >> 8;
+      ext[ext_len++] = (fields[i] - 269) & 0xFF;
+    }
+  }
+  if (1 + ext_len + len > size)
+  {
+    return -ENOMEM;
+  }
+  buf[0] = (nibbles[0] << 4) | nibbles[1];
+  memcpy(&buf[1], ext, ext_len);
+  memcpy(&buf[1 + ext_len], value, len);
+  return 1 + ext_len + len;
+}
+
+int coap_encode_path(struct coap_encoded_path *out, const char *path,
+                     uint16_t prev_option)
+{
+  const char *start = path;
+  const char *p = path;
+  uint16_t delta = COAP_OPTION_URI_PATH - prev_option;
+
+  out->len = 0;
+  while (true)
+  {
+    if (*p == '/' || (*p == 0 && start < p))
+    {
+      int r = encode_option(&out->data[out->len], sizeof(out->data) - out->len,
+                            delta, (const uint8_t *)start, p - start);
+      if (r < 0)
+      {
+        LOG_ERR("Path %s is too long", log_strdup(path));
+        return r;
+      }
+      out->len += r;
+      delta = 0;
+      start = p + 1;
+    }
+    if (*p == 0)
+    {
+      return 0;
+    }
+    p++;
+  }
+}
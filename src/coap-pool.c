@@ -0,0 +1,51 @@
+#include <zephyr.h>
+
+#include <logging/log.h>
+
+#include "coap-pool.h"
+
+LOG_MODULE_REGISTER(coap_pool, LOG_LEVEL_DBG);
+
+K_MEM_SLAB_DEFINE(coap_slab, ROUND_UP(COAP_POOL_BUFFER_SIZE, 4),
+                  CONFIG_SPAN_COAP_POOL_BUFFERS, 4);
+
+static atomic_t used;
+static atomic_t high_water;
+static atomic_t failures;
+
+uint8_t *coap_pool_alloc(void)
+{
+  void *buffer;
+  if (k_mem_slab_alloc(&coap_slab, &buffer, K_NO_WAIT) != 0)
+  {
+    atomic_inc(&failures);
+    return NULL;
+  }
+
+  atomic_val_t now = atomic_inc(&used) + 1;
+  atomic_val_t max = atomic_get(&high_water);
+  while (now > max && !atomic_cas(&high_water, max, now))
+  {
+    max = atomic_get(&high_water);
+  }
+  return (uint8_t *)buffer;
+}
+
+void coap_pool_free(uint8_t *buffer)
+{
+  if (!buffer)
+  {
+    return;
+  }
+  void *block = buffer;
+  k_mem_slab_free(&coap_slab, &block);
+  atomic_dec(&used);
+}
+
+void coap_pool_get_stats(struct coap_pool_stats *stats)
+{
+  stats->buffers = CONFIG_SPAN_COAP_POOL_BUFFERS;
+  stats->used = atomic_get(&used);
+  stats->high_water = atomic_get(&high_water);
+  stats->failures = atomic_get(&failures);
+}
@@ -0,0 +1,142 @@
+#include <zephyr.h>
+
+#include <logging/log.h>
+#include <random/rand32.h>
+
+#include "coap-rtt.h"
+
+LOG_MODULE_REGISTER(coap_rtt, LOG_LEVEL_DBG);
+
+// Upper bound for the RTO. Same as the longest retransmission timeout
+// permitted by RFC 7252 for the first transmission.
+#define RTO_MAX_MS 60000
+
+static struct coap_rtt peers[CONFIG_SPAN_COAP_RTT_PEERS];
+
+static void init_peer(struct coap_rtt *rtt, const struct sockaddr_in *addr)
+{
+  memset(rtt, 0, sizeof(*rtt));
+  rtt->in_use = true;
+  rtt->addr = addr->sin_addr;
+  rtt->port = addr->sin_port;
+  rtt->rto = CONFIG_SPAN_COAP_ACK_TIMEOUT_MS;
+  rtt->last_update = k_uptime_get_32();
+}
+
+struct coap_rtt *coap_rtt_lookup(const struct sockaddr_in *addr)
+{
+  // Compare ages rather than times, k_uptime_get_32() wraps after 49 days
+  uint32_t now = k_uptime_get_32();
+  struct coap_rtt *oldest = &peers[0];
+  for (int i = 0; i < CONFIG_SPAN_COAP_RTT_PEERS; i++)
+  {
+    if (!peers[i].in_use)
+    {
+      oldest = &peers[i];
+      continue;
+    }
+    if (peers[i].addr.s_addr == addr->sin_addr.s_addr &&
+        peers[i].port == addr->sin_port)
+    {
+      return &peers[i];
+    }
+    if (oldest->in_use &&
+        now - peers[i].last_update > now - oldest->last_update)
+    {
+      oldest = &peers[i];
+    }
+  }
+  init_peer(oldest, addr);
+  return oldest;
+}
+
+/*
+ * Estimates that haven't been updated in a while drift back towards the
+ * default so a stale value doesn't cause spurious retransmissions (or
+ * needlessly long waits).
+ */
+static void age_rto(struct coap_rtt *rtt)
+{
+  uint32_t idle = k_uptime_get_32() - rtt->last_update;
+  if (rtt->rto < 1000 && idle > 16 * rtt->rto)
+  {
+    rtt->rto *= 2;
+    rtt->last_update = k_uptime_get_32();
+  }
+  else if (rtt->rto > 3000 && idle > 4 * rtt->rto)
+  {
+    rtt->rto = 1000 + rtt->rto / 2;
+    rtt->last_update = k_uptime_get_32();
+  }
+}
+
+uint32_t coap_rtt_timeout(struct coap_rtt *rtt)
+{
+  age_rto(rtt);
+  // ACK_RANDOM_FACTOR is 1.5
+  return rtt->rto + (sys_rand32_get() % (rtt->rto / 2 + 1));
+}
+
+uint32_t coap_rtt_backoff(const struct coap_rtt *rtt, uint32_t timeout)
+{
+  uint32_t next;
+  if (rtt->rto < 1000)
+  {
+    next = timeout * 3;
+  }
+  else if (rtt->rto > 3000)
+  {
+    next = timeout + timeout / 2;
+  }
+  else
+  {
+    next = timeout * 2;
+  }
+  return MIN(next, RTO_MAX_MS);
+}
+
+/*
+ * RFC 6298 update with alpha = 1/8 and beta = 1/4. K is 4 for the strong
+ * estimator and 1 for the weak one.
+ */
+static void update_estimator(struct coap_rtt_estimator *est, uint32_t rtt_ms,
+                             uint32_t k)
+{
+  if (!est->valid)
+  {
+    est->srtt = rtt_ms;
+    est->rttvar = rtt_ms / 2;
+    est->valid = true;
+  }
+  else
+  {
+    uint32_t delta = (est->srtt > rtt_ms) ? (est->srtt - rtt_ms)
+                                          : (rtt_ms - est->srtt);
+    est->rttvar = (3 * est->rttvar + delta) / 4;
+    est->srtt = (7 * est->srtt + rtt_ms) / 8;
+  }
+  est->rto = MIN(est->srtt + k * est->rttvar, RTO_MAX_MS);
+}
+
+void coap_rtt_sample(struct coap_rtt *rtt, uint32_t rtt_ms,
+                     uint8_t retransmissions)
+{
+  if (retransmissions == 0)
+  {
+    update_estimator(&rtt->strong, rtt_ms, 4);
+    rtt->rto = (rtt->strong.rto + rtt->rto) / 2;
+  }
+  else if (retransmissions <= 2)
+  {
+    update_estimator(&rtt->weak, rtt_ms, 1);
+    rtt->rto = (rtt->weak.rto + 3 * rtt->rto) / 4;
+  }
+  else
+  {
+    // Too ambiguous to say which transmission the reply belongs to
+    return;
+  }
+  rtt->last_update = k_uptime_get_32();
+  LOG_DBG("RTT sample %d ms (%d retransmissions), RTO is now %d ms", rtt_ms,
+          retransmissions, rtt->rto);
+}
@@ -0,0 +1,135 @@
+#include <zephyr.h>
+
+#include <logging/log.h>
+
+#ifdef CONFIG_SPAN_FOOTPRINT
+
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+#include <mbedtls/memory_buffer_alloc.h>
+#endif
+
+#include "coap-pool.h"
+#include "footprint.h"
+
+LOG_MODULE_REGISTER(footprint, LOG_LEVEL_DBG);
+
+#define MAX_KEY_LEN 48
+
+static K_MUTEX_DEFINE(heap_lock);
+static struct footprint_heap_stats heap;
+// Handshakes in progress. The CoAP client and the uplink can both be in one.
+static int handshakes_running;
+
+/*
+ * Peak heap use since the last call. The allocator only updates its maximum
+ * when it allocates, so whatever is held right now counts as well. Must be
+ * called with the lock held.
+ */
+static uint32_t take_heap_peak(void)
+{
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+  size_t max_used, max_blocks, cur_used, cur_blocks;
+  mbedtls_memory_buffer_alloc_max_get(&max_used, &max_blocks);
+  mbedtls_memory_buffer_alloc_cur_get(&cur_used, &cur_blocks);
+  mbedtls_memory_buffer_alloc_max_reset();
+  return MAX(max_used, cur_used);
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Charge the peak since the last call to the handshakes if one was running
+ * and to the steady state otherwise. Must be called with the lock held.
+ */
+static void update_heap_locked(void)
+{
+  uint32_t peak = take_heap_peak();
+  if (handshakes_running > 0)
+  {
+    heap.handshake_peak = MAX(heap.handshake_peak, peak);
+  }
+  else
+  {
+    heap.steady_peak = MAX(heap.steady_peak, peak);
+  }
+}
+
+void footprint_handshake_begin(void)
+{
+  k_mutex_lock(&heap_lock, K_FOREVER);
+  update_heap_locked();
+  handshakes_running++;
+  heap.handshakes++;
+  k_mutex_unlock(&heap_lock);
+}
+
+void footprint_handshake_end(void)
+{
+  k_mutex_lock(&heap_lock, K_FOREVER);
+  update_heap_locked();
+  if (handshakes_running > 0)
+  {
+    handshakes_running--;
+  }
+  k_mutex_unlock(&heap_lock);
+}
+
+void footprint_get_heap_stats(struct footprint_heap_stats *stats)
+{
+  k_mutex_lock(&heap_lock, K_FOREVER);
+  update_heap_locked();
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+  heap.size = CONFIG_MBEDTLS_HEAP_SIZE;
+#endif
+  *stats = heap;
+  k_mutex_unlock(&heap_lock);
+}
+
+static void put(const char *key, uint32_t value)
+{
+  LOG_INF("footprint %s=%u", log_strdup(key), value);
+}
+
+static void report_thread(const struct k_thread *thread, void *user_data)
+{
+  size_t unused;
+  if (k_thread_stack_space_get(thread, &unused) != 0)
+  {
+    return;
+  }
+  const char *name = k_thread_name_get((k_tid_t)thread);
+  char id[12];
+  if (!name || !name[0])
+  {
+    snprintk(id, sizeof(id), "%p", thread);
+    name = id;
+  }
+
+  char key[MAX_KEY_LEN];
+  size_t size = thread->stack_info.size;
+  snprintk(key, sizeof(key), "stack.%s.used", name);
+  put(key, size - unused);
+  snprintk(key, sizeof(key), "stack.%s.size", name);
+  put(key, size);
+}
+
+void footprint_report(void)
+{
+  k_thread_foreach(report_thread, NULL);
+
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+  struct footprint_heap_stats stats;
+  footprint_get_heap_stats(&stats);
+  put("heap.mbedtls.size", stats.size);
+  put("heap.mbedtls.handshake", stats.handshake_peak);
+  put("heap.mbedtls.steady", stats.steady_peak);
+#endif
+
+  struct coap_pool_stats pool;
+  coap_pool_get_stats(&pool);
+  put("pool.coap.size", pool.buffers * ROUND_UP(COAP_POOL_BUFFER_SIZE, 4));
+  put("pool.coap.used", pool.high_water * ROUND_UP(COAP_POOL_BUFFER_SIZE, 4));
+}
+
+#endif /* CONFIG_SPAN_FOOTPRINT */
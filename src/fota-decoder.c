@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <string.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_SPAN_FOTA_SINK
+
+#include <storage/flash_map.h>
+
+#include "fota-decoder.h"
+
+LOG_MODULE_REGISTER(fota_decoder, LOG_LEVEL_DBG);
+
+#define SOURCE_SLOT_ID FLASH_AREA_ID(image_0)
+
+// Largest LEB128 encoding of a 32-bit value
+#define MAX_VARINT_SHIFT 28
+
+enum decoder_stage
+{
+  STAGE_HEADER,
+  STAGE_RAW,
+  STAGE_DATA,
+  STAGE_DONE,
+};
+
+enum heatshrink_state
+{
+  HS_TAG,
+  HS_LITERAL,
+  HS_INDEX,
+  HS_COUNT,
+};
+
+enum delta_state
+{
+  DELTA_DIFF_LEN,
+  DELTA_EXTRA_LEN,
+  DELTA_SEEK,
+  DELTA_DIFF,
+  DELTA_EXTRA,
+};
+
+static const struct flash_area *source;
+
+void fota_decoder_init(struct fota_decoder *dec)
+{
+  memset(dec, 0, sizeof(*dec));
+}
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+  return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+         ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static int parse_header(struct fota_decoder *dec, const uint8_t *buf)
+{
+  if (buf[4] != FOTA_IMAGE_VERSION)
+  {
+    LOG_ERR("Unsupported image version %d", buf[4]);
+    return -ENOTSUP;
+  }
+  dec->flags = buf[5];
+  dec->window_sz2 = buf[6];
+  dec->lookahead_sz2 = buf[7];
+  dec->image_size = get_le32(buf + 8);
+  dec->source_size = get_le32(buf + 12);
+
+  if ((dec->flags & FOTA_IMAGE_COMPRESSED) &&
+      (dec->window_sz2 < 4 ||
+       dec->window_sz2 > CONFIG_SPAN_FOTA_DECODER_WINDOW_SZ2 ||
+       dec->lookahead_sz2 < 3 || dec->lookahead_sz2 >= dec->window_sz2))
+  {
+    LOG_ERR("Unsupported window (%d) or lookahead (%d)", dec->window_sz2,
+            dec->lookahead_sz2);
+    return -ENOTSUP;
+  }
+  if (dec->flags & FOTA_IMAGE_DELTA)
+  {
+    if (!source)
+    {
+      int ret = flash_area_open(SOURCE_SLOT_ID, &source);
+      if (ret < 0)
+      {
+        LOG_ERR("Unable to open primary slot: %d", ret);
+        source = NULL;
+        return ret;
+      }
+    }
+    if (dec->source_size > source->fa_size)
+    {
+      LOG_ERR("Delta source is larger than the primary slot");
+      return -EBADMSG;
+    }
+  }
+  if (dec->image_size == 0)
+  {
+    LOG_ERR("Packed image is empty");
+    return -EBADMSG;
+  }
+  LOG_INF("Packed image: %d bytes, flags 0x%02x", dec->image_size,
+          dec->flags);
+  dec->stage = STAGE_DATA;
+  return 0;
+}
+
+static int flush_output(struct fota_decoder *dec, blockwise_callback_t output)
+{
+  if (dec->out_len == 0 && dec->stage != STAGE_DONE)
+  {
+    return 0;
+  }
+  bool last = (dec->stage == STAGE_DONE);
+  uint32_t offset = dec->offset;
+  size_t len = dec->out_len;
+  dec->offset += len;
+  dec->out_len = 0;
+  return output(last, offset, dec->out, len);
+}
+
+static int output_byte(struct fota_decoder *dec, uint8_t c,
+                       blockwise_callback_t output)
+{
+  dec->out[dec->out_len++] = c;
+  if (dec->offset + dec->out_len == dec->image_size)
+  {
+    dec->stage = STAGE_DONE;
+    return flush_output(dec, output);
+  }
+  if (dec->out_len == sizeof(dec->out))
+  {
+    return flush_output(dec, output);
+  }
+  return 0;
+}
+
+static int read_source(struct fota_decoder *dec, uint8_t *c)
+{
+  uint32_t pos = dec->source_pos++;
+  if (pos >= dec->source_size)
+  {
+    LOG_ERR("Delta reads past the end of the source image");
+    return -EBADMSG;
+  }
+  if (pos < dec->cache_offset || pos >= dec->cache_offset + dec->cache_len)
+  {
+    size_t len = MIN(sizeof(dec->cache), dec->source_size - pos);
+    int ret = flash_area_read(source, pos, dec->cache, len);
+    if (ret < 0)
+    {
+      LOG_ERR("Unable to read primary slot at offset %d: %d", pos, ret);
+      return ret;
+    }
+    dec->cache_offset = pos;
+    dec->cache_len = len;
+  }
+  *c = dec->cache[pos - dec->cache_offset];
+  return 0;
+}
+
+/*
+ * Returns 1 when a complete varint has been read into dec->varint.
+ */
+static int read_varint(struct fota_decoder *dec, uint8_t c)
+{
+  if (dec->varint_shift == 0)
+  {
+    dec->varint = 0;
+  }
+  dec->varint |= (uint32_t)(c & 0x7F) << dec->varint_shift;
+  if (c & 0x80)
+  {
+    dec->varint_shift += 7;
+    return (dec->varint_shift > MAX_VARINT_SHIFT) ? -EBADMSG : 0;
+  }
+  dec->varint_shift = 0;
+  return 1;
+}
+
+static void next_record(struct fota_decoder *dec)
+{
+  if (dec->diff_left > 0)
+  {
+    dec->delta_state = DELTA_DIFF;
+  }
+  else if (dec->extra_left > 0)
+  {
+    dec->delta_state = DELTA_EXTRA;
+  }
+  else
+  {
+    dec->source_pos += dec->seek;
+    dec->delta_state = DELTA_DIFF_LEN;
+  }
+}
+
+static int delta_byte(struct fota_decoder *dec, uint8_t c,
+                      blockwise_callback_t output)
+{
+  if (!(dec->flags & FOTA_IMAGE_DELTA))
+  {
+    return output_byte(dec, c, output);
+  }
+
+  int ret;
+  uint8_t old;
+  switch (dec->delta_state)
+  {
+  case DELTA_DIFF_LEN:
+  case DELTA_EXTRA_LEN:
+  case DELTA_SEEK:
+    ret = read_varint(dec, c);
+    if (ret <= 0)
+    {
+      return ret;
+    }
+    if (dec->delta_state == DELTA_DIFF_LEN)
+    {
+      dec->diff_left = dec->varint;
+      dec->delta_state = DELTA_EXTRA_LEN;
+    }
+    else if (dec->delta_state == DELTA_EXTRA_LEN)
+    {
+      dec->extra_left = dec->varint;
+      dec->delta_state = DELTA_SEEK;
+    }
+    else
+    {
+      dec->seek = (int32_t)(dec->varint >> 1) ^ -(int32_t)(dec->varint & 1);
+      next_record(dec);
+    }
+    return 0;
+  case DELTA_DIFF:
+    ret = read_source(dec, &old);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    dec->diff_left--;
+    next_record(dec);
+    return output_byte(dec, old + c, output);
+  case DELTA_EXTRA:
+    dec->extra_left--;
+    next_record(dec);
+    return output_byte(dec, c, output);
+  default:
+    return -EBADMSG;
+  }
+}
+
+static int emit_window_byte(struct fota_decoder *dec, uint8_t c,
+                            blockwise_callback_t output)
+{
+  dec->window[dec->head & ((1 << dec->window_sz2) - 1)] = c;
+  dec->head++;
+  return delta_byte(dec, c, output);
+}
+
+static int heatshrink_byte(struct fota_decoder *dec, uint8_t c,
+                           blockwise_callback_t output)
+{
+  if (!(dec->flags & FOTA_IMAGE_COMPRESSED))
+  {
+    return delta_byte(dec, c, output);
+  }
+
+  // Bits are read from the most significant bit
+  for (int bit = 7; bit >= 0 && dec->stage == STAGE_DATA; bit--)
+  {
+    dec->acc = (dec->acc << 1) | ((c >> bit) & 1);
+    dec->acc_bits++;
+
+    uint8_t needed = 1;
+    if (dec->hs_state == HS_LITERAL)
+    {
+      needed = 8;
+    }
+    else if (dec->hs_state == HS_INDEX)
+    {
+      needed = dec->window_sz2;
+    }
+    else if (dec->hs_state == HS_COUNT)
+    {
+      needed = dec->lookahead_sz2;
+    }
+    if (dec->acc_bits < needed)
+    {
+      continue;
+    }
+    uint16_t value = dec->acc;
+    dec->acc = 0;
+    dec->acc_bits = 0;
+
+    int ret = 0;
+    switch (dec->hs_state)
+    {
+    case HS_TAG:
+      dec->hs_state = value ? HS_LITERAL : HS_INDEX;
+      break;
+    case HS_LITERAL:
+      dec->hs_state = HS_TAG;
+      ret = emit_window_byte(dec, (uint8_t)value, output);
+      break;
+    case HS_INDEX:
+      dec->hs_index = value + 1;
+      dec->hs_state = HS_COUNT;
+      break;
+    case HS_COUNT:
+      dec->hs_state = HS_TAG;
+      // Back reference into the window. The window starts out zeroed.
+      for (int i = 0; i <= value && ret == 0 && dec->stage == STAGE_DATA; i++)
+      {
+        uint16_t mask = (1 << dec->window_sz2) - 1;
+        ret = emit_window_byte(dec, dec->window[(dec->head - dec->hs_index) &
+                                                mask],
+                               output);
+      }
+      break;
+    }
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int fota_decoder_write(struct fota_decoder *dec, bool last,
+                       const uint8_t *buffer, size_t len,
+                       blockwise_callback_t output)
+{
+  int ret;
+
+  if (dec->stage == STAGE_HEADER)
+  {
+    // Blocks are at least 16 bytes so the header is always in the first one
+    if (len >= FOTA_IMAGE_HEADER_LEN &&
+        memcmp(buffer, FOTA_IMAGE_MAGIC, strlen(FOTA_IMAGE_MAGIC)) == 0)
+    {
+      ret = parse_header(dec, buffer);
+      if (ret < 0)
+      {
+        return ret;
+      }
+      buffer += FOTA_IMAGE_HEADER_LEN;
+      len -= FOTA_IMAGE_HEADER_LEN;
+    }
+    else
+    {
+      dec->stage = STAGE_RAW;
+    }
+  }
+
+  if (dec->stage == STAGE_RAW)
+  {
+    uint32_t offset = dec->offset;
+    dec->offset += len;
+    return output(last, offset, (uint8_t *)buffer, len);
+  }
+
+  for (size_t i = 0; i < len && dec->stage == STAGE_DATA; i++)
+  {
+    ret = heatshrink_byte(dec, buffer[i], output);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  if (dec->stage == STAGE_DONE)
+  {
+    return 0;
+  }
+  if (last)
+  {
+    LOG_ERR("Image ends after %d of %d bytes",
+            dec->offset + dec->out_len, dec->image_size);
+    return -EBADMSG;
+  }
+  return flush_output(dec, output);
+}
+
+#endif
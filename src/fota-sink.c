@@ -0,0 +1,577 @@
+#include <errno.h>
+#include <string.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_SPAN_FOTA_SINK
+
+#include <dfu/mcuboot.h>
+#include <drivers/flash.h>
+#include <mbedtls/sha256.h>
+#include <storage/flash_map.h>
+#ifdef CONFIG_SPAN_FOTA_CHECKPOINT
+#include <settings/settings.h>
+#endif
+
+#include "coap-client.h"
+#include "fota-decoder.h"
+#include "fota-sink.h"
+
+LOG_MODULE_REGISTER(fota_sink, LOG_LEVEL_DBG);
+
+#define SLOT_ID FLASH_AREA_ID(image_1)
+
+/*
+ * The slot is erased when a new image is started. Data is collected in
+ * write_buf and programmed a buffer at a time so the flash driver sees
+ * large, aligned writes.
+ */
+static const struct flash_area *slot;
+static uint8_t write_buf[CONFIG_SPAN_FOTA_WRITE_BUF_SIZE] __aligned(4);
+static size_t buf_len;
+static size_t written;
+// End of the data a resumed download finds already programmed past the
+// checkpoint, in the sector the checkpoint ends in. See prepare_resume().
+static size_t verify_end;
+
+static mbedtls_sha256_context sha;
+static uint8_t digest[FOTA_SINK_DIGEST_LEN];
+static uint8_t expected[FOTA_SINK_DIGEST_LEN];
+static bool check_digest;
+static bool active;
+static bool complete;
+
+// Decoder for packed images in fota_sink_download()
+static struct fota_decoder decoder;
+
+static int open_slot(void)
+{
+  if (slot)
+  {
+    return 0;
+  }
+  int ret = flash_area_open(SLOT_ID, &slot);
+  if (ret < 0)
+  {
+    LOG_ERR("Unable to open secondary slot: %d", ret);
+    slot = NULL;
+  }
+  return ret;
+}
+
+static void set_expected(const uint8_t *expected_sha256)
+{
+  check_digest = (expected_sha256 != NULL);
+  if (check_digest)
+  {
+    memcpy(expected, expected_sha256, sizeof(expected));
+  }
+}
+
+int fota_sink_begin(const uint8_t *expected_sha256)
+{
+  int ret = open_slot();
+  if (ret < 0)
+  {
+    return ret;
+  }
+  ret = flash_area_erase(slot, 0, slot->fa_size);
+  if (ret < 0)
+  {
+    LOG_ERR("Unable to erase secondary slot: %d", ret);
+    return ret;
+  }
+  buf_len = 0;
+  written = 0;
+  verify_end = 0;
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+
+  set_expected(expected_sha256);
+  active = true;
+  complete = false;
+  return 0;
+}
+
+/*
+ * Compare data with what is programmed at offset. Returns -EBADMSG if it
+ * differs.
+ */
+static int verify_programmed(size_t offset, const uint8_t *data, size_t len)
+{
+  uint8_t chunk[32];
+  while (len > 0)
+  {
+    size_t n = MIN(len, sizeof(chunk));
+    int ret = flash_area_read(slot, offset, chunk, n);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (memcmp(chunk, data, n) != 0)
+    {
+      LOG_ERR("Slot at offset %d doesn't match the interrupted download",
+              offset);
+      return -EBADMSG;
+    }
+    offset += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Program the buffered data. A partial buffer is padded up to the write
+ * alignment of the flash. Data a resumed download finds already programmed
+ * is compared instead, since not every flash can program a location twice.
+ */
+static int flush_buffer(void)
+{
+  if (buf_len == 0)
+  {
+    return 0;
+  }
+  size_t align = flash_area_align(slot);
+  size_t len = ROUND_UP(buf_len, align);
+  memset(write_buf + buf_len, 0xFF, len - buf_len);
+
+  size_t done = 0;
+  if (written < verify_end)
+  {
+    done = MIN(len, verify_end - written);
+    int ret = verify_programmed(written, write_buf, done);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  if (done < len)
+  {
+    int ret = flash_area_write(slot, written + done, write_buf + done,
+                               len - done);
+    if (ret < 0)
+    {
+      LOG_ERR("Unable to write %d bytes at offset %d: %d", len - done,
+              written + done, ret);
+      return ret;
+    }
+  }
+  written += buf_len;
+  buf_len = 0;
+  return 0;
+}
+
+static void stop(void)
+{
+  mbedtls_sha256_free(&sha);
+  active = false;
+}
+
+static int finish_image(void)
+{
+  int ret = flush_buffer();
+  if (ret < 0)
+  {
+    stop();
+    return ret;
+  }
+  mbedtls_sha256_finish_ret(&sha, digest);
+  stop();
+
+  if (check_digest && memcmp(digest, expected, sizeof(digest)) != 0)
+  {
+    LOG_ERR("Image digest doesn't match, discarding image");
+    return -EBADMSG;
+  }
+  complete = true;
+
+  ret = boot_request_upgrade(BOOT_UPGRADE_TEST);
+  if (ret < 0)
+  {
+    LOG_ERR("Unable to request upgrade: %d", ret);
+    return ret;
+  }
+  LOG_INF("Image of %d bytes written, upgrade on next boot", written);
+  return 0;
+}
+
+int fota_sink_write(bool last, uint32_t offset, uint8_t *buffer, size_t len)
+{
+  if (!active)
+  {
+    return -EINVAL;
+  }
+  if (offset != written + buf_len)
+  {
+    LOG_ERR("Block at offset %d is out of order, expected offset %d", offset,
+            written + buf_len);
+    stop();
+    return -EINVAL;
+  }
+  if (offset + len > slot->fa_size)
+  {
+    LOG_ERR("Image doesn't fit in the secondary slot");
+    stop();
+    return -EFBIG;
+  }
+  mbedtls_sha256_update_ret(&sha, buffer, len);
+
+  while (len > 0)
+  {
+    size_t n = MIN(len, sizeof(write_buf) - buf_len);
+    memcpy(write_buf + buf_len, buffer, n);
+    buf_len += n;
+    buffer += n;
+    len -= n;
+    if (buf_len == sizeof(write_buf))
+    {
+      int ret = flush_buffer();
+      if (ret < 0)
+      {
+        stop();
+        return ret;
+      }
+    }
+  }
+
+  if (last)
+  {
+    return finish_image();
+  }
+  return 0;
+}
+
+int fota_sink_get_digest(uint8_t *out)
+{
+  if (!complete)
+  {
+    return -EAGAIN;
+  }
+  memcpy(out, digest, sizeof(digest));
+  return 0;
+}
+
+size_t fota_sink_bytes_written(void)
+{
+  return written + buf_len;
+}
+
+#ifdef CONFIG_SPAN_FOTA_CHECKPOINT
+
+#define CHECKPOINT_KEY "fota/checkpoint"
+
+/*
+ * Everything needed to continue a download: the transfer state, the
+ * decoder state and the hash of the data written so far. The first
+ * written bytes of the slot are programmed when the checkpoint is saved.
+ */
+struct fota_checkpoint
+{
+  char path[CONFIG_SPAN_COAP_PATH_MAX_LEN];
+  struct coap_blockwise_state transfer;
+  struct fota_decoder decoder;
+  uint32_t written;
+  bool check_digest;
+  uint8_t expected[FOTA_SINK_DIGEST_LEN];
+  mbedtls_sha256_context sha;
+};
+
+static struct fota_checkpoint checkpoint;
+static bool checkpoint_loaded;
+static bool settings_ready;
+
+static int checkpoint_set(const char *key, size_t len, settings_read_cb read_cb,
+                          void *cb_arg)
+{
+  if (strcmp(key, "checkpoint") != 0)
+  {
+    return -ENOENT;
+  }
+  // A checkpoint from a different build (or a deleted one) is ignored
+  if (len != sizeof(checkpoint))
+  {
+    return 0;
+  }
+  if (read_cb(cb_arg, &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint))
+  {
+    checkpoint_loaded = true;
+  }
+  return 0;
+}
+
+static struct settings_handler checkpoint_handler = {
+    .name = "fota",
+    .h_set = checkpoint_set,
+};
+
+/*
+ * Load the checkpoint and check that it is for the same download. A
+ * different expected digest means a different image.
+ */
+static bool load_checkpoint(const char *path, const uint8_t *expected_sha256)
+{
+  if (!settings_ready)
+  {
+    int ret = settings_subsys_init();
+    if (ret == 0)
+    {
+      ret = settings_register(&checkpoint_handler);
+    }
+    if (ret < 0)
+    {
+      LOG_ERR("Unable to initialize settings: %d", ret);
+      return false;
+    }
+    settings_ready = true;
+  }
+  checkpoint_loaded = false;
+  settings_load_subtree("fota");
+  if (!checkpoint_loaded || strcmp(checkpoint.path, path) != 0 ||
+      checkpoint.transfer.offset == 0)
+  {
+    return false;
+  }
+  if (expected_sha256)
+  {
+    return checkpoint.check_digest &&
+           memcmp(checkpoint.expected, expected_sha256,
+                  sizeof(checkpoint.expected)) == 0;
+  }
+  return !checkpoint.check_digest;
+}
+
+static bool save_checkpoint(const char *path,
+                            const struct coap_blockwise_state *state,
+                            uint32_t offset)
+{
+  // Only data that is in flash can be skipped when resuming. A partial
+  // buffer can be programmed if it ends on a write boundary.
+  if ((written + buf_len) % flash_area_align(slot) != 0 ||
+      flush_buffer() < 0)
+  {
+    return false;
+  }
+  strncpy(checkpoint.path, path, sizeof(checkpoint.path) - 1);
+  checkpoint.transfer = *state;
+  checkpoint.transfer.offset = offset;
+  checkpoint.decoder = decoder;
+  checkpoint.written = written;
+  checkpoint.check_digest = check_digest;
+  memcpy(checkpoint.expected, expected, sizeof(expected));
+  mbedtls_sha256_clone(&checkpoint.sha, &sha);
+
+  int ret = settings_save_one(CHECKPOINT_KEY, &checkpoint, sizeof(checkpoint));
+  if (ret < 0)
+  {
+    LOG_WRN("Unable to save download checkpoint: %d", ret);
+    return false;
+  }
+  return true;
+}
+
+static void delete_checkpoint(void)
+{
+  settings_delete(CHECKPOINT_KEY);
+}
+
+/*
+ * Offset just past the last byte in [start, end) of the slot that isn't
+ * erased, or start if the range is blank. Uses write_buf, which must be
+ * empty.
+ */
+static int programmed_end(size_t start, size_t end, size_t *out)
+{
+  uint8_t erased = flash_area_erased_val(slot);
+  *out = start;
+  for (size_t off = start; off < end; off += sizeof(write_buf))
+  {
+    size_t n = MIN(sizeof(write_buf), end - off);
+    int ret = flash_area_read(slot, off, write_buf, n);
+    if (ret < 0)
+    {
+      LOG_ERR("Unable to read the slot at offset %d: %d", off, ret);
+      return ret;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+      if (write_buf[i] != erased)
+      {
+        *out = off + i + 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Blocks flushed after the checkpoint was saved are still in the slot. The
+ * sectors after the one the checkpoint ends in are erased if they aren't
+ * blank. The rest of that sector can't be erased without losing the data
+ * before the checkpoint, so flush_buffer() compares the data that is
+ * programmed there instead of programming it again.
+ */
+static int prepare_resume(void)
+{
+  const struct device *dev = flash_area_get_device(slot);
+  size_t off = written;
+  verify_end = 0;
+  while (off < slot->fa_size)
+  {
+    struct flash_pages_info page;
+    int ret = flash_get_page_info_by_offs(dev, slot->fa_off + off, &page);
+    if (ret < 0)
+    {
+      LOG_ERR("Unable to read the slot layout: %d", ret);
+      return ret;
+    }
+    size_t start = page.start_offset - slot->fa_off;
+    size_t end = MIN(start + page.size, slot->fa_size);
+    size_t used;
+    ret = programmed_end(off, end, &used);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (start < written)
+    {
+      verify_end = ROUND_UP(used, flash_area_align(slot));
+    }
+    else if (used > start)
+    {
+      ret = flash_area_erase(slot, start, end - start);
+      if (ret < 0)
+      {
+        LOG_ERR("Unable to erase the slot at offset %d: %d", start, ret);
+        return ret;
+      }
+    }
+    off = end;
+  }
+  return 0;
+}
+
+/*
+ * Continue writing an image from a checkpoint. Only the part of the slot
+ * past the checkpoint is prepared again, see prepare_resume().
+ */
+static int resume_image(struct coap_blockwise_state *state)
+{
+  int ret = open_slot();
+  if (ret < 0)
+  {
+    return ret;
+  }
+  *state = checkpoint.transfer;
+  decoder = checkpoint.decoder;
+  buf_len = 0;
+  written = checkpoint.written;
+  ret = prepare_resume();
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_clone(&sha, &checkpoint.sha);
+
+  check_digest = checkpoint.check_digest;
+  memcpy(expected, checkpoint.expected, sizeof(expected));
+  active = true;
+  complete = false;
+  return 0;
+}
+
+#else
+
+static bool load_checkpoint(const char *path, const uint8_t *expected_sha256)
+{
+  return false;
+}
+
+static void delete_checkpoint(void)
+{
+}
+
+static int resume_image(struct coap_blockwise_state *state)
+{
+  return -ENOTSUP;
+}
+
+#endif
+
+static const char *download_path;
+static struct coap_blockwise_state download_state;
+static int download_blocks;
+
+/*
+ * Blocks go through the decoder to the slot. A checkpoint is attempted
+ * on every block once CONFIG_SPAN_FOTA_CHECKPOINT_BLOCKS blocks have
+ * arrived since the last one, since the decoded data doesn't always end on
+ * a flash write boundary.
+ */
+static int download_callback(bool last, uint32_t offset, uint8_t *buffer,
+                             size_t len)
+{
+  int ret = fota_decoder_write(&decoder, last, buffer, len, fota_sink_write);
+#ifdef CONFIG_SPAN_FOTA_CHECKPOINT
+  if (ret == 0 && !last &&
+      ++download_blocks >= CONFIG_SPAN_FOTA_CHECKPOINT_BLOCKS &&
+      save_checkpoint(download_path, &download_state, offset + len))
+  {
+    download_blocks = 0;
+  }
+#endif
+  return ret;
+}
+
+int fota_sink_download(const char *path, uint8_t window,
+                       const uint8_t *expected_sha256)
+{
+  int ret;
+
+  memset(&download_state, 0, sizeof(download_state));
+  if (load_checkpoint(path, expected_sha256))
+  {
+    ret = resume_image(&download_state);
+  }
+  else
+  {
+    // A checkpoint for another image would point into the erased slot
+    delete_checkpoint();
+    fota_decoder_init(&decoder);
+    ret = fota_sink_begin(expected_sha256);
+  }
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  download_path = path;
+  download_blocks = 0;
+  ret = coap_blockwise_transfer_resume(path, window, &download_state,
+                                       download_callback);
+  if (ret == -ESTALE)
+  {
+    // The image on the server has changed. Start over.
+    stop();
+    delete_checkpoint();
+    fota_decoder_init(&decoder);
+    ret = fota_sink_begin(expected_sha256);
+    if (ret == 0)
+    {
+      ret = coap_blockwise_transfer_resume(path, window, &download_state,
+                                           download_callback);
+    }
+  }
+  if (ret == 0 || ret == -EBADMSG)
+  {
+    // The image is either complete or has to be downloaded again
+    delete_checkpoint();
+  }
+  return ret;
+}
+
+#endif
@@ -5,14 +5,24 @@
 #include <logging/log.h>
 #include <net/coap.h>
 #include <net/socket.h>
+#include <sys/byteorder.h>
 #include <zephyr.h>
 
+#ifdef CONFIG_MBEDTLS_MEMORY_DEBUG
+#include <mbedtls/memory_buffer_alloc.h>
+#endif
+
 #include "udp-client.h"
 #include "coap-client.h"
+#include "coap-pool.h"
+#include "footprint.h"
+#include "fota-sink.h"
 #include "fota_report.h"
+#include "metrics.h"
+#include "net-sched.h"
 #include "networking.h"
-
-#include "clientcert.h"
+#include "uplink-batch.h"
+#include "uplink-store.h"
 
 // This is the buffer we'll be using for messages.
 #define BUF_SIZE 256
@@ -21,7 +31,7 @@ static uint8_t buffer[BUF_SIZE];
 // Test host. The real host will be "data.lab5e.com:5684" for external clients
 // and "172.16.15.14:5683" for internal (ie CIoT) clients.
 
-#define LAB5E_HOST "192.168.1.118"
+#define LAB5E_HOST CONFIG_SPAN_SERVER_HOST
 #define LAB5E_COAP_PORT 5684
 #define LAB5E_UDP_PORT 1234
 LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
@@ -31,6 +41,7 @@ LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
 #define FW_SERIAL "00001"
 #define FW_MANUFACTURER "Lab5e AS"
 
+#ifndef CONFIG_SPAN_FOTA_SINK
 /**
  * This is the callback for the blockwise transfer. It is called once for every
  * block returned from the server. The offset is the offset (in bytes) into the
@@ -49,6 +60,98 @@ static int bw_callback(bool last, uint32_t offset, uint8_t *buffer,
   }
   return 0;
 }
+#endif
+
+/*
+ * @brief Download the firmware image
+ */
+static int download_firmware(void)
+{
+#ifdef CONFIG_SPAN_FOTA_SINK
+  // The response doesn't carry a digest for the image. MCUboot checks the
+  // image hash before it swaps.
+  int ret = fota_sink_download("fw", CONFIG_SPAN_FOTA_DOWNLOAD_WINDOW, NULL);
+  if (ret == 0)
+  {
+    uint8_t digest[FOTA_SINK_DIGEST_LEN];
+    fota_sink_get_digest(digest);
+    LOG_HEXDUMP_INF(digest, sizeof(digest), "Image SHA-256:");
+  }
+  return ret;
+#else
+  return coap_blockwise_transfer_windowed(
+      "fw", CONFIG_SPAN_FOTA_DOWNLOAD_WINDOW, bw_callback);
+#endif
+}
+
+static K_SEM_DEFINE(update_sem, 0, 1);
+
+/*
+ * FOTA_REGISTERING is set until the first response to the observation of
+ * the firmware resource arrives, FOTA_QUEUED while a download is queued or
+ * running and FOTA_DONE once an image has been downloaded. That image is
+ * swapped in at the next boot, so the responses to the renewed registration
+ * don't fetch it again.
+ */
+#define FOTA_REGISTERING 0
+#define FOTA_QUEUED 1
+#define FOTA_DONE 2
+static atomic_t fota_state;
+
+// The download waits for a window where the link is awake
+static void fota_job_handler(struct net_job *job)
+{
+  k_sem_give(&update_sem);
+}
+
+static struct net_job fota_job;
+
+/*
+ * @brief Download the firmware if a notification has asked for it. Only the
+ *        main thread downloads.
+ */
+static void check_for_update(void)
+{
+  if (k_sem_take(&update_sem, K_NO_WAIT) < 0)
+  {
+    return;
+  }
+  if (download_firmware() == 0)
+  {
+    atomic_set_bit(&fota_state, FOTA_DONE);
+  }
+  // A failed download is tried again when the registration is renewed
+  atomic_clear_bit(&fota_state, FOTA_QUEUED);
+}
+
+/*
+ * Notifications for the firmware resource. This runs on the CoAP client's
+ * receive thread so the download is left to the main thread.
+ */
+static void fota_notification(int result, const struct coap_packet *reply,
+                              void *user_data)
+{
+  atomic_clear_bit(&fota_state, FOTA_REGISTERING);
+  if (result < 0)
+  {
+    LOG_WRN("Firmware observation failed: %d", result);
+    return;
+  }
+  uint16_t len = 0;
+  const uint8_t *payload = coap_packet_get_payload(reply, &len);
+  fota_response_t resp;
+  if (coap_header_get_code(reply) != COAP_RESPONSE_CODE_CONTENT || !payload ||
+      decode_fota_response(&resp, payload, len) < 0)
+  {
+    return;
+  }
+  if (resp.update && !atomic_test_bit(&fota_state, FOTA_DONE) &&
+      !atomic_test_and_set_bit(&fota_state, FOTA_QUEUED))
+  {
+    LOG_INF("New firmware is available");
+    net_sched_submit(&fota_job);
+  }
+}
 
 /*
  * @brief Report the firmware version to the Lab5e CoAP endpoint
@@ -60,17 +163,22 @@ static int report_version(void)
                           .serial = FW_SERIAL,
                           .version = FW_VERSION};
 
-  size_t sz = encode_fota_report(&report, buffer);
+  int ret = encode_fota_report(&report, buffer, sizeof(buffer));
+  if (ret < 0)
+  {
+    return ret;
+  }
 
-  int ret = coap_send_message(COAP_METHOD_POST, "u", buffer, sz);
+  ret = coap_send_message(COAP_METHOD_POST, "u", buffer, ret);
   if (ret < 0)
   {
     LOG_ERR("Error sending message: %d", ret);
     return ret;
   }
 
-  uint8_t code = 0;
-  ret = coap_read_message(&code, buffer, &sz);
+  // Decode the response straight from the receive buffer
+  struct coap_message_view reply;
+  ret = coap_read_message_view(&reply);
   if (ret < 0)
   {
     LOG_ERR("Error receving message: %d", ret);
@@ -79,7 +187,8 @@ static int report_version(void)
 
   fota_response_t resp;
 
-  ret = decode_fota_response(&resp, buffer, sz);
+  ret = decode_fota_response(&resp, reply.payload, reply.len);
+  coap_release_message(&reply);
   if (ret == 0)
   {
     LOG_INF("Host: %s", log_strdup(resp.host));
@@ -87,42 +196,232 @@ static int report_version(void)
     LOG_INF("Path: %s", log_strdup(resp.path));
     LOG_INF("Available: %d", resp.update);
   }
-
-  coap_blockwise_transfer("fw", bw_callback);
+  // The registration of the observation in go_online() is answered with
+  // the same response, and fota_notification() starts the download
   return 0;
 }
 
-void main(void)
+/*
+ * @brief Start the CoAP client once the interface has an address, report
+ *        the firmware version and observe the firmware resource.
+ */
+static int go_online(void)
 {
-  dhcp_init();
-  int res = coap_start_client(LAB5E_HOST, LAB5E_COAP_PORT);
+  int res = coap_start_client(LAB5E_HOST, LAB5E_COAP_PORT,
+                              transport_get_default("coap"));
+  if (res < 0)
+  {
+    LOG_ERR("Unable to start CoAP client: %d", res);
+    return res;
+  }
 
   res = report_version();
+  if (res < 0)
+  {
+    // Not fatal, the observation below still reports new firmware
+    LOG_WRN("Unable to report firmware version: %d", res);
+  }
 
+  // Get told when new firmware is published instead of reporting again
+  atomic_set_bit(&fota_state, FOTA_REGISTERING);
+  res = coap_observe("u", fota_notification, NULL);
+  if (res < 0)
+  {
+    atomic_clear_bit(&fota_state, FOTA_REGISTERING);
+    LOG_WRN("Unable to observe firmware updates: %d", res);
+  }
+  return 0;
+}
+
+/*
+ * @brief Send CONFIG_SPAN_COAP_FAST_SAMPLE_MESSAGES messages on the CoAP fast
+ *        path as fast as the congestion limits allow and log the rate.
+ */
+static void send_fast_samples(void)
+{
+  int path = coap_register_path("data/on/server");
+  if (path < 0)
+  {
+    LOG_WRN("Unable to register fast path: %d", path);
+    return;
+  }
+
+  struct coap_client_metrics before;
+  coap_get_metrics(&before);
+  uint32_t start = k_uptime_get_32();
+  int sent = 0;
+  for (int i = 0; i < CONFIG_SPAN_COAP_FAST_SAMPLE_MESSAGES; i++)
+  {
+    // Sequence number and uptime, both big endian
+    sys_put_be32(i, buffer);
+    sys_put_be32(k_uptime_get_32(), buffer + 4);
+    int res = coap_send_fast(path, COAP_METHOD_POST, buffer, 8);
+    while (res == -EAGAIN)
+    {
+      k_sleep(K_MSEC(10));
+      res = coap_send_fast(path, COAP_METHOD_POST, buffer, 8);
+    }
+    if (res < 0)
+    {
+      LOG_WRN("Fast path message %d failed: %d", i, res);
+      break;
+    }
+    sent++;
+  }
+  uint32_t elapsed = MAX(k_uptime_get_32() - start, 1);
+
+  struct coap_client_metrics after;
+  coap_get_metrics(&after);
+  LOG_INF("CoAP fast path: %d messages in %d ms (%d/s), %d probes, "
+          "%d throttled, loss %d.%d%%",
+          sent, elapsed, sent * 1000 / elapsed, after.probes - before.probes,
+          after.throttled - before.throttled, after.loss_permille / 10,
+          after.loss_permille % 10);
+}
+
+void main(void)
+{
+  net_sched_init();
+  net_job_init(&fota_job, NET_CLASS_FOTA, fota_job_handler);
+  // The address is configured in the background while sampling starts
+  net_bringup_start();
+  bool online = false;
+
+  // Samples are batched and posted together rather than one message each
+  int res = uplink_batch_init("data/on/server");
+  if (res < 0)
+  {
+    goto ohnoes;
+  }
+  // Sampling doesn't touch the network, the scheduler decides when the
+  // batches go out. Batches that are due before the client is up are
+  // retried later.
   for (int i = 0; i < 10; i++)
   {
-    buffer[0] = (uint8_t)i;
-    res = coap_send_message(COAP_METHOD_POST, "data/on/server", buffer, 1);
-    if (res >= 0)
+    if (!online && net_bringup_wait(K_NO_WAIT) == 0)
     {
-      size_t len = 0;
-      uint8_t code = 0;
-      res = coap_read_message(&code, buffer, &len);
-      if (res >= 0)
+      if (go_online() < 0)
       {
-        LOG_INF("Message %d sent successfully, code=%d, %d bytes returned from "
-                "server",
-                i, code, len);
+        goto ohnoes;
       }
+      online = true;
+    }
+    res = uplink_batch_add_value(i);
+    if (res == -EAGAIN || res == -ENOTCONN)
+    {
+      LOG_WRN("Unable to send batch, dropping sample %d", i);
     }
-    else
+    else if (res < 0)
     {
       goto ohnoes;
     }
+    check_for_update();
     k_sleep(K_MSEC(250));
   }
+  if (!online)
+  {
+    if (net_bringup_wait(K_MSEC(CONFIG_SPAN_NET_BRINGUP_TIMEOUT_MS)) < 0)
+    {
+      LOG_ERR("No IP address after %d ms", CONFIG_SPAN_NET_BRINGUP_TIMEOUT_MS);
+      goto ohnoes;
+    }
+    if (go_online() < 0)
+    {
+      goto ohnoes;
+    }
+  }
+  uplink_batch_flush();
+  // Give the last batch a chance to complete before the client stops, and
+  // the observation a chance to start a download if the client only came up
+  // after the loop. Stored batches that don't make it are sent after the
+  // next boot.
+  for (int i = 0; i < 240 && (uplink_batch_in_flight() > 0 ||
+                              atomic_test_bit(&fota_state, FOTA_REGISTERING) ||
+                              atomic_test_bit(&fota_state, FOTA_QUEUED));
+       i++)
+  {
+    check_for_update();
+    k_sleep(K_MSEC(250));
+  }
+  check_for_update();
+
+  struct uplink_batch_stats batch_stats;
+  uplink_batch_get_stats(&batch_stats);
+  LOG_INF("Sent %d samples (%d bytes) in %d messages (%d bytes)",
+          batch_stats.samples, batch_stats.sample_bytes, batch_stats.messages,
+          batch_stats.payload_bytes);
+
+#ifdef CONFIG_SPAN_UPLINK_STORE
+  struct uplink_store_stats store;
+  uplink_store_get_stats(&store);
+  LOG_INF("Uplink queue: %d stored, %d acknowledged, %d failed, %d dropped, "
+          "%d pending",
+          store.appended, store.acked, store.failed, store.dropped,
+          store.pending);
+  LOG_INF("Uplink queue: %d bytes stored, %d bytes written to flash, "
+          "%d commits, %d erases",
+          store.payload_bytes, store.flash_bytes, store.commits, store.erases);
+#endif
+
+  if (CONFIG_SPAN_COAP_FAST_SAMPLE_MESSAGES > 0)
+  {
+    send_fast_samples();
+  }
+
+  // Counters end up on the server as well as in the log
+  if (metrics_send() == 0)
+  {
+    k_sleep(K_SECONDS(2));
+  }
 ohnoes:
   coap_stop_client();
+  coap_close_session();
+
+  struct coap_session_stats session;
+  coap_get_session_stats(&session);
+  LOG_INF("DTLS: %d handshakes (%d ms total), %d kept connections reused",
+          session.handshakes, session.total_handshake_ms, session.reused);
+  LOG_INF("DTLS: last handshake took %d ms (%d cycles)",
+          session.last_handshake_ms, session.last_handshake_cycles);
+
+#if defined(CONFIG_MBEDTLS_MEMORY_DEBUG) && !defined(CONFIG_SPAN_FOOTPRINT)
+  size_t heap_used, heap_blocks;
+  mbedtls_memory_buffer_alloc_max_get(&heap_used, &heap_blocks);
+  LOG_INF("mbedTLS heap: %d bytes in %d blocks at most", heap_used,
+          heap_blocks);
+#endif
+
+  static const char *const address_sources[] = {"none", "static", "cached",
+                                                "DHCP"};
+  struct net_bringup_stats bringup;
+  net_bringup_get_stats(&bringup);
+  struct coap_client_metrics coap_metrics;
+  coap_get_metrics(&coap_metrics);
+  LOG_INF("Boot: %s address after %d ms, first CoAP request after %d ms",
+          address_sources[bringup.source], bringup.ready_ms,
+          coap_metrics.first_request_ms);
+  LOG_INF("CoAP receive: %d datagrams, %d cycles per datagram",
+          coap_metrics.rx_datagrams,
+          coap_metrics.rx_datagrams
+              ? coap_metrics.rx_cycles / coap_metrics.rx_datagrams
+              : 0);
+
+  struct net_sched_stats sched;
+  net_sched_get_stats(&sched);
+  LOG_INF("Scheduler: %d jobs, %d piggybacked, %d deadline wakeups",
+          sched.jobs, sched.piggybacked, sched.deadline_wakeups);
+  LOG_INF("Link: %d wakeups, about %d ms awake", sched.link_wakeups,
+          sched.link_awake_ms);
+
+  struct coap_pool_stats stats;
+  coap_pool_get_stats(&stats);
+  LOG_INF("CoAP buffers: %d of %d used at most, %d allocation failures",
+          stats.high_water, stats.buffers, stats.failures);
+
+  send_udp(LAB5E_HOST, LAB5E_UDP_PORT, transport_get_default("uplink"));
 
-  send_udp(LAB5E_HOST, LAB5E_UDP_PORT);
+#ifdef CONFIG_SPAN_FOOTPRINT
+  // Last, so every thread has done its work and the stacks show their peak
+  footprint_report();
+#endif
 }
@@ -0,0 +1,249 @@
+#include <errno.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#include <net/coap.h>
+
+#ifdef CONFIG_SHELL
+#include <shell/shell.h>
+#endif
+
+#include "coap-client.h"
+#include "metrics.h"
+#include "tlv.h"
+#include "udp-client.h"
+
+LOG_MODULE_REGISTER(metrics, LOG_LEVEL_DBG);
+
+// Largest LEB128 encoding of a 32-bit value
+#define MAX_VARINT_LEN 5
+
+// Every counter is a 2 byte header and 4 bytes, the histogram a 2 byte
+// header and a varint per bucket
+#define SNAPSHOT_COUNTERS 19
+#define SNAPSHOT_SIZE                                                          \
+  (SNAPSHOT_COUNTERS * (2 + 4) + 2 +                                           \
+   COAP_RTT_HISTOGRAM_BUCKETS * MAX_VARINT_LEN)
+
+struct metrics_snapshot
+{
+  uint32_t uptime_s;
+  uint32_t requests;
+  uint32_t responses;
+  uint32_t notifications;
+  uint32_t retransmits;
+  uint32_t timeouts;
+  uint32_t resets;
+  uint32_t bytes_out;
+  uint32_t bytes_in;
+  uint32_t handshakes;
+  uint32_t handshake_ms;
+  uint32_t udp_datagrams;
+  uint32_t udp_bytes_out;
+  uint32_t udp_errors;
+  struct tlv_span rtt;
+  uint32_t non_sent;
+  uint32_t probes;
+  uint32_t throttled;
+  uint32_t fallbacks;
+  uint32_t loss_permille;
+};
+
+static const struct tlv_field snapshot_fields[] = {
+    TLV_FIELD(METRICS_UPTIME_S, TLV_UINT32, struct metrics_snapshot, uptime_s),
+    TLV_FIELD(METRICS_COAP_REQUESTS, TLV_UINT32, struct metrics_snapshot,
+              requests),
+    TLV_FIELD(METRICS_COAP_RESPONSES, TLV_UINT32, struct metrics_snapshot,
+              responses),
+    TLV_FIELD(METRICS_COAP_NOTIFICATIONS, TLV_UINT32, struct metrics_snapshot,
+              notifications),
+    TLV_FIELD(METRICS_COAP_RETRANSMITS, TLV_UINT32, struct metrics_snapshot,
+              retransmits),
+    TLV_FIELD(METRICS_COAP_TIMEOUTS, TLV_UINT32, struct metrics_snapshot,
+              timeouts),
+    TLV_FIELD(METRICS_COAP_RESETS, TLV_UINT32, struct metrics_snapshot,
+              resets),
+    TLV_FIELD(METRICS_COAP_BYTES_OUT, TLV_UINT32, struct metrics_snapshot,
+              bytes_out),
+    TLV_FIELD(METRICS_COAP_BYTES_IN, TLV_UINT32, struct metrics_snapshot,
+              bytes_in),
+    TLV_FIELD(METRICS_DTLS_HANDSHAKES, TLV_UINT32, struct metrics_snapshot,
+              handshakes),
+    TLV_FIELD(METRICS_DTLS_HANDSHAKE_MS, TLV_UINT32, struct metrics_snapshot,
+              handshake_ms),
+    TLV_FIELD(METRICS_UDP_DATAGRAMS, TLV_UINT32, struct metrics_snapshot,
+              udp_datagrams),
+    TLV_FIELD(METRICS_UDP_BYTES_OUT, TLV_UINT32, struct metrics_snapshot,
+              udp_bytes_out),
+    TLV_FIELD(METRICS_UDP_ERRORS, TLV_UINT32, struct metrics_snapshot,
+              udp_errors),
+    TLV_FIELD(METRICS_RTT_HISTOGRAM, TLV_SPAN, struct metrics_snapshot, rtt),
+    TLV_FIELD(METRICS_COAP_NON_SENT, TLV_UINT32, struct metrics_snapshot,
+              non_sent),
+    TLV_FIELD(METRICS_COAP_PROBES, TLV_UINT32, struct metrics_snapshot,
+              probes),
+    TLV_FIELD(METRICS_COAP_THROTTLED, TLV_UINT32, struct metrics_snapshot,
+              throttled),
+    TLV_FIELD(METRICS_COAP_FALLBACKS, TLV_UINT32, struct metrics_snapshot,
+              fallbacks),
+    TLV_FIELD(METRICS_COAP_LOSS_PERMILLE, TLV_UINT32, struct metrics_snapshot,
+              loss_permille),
+};
+
+BUILD_ASSERT(ARRAY_SIZE(snapshot_fields) == SNAPSHOT_COUNTERS + 1,
+             "SNAPSHOT_SIZE doesn't cover every field");
+
+static size_t put_varint(uint8_t *buf, uint32_t val)
+{
+  size_t n = 0;
+  while (val >= 0x80)
+  {
+    buf[n++] = (uint8_t)(val | 0x80);
+    val >>= 7;
+  }
+  buf[n++] = (uint8_t)val;
+  return n;
+}
+
+int metrics_encode(uint8_t *buffer, size_t size)
+{
+  struct coap_client_metrics coap;
+  struct coap_session_stats session;
+  struct udp_client_metrics udp;
+
+  coap_get_metrics(&coap);
+  coap_get_session_stats(&session);
+  udp_get_metrics(&udp);
+
+  uint8_t histogram[COAP_RTT_HISTOGRAM_BUCKETS * MAX_VARINT_LEN];
+  size_t histogram_len = 0;
+  for (int i = 0; i < COAP_RTT_HISTOGRAM_BUCKETS; i++)
+  {
+    histogram_len += put_varint(histogram + histogram_len,
+                                coap.rtt_histogram[i]);
+  }
+
+  struct metrics_snapshot snapshot = {
+      .uptime_s = k_uptime_get_32() / MSEC_PER_SEC,
+      .requests = coap.requests,
+      .responses = coap.responses,
+      .notifications = coap.notifications,
+      .retransmits = coap.retransmits,
+      .timeouts = coap.timeouts,
+      .resets = coap.resets,
+      .bytes_out = coap.bytes_out,
+      .bytes_in = coap.bytes_in,
+      .handshakes = session.handshakes + udp.handshakes,
+      .handshake_ms = session.total_handshake_ms,
+      .udp_datagrams = udp.datagrams,
+      .udp_bytes_out = udp.bytes_out,
+      .udp_errors = udp.errors,
+      .rtt = {.data = histogram, .len = histogram_len},
+      .non_sent = coap.non_sent,
+      .probes = coap.probes,
+      .throttled = coap.throttled,
+      .fallbacks = coap.fallbacks,
+      .loss_permille = coap.loss_permille,
+  };
+  return tlv_encode(snapshot_fields, ARRAY_SIZE(snapshot_fields), &snapshot,
+                    buffer, size);
+}
+
+static void send_callback(int result, const struct coap_packet *reply,
+                          void *user_data)
+{
+  if (result < 0)
+  {
+    LOG_WRN("Metrics weren't delivered: %d", result);
+  }
+}
+
+int metrics_send(void)
+{
+  uint8_t buffer[SNAPSHOT_SIZE];
+  int len = metrics_encode(buffer, sizeof(buffer));
+  if (len < 0)
+  {
+    LOG_ERR("Unable to encode metrics: %d", len);
+    return len;
+  }
+  int ret = coap_submit_request(COAP_METHOD_POST, CONFIG_SPAN_METRICS_PATH,
+                                buffer, len, send_callback, NULL);
+  if (ret < 0)
+  {
+    LOG_ERR("Unable to send metrics: %d", ret);
+    return ret;
+  }
+  return 0;
+}
+
+#ifdef CONFIG_SHELL
+
+static int cmd_metrics_show(const struct shell *shell, size_t argc,
+                            char **argv)
+{
+  struct coap_client_metrics coap;
+  struct coap_session_stats session;
+  struct udp_client_metrics udp;
+
+  coap_get_metrics(&coap);
+  coap_get_session_stats(&session);
+  udp_get_metrics(&udp);
+
+  shell_print(shell, "CoAP: %u requests, %u responses, %u notifications",
+              coap.requests, coap.responses, coap.notifications);
+  shell_print(shell, "CoAP: %u retransmits, %u timeouts, %u resets",
+              coap.retransmits, coap.timeouts, coap.resets);
+  shell_print(shell, "CoAP: %u bytes out, %u bytes in", coap.bytes_out,
+              coap.bytes_in);
+  shell_print(shell, "CoAP fast path: %u NON, %u probes, %u throttled",
+              coap.non_sent, coap.probes, coap.throttled);
+  shell_print(shell, "CoAP fast path: loss %u.%u%%, %u fallbacks to CON",
+              coap.loss_permille / 10, coap.loss_permille % 10,
+              coap.fallbacks);
+  shell_print(shell, "DTLS: %u handshakes (%u ms total), last %u ms",
+              session.handshakes, session.total_handshake_ms,
+              session.last_handshake_ms);
+  shell_print(shell, "UDP: %u datagrams, %u bytes out, %u errors",
+              udp.datagrams, udp.bytes_out, udp.errors);
+
+  shell_print(shell, "RTT histogram:");
+  for (int i = 0; i < COAP_RTT_HISTOGRAM_BUCKETS; i++)
+  {
+    if (i == 0)
+    {
+      shell_print(shell, "  < %5u ms: %u", 16, coap.rtt_histogram[i]);
+    }
+    else if (i == COAP_RTT_HISTOGRAM_BUCKETS - 1)
+    {
+      shell_print(shell, "  >= %4u ms: %u", 8 << i, coap.rtt_histogram[i]);
+    }
+    else
+    {
+      shell_print(shell, "  < %5u ms: %u", 16 << i, coap.rtt_histogram[i]);
+    }
+  }
+  return 0;
+}
+
+static int cmd_metrics_send(const struct shell *shell, size_t argc,
+                            char **argv)
+{
+  int ret = metrics_send();
+  if (ret < 0)
+  {
+    shell_error(shell, "Unable to send metrics: %d", ret);
+  }
+  return ret;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    metrics_cmds,
+    SHELL_CMD(show, NULL, "Show networking counters", cmd_metrics_show),
+    SHELL_CMD(send, NULL, "Post a snapshot to the server", cmd_metrics_send),
+    SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(metrics, &metrics_cmds, "Networking metrics", NULL);
+
+#endif
@@ -0,0 +1,306 @@
+#include <errno.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#include "net-sched.h"
+
+LOG_MODULE_REGISTER(net_sched, LOG_LEVEL_DBG);
+
+enum
+{
+  JOB_IDLE,
+  // Waiting in the pending list
+  JOB_PENDING,
+  // Picked for the current window, waiting in the due list
+  JOB_DUE,
+};
+
+struct class_timing
+{
+  uint32_t min_delay_ms;
+  uint32_t deadline_ms;
+};
+
+static const struct class_timing class_timing[NET_CLASS_COUNT] = {
+    [NET_CLASS_READ] = {CONFIG_SPAN_NET_SCHED_READ_MIN_DELAY_MS,
+                        CONFIG_SPAN_NET_SCHED_READ_DEADLINE_MS},
+    [NET_CLASS_UPLINK] = {CONFIG_SPAN_NET_SCHED_UPLINK_MIN_DELAY_MS,
+                          CONFIG_SPAN_NET_SCHED_UPLINK_DEADLINE_MS},
+    [NET_CLASS_FOTA] = {CONFIG_SPAN_NET_SCHED_FOTA_MIN_DELAY_MS,
+                        CONFIG_SPAN_NET_SCHED_FOTA_DEADLINE_MS},
+};
+
+/*
+ * Jobs wait in the pending list until they are picked for a window. The
+ * picked jobs are moved to the due list and run one at a time without the
+ * lock held, so handlers may submit or cancel jobs.
+ */
+static struct net_job *pending;
+static struct net_job *due;
+static K_MUTEX_DEFINE(sched_lock);
+static struct k_delayed_work run_work;
+static bool initialized;
+
+static uint32_t last_activity;
+static bool seen_activity;
+static struct net_sched_stats stats;
+
+// Times are k_uptime_get_32() values that may wrap
+static bool time_reached(uint32_t t, uint32_t now)
+{
+  return (int32_t)(now - t) >= 0;
+}
+
+static bool link_awake(uint32_t now)
+{
+  return seen_activity &&
+         now - last_activity < CONFIG_SPAN_NET_SCHED_WINDOW_MS;
+}
+
+static void unlink_job(struct net_job **list, struct net_job *job)
+{
+  for (struct net_job **p = list; *p; p = &(*p)->next)
+  {
+    if (*p == job)
+    {
+      *p = job->next;
+      job->next = NULL;
+      return;
+    }
+  }
+}
+
+/*
+ * Arm the work item for the next job. That is the earliest deadline or,
+ * while the link is awake, the first job that may run in the current
+ * window. Must be called with the lock held.
+ */
+static void arm_locked(uint32_t now)
+{
+  if (!initialized || !pending)
+  {
+    return;
+  }
+  uint32_t next = pending->deadline;
+  for (struct net_job *job = pending; job; job = job->next)
+  {
+    if (!time_reached(next, job->deadline))
+    {
+      next = job->deadline;
+    }
+  }
+  if (link_awake(now))
+  {
+    uint32_t window_end = last_activity + CONFIG_SPAN_NET_SCHED_WINDOW_MS;
+    for (struct net_job *job = pending; job; job = job->next)
+    {
+      if (!time_reached(window_end, job->earliest) &&
+          !time_reached(next, job->earliest))
+      {
+        next = job->earliest;
+      }
+    }
+  }
+  uint32_t delay = time_reached(next, now) ? 0 : next - now;
+  k_delayed_work_submit(&run_work, K_MSEC(delay));
+}
+
+/*
+ * Note traffic on the link. The link is assumed to wake up with traffic that
+ * starts after it has been idle for a full window. Must be called with the
+ * lock held.
+ */
+static void activity_locked(uint32_t now)
+{
+  if (link_awake(now))
+  {
+    stats.link_awake_ms += now - last_activity;
+  }
+  else
+  {
+    stats.link_wakeups++;
+    if (seen_activity)
+    {
+      stats.link_awake_ms += CONFIG_SPAN_NET_SCHED_WINDOW_MS;
+    }
+  }
+  last_activity = now;
+  seen_activity = true;
+}
+
+static void run_handler(struct k_work *work)
+{
+  k_mutex_lock(&sched_lock, K_FOREVER);
+  uint32_t now = k_uptime_get_32();
+
+  // A deadline that has passed opens a window if there isn't one already
+  bool deadline_passed = false;
+  for (struct net_job *job = pending; job; job = job->next)
+  {
+    deadline_passed |= time_reached(job->deadline, now);
+  }
+  if (deadline_passed && !link_awake(now))
+  {
+    stats.deadline_wakeups++;
+    activity_locked(now);
+  }
+
+  // Everything that may run goes in the window
+  if (link_awake(now))
+  {
+    struct net_job **p = &pending;
+    while (*p)
+    {
+      struct net_job *job = *p;
+      if (time_reached(job->earliest, now))
+      {
+        *p = job->next;
+        job->next = due;
+        job->state = JOB_DUE;
+        due = job;
+        if (!time_reached(job->deadline, now))
+        {
+          stats.piggybacked++;
+        }
+      }
+      else
+      {
+        p = &job->next;
+      }
+    }
+  }
+  arm_locked(now);
+
+  for (;;)
+  {
+    struct net_job *job = due;
+    if (!job)
+    {
+      break;
+    }
+    due = job->next;
+    job->next = NULL;
+    job->state = JOB_IDLE;
+    stats.jobs++;
+    k_mutex_unlock(&sched_lock);
+
+    job->handler(job);
+
+    k_mutex_lock(&sched_lock, K_FOREVER);
+  }
+  k_mutex_unlock(&sched_lock);
+}
+
+void net_sched_init(void)
+{
+  k_mutex_lock(&sched_lock, K_FOREVER);
+  if (!initialized)
+  {
+    k_delayed_work_init(&run_work, run_handler);
+    initialized = true;
+  }
+  arm_locked(k_uptime_get_32());
+  k_mutex_unlock(&sched_lock);
+}
+
+void net_job_init(struct net_job *job, uint8_t traffic_class,
+                  net_job_handler_t handler)
+{
+  job->handler = handler;
+  job->traffic_class = traffic_class;
+  job->state = JOB_IDLE;
+  job->next = NULL;
+}
+
+int net_sched_submit_in(struct net_job *job, uint32_t deadline_ms)
+{
+  if (job->traffic_class >= NET_CLASS_COUNT)
+  {
+    return -EINVAL;
+  }
+  uint32_t min_delay =
+      MIN(class_timing[job->traffic_class].min_delay_ms, deadline_ms);
+
+  k_mutex_lock(&sched_lock, K_FOREVER);
+  uint32_t now = k_uptime_get_32();
+  uint32_t deadline = now + deadline_ms;
+  switch (job->state)
+  {
+  case JOB_IDLE:
+    job->earliest = now + min_delay;
+    job->deadline = deadline;
+    job->state = JOB_PENDING;
+    job->next = pending;
+    pending = job;
+    break;
+  case JOB_PENDING:
+    if (!time_reached(job->deadline, deadline))
+    {
+      job->deadline = deadline;
+      if (!time_reached(job->deadline, job->earliest))
+      {
+        job->earliest = job->deadline;
+      }
+    }
+    break;
+  default:
+    // Runs in the current window anyway
+    break;
+  }
+  arm_locked(now);
+  k_mutex_unlock(&sched_lock);
+  return 0;
+}
+
+int net_sched_submit(struct net_job *job)
+{
+  if (job->traffic_class >= NET_CLASS_COUNT)
+  {
+    return -EINVAL;
+  }
+  return net_sched_submit_in(job,
+                             class_timing[job->traffic_class].deadline_ms);
+}
+
+void net_sched_cancel(struct net_job *job)
+{
+  k_mutex_lock(&sched_lock, K_FOREVER);
+  if (job->state == JOB_PENDING)
+  {
+    unlink_job(&pending, job);
+  }
+  else if (job->state == JOB_DUE)
+  {
+    unlink_job(&due, job);
+  }
+  job->state = JOB_IDLE;
+  k_mutex_unlock(&sched_lock);
+}
+
+void net_sched_link_active(void)
+{
+  k_mutex_lock(&sched_lock, K_FOREVER);
+  uint32_t now = k_uptime_get_32();
+  activity_locked(now);
+  // The window has moved, so more jobs may fit in it
+  arm_locked(now);
+  k_mutex_unlock(&sched_lock);
+}
+
+void net_sched_get_stats(struct net_sched_stats *out)
+{
+  k_mutex_lock(&sched_lock, K_FOREVER);
+  *out = stats;
+  // Count the current window up to now, or all of the last one
+  uint32_t now = k_uptime_get_32();
+  if (link_awake(now))
+  {
+    out->link_awake_ms += now - last_activity;
+  }
+  else if (seen_activity)
+  {
+    out->link_awake_ms += CONFIG_SPAN_NET_SCHED_WINDOW_MS;
+  }
+  k_mutex_unlock(&sched_lock);
+}
@@ -1,39 +1,189 @@
 #include <errno.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <logging/log.h>
+#include <net/dhcpv4.h>
 #include <net/net_core.h>
 #include <net/net_if.h>
+#include <net/net_mgmt.h>
 #include <zephyr.h>
 
+#ifdef CONFIG_SPAN_DHCP_CACHE_LEASE
+#include <settings/settings.h>
+#endif
+
 #include "networking.h"
 
 LOG_MODULE_REGISTER(networking, LOG_LEVEL_DBG);
 
-struct k_sem address_sem;
+#define LEASE_KEY "net/lease"
+
+static K_SEM_DEFINE(address_sem, 0, 1);
+static atomic_t address_ready;
+static struct net_bringup_stats stats;
 
 static struct net_mgmt_event_callback mgmt_cb;
-static void net_event_handler(struct net_mgmt_event_callback *cb,
-                              uint32_t mgmt_event, struct net_if *iface) {
-  if (mgmt_event != NET_EVENT_IPV4_ADDR_ADD) {
+
+static void set_ready(uint8_t source) {
+  if (atomic_set(&address_ready, 1)) {
     return;
   }
-  LOG_DBG("Got IP address");
+  stats.source = source;
+  stats.ready_ms = k_uptime_get_32();
   k_sem_give(&address_sem);
 }
 
-void dhcp_init(void) {
-  LOG_DBG("Starting DHCP");
-  if (0 != k_sem_init(&address_sem, 0, 1)) {
-    LOG_ERR("Could not initialize semaphore: %d", errno);
+#ifdef CONFIG_SPAN_DHCP_CACHE_LEASE
+
+/*
+ * The address, netmask and gateway from the last lease. There is no wall
+ * clock to tell if the lease has expired, so the address is used until the
+ * DHCP client gets a new one.
+ */
+struct dhcp_lease {
+  struct in_addr addr;
+  struct in_addr netmask;
+  struct in_addr gw;
+};
+
+static struct dhcp_lease lease;
+static bool lease_loaded;
+static bool cached_in_use;
+static struct k_work save_work;
+
+static int lease_set(const char *key, size_t len, settings_read_cb read_cb,
+                     void *cb_arg) {
+  if (strcmp(key, "lease") != 0) {
+    return -ENOENT;
+  }
+  if (len == sizeof(lease) &&
+      read_cb(cb_arg, &lease, sizeof(lease)) == sizeof(lease)) {
+    lease_loaded = true;
+  }
+  return 0;
+}
+
+static struct settings_handler lease_handler = {
+    .name = "net",
+    .h_set = lease_set,
+};
+
+static bool load_lease(void) {
+  int ret = settings_subsys_init();
+  if (ret == 0) {
+    ret = settings_register(&lease_handler);
+  }
+  if (ret < 0) {
+    LOG_ERR("Unable to initialize settings: %d", ret);
+    return false;
+  }
+  settings_load_subtree("net");
+  return lease_loaded && lease.addr.s_addr != INADDR_ANY;
+}
+
+// Flash writes are kept off the net_mgmt thread
+static void save_handler(struct k_work *work) {
+  int ret = settings_save_one(LEASE_KEY, &lease, sizeof(lease));
+  if (ret < 0) {
+    LOG_WRN("Unable to save DHCP lease: %d", ret);
   }
+}
+
+static void use_cached_lease(struct net_if *iface) {
+  if (!net_if_ipv4_addr_add(iface, &lease.addr, NET_ADDR_DHCP, 0)) {
+    LOG_WRN("Unable to use cached address");
+    return;
+  }
+  net_if_ipv4_set_netmask(iface, &lease.netmask);
+  net_if_ipv4_set_gw(iface, &lease.gw);
+  cached_in_use = true;
+  LOG_DBG("Using cached address while DHCP runs");
+  set_ready(NET_ADDRESS_CACHED);
+}
+
+/*
+ * The DHCP client is bound. Drop the cached address if the server handed
+ * out a different one and save the lease if anything has changed.
+ */
+static void dhcp_bound(struct net_if *iface) {
+  struct dhcp_lease bound = {
+      .addr = iface->config.dhcpv4.requested_ip,
+      .netmask = iface->config.ip.ipv4->netmask,
+      .gw = iface->config.ip.ipv4->gw,
+  };
+  if (cached_in_use && lease.addr.s_addr != bound.addr.s_addr) {
+    LOG_WRN("DHCP server changed the address");
+    net_if_ipv4_addr_rm(iface, &lease.addr);
+  }
+  cached_in_use = false;
+  if (!lease_loaded || memcmp(&lease, &bound, sizeof(lease)) != 0) {
+    lease = bound;
+    lease_loaded = true;
+    k_work_submit(&save_work);
+  }
+}
+
+#else
+
+static void dhcp_bound(struct net_if *iface) {}
+
+#endif /* CONFIG_SPAN_DHCP_CACHE_LEASE */
+
+static void net_event_handler(struct net_mgmt_event_callback *cb,
+                              uint32_t mgmt_event, struct net_if *iface) {
+  switch (mgmt_event) {
+  case NET_EVENT_IPV4_ADDR_ADD:
+    LOG_DBG("Got IP address");
+    set_ready(NET_ADDRESS_DHCP);
+    break;
+  case NET_EVENT_IPV4_DHCP_BOUND:
+    stats.dhcp_bound_ms = k_uptime_get_32();
+    dhcp_bound(iface);
+    break;
+  default:
+    break;
+  }
+}
+
+void net_bringup_start(void) {
   net_mgmt_init_event_callback(&mgmt_cb, net_event_handler,
-                               NET_EVENT_IPV4_ADDR_ADD);
+                               NET_EVENT_IPV4_ADDR_ADD |
+                                   NET_EVENT_IPV4_DHCP_BOUND);
   net_mgmt_add_event_callback(&mgmt_cb);
 
   struct net_if *iface = net_if_get_default();
+  if (net_if_ipv4_get_global_addr(iface, NET_ADDR_PREFERRED)) {
+    // Static address (CONFIG_NET_CONFIG_MY_IPV4_ADDR), nothing to wait for
+    LOG_DBG("Using static IP address");
+    set_ready(NET_ADDRESS_STATIC);
+    return;
+  }
+
+#ifdef CONFIG_SPAN_DHCP_CACHE_LEASE
+  // Zephyr's DHCP client has no INIT-REBOOT state, so the cached address is
+  // configured directly and the client does a full exchange in the
+  // background
+  k_work_init(&save_work, save_handler);
+  if (load_lease()) {
+    use_cached_lease(iface);
+  }
+#endif
+
+  LOG_DBG("Starting DHCP");
   net_dhcpv4_start(iface);
+}
 
-  LOG_DBG("Waiting for IP address...");
-  k_sem_take(&address_sem, K_FOREVER);
+int net_bringup_wait(k_timeout_t timeout) {
+  if (atomic_get(&address_ready)) {
+    return 0;
+  }
+  if (k_sem_take(&address_sem, timeout) < 0) {
+    return -ETIMEDOUT;
+  }
+  // Let any other waiters through as well
+  k_sem_give(&address_sem);
+  return 0;
 }
+
+void net_bringup_get_stats(struct net_bringup_stats *out) { *out = stats; }
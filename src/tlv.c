@@ -0,0 +1,168 @@
+// strnlen() is POSIX.1-2008. With a strict C standard newlib and glibc only
+// declare it when asked to.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "tlv.h"
+
+static const struct tlv_field *find_field(const struct tlv_field *fields,
+                                          size_t count, uint8_t id) {
+  for (size_t i = 0; i < count; i++) {
+    if (fields[i].id == id) {
+      return &fields[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Write the id and length header. Returns the number of bytes written or
+ * -ENOMEM if the header and the value doesn't fit.
+ */
+static int encode_header(uint8_t *buf, size_t size, uint8_t id, size_t len) {
+  size_t hdr = (len < TLV_LONG_LENGTH) ? 2 : 4;
+  if (len > TLV_MAX_LENGTH) {
+    return -EMSGSIZE;
+  }
+  if (size < hdr || size - hdr < len) {
+    return -ENOMEM;
+  }
+  buf[0] = id;
+  if (hdr == 2) {
+    buf[1] = (uint8_t)len;
+  } else {
+    buf[1] = TLV_LONG_LENGTH;
+    buf[2] = (uint8_t)(len >> 8);
+    buf[3] = (uint8_t)len;
+  }
+  return (int)hdr;
+}
+
+int tlv_encode(const struct tlv_field *fields, size_t count, const void *src,
+               uint8_t *buf, size_t size) {
+  size_t idx = 0;
+  uint8_t scratch[4];
+
+  for (size_t i = 0; i < count; i++) {
+    const struct tlv_field *f = &fields[i];
+    const uint8_t *member = (const uint8_t *)src + f->offset;
+    const uint8_t *value;
+    size_t len;
+
+    switch (f->type) {
+    case TLV_CSTR:
+      value = *(const uint8_t *const *)member;
+      if (!value) {
+        // Missing strings are left out
+        continue;
+      }
+      len = strlen((const char *)value);
+      break;
+    case TLV_CHARS:
+      value = member;
+      len = strnlen((const char *)value, f->size);
+      break;
+    case TLV_SPAN:
+      value = ((const struct tlv_span *)member)->data;
+      len = ((const struct tlv_span *)member)->len;
+      if (!value) {
+        continue;
+      }
+      break;
+    case TLV_UINT32: {
+      uint32_t v;
+      memcpy(&v, member, sizeof(v));
+      scratch[0] = (uint8_t)(v >> 24);
+      scratch[1] = (uint8_t)(v >> 16);
+      scratch[2] = (uint8_t)(v >> 8);
+      scratch[3] = (uint8_t)v;
+      value = scratch;
+      len = 4;
+      break;
+    }
+    case TLV_BOOL:
+      scratch[0] = *(const bool *)member ? 1 : 0;
+      value = scratch;
+      len = 1;
+      break;
+    default:
+      return -EINVAL;
+    }
+
+    int hdr = encode_header(buf + idx, size - idx, f->id, len);
+    if (hdr < 0) {
+      return hdr;
+    }
+    idx += hdr;
+    memcpy(buf + idx, value, len);
+    idx += len;
+  }
+  return (int)idx;
+}
+
+int tlv_decode(const struct tlv_field *fields, size_t count, void *dst,
+               const uint8_t *buf, size_t len) {
+  size_t idx = 0;
+
+  while (idx < len) {
+    if (len - idx < 2) {
+      return -EBADMSG;
+    }
+    uint8_t id = buf[idx++];
+    size_t vlen = buf[idx++];
+    if (vlen == TLV_LONG_LENGTH) {
+      if (len - idx < 2) {
+        return -EBADMSG;
+      }
+      vlen = ((size_t)buf[idx] << 8) | buf[idx + 1];
+      idx += 2;
+    }
+    if (len - idx < vlen) {
+      return -EBADMSG;
+    }
+    const uint8_t *value = buf + idx;
+    idx += vlen;
+
+    const struct tlv_field *f = find_field(fields, count, id);
+    if (!f) {
+      return -EBADMSG;
+    }
+    uint8_t *member = (uint8_t *)dst + f->offset;
+
+    switch (f->type) {
+    case TLV_CHARS:
+      if (vlen >= f->size) {
+        return -ENOSPC;
+      }
+      memcpy(member, value, vlen);
+      member[vlen] = 0;
+      break;
+    case TLV_SPAN:
+      ((struct tlv_span *)member)->data = value;
+      ((struct tlv_span *)member)->len = vlen;
+      break;
+    case TLV_UINT32: {
+      if (vlen != 4) {
+        return -EBADMSG;
+      }
+      uint32_t v = ((uint32_t)value[0] << 24) | ((uint32_t)value[1] << 16) |
+                   ((uint32_t)value[2] << 8) | value[3];
+      memcpy(member, &v, sizeof(v));
+      break;
+    }
+    case TLV_BOOL:
+      if (vlen != 1) {
+        return -EBADMSG;
+      }
+      *(bool *)member = (value[0] == 1);
+      break;
+    default:
+      return -EINVAL;
+    }
+  }
+  return 0;
+}
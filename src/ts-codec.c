@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <string.h>
+
+#include "ts-codec.h"
+
+/*
+ * Bucket widths after the '10', '110' and '1110' prefixes. Anything larger
+ * gets '1111' and 32 bits.
+ */
+static const uint8_t time_widths[3] = {7, 9, 12};
+static const uint8_t value_widths[3] = {4, 8, 16};
+
+static uint32_t zigzag(int32_t v) {
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+  return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+/*
+ * Write the low n bits of val (n <= 32). Bytes are cleared as they are
+ * started, so the buffer doesn't have to be.
+ */
+static void put_bits(struct ts_encoder *enc, uint32_t val, int n) {
+  while (n > 0) {
+    size_t byte = enc->bits >> 3;
+    int used = enc->bits & 7;
+    int take = (8 - used < n) ? 8 - used : n;
+    uint8_t chunk = (uint8_t)((val >> (n - take)) & ((1u << take) - 1));
+    if (used == 0) {
+      enc->buf[byte] = 0;
+    }
+    enc->buf[byte] |= (uint8_t)(chunk << (8 - used - take));
+    enc->bits += take;
+    n -= take;
+  }
+}
+
+static int get_bits(struct ts_decoder *dec, int n, uint32_t *out) {
+  if (dec->bits + n > dec->len * 8) {
+    return -EBADMSG;
+  }
+  uint32_t val = 0;
+  while (n > 0) {
+    size_t byte = dec->bits >> 3;
+    int used = dec->bits & 7;
+    int take = (8 - used < n) ? 8 - used : n;
+    uint32_t chunk =
+        (dec->buf[byte] >> (8 - used - take)) & ((1u << take) - 1);
+    val = (val << take) | chunk;
+    dec->bits += take;
+    n -= take;
+  }
+  *out = val;
+  return 0;
+}
+
+/*
+ * Number of bits put_bucket() writes for v.
+ */
+static int bucket_bits(uint32_t v, const uint8_t *widths) {
+  if (v == 0) {
+    return 1;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (v < (1u << widths[i])) {
+      return i + 2 + widths[i];
+    }
+  }
+  return 4 + 32;
+}
+
+static void put_bucket(struct ts_encoder *enc, uint32_t v,
+                       const uint8_t *widths) {
+  if (v == 0) {
+    put_bits(enc, 0, 1);
+    return;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (v < (1u << widths[i])) {
+      // i + 1 ones and a zero
+      put_bits(enc, ((1u << (i + 1)) - 1) << 1, i + 2);
+      put_bits(enc, v, widths[i]);
+      return;
+    }
+  }
+  put_bits(enc, 0xF, 4);
+  put_bits(enc, v, 32);
+}
+
+static int get_bucket(struct ts_decoder *dec, const uint8_t *widths,
+                      uint32_t *out) {
+  int ones = 0;
+  uint32_t bit;
+  while (ones < 4) {
+    if (get_bits(dec, 1, &bit) < 0) {
+      return -EBADMSG;
+    }
+    if (!bit) {
+      break;
+    }
+    ones++;
+  }
+  if (ones == 0) {
+    *out = 0;
+    return 0;
+  }
+  return get_bits(dec, ones < 4 ? widths[ones - 1] : 32, out);
+}
+
+/*
+ * The XOR encoding of a value. Returns the number of bits and updates the
+ * window if a new one is needed.
+ */
+static int xor_bits(uint32_t x, uint8_t *leading, uint8_t *trailing,
+                    bool *reuse) {
+  if (x == 0) {
+    return 1;
+  }
+  int lz = __builtin_clz(x);
+  int tz = __builtin_ctz(x);
+  if (*leading + *trailing < 32 && lz >= *leading && tz >= *trailing) {
+    *reuse = true;
+    return 2 + 32 - *leading - *trailing;
+  }
+  *reuse = false;
+  *leading = (uint8_t)lz;
+  *trailing = (uint8_t)tz;
+  return 2 + 5 + 5 + 32 - lz - tz;
+}
+
+void ts_encoder_init(struct ts_encoder *enc, uint8_t *buf, size_t size,
+                     enum ts_value_mode mode) {
+  memset(enc, 0, sizeof(*enc));
+  enc->buf = buf;
+  enc->size = size;
+  enc->mode = (uint8_t)mode;
+  // No XOR window yet
+  enc->leading = 32;
+}
+
+int ts_encode(struct ts_encoder *enc, uint32_t time, uint32_t value) {
+  if (enc->count == 0) {
+    if (enc->bits + 64 > enc->size * 8) {
+      return -ENOMEM;
+    }
+    put_bits(enc, time, 32);
+    put_bits(enc, value, 32);
+    enc->time = time;
+    enc->value = value;
+    enc->count++;
+    return 0;
+  }
+
+  // Work out the size first so a sample that doesn't fit leaves the stream
+  // as it was. The differences wrap like the uptime counter does.
+  int32_t delta = (int32_t)(time - enc->time);
+  uint32_t dod = zigzag((int32_t)((uint32_t)delta - (uint32_t)enc->delta));
+  int n = bucket_bits(dod, time_widths);
+
+  uint32_t v;
+  uint8_t leading = enc->leading;
+  uint8_t trailing = enc->trailing;
+  bool reuse = false;
+  if (enc->mode == TS_VALUE_XOR) {
+    v = value ^ enc->value;
+    n += xor_bits(v, &leading, &trailing, &reuse);
+  } else {
+    v = zigzag((int32_t)(value - enc->value));
+    n += bucket_bits(v, value_widths);
+  }
+  if (enc->bits + n > enc->size * 8) {
+    return -ENOMEM;
+  }
+
+  put_bucket(enc, dod, time_widths);
+  if (enc->mode == TS_VALUE_XOR) {
+    if (v == 0) {
+      put_bits(enc, 0, 1);
+    } else if (reuse) {
+      put_bits(enc, 0x2, 2);
+      put_bits(enc, v >> trailing, 32 - leading - trailing);
+    } else {
+      int meaningful = 32 - leading - trailing;
+      put_bits(enc, 0x3, 2);
+      put_bits(enc, leading, 5);
+      put_bits(enc, meaningful - 1, 5);
+      put_bits(enc, v >> trailing, meaningful);
+      enc->leading = leading;
+      enc->trailing = trailing;
+    }
+  } else {
+    put_bucket(enc, v, value_widths);
+  }
+  enc->delta = delta;
+  enc->time = time;
+  enc->value = value;
+  enc->count++;
+  return 0;
+}
+
+uint32_t ts_encoder_count(const struct ts_encoder *enc) {
+  return enc->count;
+}
+
+size_t ts_encoder_len(const struct ts_encoder *enc) {
+  return (enc->bits + 7) >> 3;
+}
+
+void ts_decoder_init(struct ts_decoder *dec, const uint8_t *buf, size_t len,
+                     enum ts_value_mode mode) {
+  memset(dec, 0, sizeof(*dec));
+  dec->buf = buf;
+  dec->len = len;
+  dec->mode = (uint8_t)mode;
+  dec->leading = 32;
+}
+
+int ts_decode(struct ts_decoder *dec, uint32_t *time, uint32_t *value) {
+  if (dec->count == 0) {
+    if (get_bits(dec, 32, &dec->time) < 0 ||
+        get_bits(dec, 32, &dec->value) < 0) {
+      return -EBADMSG;
+    }
+  } else {
+    uint32_t dod;
+    if (get_bucket(dec, time_widths, &dod) < 0) {
+      return -EBADMSG;
+    }
+    dec->delta = (int32_t)((uint32_t)dec->delta + (uint32_t)unzigzag(dod));
+    dec->time += (uint32_t)dec->delta;
+
+    uint32_t v;
+    if (dec->mode == TS_VALUE_XOR) {
+      uint32_t control;
+      if (get_bits(dec, 1, &control) < 0) {
+        return -EBADMSG;
+      }
+      if (control) {
+        if (get_bits(dec, 1, &control) < 0) {
+          return -EBADMSG;
+        }
+        if (control) {
+          uint32_t leading, len;
+          if (get_bits(dec, 5, &leading) < 0 || get_bits(dec, 5, &len) < 0) {
+            return -EBADMSG;
+          }
+          if (leading + len + 1 > 32) {
+            return -EBADMSG;
+          }
+          dec->leading = (uint8_t)leading;
+          dec->trailing = (uint8_t)(32 - leading - len - 1);
+        } else if (dec->leading + dec->trailing >= 32) {
+          // No window has been set up yet
+          return -EBADMSG;
+        }
+        if (get_bits(dec, 32 - dec->leading - dec->trailing, &v) < 0) {
+          return -EBADMSG;
+        }
+        dec->value ^= v << dec->trailing;
+      }
+    } else {
+      if (get_bucket(dec, value_widths, &v) < 0) {
+        return -EBADMSG;
+      }
+      dec->value += (uint32_t)unzigzag(v);
+    }
+  }
+  dec->count++;
+  *time = dec->time;
+  *value = dec->value;
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 
 #include <logging/log.h>
 #include <zephyr.h>
@@ -8,22 +9,173 @@
 #include <net/net_ip.h>
 #include <net/socket.h>
 #include <net/udp.h>
+#include <sys/byteorder.h>
 
 LOG_MODULE_REGISTER(udp_client, LOG_LEVEL_DBG);
 
+#include "net-sched.h"
+#include "transport.h"
 #include "udp-client.h"
+#include "uplink-ring.h"
 
-#include "clientcert.h"
+// Updated by the sender thread and the producers, metrics_lock keeps
+// udp_get_metrics() from reading a half updated copy
+static struct udp_client_metrics metrics;
+static K_MUTEX_DEFINE(metrics_lock);
 
-#ifdef CLIENT_CERT
-#include <net/tls_credentials.h>
-#endif
+void udp_get_metrics(struct udp_client_metrics *out)
+{
+    k_mutex_lock(&metrics_lock, K_FOREVER);
+    *out = metrics;
+    k_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * Datagrams are formatted straight into the slots of uplink-ring.c by the
+ * producers and sent from the sender thread. On TCP and TLS every message is
+ * sent with a 16-bit big endian length in front, which is written to frame
+ * so the message goes out in a single send().
+ */
+
+// The socket is kept open between calls. sock_lock keeps it from being
+// closed while the sender thread uses it.
+static int sock = -1;
+static enum transport_type transport;
+static K_MUTEX_DEFINE(sock_lock);
 
-int send_udp(const char *host, const int port)
+static K_THREAD_STACK_DEFINE(sender_stack, CONFIG_SPAN_UDP_UPLINK_STACK_SIZE);
+static struct k_thread sender_thread;
+static bool sender_created;
+
+/*
+ * Token bucket in thousandths of a token. One token is added every
+ * 1000 / rate ms up to the burst size and every datagram takes one. A rate
+ * of 0 turns the limiter off.
+ */
+static uint32_t rate = CONFIG_SPAN_UDP_UPLINK_RATE;
+static uint32_t burst = CONFIG_SPAN_UDP_UPLINK_BURST;
+static uint32_t tokens;
+static uint32_t last_refill;
+
+void udp_uplink_set_rate(uint32_t packets_per_second, uint32_t burst_size)
 {
-    int ret = 0;
-    int sock = 0;
+    rate = packets_per_second;
+    burst = MAX(burst_size, 1);
+    tokens = MIN(tokens, burst * 1000);
+}
+
+static void take_token(void)
+{
+    if (rate == 0)
+    {
+        return;
+    }
+    for (;;)
+    {
+        uint32_t now = k_uptime_get_32();
+        // burst * 1000 ms fills the bucket at any rate, and capping the
+        // time keeps this from overflowing after a long idle period
+        uint32_t elapsed = MIN(now - last_refill, burst * 1000);
+        tokens = MIN(tokens + elapsed * rate, burst * 1000);
+        last_refill = now;
+        if (tokens >= 1000)
+        {
+            tokens -= 1000;
+            return;
+        }
+        k_sleep(K_MSEC((1000 - tokens + rate - 1) / rate));
+    }
+}
+
+/*
+ * Send a whole message. Stream sockets may take only part of it.
+ */
+static int send_all(const uint8_t *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        int ret = send(sock, buf + sent, len - sent, 0);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+/*
+ * Send the datagram in a slot and count it. Errors are counted and logged,
+ * the datagram isn't sent again.
+ */
+static void send_slot(struct uplink_slot *slot)
+{
+    int ret = -ENOTCONN;
+    uint32_t cycles = 0;
+    uint32_t wire_bytes = 0;
+    k_mutex_lock(&sock_lock, K_FOREVER);
+    if (sock >= 0)
+    {
+        const uint8_t *buf = slot->data;
+        size_t len = slot->len;
+        if (transport_is_stream(transport))
+        {
+            sys_put_be16(slot->len, slot->frame);
+            buf = slot->frame;
+            len += sizeof(slot->frame);
+        }
+        uint32_t start = k_cycle_get_32();
+        ret = send_all(buf, len);
+        cycles = k_cycle_get_32() - start;
+        if (ret < 0)
+        {
+            LOG_ERR("Error sending data on socket: %d", errno);
+        }
+        else
+        {
+            wire_bytes = transport_wire_bytes(transport, ret);
+        }
+    }
+    k_mutex_unlock(&sock_lock);
+
+    k_mutex_lock(&metrics_lock, K_FOREVER);
+    metrics.send_cycles += cycles;
+    if (ret < 0)
+    {
+        metrics.errors++;
+    }
+    else
+    {
+        metrics.datagrams++;
+        metrics.bytes_out += ret;
+        metrics.wire_bytes += wire_bytes;
+        metrics.latency_ms += k_uptime_get_32() - slot->queued_at;
+    }
+    k_mutex_unlock(&metrics_lock);
+    if (ret >= 0)
+    {
+        net_sched_link_active();
+    }
+}
+
+static void send_thread(void *p1, void *p2, void *p3)
+{
+    for (;;)
+    {
+        struct uplink_slot *slot = uplink_ring_next(K_FOREVER);
+        // Datagrams that were too large are only handed back
+        if (!slot->drop)
+        {
+            take_token();
+            send_slot(slot);
+        }
+        uplink_ring_release(slot);
+    }
+}
 
+static int open_socket(const char *host, const int port)
+{
     struct sockaddr_in addr;
 
     addr.sin_family = AF_INET;
@@ -31,92 +183,151 @@ int send_udp(const char *host, const int port)
 
     inet_pton(AF_INET, host, &addr.sin_addr);
 
-#ifdef CLIENT_CERT
-    /*
-    ret = tls_credential_add(ROOT_CERT_TAG, TLS_CREDENTIAL_CA_CERTIFICATE,
-                             root_certificate, sizeof(root_certificate));
-    if (ret != 0)
+    LOG_INF("Connecting to %s service on port %d...", transport_name(transport),
+            port);
+    struct transport_handshake handshake;
+    int ret = transport_open(transport, &addr, &handshake);
+    k_mutex_lock(&metrics_lock, K_FOREVER);
+    if (ret < 0)
     {
-        LOG_ERR("Unable to add root certificate to TLS credentials: %d", ret);
+        metrics.errors++;
     }
-
-    // There's no constant for a client certificate but the rest of the code
-    // refers to the server certificate as "own" so this looks a bit weird.
-    ret = tls_credential_add(CLIENT_CERT_TAG, TLS_CREDENTIAL_SERVER_CERTIFICATE,
-                             client_certificate, sizeof(client_certificate));
-    if (ret != 0)
+    else if (handshake.done)
     {
-        LOG_ERR("Unable to add client certificate to TLS credentials: %d", ret);
+        metrics.handshakes++;
+        metrics.last_handshake_ms = handshake.ms;
     }
-    ret = tls_credential_add(CLIENT_CERT_TAG, TLS_CREDENTIAL_PRIVATE_KEY,
-                             client_key, sizeof(client_key));
-    if (ret != 0)
+    k_mutex_unlock(&metrics_lock);
+    if (ret < 0)
     {
-        LOG_ERR("Unable to add client key to TLS credentials: %d", ret);
+        return ret;
     }
-    LOG_DBG("TLS credentials added for socket");
-*/
-    sock = socket(addr.sin_family, SOCK_DGRAM, IPPROTO_DTLS_1_2);
-#else
-    sock = socket(addr.sin_family, SOCK_DGRAM, IPPROTO_UDP);
-#endif
+    sock = ret;
+    LOG_INF("Connected to service on port %d", port);
+    return 0;
+}
+
+int udp_uplink_open(const char *host, const int port,
+                    enum transport_type type)
+{
+    k_mutex_lock(&sock_lock, K_FOREVER);
+    int ret = 0;
     if (sock < 0)
     {
-        LOG_ERR("Failed to create UDP socket %d", errno);
-        return -errno;
+        transport = type;
+        ret = open_socket(host, port);
     }
-#ifdef CLIENT_CERT
-    sec_tag_t sec_tag_list[] = {
-        ROOT_CERT_TAG,
-        CLIENT_CERT_TAG,
-    };
-
-    ret = setsockopt(sock, SOL_TLS, TLS_SEC_TAG_LIST, sec_tag_list,
-                     sizeof(sec_tag_list));
+    k_mutex_unlock(&sock_lock);
     if (ret < 0)
     {
-        LOG_ERR("Error setting TLS tag socket option: %d", errno);
-        return -errno;
+        return ret;
     }
 
-    // Certificate verification doesn't work - it might be a memory issue or it
-    // might be the missing intermediate(s). The verification works for the
-    // *server* so the client is behaving as expected and it works for mbedtls on
-    // ESP-IDF so I'm inclined to point a finger on impedance mismatch somewhere
-    // in Zephyr
-    int verify = TLS_PEER_VERIFY_OPTIONAL;
-    ret = setsockopt(sock, SOL_TLS, TLS_PEER_VERIFY, &verify, sizeof(verify));
-    if (ret < 0)
+    if (!sender_created)
     {
-        LOG_ERR("Failed to set TLS_PEER_VERIFY option: %d", errno);
-        ret = -errno;
+        last_refill = k_uptime_get_32();
+        tokens = burst * 1000;
+        k_thread_create(&sender_thread, sender_stack,
+                        K_THREAD_STACK_SIZEOF(sender_stack), send_thread, NULL,
+                        NULL, NULL, CONFIG_SPAN_UDP_UPLINK_THREAD_PRIORITY, 0,
+                        K_NO_WAIT);
+        k_thread_name_set(&sender_thread, "udp_tx");
+        sender_created = true;
     }
-#endif
+    return 0;
+}
 
-    LOG_INF("Connecting to UDP service on port %d...", port);
-    ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-    if (ret < 0)
+uint8_t *udp_uplink_alloc(k_timeout_t timeout)
+{
+    uint8_t *buffer = uplink_ring_alloc(timeout);
+    if (!buffer)
     {
-        LOG_ERR("Cannot connect UDP socket: %d", ret);
-        return -errno;
+        k_mutex_lock(&metrics_lock, K_FOREVER);
+        metrics.queue_full++;
+        k_mutex_unlock(&metrics_lock);
     }
-    LOG_INF("Connected to service on port %d", port);
-    k_sleep(K_MSEC(2500));
-    char buffer[32];
+    return buffer;
+}
+
+int udp_uplink_commit(uint8_t *buffer, size_t len)
+{
+    return uplink_ring_commit(buffer, len);
+}
 
-    for (int i = 0; i < 100; i++)
+int udp_uplink_send(const uint8_t *buffer, size_t len, k_timeout_t timeout)
+{
+    if (len > CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD)
     {
-        sprintf(buffer, "Packet %d", i);
-        ret = send(sock, buffer, strlen(buffer), 0);
-        if (ret < 0)
+        return -EMSGSIZE;
+    }
+    uint8_t *slot = udp_uplink_alloc(timeout);
+    if (!slot)
+    {
+        return -EAGAIN;
+    }
+    memcpy(slot, buffer, len);
+    return udp_uplink_commit(slot, len);
+}
+
+int udp_uplink_flush(int timeout_ms)
+{
+    uint32_t start = k_uptime_get_32();
+    while (uplink_ring_pending() > 0)
+    {
+        if (k_uptime_get_32() - start >= (uint32_t)timeout_ms)
         {
-            LOG_ERR("Error sending data on socket: %d", ret);
-            return ret;
+            return -ETIMEDOUT;
         }
-        LOG_INF("Sent UDP packet %d...", i);
-        k_sleep(K_MSEC(250));
+        k_sleep(K_MSEC(10));
     }
-
-    close(sock);
     return 0;
-}
\ No newline at end of file
+}
+
+void udp_uplink_close(void)
+{
+    k_mutex_lock(&sock_lock, K_FOREVER);
+    if (sock >= 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+    k_mutex_unlock(&sock_lock);
+}
+
+int send_udp(const char *host, const int port, enum transport_type type)
+{
+    int ret = udp_uplink_open(host, port, type);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    struct udp_client_metrics before;
+    struct udp_client_metrics after;
+    udp_get_metrics(&before);
+    uint32_t start = k_uptime_get_32();
+    for (uint32_t i = 0; i < CONFIG_SPAN_UDP_SAMPLE_PACKETS; i++)
+    {
+        // Sequence number and uptime, both big endian
+        uint8_t *buf = udp_uplink_alloc(K_FOREVER);
+        sys_put_be32(i, buf);
+        sys_put_be32(k_uptime_get_32(), buf + 4);
+        udp_uplink_commit(buf, 8);
+    }
+    ret = udp_uplink_flush(CONFIG_SPAN_UDP_SAMPLE_PACKETS * 1000);
+    uint32_t elapsed = MAX(k_uptime_get_32() - start, 1);
+    udp_get_metrics(&after);
+
+    uint32_t sent = after.datagrams - before.datagrams;
+    LOG_INF("UDP uplink: %d packets over %s in %d ms (%d/s), %d errors", sent,
+            transport_name(type), elapsed, sent * 1000 / elapsed,
+            after.errors - before.errors);
+    LOG_INF("UDP uplink: %d cycles per packet",
+            sent ? (after.send_cycles - before.send_cycles) / sent : 0);
+    LOG_INF("UDP uplink: %d ms latency and %d bytes on the wire per packet",
+            sent ? (after.latency_ms - before.latency_ms) / sent : 0,
+            sent ? (after.wire_bytes - before.wire_bytes) / sent : 0);
+
+    udp_uplink_close();
+    return ret;
+}
@@ -0,0 +1,376 @@
+#include <errno.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#include <net/coap.h>
+
+#include "coap-client.h"
+#include "net-sched.h"
+#include "ts-codec.h"
+#include "uplink-batch.h"
+#include "uplink-store.h"
+
+LOG_MODULE_REGISTER(uplink_batch, LOG_LEVEL_DBG);
+
+// Largest LEB128 encoding of a 32-bit value
+#define MAX_VARINT_LEN 5
+
+// Room for the version byte and the age in front of the records
+#define HEADER_ROOM (1 + MAX_VARINT_LEN)
+
+BUILD_ASSERT(CONFIG_SPAN_UPLINK_BATCH_SIZE + HEADER_ROOM <=
+                 CONFIG_SPAN_COAP_MAX_BLOCK_SIZE,
+             "Uplink batch must fit in a single CoAP message");
+BUILD_ASSERT(CONFIG_SPAN_UPLINK_BATCH_SIZE >= MAX_VARINT_LEN + 8,
+             "Uplink batch must hold the count and first sample of a series");
+
+static int batch_path;
+static uint8_t batch[HEADER_ROOM + CONFIG_SPAN_UPLINK_BATCH_SIZE];
+static size_t batch_len;
+static int batch_samples;
+// Format of the batch being collected
+static uint8_t batch_version;
+// Value series are encoded after room for the sample count
+static struct ts_encoder series;
+static uint32_t first_sample_time;
+static struct uplink_batch_stats stats;
+static atomic_t in_flight;
+
+#ifdef CONFIG_SPAN_UPLINK_STORE
+// Stored batches are sent from the system work queue, not under batch_lock.
+// The CoAP client copies the payload, so one buffer is enough for a burst.
+static uint8_t drain_buf[HEADER_ROOM + CONFIG_SPAN_UPLINK_BATCH_SIZE];
+#endif
+
+static K_MUTEX_DEFINE(batch_lock);
+
+// Sends the batch before the first sample gets too old, or earlier if the
+// link is awake anyway
+static struct net_job age_job;
+
+static size_t put_varint(uint8_t *buf, uint32_t val)
+{
+  size_t n = 0;
+  while (val >= 0x80)
+  {
+    buf[n++] = (uint8_t)(val | 0x80);
+    val >>= 7;
+  }
+  buf[n++] = (uint8_t)val;
+  return n;
+}
+
+static size_t varint_len(uint32_t val)
+{
+  size_t n = 1;
+  while (val >= 0x80)
+  {
+    val >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static void batch_callback(int result, const struct coap_packet *reply,
+                           void *user_data)
+{
+  atomic_dec(&in_flight);
+  if (result < 0)
+  {
+    LOG_ERR("Batch of %d samples failed: %d", (int)(intptr_t)user_data,
+            result);
+    return;
+  }
+  LOG_DBG("Batch of %d samples sent, code=%d", (int)(intptr_t)user_data,
+          coap_header_get_code(reply));
+}
+
+/*
+ * Write the header in front of the records and post the batch. There must be
+ * HEADER_ROOM bytes in front of the records. The age of the first sample
+ * can't be encoded until now. The header is written right in front of the
+ * records so nothing has to be moved.
+ */
+static int submit_batch(uint8_t *records, size_t len, uint8_t version,
+                        uint32_t age, coap_response_callback_t callback,
+                        void *user_data)
+{
+  size_t header_len = 1 + varint_len(age);
+  uint8_t *message = records - header_len;
+  message[0] = version;
+  put_varint(&message[1], age);
+  size_t n = header_len + len;
+
+  atomic_inc(&in_flight);
+  int r = coap_submit_request_to(batch_path, COAP_METHOD_POST, message, n,
+                                 callback, user_data);
+  if (r < 0)
+  {
+    atomic_dec(&in_flight);
+    return r;
+  }
+  return n;
+}
+
+#ifdef CONFIG_SPAN_UPLINK_STORE
+static void stored_callback(int result, const struct coap_packet *reply,
+                            void *user_data)
+{
+  uint32_t seq = (uint32_t)(uintptr_t)user_data;
+  atomic_dec(&in_flight);
+  if (result == 0 && (coap_header_get_code(reply) >> 5) == 5)
+  {
+    // Server errors are worth another try, client errors are not
+    result = -EIO;
+  }
+  if (result < 0)
+  {
+    LOG_DBG("Stored batch %d failed: %d", seq, result);
+  }
+  else if ((coap_header_get_code(reply) >> 5) == 4)
+  {
+    LOG_ERR("Stored batch %d rejected, code=%d", seq,
+            coap_header_get_code(reply));
+  }
+  uplink_store_done(seq, result);
+}
+
+static int send_stored(const struct uplink_store_entry *entry)
+{
+  memcpy(&drain_buf[HEADER_ROOM], entry->data, entry->len);
+  int r = submit_batch(&drain_buf[HEADER_ROOM], entry->len, entry->format,
+                       entry->age, stored_callback,
+                       (void *)(uintptr_t)entry->seq);
+  if (r < 0)
+  {
+    return r;
+  }
+  k_mutex_lock(&batch_lock, K_FOREVER);
+  stats.messages++;
+  stats.payload_bytes += r;
+  k_mutex_unlock(&batch_lock);
+  return 0;
+}
+#endif
+
+/*
+ * Send the batch, or put it in the store and let the store send it. Must be
+ * called with the lock held.
+ */
+static int flush_locked(void)
+{
+  if (batch_len == 0)
+  {
+    return 0;
+  }
+
+  uint8_t *records = &batch[HEADER_ROOM];
+  size_t len = batch_len;
+  if (batch_version == UPLINK_BATCH_VERSION_SERIES)
+  {
+    // The sample count goes right in front of the series
+    size_t count_len = varint_len(batch_samples);
+    records = &batch[HEADER_ROOM + MAX_VARINT_LEN - count_len];
+    put_varint(records, batch_samples);
+    len += count_len;
+  }
+
+  uint32_t age = k_uptime_get_32() - first_sample_time;
+#ifdef CONFIG_SPAN_UPLINK_STORE
+  int r = uplink_store_append(batch_version, records, len, age);
+  if (r == 0)
+  {
+    stats.stored++;
+    batch_len = 0;
+    batch_samples = 0;
+    net_sched_cancel(&age_job);
+    uplink_store_drain();
+    return 0;
+  }
+  // Send it straight away if the flash can't be written
+  LOG_WRN("Unable to store batch: %d", r);
+#endif
+
+  int n = submit_batch(records, len, batch_version, age, batch_callback,
+                       (void *)(intptr_t)batch_samples);
+  if (n < 0)
+  {
+    LOG_ERR("Unable to send batch: %d", n);
+    return n;
+  }
+  stats.messages++;
+  stats.payload_bytes += n;
+  batch_len = 0;
+  batch_samples = 0;
+  net_sched_cancel(&age_job);
+  return 0;
+}
+
+static void age_handler(struct net_job *job)
+{
+  k_mutex_lock(&batch_lock, K_FOREVER);
+  if (flush_locked() < 0)
+  {
+    // Try again later
+    net_sched_submit_in(&age_job, CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS);
+  }
+  k_mutex_unlock(&batch_lock);
+}
+
+int uplink_batch_init(const char *path)
+{
+  batch_path = coap_register_path(path);
+  if (batch_path < 0)
+  {
+    return batch_path;
+  }
+  batch_len = 0;
+  batch_samples = 0;
+  net_job_init(&age_job, NET_CLASS_UPLINK, age_handler);
+#ifdef CONFIG_SPAN_UPLINK_STORE
+  // Without the store batches are sent directly, so this isn't fatal
+  if (uplink_store_init(send_stored) < 0)
+  {
+    LOG_WRN("Uplink queue unavailable, batches are not stored");
+  }
+#endif
+  return 0;
+}
+
+/*
+ * Flush the batch if it has a different format. Must be called with the lock
+ * held.
+ */
+static int switch_version_locked(uint8_t version)
+{
+  if (batch_len > 0 && batch_version != version)
+  {
+    int r = flush_locked();
+    if (r < 0)
+    {
+      return r;
+    }
+  }
+  batch_version = version;
+  return 0;
+}
+
+int uplink_batch_add(const uint8_t *sample, size_t len)
+{
+  k_mutex_lock(&batch_lock, K_FOREVER);
+
+  int r = switch_version_locked(UPLINK_BATCH_VERSION);
+  if (r < 0)
+  {
+    stats.dropped++;
+    k_mutex_unlock(&batch_lock);
+    return r;
+  }
+
+  uint32_t now = k_uptime_get_32();
+  uint32_t dt = (batch_len == 0) ? 0 : now - first_sample_time;
+  size_t record_len = varint_len(dt) + varint_len(len) + len;
+  if (record_len > CONFIG_SPAN_UPLINK_BATCH_SIZE)
+  {
+    stats.dropped++;
+    k_mutex_unlock(&batch_lock);
+    return -EMSGSIZE;
+  }
+  if (batch_len + record_len > CONFIG_SPAN_UPLINK_BATCH_SIZE)
+  {
+    r = flush_locked();
+    if (r < 0)
+    {
+      stats.dropped++;
+      k_mutex_unlock(&batch_lock);
+      return r;
+    }
+    dt = 0;
+    record_len = varint_len(dt) + varint_len(len) + len;
+  }
+
+  if (batch_len == 0)
+  {
+    first_sample_time = now;
+    net_sched_submit_in(&age_job, CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS);
+  }
+  uint8_t *p = &batch[HEADER_ROOM + batch_len];
+  p += put_varint(p, dt);
+  p += put_varint(p, len);
+  memcpy(p, sample, len);
+  batch_len += record_len;
+  batch_samples++;
+
+  stats.samples++;
+  stats.sample_bytes += len;
+  k_mutex_unlock(&batch_lock);
+  return 0;
+}
+
+int uplink_batch_add_value(int32_t value)
+{
+  k_mutex_lock(&batch_lock, K_FOREVER);
+
+  int r = switch_version_locked(UPLINK_BATCH_VERSION_SERIES);
+  uint32_t now = k_uptime_get_32();
+  if (r == 0 && batch_len > 0 &&
+      ts_encode(&series, now - first_sample_time, (uint32_t)value) < 0)
+  {
+    r = flush_locked();
+  }
+  if (r < 0)
+  {
+    stats.dropped++;
+    k_mutex_unlock(&batch_lock);
+    return r;
+  }
+
+  if (batch_len == 0)
+  {
+    first_sample_time = now;
+    net_sched_submit_in(&age_job, CONFIG_SPAN_UPLINK_BATCH_MAX_AGE_MS);
+    ts_encoder_init(&series, &batch[HEADER_ROOM + MAX_VARINT_LEN],
+                    CONFIG_SPAN_UPLINK_BATCH_SIZE - MAX_VARINT_LEN,
+                    TS_VALUE_DELTA);
+    // An empty series always has room for the first sample
+    ts_encode(&series, 0, (uint32_t)value);
+  }
+  batch_len = ts_encoder_len(&series);
+  batch_samples++;
+
+  stats.samples++;
+  stats.sample_bytes += sizeof(value);
+  k_mutex_unlock(&batch_lock);
+  return 0;
+}
+
+int uplink_batch_flush(void)
+{
+  k_mutex_lock(&batch_lock, K_FOREVER);
+  int r = flush_locked();
+  k_mutex_unlock(&batch_lock);
+#ifdef CONFIG_SPAN_UPLINK_STORE
+  // Batches stored while the link was down go out now as well
+  uplink_store_drain();
+#endif
+  return r;
+}
+
+int uplink_batch_in_flight(void)
+{
+#ifdef CONFIG_SPAN_UPLINK_STORE
+  struct uplink_store_stats store;
+  uplink_store_get_stats(&store);
+  return MAX(atomic_get(&in_flight), (atomic_val_t)store.pending);
+#else
+  return atomic_get(&in_flight);
+#endif
+}
+
+void uplink_batch_get_stats(struct uplink_batch_stats *out)
+{
+  k_mutex_lock(&batch_lock, K_FOREVER);
+  *out = stats;
+  k_mutex_unlock(&batch_lock);
+}
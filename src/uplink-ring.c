@@ -0,0 +1,81 @@
+#include <errno.h>
+
+#include <zephyr.h>
+
+#include "uplink-ring.h"
+
+#define RING_LEN CONFIG_SPAN_UDP_UPLINK_QUEUE_LEN
+
+/*
+ * Slots are handed out at head, passed on to the sender at committed and
+ * given back at tail. free_slots counts the slots that may be handed out,
+ * queued the slots the sender may take. lock is only held to move head and
+ * committed, so producers don't wait for each other while they format.
+ */
+static struct uplink_slot slots[RING_LEN];
+static int head;
+static int committed;
+static int tail;
+static atomic_t pending;
+static K_SEM_DEFINE(free_slots, RING_LEN, RING_LEN);
+static K_SEM_DEFINE(queued, 0, RING_LEN);
+static K_MUTEX_DEFINE(lock);
+
+uint8_t *uplink_ring_alloc(k_timeout_t timeout)
+{
+  if (k_sem_take(&free_slots, timeout) < 0)
+  {
+    return NULL;
+  }
+  // free_slots keeps head from running past tail
+  k_mutex_lock(&lock, K_FOREVER);
+  struct uplink_slot *slot = &slots[head];
+  head = (head + 1) % RING_LEN;
+  k_mutex_unlock(&lock);
+  return slot->data;
+}
+
+int uplink_ring_commit(uint8_t *buffer, size_t len)
+{
+  struct uplink_slot *slot = CONTAINER_OF(buffer, struct uplink_slot, data);
+  slot->drop = len > CONFIG_SPAN_UDP_UPLINK_MAX_PAYLOAD;
+  slot->len = slot->drop ? 0 : len;
+  slot->queued_at = k_uptime_get_32();
+
+  // Pass on this slot and the committed slots after it, unless a slot
+  // before it is still being filled. With every slot handed out head is
+  // back at committed, so only ready tells where to stop; slots that are
+  // free or with the sender are never ready.
+  k_mutex_lock(&lock, K_FOREVER);
+  slot->ready = true;
+  while (slots[committed].ready)
+  {
+    slots[committed].ready = false;
+    committed = (committed + 1) % RING_LEN;
+    atomic_inc(&pending);
+    k_sem_give(&queued);
+  }
+  k_mutex_unlock(&lock);
+  return slot->drop ? -EMSGSIZE : 0;
+}
+
+struct uplink_slot *uplink_ring_next(k_timeout_t timeout)
+{
+  if (k_sem_take(&queued, timeout) < 0)
+  {
+    return NULL;
+  }
+  return &slots[tail];
+}
+
+void uplink_ring_release(struct uplink_slot *slot)
+{
+  tail = (tail + 1) % RING_LEN;
+  atomic_dec(&pending);
+  k_sem_give(&free_slots);
+}
+
+int uplink_ring_pending(void)
+{
+  return atomic_get(&pending);
+}
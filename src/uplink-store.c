@@ -0,0 +1,657 @@
+#include <errno.h>
+#include <string.h>
+
+#include <logging/log.h>
+#include <zephyr.h>
+
+#ifdef CONFIG_SPAN_UPLINK_STORE
+
+#include <fs/fcb.h>
+#include <storage/flash_map.h>
+
+#include "net-sched.h"
+#include "uplink-store.h"
+
+LOG_MODULE_REGISTER(uplink_store, LOG_LEVEL_DBG);
+
+#define STORE_AREA_ID FLASH_AREA_ID(storage)
+#define STORE_MAGIC 0x53504e55
+
+// Settings (NVS) use the first sectors of the storage partition
+#define SETTINGS_SECTORS                                                       \
+  (CONFIG_SETTINGS_NVS_SECTOR_COUNT * CONFIG_SETTINGS_NVS_SECTOR_SIZE_MULT)
+
+// Flash writes are padded to this, which covers every write block size the
+// sample runs on
+#define MAX_WRITE_ALIGN 8
+
+enum
+{
+  ENTRY_BATCH = 1,
+  ENTRY_COMMIT = 2,
+};
+
+/*
+ * Every FCB entry starts with this header. Batches are followed by their
+ * records, commits have no data and seq is the highest committed batch.
+ */
+struct entry_header
+{
+  uint8_t type;
+  uint8_t format;
+  uint8_t reserved[2];
+  uint32_t seq;
+  uint32_t stored_at;
+  uint32_t age;
+};
+
+#define ENTRY_MAX_LEN                                                          \
+  (sizeof(struct entry_header) + CONFIG_SPAN_UPLINK_BATCH_SIZE)
+
+BUILD_ASSERT(CONFIG_SPAN_UPLINK_STORE_BURST <= CONFIG_SPAN_COAP_MAX_REQUESTS,
+             "Uplink queue bursts can't be larger than the request table");
+
+static struct flash_sector sectors[SETTINGS_SECTORS +
+                                   CONFIG_SPAN_UPLINK_STORE_SECTORS];
+static struct fcb fcb;
+static bool store_ready;
+static uplink_store_send_t send_batch;
+
+/*
+ * store_lock covers the FCB, the buffers and the drain state. It is held
+ * while flash is programmed or erased, so the CoAP client, which reports
+ * results from its receive thread with its own lock held, never takes it:
+ * uplink_store_done() only marks the batch under done_lock and the work
+ * item applies the result. in_flight is changed with both locks held and
+ * the results only with done_lock.
+ */
+static K_MUTEX_DEFINE(store_lock);
+static K_MUTEX_DEFINE(done_lock);
+static uint8_t append_buf[ROUND_UP(ENTRY_MAX_LEN, MAX_WRITE_ALIGN)]
+    __aligned(4);
+static uint8_t read_buf[ENTRY_MAX_LEN] __aligned(4);
+
+static uint32_t next_seq = 1;
+// Batches from before this sequence number were stored before the last reset
+static uint32_t boot_seq;
+// Every batch up to this one has been acknowledged
+static uint32_t committed;
+// committed as it was in the last commit entry
+static uint32_t saved_commit;
+// Highest batch handed to the send function
+static uint32_t sent_upto;
+
+// The next entry to send. A zeroed entry starts from the oldest sector.
+static struct fcb_entry cursor;
+
+struct in_flight_batch
+{
+  uint32_t seq;
+  // Set by uplink_store_done(), applied by the work item
+  bool done;
+  int result;
+};
+
+// Batches waiting for a response (or for their result to be applied) and
+// batches that failed and are sent again after
+// CONFIG_SPAN_UPLINK_STORE_RETRY_MS. Together they take at most a burst, so
+// the queue stops sending while the link is down.
+static struct in_flight_batch in_flight[CONFIG_SPAN_UPLINK_STORE_BURST];
+static int in_flight_count;
+static uint32_t failed[CONFIG_SPAN_UPLINK_STORE_BURST];
+static int failed_count;
+static bool retry_due;
+
+static struct uplink_store_stats stats;
+
+static struct k_work drain_work;
+// Sends the queue again some time after a failure
+static struct net_job retry_job;
+
+static int write_entry(struct entry_header *header, const uint8_t *data,
+                       size_t len)
+{
+  size_t total = sizeof(*header) + len;
+  struct fcb_entry loc;
+  int ret = fcb_append(&fcb, total, &loc);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  memcpy(append_buf, header, sizeof(*header));
+  if (len)
+  {
+    memcpy(&append_buf[sizeof(*header)], data, len);
+  }
+  size_t padded = ROUND_UP(total, fcb.f_align);
+  memset(&append_buf[total], 0xFF, padded - total);
+  ret = flash_area_write(fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), append_buf,
+                         padded);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  // The length in front of the entry and the CRC behind it
+  stats.flash_bytes += padded + 2 * fcb.f_align;
+  return fcb_append_finish(&fcb, &loc);
+}
+
+static int read_header(const struct fcb_entry *loc, struct entry_header *hdr)
+{
+  if (loc->fe_data_len < sizeof(*hdr))
+  {
+    return -EBADMSG;
+  }
+  return flash_area_read(fcb.fap, FCB_ENTRY_FA_DATA_OFF(*loc), hdr,
+                         sizeof(*hdr));
+}
+
+static bool contains(const uint32_t *list, int count, uint32_t seq)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (list[i] == seq)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool is_in_flight(uint32_t seq)
+{
+  for (int i = 0; i < in_flight_count; i++)
+  {
+    if (in_flight[i].seq == seq)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void add_in_flight(uint32_t seq)
+{
+  k_mutex_lock(&done_lock, K_FOREVER);
+  in_flight[in_flight_count++] = (struct in_flight_batch){.seq = seq};
+  k_mutex_unlock(&done_lock);
+}
+
+static void remove_in_flight(uint32_t seq)
+{
+  k_mutex_lock(&done_lock, K_FOREVER);
+  for (int i = 0; i < in_flight_count; i++)
+  {
+    if (in_flight[i].seq == seq)
+    {
+      in_flight[i] = in_flight[--in_flight_count];
+      break;
+    }
+  }
+  k_mutex_unlock(&done_lock);
+}
+
+/*
+ * Everything below the oldest outstanding (or failed) batch is done. Must be
+ * called with the lock held.
+ */
+static void update_committed_locked(void)
+{
+  uint32_t low = sent_upto + 1;
+  for (int i = 0; i < in_flight_count; i++)
+  {
+    low = MIN(low, in_flight[i].seq);
+  }
+  for (int i = 0; i < failed_count; i++)
+  {
+    low = MIN(low, failed[i]);
+  }
+  committed = MAX(committed, low - 1);
+}
+
+/*
+ * Drop the oldest sector. Batches in it that weren't acknowledged are lost.
+ * Must be called with the lock held.
+ */
+static int drop_oldest_locked(void)
+{
+  struct flash_sector *oldest = fcb.f_oldest;
+  struct fcb_entry loc = {0};
+  struct entry_header hdr;
+  while (fcb_getnext(&fcb, &loc) == 0 && loc.fe_sector == oldest)
+  {
+    if (read_header(&loc, &hdr) == 0 && hdr.type == ENTRY_BATCH &&
+        hdr.seq > committed &&
+        !is_in_flight(hdr.seq) &&
+        !contains(failed, failed_count, hdr.seq))
+    {
+      stats.dropped++;
+      stats.pending -= MIN(stats.pending, 1);
+    }
+  }
+  if (cursor.fe_sector == oldest)
+  {
+    memset(&cursor, 0, sizeof(cursor));
+  }
+  int ret = fcb_rotate(&fcb);
+  if (ret == 0)
+  {
+    stats.erases++;
+  }
+  return ret;
+}
+
+/*
+ * Erase the oldest sectors once every batch in them is committed. The
+ * active sector (with the last commit entry) is never erased here. Must be
+ * called with the lock held.
+ */
+static void erase_committed_locked(void)
+{
+  while (fcb.f_oldest != fcb.f_active.fe_sector)
+  {
+    struct flash_sector *oldest = fcb.f_oldest;
+    struct fcb_entry loc = {0};
+    struct entry_header hdr;
+    while (fcb_getnext(&fcb, &loc) == 0 && loc.fe_sector == oldest)
+    {
+      if (read_header(&loc, &hdr) == 0 && hdr.type == ENTRY_BATCH &&
+          hdr.seq > committed)
+      {
+        return;
+      }
+    }
+    if (cursor.fe_sector == oldest)
+    {
+      memset(&cursor, 0, sizeof(cursor));
+    }
+    if (fcb_rotate(&fcb) < 0)
+    {
+      return;
+    }
+    stats.erases++;
+  }
+}
+
+static void commit_locked(void)
+{
+  if (committed == saved_commit)
+  {
+    return;
+  }
+  struct entry_header hdr = {.type = ENTRY_COMMIT, .seq = committed};
+  int ret = write_entry(&hdr, NULL, 0);
+  if (ret == -ENOSPC && drop_oldest_locked() == 0)
+  {
+    ret = write_entry(&hdr, NULL, 0);
+  }
+  if (ret < 0)
+  {
+    LOG_WRN("Unable to commit uplink queue: %d", ret);
+    return;
+  }
+  saved_commit = committed;
+  stats.commits++;
+  erase_committed_locked();
+}
+
+static int read_batch(const struct fcb_entry *loc)
+{
+  return flash_area_read(fcb.fap, FCB_ENTRY_FA_DATA_OFF(*loc), read_buf,
+                         loc->fe_data_len);
+}
+
+/*
+ * Move the cursor to the next batch that hasn't been sent and read it into
+ * read_buf. The cursor is only moved to entries that exist so appends after
+ * the end are found next time. Must be called with the lock held.
+ */
+static bool next_batch_locked(struct entry_header *hdr, size_t *len)
+{
+  struct fcb_entry loc = cursor;
+  while (fcb_getnext(&fcb, &loc) == 0)
+  {
+    cursor = loc;
+    if (read_header(&cursor, hdr) < 0 || hdr->type != ENTRY_BATCH ||
+        hdr->seq <= committed || hdr->seq <= sent_upto ||
+        read_batch(&cursor) < 0)
+    {
+      continue;
+    }
+    *len = cursor.fe_data_len;
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Find a batch that failed and read it into read_buf. This walks the queue
+ * from the oldest sector, which only happens after a failure. Must be called
+ * with the lock held.
+ */
+static bool find_batch_locked(uint32_t seq, struct entry_header *hdr,
+                              size_t *len)
+{
+  struct fcb_entry loc = {0};
+  while (fcb_getnext(&fcb, &loc) == 0)
+  {
+    if (read_header(&loc, hdr) == 0 && hdr->type == ENTRY_BATCH &&
+        hdr->seq == seq)
+    {
+      *len = loc.fe_data_len;
+      return read_batch(&loc) == 0;
+    }
+  }
+  return false;
+}
+
+/*
+ * Pick the next batch to send: the failed batches when the retry is due,
+ * otherwise the next batch in the queue if the burst isn't used up. Must be
+ * called with the lock held.
+ */
+static bool pick_batch_locked(struct entry_header *hdr, size_t *len,
+                              bool *retry)
+{
+  while (retry_due && failed_count > 0)
+  {
+    uint32_t seq = failed[--failed_count];
+    if (find_batch_locked(seq, hdr, len))
+    {
+      *retry = true;
+      return true;
+    }
+    // The sector was dropped while the batch waited
+    stats.dropped++;
+    stats.pending -= MIN(stats.pending, 1);
+    update_committed_locked();
+  }
+  retry_due = false;
+  *retry = false;
+  if (in_flight_count + failed_count >= CONFIG_SPAN_UPLINK_STORE_BURST ||
+      !next_batch_locked(hdr, len))
+  {
+    return false;
+  }
+  sent_upto = hdr->seq;
+  return true;
+}
+
+/*
+ * Apply the results uplink_store_done() has marked. Must be called with the
+ * lock held.
+ */
+static void apply_results_locked(void)
+{
+  k_mutex_lock(&done_lock, K_FOREVER);
+  for (int i = 0; i < in_flight_count;)
+  {
+    struct in_flight_batch *batch = &in_flight[i];
+    if (!batch->done)
+    {
+      i++;
+      continue;
+    }
+    if (batch->result < 0)
+    {
+      // Sent again when the retry is due, the slot stays taken until then
+      stats.failed++;
+      failed[failed_count++] = batch->seq;
+    }
+    else
+    {
+      stats.acked++;
+      stats.pending -= MIN(stats.pending, 1);
+    }
+    *batch = in_flight[--in_flight_count];
+  }
+  k_mutex_unlock(&done_lock);
+  update_committed_locked();
+}
+
+static void drain_handler(struct k_work *work)
+{
+  for (;;)
+  {
+    k_mutex_lock(&store_lock, K_FOREVER);
+    apply_results_locked();
+    if (in_flight_count == 0 || committed - saved_commit >=
+                                    CONFIG_SPAN_UPLINK_STORE_COMMIT_INTERVAL)
+    {
+      commit_locked();
+    }
+
+    struct entry_header hdr;
+    size_t len;
+    bool retry;
+    if (!pick_batch_locked(&hdr, &len, &retry))
+    {
+      bool wait = failed_count > 0;
+      k_mutex_unlock(&store_lock);
+      if (wait)
+      {
+        net_sched_submit_in(&retry_job, CONFIG_SPAN_UPLINK_STORE_RETRY_MS);
+      }
+      return;
+    }
+    add_in_flight(hdr.seq);
+    stats.sent++;
+
+    uint32_t now = k_uptime_get_32();
+    struct uplink_store_entry entry = {
+        .seq = hdr.seq,
+        .format = hdr.format,
+        .age = hdr.age + (hdr.seq >= boot_seq ? now - hdr.stored_at : now),
+        .data = &read_buf[sizeof(hdr)],
+        .len = len - sizeof(hdr),
+    };
+    k_mutex_unlock(&store_lock);
+
+    // read_buf is only used by this work item, so it stays valid
+    int ret = send_batch(&entry);
+    if (ret < 0)
+    {
+      // Not sent at all (no connection or no free request), so put it back
+      // and try again later
+      LOG_DBG("Unable to send stored batch %d: %d", entry.seq, ret);
+      k_mutex_lock(&store_lock, K_FOREVER);
+      stats.sent--;
+      remove_in_flight(entry.seq);
+      if (retry)
+      {
+        failed[failed_count++] = entry.seq;
+        retry_due = false;
+      }
+      else
+      {
+        // Only this work item moves sent_upto, so nothing was sent after it
+        sent_upto = entry.seq - 1;
+        memset(&cursor, 0, sizeof(cursor));
+      }
+      k_mutex_unlock(&store_lock);
+      net_sched_submit_in(&retry_job, CONFIG_SPAN_UPLINK_STORE_RETRY_MS);
+      return;
+    }
+  }
+}
+
+static void retry_handler(struct net_job *job)
+{
+  k_mutex_lock(&store_lock, K_FOREVER);
+  retry_due = true;
+  k_mutex_unlock(&store_lock);
+  uplink_store_drain();
+}
+
+int uplink_store_init(uplink_store_send_t send)
+{
+  uint32_t count = ARRAY_SIZE(sectors);
+  int ret = flash_area_get_sectors(STORE_AREA_ID, &count, sectors);
+  if (ret == -ENOMEM)
+  {
+    // The partition has more sectors than the queue needs
+    count = ARRAY_SIZE(sectors);
+  }
+  else if (ret < 0)
+  {
+    LOG_ERR("Unable to read the storage partition layout: %d", ret);
+    return ret;
+  }
+  if (count < SETTINGS_SECTORS + 2)
+  {
+    LOG_ERR("Not enough room for the uplink queue after settings");
+    return -ENOSPC;
+  }
+
+  k_mutex_lock(&store_lock, K_FOREVER);
+  fcb.f_magic = STORE_MAGIC;
+  fcb.f_version = 1;
+  fcb.f_sectors = &sectors[SETTINGS_SECTORS];
+  fcb.f_sector_cnt = count - SETTINGS_SECTORS;
+  fcb.f_scratch_cnt = 0;
+  ret = fcb_init(STORE_AREA_ID, &fcb);
+  if (ret < 0)
+  {
+    // Not an FCB (or a different version), start over
+    LOG_WRN("Erasing the uplink queue: %d", ret);
+    const struct flash_area *fa;
+    ret = flash_area_open(STORE_AREA_ID, &fa);
+    for (int i = 0; ret == 0 && i < fcb.f_sector_cnt; i++)
+    {
+      ret = flash_area_erase(fa, fcb.f_sectors[i].fs_off,
+                             fcb.f_sectors[i].fs_size);
+    }
+    if (ret == 0)
+    {
+      ret = fcb_init(STORE_AREA_ID, &fcb);
+    }
+  }
+  if (ret < 0)
+  {
+    k_mutex_unlock(&store_lock);
+    LOG_ERR("Unable to open the uplink queue: %d", ret);
+    return ret;
+  }
+
+  // Find the last commit and the batches after it. Only done at boot.
+  struct fcb_entry loc = {0};
+  struct entry_header hdr;
+  uint32_t last_seq = 0;
+  while (fcb_getnext(&fcb, &loc) == 0)
+  {
+    if (read_header(&loc, &hdr) < 0)
+    {
+      continue;
+    }
+    last_seq = MAX(last_seq, hdr.seq);
+    if (hdr.type == ENTRY_COMMIT)
+    {
+      committed = MAX(committed, hdr.seq);
+    }
+  }
+  memset(&loc, 0, sizeof(loc));
+  while (fcb_getnext(&fcb, &loc) == 0)
+  {
+    if (read_header(&loc, &hdr) == 0 && hdr.type == ENTRY_BATCH &&
+        hdr.seq > committed)
+    {
+      stats.pending++;
+    }
+  }
+  saved_commit = committed;
+  sent_upto = committed;
+  next_seq = last_seq + 1;
+  boot_seq = next_seq;
+  memset(&cursor, 0, sizeof(cursor));
+
+  send_batch = send;
+  k_work_init(&drain_work, drain_handler);
+  net_job_init(&retry_job, NET_CLASS_UPLINK, retry_handler);
+  store_ready = true;
+  k_mutex_unlock(&store_lock);
+
+  LOG_INF("Uplink queue: %d sectors, %d batches waiting", fcb.f_sector_cnt,
+          stats.pending);
+  return 0;
+}
+
+int uplink_store_append(uint8_t format, const uint8_t *data, size_t len,
+                        uint32_t age)
+{
+  if (!store_ready)
+  {
+    return -ENODEV;
+  }
+  if (len > CONFIG_SPAN_UPLINK_BATCH_SIZE)
+  {
+    return -EMSGSIZE;
+  }
+  k_mutex_lock(&store_lock, K_FOREVER);
+  struct entry_header hdr = {
+      .type = ENTRY_BATCH,
+      .format = format,
+      .seq = next_seq,
+      .stored_at = k_uptime_get_32(),
+      .age = age,
+  };
+  int ret = write_entry(&hdr, data, len);
+  if (ret == -ENOSPC)
+  {
+    LOG_WRN("Uplink queue is full, dropping the oldest sector");
+    ret = drop_oldest_locked();
+    if (ret == 0)
+    {
+      ret = write_entry(&hdr, data, len);
+    }
+  }
+  if (ret == 0)
+  {
+    next_seq++;
+    stats.appended++;
+    stats.pending++;
+    stats.payload_bytes += len;
+  }
+  k_mutex_unlock(&store_lock);
+  return ret;
+}
+
+void uplink_store_drain(void)
+{
+  if (store_ready)
+  {
+    k_work_submit(&drain_work);
+  }
+}
+
+void uplink_store_done(uint32_t seq, int result)
+{
+  bool found = false;
+  k_mutex_lock(&done_lock, K_FOREVER);
+  for (int i = 0; i < in_flight_count; i++)
+  {
+    if (in_flight[i].seq == seq && !in_flight[i].done)
+    {
+      in_flight[i].done = true;
+      in_flight[i].result = result;
+      found = true;
+      break;
+    }
+  }
+  k_mutex_unlock(&done_lock);
+
+  // A batch that isn't from this queue doesn't take a slot. The result,
+  // commits, erases and the next batches are handled on the work queue.
+  if (found)
+  {
+    k_work_submit(&drain_work);
+  }
+}
+
+void uplink_store_get_stats(struct uplink_store_stats *out)
+{
+  k_mutex_lock(&store_lock, K_FOREVER);
+  *out = stats;
+  k_mutex_unlock(&store_lock);
+}
+
+#endif /* CONFIG_SPAN_UPLINK_STORE */